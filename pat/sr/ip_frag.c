@@ -0,0 +1,406 @@
+/*-----------------------------------------------------------------------------
+ * File: ip_frag.c
+ * Date: Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * Outgoing datagrams larger than the MTU of the interface they leave on
+ * are cut into fragments built one at a time in a single per router
+ * buffer, straight from the received frame; the datagram itself is never
+ * copied whole.
+ *
+ * Fragments addressed to the router are put back together in a small
+ * fixed table.  Slot buffers are allocated the first time a slot is used
+ * and then kept, so steady state reassembly does no allocation.  When the
+ * table is full the oldest datagram is evicted.  Timeouts are checked
+ * lazily on every fragment, so only the receive thread ever touches the
+ * table and no lock is needed.  Their age is kept on the monotonic clock,
+ * so setting the time of day can't expire or prolong them.
+ *
+ *---------------------------------------------------------------------------*/
+
+/* clock_gettime, which -ansi hides */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "sr_if.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "ip_frag.h"
+
+#define ETHER_HDR_LEN sizeof(struct sr_ethernet_hdr)
+
+/* Private Fnc Prototypes */
+unsigned int keep_copied_options(struct ip* ip_hdr, unsigned int hl);
+struct reasm_entry* find_reasm_entry(struct ip_frag_state* fs, struct ip* ip_hdr, time_t now);
+void check_reasm_timeouts(struct ip_frag_state* fs, time_t now);
+time_t reasm_clock(void);
+
+/*---------------------------------------------------------------------
+ * Method: init_ip_frag(struct sr_instance* sr)
+ * Scope:  Global
+ *
+ * Allocates the fragmentation buffer and an empty reassembly table.
+ *
+ *---------------------------------------------------------------------*/
+void init_ip_frag(struct sr_instance* sr)
+{
+	Debug("Initializing IP Fragmentation\n");
+	sr->frag = (struct ip_frag_state*)malloc(sizeof(struct ip_frag_state));
+	assert(sr->frag);
+	memset(sr->frag, 0, sizeof(struct ip_frag_state));
+}
+
+/*---------------------------------------------------------------------
+ * Method: ip_output(struct sr_instance* sr, struct sr_if* itf,
+ * 					 uint8_t* packet, unsigned int len)
+ * Scope:  Global
+ *
+ * Sends a frame we built ourselves (an echo reply, say), fragmenting it
+ * if it doesn't fit the MTU.  The ethernet header is taken as is.
+ *
+ *---------------------------------------------------------------------*/
+void ip_output(struct sr_instance* sr, struct sr_if* itf, uint8_t* packet, unsigned int len)
+{
+	struct sr_ethernet_hdr* e_hdr = (struct sr_ethernet_hdr*)packet;
+	struct ip* ip_hdr = (struct ip*)(packet + ETHER_HDR_LEN);
+
+	if (ntohs(ip_hdr->ip_len) <= itf->mtu) {
+		sr_send_packet(sr, packet, len, itf->name);
+	}
+	else {
+		ip_fragment(sr, itf, e_hdr->ether_dhost, packet, len, 0);
+	}
+}
+
+/*---------------------------------------------------------------------
+ * Method: ip_fragment(struct sr_instance* sr, struct sr_if* itf, uint8_t* dst_ether_addr,
+ * 					   uint8_t* src_packet, unsigned int len, int dec_ttl)
+ * Scope:  Global
+ *
+ * Each fragment is assembled in sr->frag->frag_buffer: the ethernet and
+ * IP headers are written once and patched per fragment (length, offset,
+ * MF, checksum), and the slice of payload is copied in right behind them
+ * from the source frame.  Offsets are relative to the source datagram's
+ * own offset, so a fragment can be fragmented again, and MF on the last
+ * piece is whatever the source had.
+ *
+ * Only the first fragment carries all the IP options; later ones keep
+ * just those with the copied flag set (RFC 791).
+ *
+ *---------------------------------------------------------------------*/
+void ip_fragment(struct sr_instance* sr, struct sr_if* itf, uint8_t* dst_ether_addr,
+				 uint8_t* src_packet, unsigned int len, int dec_ttl)
+{
+	uint8_t* out = sr->frag->frag_buffer;
+	struct sr_ethernet_hdr* e_hdr = (struct sr_ethernet_hdr*)out;
+	struct ip* ip_hdr = (struct ip*)(out + ETHER_HDR_LEN);
+	struct ip* src_ip_hdr = (struct ip*)(src_packet + ETHER_HDR_LEN);
+	unsigned int hl = src_ip_hdr->ip_hl * 4;
+	unsigned int total = ntohs(src_ip_hdr->ip_len);
+	uint16_t src_off = ntohs(src_ip_hdr->ip_off);
+	unsigned int base = (src_off & IP_OFFMASK) * IP_FRAG_UNIT;
+	uint8_t* data = src_packet + ETHER_HDR_LEN + hl;
+	unsigned int data_len, pos = 0, chunk;
+	uint16_t flags;
+
+	/* validate_ip_packet has vouched for hl and total */
+	data_len = total - hl;
+
+	/* Headers common to all fragments */
+	memcpy(e_hdr->ether_dhost, dst_ether_addr, ETHER_ADDR_LEN);
+	memcpy(e_hdr->ether_shost, itf->addr, ETHER_ADDR_LEN);
+	e_hdr->ether_type = htons(ETHERTYPE_IP);
+	memcpy(ip_hdr, src_ip_hdr, hl);
+	if (dec_ttl) {
+		ip_hdr->ip_ttl--;
+	}
+
+	while (pos < data_len) {
+		/* Everything but the last fragment has to be a multiple of 8 bytes */
+		chunk = (itf->mtu - hl) & ~(IP_FRAG_UNIT - 1);
+		if (chunk == 0) {
+			Debug("MTU of %s too small to fragment into. Drop\n", itf->name);
+			return;
+		}
+		flags = IP_MF;
+		if (chunk >= data_len - pos) {
+			chunk = data_len - pos;
+			flags = src_off & IP_MF;
+		}
+		ip_hdr->ip_len = htons(hl + chunk);
+		ip_hdr->ip_off = htons(flags | ((base + pos) / IP_FRAG_UNIT));
+		calc_checksum(ip_hdr, NULL, hl);
+		memcpy(out + ETHER_HDR_LEN + hl, data + pos, chunk);
+
+		sr_send_packet(sr, out, ETHER_HDR_LEN + hl + chunk, itf->name);
+		sr->frag->stats.frags_out++;
+
+		if (pos == 0 && hl > sizeof(struct ip)) {
+			hl = keep_copied_options(ip_hdr, hl);
+		}
+		pos += chunk;
+	}
+}
+
+/*---------------------------------------------------------------------
+ * Method: keep_copied_options(struct ip* ip_hdr, unsigned int hl)
+ * Scope:  Private
+ *
+ * Squeezes out of the header every option that isn't to be copied into
+ * fragments, pads what's left to a 32 bit boundary and returns the new
+ * header length.
+ *
+ *---------------------------------------------------------------------*/
+#define IPOPT_COPIED_FLAG 0x80
+#define IPOPT_END_OF_LIST 0
+#define IPOPT_NO_OP 1
+unsigned int keep_copied_options(struct ip* ip_hdr, unsigned int hl)
+{
+	uint8_t* opt = (uint8_t*)ip_hdr + sizeof(struct ip);
+	unsigned int in = 0, out = 0, opt_len;
+	unsigned int opts_len = hl - sizeof(struct ip);
+
+	while (in < opts_len && opt[in] != IPOPT_END_OF_LIST) {
+		if (opt[in] == IPOPT_NO_OP) {
+			in++;
+			continue;
+		}
+		if (in + 1 >= opts_len || opt[in+1] < 2 || in + opt[in+1] > opts_len) {
+			/* Garbled, keep nothing from here on */
+			break;
+		}
+		opt_len = opt[in+1];
+		if (opt[in] & IPOPT_COPIED_FLAG) {
+			memmove(opt + out, opt + in, opt_len);
+			out += opt_len;
+		}
+		in += opt_len;
+	}
+	while (out % 4) {
+		opt[out++] = IPOPT_END_OF_LIST;
+	}
+	ip_hdr->ip_hl = (sizeof(struct ip) + out) / 4;
+	return sizeof(struct ip) + out;
+}
+
+/*---------------------------------------------------------------------
+ * Method: ip_reassemble(struct sr_instance* sr, uint8_t* packet, unsigned int len,
+ * 						 unsigned int* out_len)
+ * Scope:  Global
+ *
+ * Called for every fragment addressed to the router.  Which 8 byte
+ * blocks of the datagram have arrived is kept in a bitmap, so overlapping
+ * and duplicate fragments are harmless: the datagram is complete once
+ * the last fragment has told us its length, fragment 0 has given us the
+ * headers and every block up to the end is in.
+ *
+ * The returned frame lives in the slot's buffer, which is only reused
+ * once we're called again.
+ *
+ *---------------------------------------------------------------------*/
+uint8_t* ip_reassemble(struct sr_instance* sr, uint8_t* packet, unsigned int len,
+					   unsigned int* out_len)
+{
+	struct ip_frag_state* fs = sr->frag;
+	struct ip* ip_hdr = (struct ip*)(packet + ETHER_HDR_LEN);
+	unsigned int hl = ip_hdr->ip_hl * 4;
+	unsigned int total = ntohs(ip_hdr->ip_len);
+	uint16_t off_field = ntohs(ip_hdr->ip_off);
+	unsigned int off = (off_field & IP_OFFMASK) * IP_FRAG_UNIT;
+	int more = (off_field & IP_MF) != 0;
+	unsigned int data_len, i, last;
+	struct reasm_entry* entry;
+	struct ip* reasm_ip_hdr;
+	uint8_t* payload;
+	time_t now = reasm_clock();
+
+	fs->stats.frags_in++;
+	check_reasm_timeouts(fs, now);
+
+	/* validate_ip_packet has vouched for hl and total, but an empty
+	 * fragment is still no use to anyone */
+	if (total == hl) {
+		Debug("Empty IP fragment. Drop\n");
+		fs->stats.reasm_drop++;
+		return NULL;
+	}
+	data_len = total - hl;
+	if (off + data_len > IP_MAXPACKET - sizeof(struct ip) ||
+		(more && (data_len % IP_FRAG_UNIT) != 0)) {
+		Debug("IP fragment doesn't fit a datagram. Drop\n");
+		fs->stats.reasm_drop++;
+		return NULL;
+	}
+
+	entry = find_reasm_entry(fs, ip_hdr, now);
+	if (entry->buffer == NULL) {
+		entry->buffer = (uint8_t*)malloc(IP_FRAME_BUF_LEN);
+		if (entry->buffer == NULL) {
+			entry->in_use = 0;
+			fs->stats.reasm_drop++;
+			return NULL;
+		}
+	}
+
+	/* The last fragment fixes the length; nothing may lie beyond it */
+	if (off + data_len > entry->max_end) {
+		entry->max_end = off + data_len;
+	}
+	if (!more && entry->total_len == 0) {
+		entry->total_len = off + data_len;
+	}
+	if ((!more && entry->total_len != off + data_len) ||
+		(entry->total_len != 0 && entry->max_end > entry->total_len)) {
+		Debug("Inconsistent IP fragments. Drop datagram\n");
+		entry->in_use = 0;
+		fs->stats.reasm_drop++;
+		return NULL;
+	}
+
+	/* Payload goes straight to its final place, headers right in front */
+	payload = entry->buffer + ETHER_HDR_LEN + IP_MAX_HDR_LEN;
+	memcpy(payload + off, (uint8_t*)ip_hdr + hl, data_len);
+	if (off == 0 && entry->hdr_len == 0) {
+		entry->hdr_len = hl;
+		memcpy(payload - hl, ip_hdr, hl);
+		memcpy(payload - hl - ETHER_HDR_LEN, packet, ETHER_HDR_LEN);
+	}
+
+	last = (off + data_len + IP_FRAG_UNIT - 1) / IP_FRAG_UNIT;
+	for (i = off / IP_FRAG_UNIT; i < last; i++) {
+		if ((entry->bitmap[i / 8] & (1 << (i % 8))) == 0) {
+			entry->bitmap[i / 8] |= 1 << (i % 8);
+			entry->blocks_have++;
+		}
+	}
+
+	if (entry->hdr_len == 0 || entry->total_len == 0 ||
+		entry->blocks_have != (entry->total_len + IP_FRAG_UNIT - 1) / IP_FRAG_UNIT) {
+		/* Still waiting for more */
+		return NULL;
+	}
+
+	entry->in_use = 0;
+	if (entry->hdr_len + entry->total_len > IP_MAXPACKET) {
+		Debug("Reassembled IP datagram too long. Drop\n");
+		fs->stats.reasm_drop++;
+		return NULL;
+	}
+
+	reasm_ip_hdr = (struct ip*)(payload - entry->hdr_len);
+	reasm_ip_hdr->ip_len = htons(entry->hdr_len + entry->total_len);
+	reasm_ip_hdr->ip_off &= htons(IP_DF);
+	calc_checksum(reasm_ip_hdr, NULL, entry->hdr_len);
+
+	fs->stats.reasm_ok++;
+	*out_len = ETHER_HDR_LEN + entry->hdr_len + entry->total_len;
+	return payload - entry->hdr_len - ETHER_HDR_LEN;
+}
+
+/*---------------------------------------------------------------------
+ * Method: find_reasm_entry(struct ip_frag_state* fs, struct ip* ip_hdr, time_t now)
+ * Scope:  Private
+ *
+ * Datagrams are told apart by (source, destination, protocol, id) as in
+ * RFC 791.  If there's no entry for this one and the table is full, the
+ * oldest datagram is thrown out to make room.
+ *
+ *---------------------------------------------------------------------*/
+struct reasm_entry* find_reasm_entry(struct ip_frag_state* fs, struct ip* ip_hdr, time_t now)
+{
+	struct reasm_entry* entry = NULL;
+	struct reasm_entry* oldest = NULL;
+	struct reasm_entry* free_entry = NULL;
+	int i;
+
+	for (i = 0; i < IP_REASM_SLOTS; i++) {
+		entry = &fs->table[i];
+		if (!entry->in_use) {
+			if (free_entry == NULL) {
+				free_entry = entry;
+			}
+			continue;
+		}
+		if (entry->ip_id == ip_hdr->ip_id && entry->ip_src == ip_hdr->ip_src.s_addr &&
+			entry->ip_dst == ip_hdr->ip_dst.s_addr && entry->ip_p == ip_hdr->ip_p) {
+			return entry;
+		}
+		if (oldest == NULL || entry->start_time < oldest->start_time) {
+			oldest = entry;
+		}
+	}
+
+	if (free_entry == NULL) {
+		Debug("Reassembly table full. Evicting oldest datagram\n");
+		fs->stats.reasm_drop++;
+		free_entry = oldest;
+	}
+
+	free_entry->in_use = 1;
+	free_entry->ip_src = ip_hdr->ip_src.s_addr;
+	free_entry->ip_dst = ip_hdr->ip_dst.s_addr;
+	free_entry->ip_id = ip_hdr->ip_id;
+	free_entry->ip_p = ip_hdr->ip_p;
+	free_entry->start_time = now;
+	free_entry->hdr_len = 0;
+	free_entry->total_len = 0;
+	free_entry->max_end = 0;
+	free_entry->blocks_have = 0;
+	memset(free_entry->bitmap, 0, sizeof(free_entry->bitmap));
+	return free_entry;
+}
+
+/*---------------------------------------------------------------------
+ * Method: check_reasm_timeouts(struct ip_frag_state* fs, time_t now)
+ * Scope:  Private
+ *
+ * Gives up on datagrams whose first fragment came in more than
+ * IP_REASM_TIME_OUT seconds ago.
+ *
+ *---------------------------------------------------------------------*/
+void check_reasm_timeouts(struct ip_frag_state* fs, time_t now)
+{
+	int i;
+	for (i = 0; i < IP_REASM_SLOTS; i++) {
+		if (fs->table[i].in_use && now - fs->table[i].start_time > IP_REASM_TIME_OUT) {
+			Debug("IP reassembly timed out\n");
+			fs->table[i].in_use = 0;
+			fs->stats.reasm_timeout++;
+		}
+	}
+}
+
+/*---------------------------------------------------------------------
+ * Method: reasm_clock(void)
+ * Scope:  Private
+ *
+ * Seconds since some fixed point in the past, for timing out datagrams.
+ *
+ *---------------------------------------------------------------------*/
+time_t reasm_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*---------------------------------------------------------------------
+ * Method: print_frag_stats(struct sr_instance* sr)
+ * Scope:  Global
+ *---------------------------------------------------------------------*/
+void print_frag_stats(struct sr_instance* sr)
+{
+	struct frag_stats* stats = &sr->frag->stats;
+	printf("IP fragmentation:\n");
+	printf("\t%lu fragments sent, %lu ICMP frag needed\n",
+		   stats->frags_out, stats->frag_needed);
+	printf("\t%lu fragments received, %lu reassembled, %lu timed out, %lu dropped\n",
+		   stats->frags_in, stats->reasm_ok, stats->reasm_timeout, stats->reasm_drop);
+}
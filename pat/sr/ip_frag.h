@@ -0,0 +1,79 @@
+/*-----------------------------------------------------------------------------
+ * File: ip_frag.h
+ * Date: Mon Oct 19 2026
+ *
+ * IP fragmentation on output and reassembly of fragments addressed to
+ * the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef IP_FRAG_H_
+#define IP_FRAG_H_
+
+#include "sr_router.h"
+
+#define IP_MAX_HDR_LEN 60		/* ip_hl is 4 bits of 32-bit words */
+#define IP_FRAG_UNIT 8			/* fragment offsets count 8 byte blocks */
+#define IP_REASM_SLOTS 8		/* datagrams reassembled at once */
+#define IP_REASM_TIME_OUT 15	/* seconds, RFC 1122 asks for 60-120 max */
+
+/* Buffer big enough for any ethernet frame carrying an IP datagram */
+#define IP_FRAME_BUF_LEN (sizeof(struct sr_ethernet_hdr) + IP_MAX_HDR_LEN + IP_MAXPACKET)
+
+#define ip_is_fragment(ip_hdr) \
+	(((ip_hdr)->ip_off & htons(IP_MF | IP_OFFMASK)) != 0)
+
+struct frag_stats {
+	unsigned long frags_out;		/* fragments we generated */
+	unsigned long frag_needed;		/* ICMP frag needed sent because of DF */
+	unsigned long frags_in;			/* fragments addressed to the router */
+	unsigned long reasm_ok;			/* datagrams put back together */
+	unsigned long reasm_timeout;	/* datagrams that never completed */
+	unsigned long reasm_drop;		/* malformed fragments, evicted datagrams */
+};
+
+/* One datagram being reassembled. The payload is written straight into
+ * buffer at its final position; the ethernet and IP headers of fragment 0
+ * are laid down just in front of it when it arrives, so the completed
+ * frame is contiguous without ever being moved. */
+struct reasm_entry {
+	int in_use;
+	uint32_t ip_src;
+	uint32_t ip_dst;
+	uint16_t ip_id;
+	uint8_t ip_p;
+	time_t start_time;
+	unsigned int hdr_len;		/* 0 until fragment 0 shows up */
+	unsigned int total_len;		/* payload bytes, 0 until the last fragment */
+	unsigned int max_end;		/* furthest payload byte seen */
+	unsigned int blocks_have;	/* 8 byte blocks received so far */
+	uint8_t* buffer;			/* kept across datagrams, IP_FRAME_BUF_LEN */
+	uint8_t bitmap[IP_MAXPACKET / IP_FRAG_UNIT / 8 + 1];
+};
+
+struct ip_frag_state {
+	struct reasm_entry table[IP_REASM_SLOTS];
+	uint8_t frag_buffer[IP_FRAME_BUF_LEN];	/* outgoing fragments are built here */
+	struct frag_stats stats;
+};
+
+void init_ip_frag(struct sr_instance* sr);
+
+/* Send an IP frame (ethernet header filled in) out of itf, splitting it
+ * into fragments if it is larger than the interface MTU. */
+void ip_output(struct sr_instance* sr, struct sr_if* itf, uint8_t* packet, unsigned int len);
+
+/* Send src_packet out of itf as fragments, rewriting the ethernet header
+ * and optionally decrementing the TTL on the way.  src_packet is not
+ * modified. */
+void ip_fragment(struct sr_instance* sr, struct sr_if* itf, uint8_t* dst_ether_addr,
+				 uint8_t* src_packet, unsigned int len, int dec_ttl);
+
+/* Feed a fragment addressed to us.  Returns the completed frame, lent
+ * until the next call, or NULL if the datagram is still incomplete. */
+uint8_t* ip_reassemble(struct sr_instance* sr, uint8_t* packet, unsigned int len,
+					   unsigned int* out_len);
+
+void print_frag_stats(struct sr_instance* sr);
+
+#endif /*IP_FRAG_H_*/
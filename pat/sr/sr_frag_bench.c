@@ -0,0 +1,263 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_frag_bench.c
+ * Date: Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * Large frame benchmark for the forwarding path, run on the stub router
+ * (sr_stub.h).  Jumbo datagrams come in on eth0 and are
+ *
+ *   fits      - forwarded out of eth1 with an MTU big enough to take them
+ *   fragment  - forwarded out of eth1 as fragments (ip_fragment)
+ *   df        - refused with ICMP frag needed because DF is set
+ *   reasm     - ICMP echo requests to the router, arriving as fragments
+ *               that are reassembled, with the reply fragmented going out
+ *
+ * and each prints datagrams/sec, input bandwidth and frames sent per
+ * datagram.
+ *
+ *   sr_frag_bench [-s datagram bytes] [-m eth1 mtu] [-n datagrams]
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_if.h"
+#include "sr_router.h"
+#include "ip_frag.h"
+#include "sr_stub.h"
+
+#define ETHER_HDR_LEN sizeof(struct sr_ethernet_hdr)
+#define ARP_REFRESH 4096   /* datagrams between ARP cache refreshes */
+
+extern char* optarg;
+
+static uint8_t rx_buffer[IP_FRAME_BUF_LEN];
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+} /* -- now -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: build_frame(..)
+ * Scope: Local
+ *
+ * An ethernet frame to the router's eth_if carrying an IP datagram of
+ * len bytes.  ICMP datagrams are echo requests with a good checksum.
+ * Returns the frame length.
+ *
+ *---------------------------------------------------------------------------*/
+
+static unsigned int build_frame(struct sr_instance* sr, uint8_t* frame,
+                                const char* eth_if, const char* dst,
+                                uint8_t proto, unsigned int len, int df)
+{
+    struct sr_ethernet_hdr* e_hdr = (struct sr_ethernet_hdr*)frame;
+    struct ip* ip_hdr = (struct ip*)(frame + ETHER_HDR_LEN);
+    struct icmp_header* icmp_hdr = 0;
+    struct sr_if* itf = sr_get_interface(sr, eth_if);
+    unsigned int i;
+
+    memcpy(e_hdr->ether_dhost, itf->addr, ETHER_ADDR_LEN);
+    memset(e_hdr->ether_shost, 0x02, ETHER_ADDR_LEN);
+    e_hdr->ether_type = htons(ETHERTYPE_IP);
+
+    memset(ip_hdr, 0, sizeof(struct ip));
+    ip_hdr->ip_v   = 4;
+    ip_hdr->ip_hl  = sizeof(struct ip) / 4;
+    ip_hdr->ip_len = htons(len);
+    ip_hdr->ip_id  = htons(1);
+    ip_hdr->ip_off = df ? htons(IP_DF) : 0;
+    ip_hdr->ip_ttl = INIT_TTL;
+    ip_hdr->ip_p   = proto;
+    ip_hdr->ip_src.s_addr = inet_addr("10.0.0.99");
+    ip_hdr->ip_dst.s_addr = inet_addr(dst);
+    calc_checksum(ip_hdr, NULL, sizeof(struct ip));
+
+    for(i = sizeof(struct ip); i < len; ++i)
+    { ((uint8_t*)ip_hdr)[i] = (uint8_t)i; }
+
+    if(proto == IPPROTO_ICMP)
+    {
+        icmp_hdr = (struct icmp_header*)(ip_hdr + 1);
+        icmp_hdr->type = ICMP_TYPE_ECHO;
+        icmp_hdr->code = 0;
+        calc_checksum(NULL, icmp_hdr, len - sizeof(struct ip));
+    }
+
+    return ETHER_HDR_LEN + len;
+} /* -- build_frame -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: split_frame(..)
+ * Scope: Local
+ *
+ * Cut frame into fragments of at most mtu bytes of IP, written one after
+ * the other into frags, each preceded by its length.  Returns the number
+ * of fragments.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int split_frame(const uint8_t* frame, unsigned int mtu, uint8_t* frags)
+{
+    const struct ip* ip_hdr = (const struct ip*)(frame + ETHER_HDR_LEN);
+    unsigned int data_len = ntohs(ip_hdr->ip_len) - sizeof(struct ip);
+    unsigned int chunk = (mtu - sizeof(struct ip)) & ~(IP_FRAG_UNIT - 1);
+    unsigned int pos, n, flen;
+    struct ip* frag_hdr;
+    int count = 0;
+
+    for(pos = 0; pos < data_len; pos += n, ++count)
+    {
+        n = (data_len - pos < chunk) ? data_len - pos : chunk;
+        flen = ETHER_HDR_LEN + sizeof(struct ip) + n;
+
+        memcpy(frags, &flen, sizeof(flen));
+        frags += sizeof(flen);
+        memcpy(frags, frame, ETHER_HDR_LEN + sizeof(struct ip));
+        memcpy(frags + ETHER_HDR_LEN + sizeof(struct ip),
+               frame + ETHER_HDR_LEN + sizeof(struct ip) + pos, n);
+
+        frag_hdr = (struct ip*)(frags + ETHER_HDR_LEN);
+        frag_hdr->ip_len = htons(sizeof(struct ip) + n);
+        frag_hdr->ip_off = htons((pos + n < data_len ? IP_MF : 0) |
+                                 (pos / IP_FRAG_UNIT));
+        calc_checksum(frag_hdr, NULL, sizeof(struct ip));
+        frags += flen;
+    }
+
+    return count;
+} /* -- split_frame -- */
+
+static void report(const char* name, struct sr_instance* sr, int n,
+                   unsigned int size, double elapsed)
+{
+    printf("%-9s %8.0f datagrams/s %8.1f MB/s in %6.2f frames out each"
+           "%s\n", name, n / elapsed, n * (double)size / elapsed / 1e6,
+           (double)sr_stub_sent.frames / n,
+           sr_stub_sent.oversize ? "  (OVERSIZE FRAMES SENT)" : "");
+} /* -- report -- */
+
+static void bench_forward(struct sr_instance* sr, const char* name,
+                          unsigned int size, int df, int n)
+{
+    uint8_t frame[IP_FRAME_BUF_LEN];
+    unsigned int len;
+    double start;
+    int i;
+
+    len = build_frame(sr, frame, SR_STUB_IF0, "10.0.1.99", IPPROTO_UDP,
+                      size, df);
+    memset(&sr_stub_sent, 0, sizeof(sr_stub_sent));
+
+    start = now();
+    for(i = 0; i < n; ++i)
+    {
+        if(i % ARP_REFRESH == 0)
+        { sr_stub_refresh_arp(sr); }
+        memcpy(rx_buffer, frame, len);
+        sr_handlepacket(sr, rx_buffer, len, SR_STUB_IF0);
+    }
+    report(name, sr, n, size, now() - start);
+} /* -- bench_forward -- */
+
+static void bench_reasm(struct sr_instance* sr, unsigned int size,
+                        unsigned int mtu, int n)
+{
+    uint8_t frame[IP_FRAME_BUF_LEN];
+    uint8_t* frags = 0;
+    uint8_t* f = 0;
+    unsigned int flen;
+    int nfrags, i, j;
+    double start;
+
+    build_frame(sr, frame, SR_STUB_IF1, "10.0.1.1", IPPROTO_ICMP, size, 0);
+    frags = (uint8_t*)malloc(2 * IP_FRAME_BUF_LEN);
+    assert(frags);
+    nfrags = split_frame(frame, mtu, frags);
+    memset(&sr_stub_sent, 0, sizeof(sr_stub_sent));
+
+    start = now();
+    for(i = 0; i < n; ++i)
+    {
+        for(j = 0, f = frags; j < nfrags; ++j, f += flen)
+        {
+            memcpy(&flen, f, sizeof(flen));
+            f += sizeof(flen);
+            memcpy(rx_buffer, f, flen);
+            sr_handlepacket(sr, rx_buffer, flen, SR_STUB_IF1);
+        }
+    }
+    report("reasm", sr, n, size, now() - start);
+
+    if(sr->frag->stats.reasm_ok != (unsigned long)n)
+    {
+        printf("reassembled %lu of %d datagrams\n",
+               sr->frag->stats.reasm_ok, n);
+    }
+    free(frags);
+} /* -- bench_reasm -- */
+
+int main(int argc, char** argv)
+{
+    struct sr_instance sr;
+    unsigned int size = 8000;
+    unsigned int mtu  = sr_IFACE_DEFAULT_MTU;
+    int n = 200000;
+    char spec[64];
+    int c;
+
+    while((c = getopt(argc, argv, "s:m:n:")) != EOF)
+    {
+        switch(c)
+        {
+            case 's': size = atoi(optarg); break;
+            case 'm': mtu  = atoi(optarg); break;
+            case 'n': n    = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s datagram bytes] [-m eth1 mtu] "
+                        "[-n datagrams]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(size < sizeof(struct ip) + ICMP_HDR_LEN || size > IP_MAXPACKET ||
+       mtu < sr_IFACE_MIN_MTU || n <= 0)
+    {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+
+    sprintf(spec, "eth0=%u,eth1=%u", (unsigned int)IP_MAXPACKET, mtu);
+    sr_stub_init(&sr, spec);
+
+    printf("%u byte datagrams, eth1 mtu %u, %d datagrams\n", size, mtu, n);
+
+    sr_set_mtu(&sr, "eth1=65535");
+    bench_forward(&sr, "fits", size, 0, n);
+
+    sprintf(spec, "eth1=%u", mtu);
+    sr_set_mtu(&sr, spec);
+    bench_forward(&sr, "fragment", size, 0, n);
+    bench_forward(&sr, "df", size, 1, n);
+    bench_reasm(&sr, size, mtu, n);
+
+    print_frag_stats(&sr);
+    print_drop_stats(&sr);
+    return 0;
+} /* -- main -- */
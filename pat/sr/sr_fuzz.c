@@ -0,0 +1,315 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_fuzz.c
+ * Date: Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * Feeds sr_handlepacket(..) random frames on the stub router (sr_stub.h).
+ * Most are mutations of well formed ones - ARP requests and replies,
+ * datagrams to forward, fragments, echo requests to the router - with
+ * the IP checksum usually fixed up afterwards so they get past
+ * validate_ip_packet(..); the rest are noise.  Each frame is copied into
+ * a buffer of exactly its length, so built with -fsanitize=address
+ * (make fuzz) any read or write past the end of it, or of anything the
+ * router sends, stops the run.
+ *
+ *   sr_fuzz [-n frames] [-S seed]
+ *
+ * The seed is printed first; the same seed replays the same frames.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_if.h"
+#include "sr_router.h"
+#include "ip_frag.h"
+#include "sr_stub.h"
+
+#define ETHER_HDR_LEN sizeof(struct sr_ethernet_hdr)
+#define IP_HDR_OFF    ETHER_HDR_LEN
+#define MAX_TEMPLATES 16
+#define MAX_FRAME     2048     /* biggest frame fed in */
+#define ARP_REFRESH   4096     /* frames between ARP cache refreshes */
+
+extern char* optarg;
+
+struct fuzz_template
+{
+    uint8_t frame[MAX_FRAME];
+    unsigned int len;
+    char* iface;
+};
+
+static struct fuzz_template templates[MAX_TEMPLATES];
+static int num_templates = 0;
+static uint32_t fuzz_seed;
+
+static uint32_t fuzz_rand(void)
+{
+    /* -- xorshift32, so a seed means the same frames everywhere -- */
+    fuzz_seed ^= fuzz_seed << 13;
+    fuzz_seed ^= fuzz_seed >> 17;
+    fuzz_seed ^= fuzz_seed << 5;
+    return fuzz_seed;
+} /* -- fuzz_rand -- */
+
+static struct fuzz_template* new_template(struct sr_instance* sr, char* iface)
+{
+    struct fuzz_template* t = 0;
+    struct sr_ethernet_hdr* e_hdr = 0;
+
+    assert(num_templates < MAX_TEMPLATES);
+    t = &templates[num_templates++];
+    t->iface = iface;
+
+    e_hdr = (struct sr_ethernet_hdr*)t->frame;
+    memcpy(e_hdr->ether_dhost, sr_get_interface(sr, iface)->addr,
+           ETHER_ADDR_LEN);
+    memset(e_hdr->ether_shost, 0x02, ETHER_ADDR_LEN);
+    return t;
+} /* -- new_template -- */
+
+static void add_arp(struct sr_instance* sr, char* iface, unsigned short op,
+                    const char* sip, const char* tip)
+{
+    struct fuzz_template* t = new_template(sr, iface);
+    struct sr_arphdr* arp_hdr = (struct sr_arphdr*)(t->frame + ETHER_HDR_LEN);
+
+    ((struct sr_ethernet_hdr*)t->frame)->ether_type = htons(ETHERTYPE_ARP);
+    arp_hdr->ar_hrd = htons(ARPHDR_ETHER);
+    arp_hdr->ar_pro = htons(ETHERTYPE_IP);
+    arp_hdr->ar_hln = ETHER_ADDR_LEN;
+    arp_hdr->ar_pln = 4;
+    arp_hdr->ar_op  = htons(op);
+    memset(arp_hdr->ar_sha, 0x02, ETHER_ADDR_LEN);
+    arp_hdr->ar_sip = inet_addr(sip);
+    memset(arp_hdr->ar_tha, 0, ETHER_ADDR_LEN);
+    arp_hdr->ar_tip = inet_addr(tip);
+    t->len = ETHER_HDR_LEN + sizeof(struct sr_arphdr);
+} /* -- add_arp -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: add_ip(..)
+ * Scope: Local
+ *
+ * A datagram of total bytes, or the frag_len bytes of it starting at
+ * frag_off when frag_len isn't 0.  ICMP datagrams are echo requests whose
+ * checksum covers the whole datagram.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void add_ip(struct sr_instance* sr, char* iface, const char* dst,
+                   uint8_t proto, uint8_t ttl, unsigned int total,
+                   unsigned int frag_off, unsigned int frag_len)
+{
+    uint8_t datagram[IP_MAXPACKET];
+    struct ip* ip_hdr = (struct ip*)datagram;
+    struct icmp_header* icmp_hdr = (struct icmp_header*)(ip_hdr + 1);
+    struct fuzz_template* t = new_template(sr, iface);
+    unsigned int i;
+
+    ((struct sr_ethernet_hdr*)t->frame)->ether_type = htons(ETHERTYPE_IP);
+
+    memset(ip_hdr, 0, sizeof(struct ip));
+    ip_hdr->ip_v   = 4;
+    ip_hdr->ip_hl  = sizeof(struct ip) / 4;
+    ip_hdr->ip_len = htons(total);
+    ip_hdr->ip_id  = htons(num_templates);
+    ip_hdr->ip_ttl = ttl;
+    ip_hdr->ip_p   = proto;
+    ip_hdr->ip_src.s_addr = inet_addr("10.0.0.99");
+    ip_hdr->ip_dst.s_addr = inet_addr(dst);
+    for(i = sizeof(struct ip); i < total; ++i)
+    { datagram[i] = (uint8_t)i; }
+    if(proto == IPPROTO_ICMP)
+    {
+        icmp_hdr->type = ICMP_TYPE_ECHO;
+        icmp_hdr->code = 0;
+        calc_checksum(NULL, icmp_hdr, total - sizeof(struct ip));
+    }
+
+    if(frag_len)
+    {
+        memcpy(datagram + sizeof(struct ip),
+               datagram + sizeof(struct ip) + frag_off, frag_len);
+        ip_hdr->ip_len = htons(sizeof(struct ip) + frag_len);
+        ip_hdr->ip_off = htons(
+            (frag_off + frag_len < total - sizeof(struct ip) ? IP_MF : 0) |
+            frag_off / IP_FRAG_UNIT);
+        total = sizeof(struct ip) + frag_len;
+    }
+    calc_checksum(ip_hdr, NULL, sizeof(struct ip));
+
+    assert(ETHER_HDR_LEN + total <= MAX_FRAME);
+    memcpy(t->frame + ETHER_HDR_LEN, datagram, total);
+    t->len = ETHER_HDR_LEN + total;
+} /* -- add_ip -- */
+
+static void init_templates(struct sr_instance* sr)
+{
+    add_arp(sr, SR_STUB_IF0, ARP_REQUEST, "10.0.0.7", "10.0.0.1");
+    add_arp(sr, SR_STUB_IF1, ARP_REPLY, "10.0.1.5", "10.0.1.1");
+    add_arp(sr, SR_STUB_IF0, ARP_REQUEST, "10.0.0.7", "10.0.0.200");
+
+    /* -- forwarded, whole and (eth1 has a small MTU) fragmented -- */
+    add_ip(sr, SR_STUB_IF0, "10.0.1.99", IPPROTO_UDP, INIT_TTL, 400, 0, 0);
+    add_ip(sr, SR_STUB_IF0, "10.0.1.99", IPPROTO_UDP, INIT_TTL, 1500, 0, 0);
+    add_ip(sr, SR_STUB_IF1, "192.168.1.1", IPPROTO_UDP, INIT_TTL, 1000, 0, 0);
+    add_ip(sr, SR_STUB_IF0, "10.0.1.99", IPPROTO_UDP, 1, 200, 0, 0);
+
+    /* -- to the router, whole and as fragments of a 3000 byte echo -- */
+    add_ip(sr, SR_STUB_IF0, "10.0.0.1", IPPROTO_ICMP, INIT_TTL, 100, 0, 0);
+    add_ip(sr, SR_STUB_IF1, "10.0.1.1", IPPROTO_ICMP, INIT_TTL, 3000, 0, 1000);
+    add_ip(sr, SR_STUB_IF1, "10.0.1.1", IPPROTO_ICMP, INIT_TTL, 3000, 1000,
+           1000);
+    add_ip(sr, SR_STUB_IF1, "10.0.1.1", IPPROTO_ICMP, INIT_TTL, 3000, 2000,
+           980);
+    add_ip(sr, SR_STUB_IF0, "10.0.0.1", IPPROTO_UDP, INIT_TTL, 60, 0, 0);
+
+    /* -- forwarded fragments -- */
+    add_ip(sr, SR_STUB_IF0, "10.0.1.99", IPPROTO_UDP, INIT_TTL, 1600, 0, 800);
+    add_ip(sr, SR_STUB_IF0, "10.0.1.99", IPPROTO_UDP, INIT_TTL, 1600, 800,
+           780);
+} /* -- init_templates -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: make_frame(..)
+ * Scope: Local
+ *
+ * Writes the next frame into buf and returns its length and the interface
+ * it arrives on.
+ *
+ *---------------------------------------------------------------------------*/
+
+static unsigned int make_frame(uint8_t* buf, char** iface)
+{
+    struct fuzz_template* t = &templates[fuzz_rand() % num_templates];
+    struct ip* ip_hdr = (struct ip*)(buf + IP_HDR_OFF);
+    unsigned int len, n, i, pos;
+
+    *iface = (fuzz_rand() % 8) ? t->iface
+                               : ((fuzz_rand() & 1) ? SR_STUB_IF0 : SR_STUB_IF1);
+
+    /* -- one in sixteen is noise -- */
+    if(fuzz_rand() % 16 == 0)
+    {
+        len = fuzz_rand() % MAX_FRAME;
+        for(i = 0; i < len; ++i)
+        { buf[i] = (uint8_t)fuzz_rand(); }
+        if(len >= ETHER_HDR_LEN && (fuzz_rand() & 1))
+        {
+            ((struct sr_ethernet_hdr*)buf)->ether_type =
+                htons((fuzz_rand() & 1) ? ETHERTYPE_IP : ETHERTYPE_ARP);
+        }
+        return len;
+    }
+
+    memcpy(buf, t->frame, t->len);
+    len = t->len;
+
+    for(n = fuzz_rand() % 5; n > 0; --n)
+    {
+        switch(fuzz_rand() % 5)
+        {
+            case 0: /* -- anywhere -- */
+                buf[fuzz_rand() % len] = (uint8_t)fuzz_rand();
+                break;
+            case 1: /* -- in the IP or ARP header -- */
+                pos = IP_HDR_OFF + fuzz_rand() % sizeof(struct sr_arphdr);
+                if(pos < len)
+                { buf[pos] = (uint8_t)fuzz_rand(); }
+                break;
+            case 2: /* -- a length, offset or flags field, to an edge -- */
+                pos = IP_HDR_OFF + 2 + 4 * (fuzz_rand() % 2);
+                i = fuzz_rand() % 4;
+                if(pos + 1 >= len)
+                { break; }
+                buf[pos]     = (i == 0) ? 0 : (i == 1) ? 0xff : buf[pos] ^ 0x20;
+                buf[pos + 1] = (i == 0) ? 0 : (i == 1) ? 0xff : buf[pos + 1] + 1;
+                break;
+            case 3: /* -- truncated -- */
+                len = fuzz_rand() % len + 1;
+                break;
+            case 4: /* -- trailing junk -- */
+                for(i = fuzz_rand() % 64; i > 0 && len < MAX_FRAME; --i)
+                { buf[len++] = (uint8_t)fuzz_rand(); }
+                break;
+        }
+    }
+
+    /* -- mostly fix the checksum so the mutation gets past validation -- */
+    if(len >= IP_HDR_OFF + sizeof(struct ip) && (fuzz_rand() % 4) &&
+       ((struct sr_ethernet_hdr*)buf)->ether_type == htons(ETHERTYPE_IP))
+    { calc_checksum(ip_hdr, NULL, sizeof(struct ip)); }
+
+    return len;
+} /* -- make_frame -- */
+
+int main(int argc, char** argv)
+{
+    /* -- static, as the ARP thread still has it when main returns -- */
+    static struct sr_instance sr;
+    uint8_t buf[MAX_FRAME];
+    uint8_t* frame = 0;
+    unsigned long n = 1000000;
+    unsigned long i;
+    unsigned int len;
+    char* iface = 0;
+    int c;
+
+    fuzz_seed = (uint32_t)time(0) ^ (uint32_t)getpid();
+
+    while((c = getopt(argc, argv, "n:S:")) != EOF)
+    {
+        switch(c)
+        {
+            case 'n': n = strtoul(optarg, 0, 0); break;
+            case 'S': fuzz_seed = strtoul(optarg, 0, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-n frames] [-S seed]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(fuzz_seed == 0)
+    { fuzz_seed = 1; }
+
+    printf("sr_fuzz: seed %lu, %lu frames\n", (unsigned long)fuzz_seed, n);
+    fflush(stdout);
+
+    /* -- a small MTU on eth1 so forwarding fragments -- */
+    sr_stub_init(&sr, "eth1=576");
+    init_templates(&sr);
+
+    for(i = 0; i < n; ++i)
+    {
+        if(i % ARP_REFRESH == 0)
+        { sr_stub_refresh_arp(&sr); }
+
+        len = make_frame(buf, &iface);
+        frame = (uint8_t*)malloc(len ? len : 1);
+        assert(frame);
+        memcpy(frame, buf, len);
+        sr_handlepacket(&sr, frame, len, iface);
+        free(frame);
+    }
+
+    printf("%lu frames in, %lu frames sent (%lu bigger than the MTU)\n", n,
+           sr_stub_sent.frames, sr_stub_sent.oversize);
+    print_frag_stats(&sr);
+    print_drop_stats(&sr);
+    return sr_stub_sent.oversize ? 1 : 0;
+} /* -- main -- */
@@ -77,6 +77,8 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
         assert(sr->if_list);
         sr->if_list->next = 0;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
+        sr->if_list->speed = 0;
+        sr->if_list->mtu = sr_IFACE_DEFAULT_MTU;
         return;
     }
 
@@ -89,6 +91,8 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     assert(if_walker->next);
     if_walker = if_walker->next;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
+    if_walker->speed = 0;
+    if_walker->mtu = sr_IFACE_DEFAULT_MTU;
     if_walker->next = 0;
 } /* -- sr_add_interface -- */ 
 
@@ -140,6 +144,73 @@ void sr_set_ether_ip(struct sr_instance* sr, uint32_t ip_nbo)
 
 } /* -- sr_set_ether_ip -- */
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_set_mtu(..)
+ * Scope: Global
+ *
+ * set interface MTUs from a comma separated spec of the form
+ * "eth0=1400,eth1=576".  A bare number applies to every interface.
+ * Interfaces not named keep sr_IFACE_DEFAULT_MTU.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success, -1 on a malformed spec or unknown interface
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_set_mtu(struct sr_instance* sr, const char* spec)
+{
+    struct sr_if* if_walker = 0;
+    char name[sr_IFACE_NAMELEN];
+    const char* end = 0;
+    const char* eq  = 0;
+    unsigned long mtu;
+    size_t n;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(spec);
+
+    while(*spec)
+    {
+        if((end = strchr(spec, ',')) == 0)
+        { end = spec + strlen(spec); }
+
+        eq = memchr(spec, '=', end - spec);
+        mtu = strtoul(eq ? eq + 1 : spec, 0, 10);
+        if((mtu < sr_IFACE_MIN_MTU) || (mtu > IP_MAXPACKET))
+        {
+            fprintf(stderr, "Bad MTU in \"%.*s\"\n", (int)(end - spec), spec);
+            return -1;
+        }
+
+        if(eq == 0)
+        {
+            for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+            { if_walker->mtu = mtu; }
+        }
+        else
+        {
+            n = eq - spec;
+            if(n >= sr_IFACE_NAMELEN)
+            { n = sr_IFACE_NAMELEN - 1; }
+            memcpy(name, spec, n);
+            name[n] = 0;
+
+            if((if_walker = sr_get_interface(sr, name)) == 0)
+            {
+                fprintf(stderr, "No interface %s for MTU\n", name);
+                return -1;
+            }
+            if_walker->mtu = mtu;
+        }
+
+        spec = *end ? end + 1 : end;
+    }
+
+    return 0;
+} /* -- sr_set_mtu -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_print_if_list(..)
  * Scope: Global
@@ -191,4 +262,5 @@ void sr_print_if(struct sr_if* iface)
     DebugMAC(iface->addr);
     Debug("\n");
     Debug("\tinet addr %s\n",inet_ntoa(ip_addr));
+    Debug("\tmtu %u\n",iface->mtu);
 } /* -- sr_print_if -- */
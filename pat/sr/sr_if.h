@@ -25,6 +25,8 @@
 #endif
 
 #define sr_IFACE_NAMELEN 32
+#define sr_IFACE_DEFAULT_MTU 1500 /* -- ethernet, bytes of IP per frame -- */
+#define sr_IFACE_MIN_MTU 68       /* -- RFC 791 -- */
 
 struct sr_instance;
 
@@ -41,6 +43,7 @@ struct sr_if
     unsigned char addr[6];
     uint32_t ip;
     uint32_t speed;
+    uint32_t mtu;
     struct sr_if* next;
 };
 
@@ -48,6 +51,7 @@ struct sr_if* sr_get_interface(struct sr_instance* sr, const char* name);
 void sr_add_interface(struct sr_instance*, const char*);
 void sr_set_ether_addr(struct sr_instance*, const unsigned char*);
 void sr_set_ether_ip(struct sr_instance*, uint32_t ip_nbo);
+int  sr_set_mtu(struct sr_instance*, const char* spec);
 void sr_print_if_list(struct sr_instance*);
 void sr_print_if(struct sr_if*);
 
@@ -32,6 +32,7 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "ip_frag.h"
 
 extern char* optarg;
 
@@ -62,9 +63,10 @@ int main(int argc, char **argv)
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
     char *logfile = 0;
+    char *mtu = 0;
     struct sr_instance sr;
 
-    while ((c = getopt(argc, argv, "hs:v:p:c:t:r:l:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:c:t:r:l:m:")) != EOF)
     {
         switch (c) 
         {
@@ -93,6 +95,9 @@ int main(int argc, char **argv)
             case 'r':
                 rtable = optarg; 
                 break;
+            case 'm':
+                mtu = optarg; 
+                break;
         } /* switch */
     } /* -- while -- */
 
@@ -115,6 +120,7 @@ int main(int argc, char **argv)
 
     sr.topo_id = topo;
     strncpy(sr.host,host,32);
+    sr.mtu_spec = mtu;
 
     if(! client )
     { sr_set_user(&sr); }
@@ -163,7 +169,7 @@ static void usage(char* argv0)
     printf("Simple Router Client\n");
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
+    printf("           [-l log file] [-m [iface=]mtu,...] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST ); 
 } /* -- usage -- */
@@ -210,6 +216,13 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    print_drop_stats(sr);
+
+    if(sr->frag)
+    {
+        print_frag_stats(sr);
+    }
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -234,6 +247,9 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->if_list = 0;
     sr->routing_table = 0;
     sr->logfile = 0;
+    sr->frag = 0;
+    sr->mtu_spec = 0;
+    memset(sr->drops, 0, sizeof(sr->drops));
 } /* -- sr_init_instance -- */
 
 /*-----------------------------------------------------------------------------
@@ -22,7 +22,22 @@
 #include "string.h"
 #include "arp_cache.h"
 #include "arp_req.h"
-
+#include "ip_frag.h"
+
+/* Indexed by the DROP_* codes in sr_router.h */
+static const char* drop_reason_names[DROP_REASONS] = {
+	"arp: bad length",
+	"arp: not for us",
+	"arp: unknown opcode",
+	"ip: bad header checksum",
+	"ip: version not 4",
+	"ip: header length not 5 words",
+	"ip: frame too short for ip header",
+	"ip: total length inconsistent with frame",
+	"arp: claims to be from the link layer",
+	"ethernet: unknown type",
+	"ethernet: runt frame"
+};
 
 /*--------------------------------------------------------------------- 
  * Method: sr_init(void)
@@ -40,6 +55,7 @@ void sr_init(struct sr_instance* sr)
     /* Add initialization code here! */
 	init_arp_cache(sr);
 	init_pending_arps(sr);
+	init_ip_frag(sr);
 	
 } /* -- sr_init -- */
 
@@ -77,69 +93,148 @@ void sr_handlepacket(struct sr_instance* sr,
 	 * we call the appropriate function */
 	
 	struct sr_ethernet_hdr* e_hdr = (struct sr_ethernet_hdr*)packet;
-	if (e_hdr->ether_type == htons(ETHERTYPE_ARP)){
-		handle_arp_packet(sr, packet, len, interface);
+	if (len < sizeof(struct sr_ethernet_hdr)) {
+		Debug("Runt frame. Droping Packet\n");
+		sr->drops[DROP_ETH_BADLEN]++;
+	}
+	else if (e_hdr->ether_type == htons(ETHERTYPE_ARP)){
+		if (len < sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arphdr)) {
+			Debug("Truncated ARP packet. Droping Packet\n");
+			sr->drops[DROP_ARP_BADLEN]++;
+		} else {
+			handle_arp_packet(sr, packet, len, interface);
+		}
 	}
 	else if (e_hdr->ether_type == htons(ETHERTYPE_IP)) {
-		handle_ip_packet(sr, packet, len, interface);
+		if (validate_ip_packet(sr, packet, &len)) {
+			handle_ip_packet(sr, packet, len, interface);
+		}
 	}
 	else {
 		Debug("Invalid Packet Type. Droping Packet\n");
+		sr->drops[DROP_ETH_UNKNOWN]++;
 	}
 }/* end sr_ForwardPacket */
 
 
+/*---------------------------------------------------------------------
+ * Method: validate_ip_packet(struct sr_instance* sr, uint8_t* packet, unsigned int* len)
+ * Scope:  Private
+ * Every sanity check on the IP header of an incoming packet is done here,
+ * once, so nothing after it has to worry about a lying header:
+ *   - the frame is long enough for an ethernet and an IP header
+ *   - version is 4 and the header is exactly 5 words (nothing in the
+ *     router understands options)
+ *   - ip_len covers at least the header and no more than the frame
+ *   - the header checksum is good
+ * The first three are folded into a single compare of the first four
+ * bytes so a good packet takes one branch; which check failed is only
+ * worked out for the drop counters once we know the packet is bad.
+ * The checksum is verified by summing the header including ip_sum, which
+ * leaves the packet untouched.
+ * On success *len is trimmed to the IP total length, so ethernet padding
+ * never leaks into ICMP checksums or replies, and 1 is returned.
+ *---------------------------------------------------------------------*/
+int validate_ip_packet(struct sr_instance* sr, uint8_t* packet, unsigned int* len)
+{
+	uint16_t words[sizeof(struct ip) / 2];
+	uint8_t vhl;
+	unsigned int room = *len - sizeof(struct sr_ethernet_hdr);
+	unsigned int total, sum = 0;
+	int i, reason;
+
+	if (*len < sizeof(struct sr_ethernet_hdr) + sizeof(struct ip)) {
+		reason = DROP_IP_BADLEN;
+	}
+	else {
+		memcpy(words, packet + sizeof(struct sr_ethernet_hdr), sizeof(struct ip));
+		vhl = packet[sizeof(struct sr_ethernet_hdr)];
+		total = ntohs(words[1]);
+		if (((vhl ^ 0x45) | (total < sizeof(struct ip)) | (total > room)) == 0) {
+			for (i = 0; i < sizeof(struct ip) / 2; i++) {
+				sum += words[i];
+			}
+			sum = (sum >> 16) + (sum & 0xffff);
+			sum += (sum >> 16);
+			if ((sum & 0xffff) == 0xffff) {
+				*len = sizeof(struct sr_ethernet_hdr) + total;
+				return 1;
+			}
+			reason = DROP_IP_CSUM;
+		}
+		else if ((vhl >> 4) != 4) {
+			reason = DROP_IP_VERSION;
+		}
+		else if ((vhl & 0x0f) != 5) {
+			reason = DROP_IP_BADHDL;
+		}
+		else {
+			reason = DROP_IP_BADTOTLEN;
+		}
+	}
+	Debug("Dropping bad IP packet: %s\n", drop_reason_names[reason]);
+	sr->drops[reason]++;
+	return 0;
+}
+
 /*---------------------------------------------------------------------
  * Method: handle_ip_packet(struct sr_instance* sr, uint8_t* packet, 
  * 							 unsigned int len, char* interface)
  * Scope:  Private
- * This method is called whenever we receive an IP packet.  Here is the
- * pseudo-code for this function
- * 	1.) Check IP checksum -- If it's invalid, drop the packet
- *  2.) Check if the packet has one of the router's IP as the destination IP
+ * This method is called whenever we receive an IP packet that made it
+ * through validate_ip_packet.  Here is the pseudo-code for this function
+ *  1.) Check if the packet has one of the router's IP as the destination IP
  * 		2.1) If this is the case, check if the packet is an ICMP message
  * 			2.1.1) If it is, confirm the ICMP checksum and call a helper function	
  * 				   for handling ICMP packets destined to the router
  *  3.) If the packet was destined to me but it's not an ICMP, we drop it like it's hot
  * 		and send back the port unreachable ICMP
  * 4.) If the packet was NOT destined to me, we call a helper fowarding function
+ * Fragments addressed to the router go into the reassembly table (ip_frag.c)
+ * first and we carry on with the whole datagram once the last piece is in.
  * 
  *---------------------------------------------------------------------*/
 void handle_ip_packet(struct sr_instance* sr, uint8_t* packet, 
 					  unsigned int len, char* interface)
 {
    	 struct ip* ip_hdr = (struct ip*)(packet + sizeof(struct sr_ethernet_hdr));
- 	 uint16_t original_sum = ip_hdr->ip_sum;
-	 calc_checksum(ip_hdr, NULL, sizeof(struct ip));
-   	 if (ip_hdr->ip_sum!=original_sum) {
-	 	Debug("PACKET HAS BAD IP CHECKSUM. DROP!!\n");	
-	 } else {
-		 if (is_router_ip(sr, ip_hdr->ip_dst.s_addr)) {
-		 	/* IP Packet Addressed to Me! */
-		 	 if (ip_hdr->ip_p == IPPROTO_ICMP){
-	 	 		struct icmp_header* icmp_hdr = (struct icmp_header*)(packet 
-	 	 				 + sizeof(struct sr_ethernet_hdr) + sizeof(struct ip));
-	 	 		uint16_t original_checksum = icmp_hdr->checksum;
-	 	 		size_t data_size = len - sizeof(struct sr_ethernet_hdr) - sizeof(struct ip);
-				calc_checksum(NULL, icmp_hdr, data_size);
-				if (icmp_hdr->checksum!=original_checksum){
-					Debug("GOT BAD ICMP MESSAGE CHECKSUM. DROP\n");
-				} else {
-					/* Potential for ECHO request */
-	 	 			sr_handle_icmp_echo(sr, packet, len, interface, icmp_hdr);
-				}
-		 	 }
-		 	 else {
-		 	 	Debug("Received non ICMP packet destined to router. Reply with ICMP \n");
-		 	 	send_icmp_message(sr, packet, interface, len, 
-		 	 				     DEST_UNREACHABLE,  PORT_UNREACHABLE, 1);
-		 	 }
-		 }
-		 else {
-		 	/* Packet not addressed to me - Let's forward it !*/
-			handle_ip_forwarding(sr, packet, len, interface, ip_hdr);
-		 }
-   	 }
+	 if (is_router_ip(sr, ip_hdr->ip_dst.s_addr)) {
+	 	/* IP Packet Addressed to Me! */
+	 	 if (ip_is_fragment(ip_hdr)) {
+	 	 	packet = ip_reassemble(sr, packet, len, &len);
+	 	 	if (packet == NULL) {
+	 	 		/* Wait for the rest of the datagram */
+	 	 		return;
+	 	 	}
+	 	 	ip_hdr = (struct ip*)(packet + sizeof(struct sr_ethernet_hdr));
+	 	 }
+	 	 if (ip_hdr->ip_p == IPPROTO_ICMP){
+ 	 		struct icmp_header* icmp_hdr = (struct icmp_header*)(packet 
+ 	 				 + sizeof(struct sr_ethernet_hdr) + sizeof(struct ip));
+ 	 		uint16_t original_checksum = icmp_hdr->checksum;
+ 	 		size_t data_size = len - sizeof(struct sr_ethernet_hdr) - sizeof(struct ip);
+			if (data_size < ICMP_HDR_LEN) {
+				Debug("ICMP MESSAGE TOO SHORT. DROP\n");
+				return;
+			}
+			calc_checksum(NULL, icmp_hdr, data_size);
+			if (icmp_hdr->checksum!=original_checksum){
+				Debug("GOT BAD ICMP MESSAGE CHECKSUM. DROP\n");
+			} else {
+				/* Potential for ECHO request */
+ 	 			sr_handle_icmp_echo(sr, packet, len, interface, icmp_hdr);
+			}
+	 	 }
+	 	 else {
+	 	 	Debug("Received non ICMP packet destined to router. Reply with ICMP \n");
+	 	 	send_icmp_message(sr, packet, interface, len, 
+	 	 				     DEST_UNREACHABLE,  PORT_UNREACHABLE, 1);
+	 	 }
+	 }
+	 else {
+	 	/* Packet not addressed to me - Let's forward it !*/
+		handle_ip_forwarding(sr, packet, len, interface, ip_hdr);
+	 }
 }
 
 /*---------------------------------------------------------------------
@@ -150,6 +245,9 @@ void handle_ip_packet(struct sr_instance* sr, uint8_t* packet,
  * we need to check is that the TTL is greater than 1. 
  *  We then need to find the next hop. If we can't find it, we send a net
  *  unreachable message.
+ * If the packet is bigger than the MTU of the outgoing interface and has DF
+ * set, we send back frag needed with that MTU.  Otherwise forward_packet
+ * takes care of fragmenting it.
  * If we find it, then we check to see if the next hop's gateway's ethernet
  * address is in our ARP cache. If so, we call yet another helper function to
  * forward the packet.
@@ -171,6 +269,11 @@ void handle_ip_forwarding(struct sr_instance* sr, uint8_t* packet,
 		if (dest_interface==NULL) {
 			/* Could not find next hop in the Routing Table, send ICMP*/
 			send_icmp_message(sr, packet, interface, len, DEST_UNREACHABLE,NET_UNREACHABLE, 1);						
+		} else if ((ip_hdr->ip_off & htons(IP_DF)) && 
+				   ntohs(ip_hdr->ip_len) > sr_get_interface(sr, dest_interface)->mtu) {
+			/* Too big and we aren't allowed to fragment it */
+			send_icmp_frag_needed(sr, packet, interface, len, 
+								  sr_get_interface(sr, dest_interface)->mtu);
 		} else {
 			if (find_cache_entry(sr,ip_gw, dest_interface, dst_ether_addr)==1){
 				Debug("IP In ARP Cache Routing For: ");
@@ -232,6 +335,8 @@ char* find_next_hop(struct sr_instance* sr, uint32_t ip_dst, uint32_t* ip_gw)
  * If we've made it this far, it means that we are ready to forward the packet out of appropriate
  * interface.  This function simply appends the correct ethernet headers to the packet,
  * decreases the TTL, recalculates the IP checksum, and finally sends the packet.
+ * Packets that don't fit the MTU of the interface are handed to ip_fragment,
+ * which builds the fragments straight from src_packet without copying it first.
  * Note that this function can be called immediately after a packet arrives and it's next hop MAC
  * address is in the cache OR from the queue of pending packets after we get the corresponding
  *  ARP reply.
@@ -240,6 +345,11 @@ void forward_packet(struct sr_instance* sr, char* dst_interface, uint8_t* dst_et
 				uint8_t* src_packet,  unsigned int len)
 {
 	struct sr_if* itf =  sr_get_interface(sr, dst_interface);
+	struct ip* src_ip_hdr = (struct ip*)(src_packet + sizeof(struct sr_ethernet_hdr));
+	if (ntohs(src_ip_hdr->ip_len) > itf->mtu) {
+		ip_fragment(sr, itf, dst_ether_addr, src_packet, len, 1);
+		return;
+	}
 	uint8_t *outgoing_packet = (uint8_t*)malloc((size_t)len);
 	/* create a copy of the packet so that we don't overwrite info
 	 * we might need */
@@ -290,6 +400,7 @@ void handle_arp_packet(struct sr_instance* sr, uint8_t* packet, unsigned int len
 	else {
 		/* We got an ARP packet with an unacceptable opcode*/
 		Debug("Invalid ARP OPCODE in Ethernet Msg \n");				
+		sr->drops[DROP_ARP_UNKNOWN]++;
 	}
 }
 
@@ -307,7 +418,9 @@ void send_arp_reply(struct sr_instance* sr, uint8_t * packet,
  {
  	Debug("Received an ARP request from interface: %s\n", interface);
  	struct sr_if* itf =  sr_get_interface(sr, interface);
-	/* Make packet copy so we don't overwrite useful data */
+	/* Make packet copy so we don't overwrite useful data.  The reply is
+	 * just the headers: whatever trailed the request stays behind */
+	len = sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arphdr);
 	uint8_t *reply_packet = (uint8_t*)malloc((size_t)len);
 	memcpy(reply_packet, packet, len);
 		
@@ -376,7 +489,8 @@ void sr_handle_icmp_echo(struct sr_instance* sr, uint8_t* packet,
  						(reply_packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct ip));
  		icmp_hdr_reply->type = ICMP_TYPE_ECHO_REPLY;
  		calc_checksum(NULL, icmp_hdr, len - sizeof(struct sr_ethernet_hdr) - sizeof(struct ip));
- 		sr_send_packet(sr, reply_packet, len, interface);	  
+ 		/* A reassembled request gives a reply that may need fragmenting */
+ 		ip_output(sr, itf, reply_packet, len);	  
  		free(reply_packet);	  
 	}
 	else {
@@ -396,6 +510,35 @@ void sr_handle_icmp_echo(struct sr_instance* sr, uint8_t* packet,
  *---------------------------------------------------------------------*/
 void send_icmp_message(struct sr_instance* sr, uint8_t* trouble_packet, char* interface, 
 					   unsigned int len,  uint8_t type, uint8_t code, int use_dest_ip)
+{
+	send_icmp_message_unused(sr, trouble_packet, interface, len, type, code, use_dest_ip, 0);
+}
+
+/*--------------------------------------------------------------------- 
+ * Method: send_icmp_frag_needed(struct sr_instance* sr, uint8_t* trouble_packet, char* interface,
+					   unsigned int len, uint16_t mtu)
+ * Scope: Private
+ * Destination unreachable, fragmentation needed and DF set.  RFC 1191 puts the MTU of the
+ * next hop in the low 16 bits of the otherwise unused word so the sender can do path MTU
+ * discovery.
+ *---------------------------------------------------------------------*/
+void send_icmp_frag_needed(struct sr_instance* sr, uint8_t* trouble_packet, char* interface,
+					   unsigned int len, uint16_t mtu)
+{
+	sr->frag->stats.frag_needed++;
+	send_icmp_message_unused(sr, trouble_packet, interface, len, DEST_UNREACHABLE, FRAG_NEEDED,
+							 0, htonl((uint32_t)mtu));
+}
+
+/*--------------------------------------------------------------------- 
+ * Method: send_icmp_message_unused(struct sr_instance* sr, uint8_t* trouble_packet, char* interface, 
+					   unsigned int len,  uint8_t type, uint8_t code, int use_dest_ip, uint32_t unused)
+ * Scope: Private
+ * Does the actual work for the two above; unused goes into the ICMP header as is
+ * (network byte order).
+ *---------------------------------------------------------------------*/
+void send_icmp_message_unused(struct sr_instance* sr, uint8_t* trouble_packet, char* interface, 
+					   unsigned int len,  uint8_t type, uint8_t code, int use_dest_ip, uint32_t unused)
 {
 	size_t header_size = sizeof(struct sr_ethernet_hdr) + sizeof(struct ip);
 	size_t icmp_len = header_size + sizeof(struct icmp_header);
@@ -418,7 +561,7 @@ void send_icmp_message(struct sr_instance* sr, uint8_t* trouble_packet, char* in
 		memset(icmp_hdr->data + data_size, 0, ICMP_DATA_LEN-data_size);
 	}
 	/* Set TYPE and CODE*/
-	icmp_hdr->unused = 0;
+	icmp_hdr->unused = unused;
 	icmp_hdr->type = type;
 	icmp_hdr->code = code;
 	/* Calculate checksum and send packet */
@@ -526,6 +669,22 @@ int is_router_ip(struct sr_instance* sr, uint32_t ip)
 	return 0;
 }
 
+/*--------------------------------------------------------------------- 
+ * Method: print_drop_stats(struct sr_instance* sr)
+ * Scope: Global
+ * Dumps the count of packets dropped by the sanity checks, per reason.
+ *---------------------------------------------------------------------*/
+void print_drop_stats(struct sr_instance* sr)
+{
+	int i;
+	printf("Dropped packets:\n");
+	for (i = 0; i < DROP_REASONS; i++) {
+		if (sr->drops[i]) {
+			printf("\t%-40s %lu\n", drop_reason_names[i], sr->drops[i]);
+		}
+	}
+}
+
 /*--------------------------------------------------------------------- 
  * Method: print_ip(uint32_t ip)
  * Scope: Private
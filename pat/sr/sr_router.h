@@ -33,9 +33,25 @@
 #define PACKET_DUMP_SIZE 1024 
 #define MIN_PACKET_LENGTH 60
 
+/* Why a packet was dropped, same codes as sr_transport's sr_router.h */
+#define DROP_ARP_BADLEN   0 /* length of arp packet was bogus */
+#define DROP_ARP_NOT_US   1 /* arp for someone else */
+#define DROP_ARP_UNKNOWN  2 /* unknown ARP type */
+#define DROP_IP_CSUM      3 /* bad ip header checksum */
+#define DROP_IP_VERSION   4 /* ip version != 4 */
+#define DROP_IP_BADHDL    5 /* ip header length isn't 5 32 bit words */
+#define DROP_IP_BADLEN    6 /* ip packet length less than ethernet hdr + ip hdr */
+#define DROP_IP_BADTOTLEN 7 /* reported total length is inconsistent with
+                               packet length */
+#define DROP_ARP_BCAST    8 /* received arp claiming to be from the link layer */
+#define DROP_ETH_UNKNOWN  9 /* unknown ethernet type */
+#define DROP_ETH_BADLEN  10 /* frame shorter than an ethernet header */
+#define DROP_REASONS     11
+
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct ip_frag_state;
 
 
 /* ----------------------------------------------------------------------------
@@ -62,6 +78,10 @@ struct sr_instance
     
     struct cache_entry* cache_head;
     struct cache_entry* cache_tail;
+    
+    struct ip_frag_state* frag; /* fragmentation / reassembly (ip_frag.c) */
+    char* mtu_spec;             /* -m argument, applied once interfaces are known */
+    unsigned long drops[DROP_REASONS]; /* indexed by DROP_* */
    
     
     
@@ -77,10 +97,12 @@ struct sr_instance
 #define HOST_UNREACHABLE 1
 #define PORT_UNREACHABLE 3
 #define HOST_UNREACHABLE 1
+#define FRAG_NEEDED 4
 #define TIME_EXCEEDED  11
 
 
 #define ICMP_DATA_LEN 8
+#define ICMP_HDR_LEN 8 /* type, code, checksum and the unused/id word */
 struct icmp_header
 {
 	uint8_t type;
@@ -109,6 +131,8 @@ void handle_arp_packet(struct sr_instance* sr, uint8_t* packet,
 void handle_ip_forwarding(struct sr_instance* sr, uint8_t* packet, 
 					   unsigned int len, char* interface, struct ip* ip_hdr);
 void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
+int validate_ip_packet(struct sr_instance* sr, uint8_t* packet, unsigned int* len);
+void print_drop_stats(struct sr_instance* sr);
 void send_arp_reply(struct sr_instance* sr, uint8_t * packet,
 										  unsigned int len, char* interface);
 void sr_handle_icmp_echo(struct sr_instance* sr, uint8_t * packet,
@@ -121,6 +145,10 @@ void print_ip(uint32_t ip);
 int check_checksum(struct ip* ip_hdr);
 void send_icmp_message(struct sr_instance* sr, uint8_t* trouble_packet, char* interface, 
 					  unsigned int len, uint8_t type, uint8_t code, int use_dest_ip);
+void send_icmp_frag_needed(struct sr_instance* sr, uint8_t* trouble_packet, char* interface,
+					  unsigned int len, uint16_t mtu);
+void send_icmp_message_unused(struct sr_instance* sr, uint8_t* trouble_packet, char* interface, 
+					  unsigned int len, uint8_t type, uint8_t code, int use_dest_ip, uint32_t unused);
 int is_router_ip(struct sr_instance* sr, uint32_t ip);
 void prepare_icmp_headers(uint8_t* trouble_packet, uint8_t* icmp_packet, struct sr_if* itf, int use_dest_ip);
 
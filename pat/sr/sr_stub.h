@@ -0,0 +1,40 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_stub.h
+ * Date: Mon Oct 19 2026
+ *
+ * Runs the router without VNS, for benchmarks and fuzzing.  sr_stub.c
+ * takes the place of sr_vns_comm.c: sr_send_packet(..) counts what the
+ * router sends instead of putting it on the wire, and sr_stub_init(..)
+ * sets up a router with two interfaces, a route out of each and the
+ * next hops already in the ARP cache:
+ *
+ *   eth0  10.0.0.1/24  next hop 10.0.0.2, also the default route
+ *   eth1  10.0.1.1/24  next hop 10.0.1.2
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_STUB_H
+#define SR_STUB_H
+
+#include "sr_router.h"
+
+#define SR_STUB_IF0 "eth0"
+#define SR_STUB_IF1 "eth1"
+
+struct sr_stub_stats
+{
+    unsigned long frames;   /* sent by the router */
+    unsigned long bytes;
+    unsigned long oversize; /* bigger than the interface's MTU */
+    uint32_t      sum;      /* of the first and last byte of each frame */
+};
+
+extern struct sr_stub_stats sr_stub_sent;
+
+/* mtu_spec as for sr -m, or 0 for the defaults */
+void sr_stub_init(struct sr_instance* sr, const char* mtu_spec);
+
+/* put the next hops back in the ARP cache before they time out */
+void sr_stub_refresh_arp(struct sr_instance* sr);
+
+#endif /* SR_STUB_H */
@@ -339,6 +339,10 @@ int sr_read_from_server(struct sr_instance* sr /* borrowed */)
 
         case VNSHWINFO:
             sr_handle_hwinfo(sr,(c_hwinfo*)buf); 
+            if(sr->mtu_spec && sr_set_mtu(sr, sr->mtu_spec) != 0)
+            {
+                return -1;
+            }
             if(sr_verify_routing_table(sr) != 0)
             {
                 fprintf(stderr,"Routing table not consistent with hardware\n");
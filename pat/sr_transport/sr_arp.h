@@ -76,17 +76,30 @@ typedef struct ip_entry
 } ip_entry;
 
 /*-----------------------------------------------------------------------------
- * Contains all data members of ARP subsystem 
+ * Contains all data members of ARP subsystem
+ *
+ * The cache is a fixed size hash table whose buckets are each protected by
+ * a sequence counter, so sr_get_arp_entry(..) never takes a lock; writers
+ * serialize on arp_cache_mutex.  Packets waiting on ARP replies are kept in
+ * per next-hop shards, each with its own lock.  Both live in sr_arp_state.c.
+ *
+ * arp_reserved keeps sizeof(struct arp_state), and so the layout of
+ * struct sr_core, the same as it was when the state held the list heads
+ * and a queue mutex inline (sr_api_init(..) allocates the sr_core).
  *---------------------------------------------------------------------------*/
 
+struct arp_cache; /* -- sr_arp_state.c -- */
+struct arp_queue; /* -- sr_arp_state.c -- */
+
 typedef struct arp_state
 {
-    struct arp_entry arp_cache_head;
-    struct ip_entry  arp_queue_head;
+    struct arp_cache* arp_cache;
+    struct arp_queue* arp_queue;
+    uint8_t arp_reserved[sizeof(struct arp_entry) + sizeof(struct ip_entry)
+                         + sizeof(pthread_mutex_t) - 2 * sizeof(void*)];
 
     pthread_t arp_worker_thread;
-    pthread_mutex_t arp_cache_mutex;
-    pthread_mutex_t arp_queue_mutex;
+    pthread_mutex_t arp_cache_mutex; /* -- cache writers only -- */
     volatile uint8_t thread_exit_condition;
     volatile uint8_t arp_cache_timeout;
     volatile uint8_t arp_queue_timeout;
@@ -0,0 +1,212 @@
+/*-----------------------------------------------------------------------------
+ * file:   sr_arp_bench.c
+ * date:   Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * ARP cache contention benchmark.  Some number of forwarding threads look
+ * up next hops with sr_get_arp_entry(..) as fast as they can, while a
+ * writer thread refreshes cache entries the way ARP replies would.
+ * Prints lookups per second for each thread count.
+ *
+ *   sr_arp_bench [-t threads,..] [-n next hops] [-w writes/sec] [-s secs]
+ *                [-l]
+ *
+ * -l takes arp_cache_mutex around every lookup, as the old list based
+ * cache did, for comparison.
+ *
+ * Links against libsr.a for sr_arp_state.o only; the ARP state's output
+ * path is stubbed out below.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_router.h"
+#include "sr_arp.h"
+#include "sr_ethernet.h"
+
+#define MAX_THREADS 64
+
+struct bench_thread
+{
+    pthread_t thread;
+    unsigned  seed;
+    uint64_t  lookups;
+    uint64_t  misses;
+};
+
+static struct sr_core core;
+static uint32_t* next_hops     = 0;
+static int       num_next_hops = 200;
+static int       writes_per_sec = 1000;
+static int       locked        = 0;
+static volatile int running    = 0;
+
+/* -- nothing is queued, so nothing is ever sent -- */
+void sr_ethernet_output(struct sr_core* sr, const char* dest_mac,
+                        uint8_t* packet, char* interface)
+{
+    (void)sr; (void)dest_mac; (void)interface;
+    free(packet);
+} /* -- sr_ethernet_output -- */
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+} /* -- now -- */
+
+static void add_entry(uint32_t ip)
+{
+    struct arp_entry* entry = (struct arp_entry*)malloc(sizeof(*entry));
+
+    assert(entry);
+    memset(entry, 0, sizeof(*entry));
+    entry->ip = ip;
+    memcpy(entry->mac, &ip, sizeof(ip));
+    sr_arp_cache_add_entry(&core, entry, 0);
+} /* -- add_entry -- */
+
+static void* forward_thread(void* arg)
+{
+    struct bench_thread* bt = (struct bench_thread*)arg;
+    char mac[ETHER_ADDR_LEN];
+    uint32_t ip;
+
+    while(running)
+    {
+        ip = next_hops[rand_r(&bt->seed) % num_next_hops];
+
+        if(locked)
+        { pthread_mutex_lock(&core.arp_subsystem.arp_cache_mutex); }
+        if(!sr_get_arp_entry(&core, ip, mac))
+        { bt->misses++; }
+        if(locked)
+        { pthread_mutex_unlock(&core.arp_subsystem.arp_cache_mutex); }
+
+        bt->lookups++;
+    }
+
+    return 0;
+} /* -- forward_thread -- */
+
+static void* writer_thread(void* arg)
+{
+    unsigned seed = 1;
+
+    (void)arg;
+    while(running)
+    {
+        add_entry(next_hops[rand_r(&seed) % num_next_hops]);
+        usleep(1000000 / writes_per_sec);
+    }
+
+    return 0;
+} /* -- writer_thread -- */
+
+static void run(int nthreads, int secs)
+{
+    struct bench_thread bt[MAX_THREADS];
+    pthread_t writer;
+    uint64_t lookups = 0, misses = 0;
+    double start, elapsed;
+    int i;
+
+    memset(bt, 0, sizeof(bt));
+    running = 1;
+    start = now();
+
+    for(i = 0; i < nthreads; ++i)
+    {
+        bt[i].seed = i + 1;
+        pthread_create(&bt[i].thread, 0, forward_thread, &bt[i]);
+    }
+    if(writes_per_sec > 0)
+    { pthread_create(&writer, 0, writer_thread, 0); }
+
+    sleep(secs);
+    running = 0;
+
+    for(i = 0; i < nthreads; ++i)
+    {
+        pthread_join(bt[i].thread, 0);
+        lookups += bt[i].lookups;
+        misses  += bt[i].misses;
+    }
+    if(writes_per_sec > 0)
+    { pthread_join(writer, 0); }
+    elapsed = now() - start;
+
+    fprintf(stderr, "%2d threads: %10.0f lookups/s (%8.0f/s per thread) "
+            "%.2f%% misses\n", nthreads, lookups / elapsed,
+            lookups / elapsed / nthreads,
+            lookups ? 100.0 * misses / lookups : 0.0);
+} /* -- run -- */
+
+int main(int argc, char** argv)
+{
+    char  threads_default[] = "1,2,4,8";
+    char* threads = threads_default;
+    char* tok = 0;
+    int   secs = 2;
+    int   c, i;
+
+    while ((c = getopt(argc, argv, "t:n:w:s:l")) != EOF)
+    {
+        switch (c)
+        {
+            case 't': threads = optarg;                 break;
+            case 'n': num_next_hops = atoi(optarg);     break;
+            case 'w': writes_per_sec = atoi(optarg);    break;
+            case 's': secs = atoi(optarg);              break;
+            case 'l': locked = 1;                       break;
+            default:
+                fprintf(stderr, "usage: %s [-t threads,..] [-n next hops] "
+                        "[-w writes/sec] [-s secs] [-l]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(num_next_hops <= 0 || secs <= 0)
+    { return 1; }
+
+    /* -- the ARP state logs every cache update on stdout -- */
+    if(freopen("/dev/null", "w", stdout) == 0)
+    { return 1; }
+
+    memset(&core, 0, sizeof(core));
+    sr_arp_subsystem_startup(&core);
+
+    next_hops = (uint32_t*)malloc(num_next_hops * sizeof(uint32_t));
+    assert(next_hops);
+    for(i = 0; i < num_next_hops; ++i)
+    {
+        next_hops[i] = htonl(0x0a000001 + i);
+        add_entry(next_hops[i]);
+    }
+
+    fprintf(stderr, "%d next hops, %d cache writes/s, %s lookups\n",
+            num_next_hops, writes_per_sec, locked ? "locked" : "lock free");
+
+    for(tok = strtok(threads, ","); tok; tok = strtok(0, ","))
+    {
+        int n = atoi(tok);
+        if(n > 0 && n <= MAX_THREADS)
+        { run(n, secs); }
+    }
+
+    sr_arp_subsystem_shutdown(&core);
+    free(next_hops);
+    return 0;
+} /* -- main -- */
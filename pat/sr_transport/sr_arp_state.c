@@ -0,0 +1,723 @@
+/*-----------------------------------------------------------------------------
+ * file:   sr_arp_state.c
+ * date:   Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * arp_state(..) component of the ARP subsystem (see sr_arp.h).
+ *
+ * ARP cache:
+ *
+ *   SR_ARP_CACHE_BUCKETS buckets of SR_ARP_CACHE_WAYS slots each,
+ *   allocated once at startup and never freed while the subsystem runs.
+ *   Each bucket carries a sequence counter which is odd while a writer is
+ *   updating it.  Readers copy what they need and retry if the counter
+ *   was odd or changed underneath them, so the forwarding path never
+ *   blocks.  Writers (ARP replies, static entries, the pruning thread)
+ *   are rare and serialize on arp_cache_mutex.
+ *
+ * ARP queue:
+ *
+ *   SR_ARP_QUEUE_SHARDS FIFO lists keyed by next hop, each with its own
+ *   mutex, so threads waiting on different next hops don't contend.
+ *   Packets are sent outside the shard lock once the reply arrives.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_arp.h"
+#include "sr_ethernet.h"
+
+#define SR_ARP_CACHE_BUCKETS 64  /* power of 2 */
+#define SR_ARP_CACHE_WAYS    4
+#define SR_ARP_QUEUE_SHARDS  16  /* power of 2 */
+
+struct arp_slot
+{
+    uint32_t       ip;         /* nbo */
+    uint8_t        in_use;
+    uint8_t        is_static;
+    char           mac[ETHER_ADDR_LEN];
+    struct timeval tv;
+};
+
+struct arp_bucket
+{
+    volatile uint32_t seq;     /* odd while being written */
+    struct arp_slot   slot[SR_ARP_CACHE_WAYS];
+};
+
+struct arp_cache
+{
+    struct arp_bucket bucket[SR_ARP_CACHE_BUCKETS];
+};
+
+struct arp_shard
+{
+    pthread_mutex_t mutex;
+    struct ip_entry* head;
+    struct ip_entry* tail;
+};
+
+struct arp_queue
+{
+    struct arp_shard shard[SR_ARP_QUEUE_SHARDS];
+};
+
+static void* sr_arp_thread(void* arg);
+static void  arp_send_queued_packets(struct sr_core* sr, uint32_t ip,
+                                     const char mac[ETHER_ADDR_LEN]);
+
+static uint32_t arp_hash(uint32_t ip)
+{
+    ip ^= ip >> 16;
+    ip *= 0x45d9f3b;
+    ip ^= ip >> 16;
+    return ip;
+} /* -- arp_hash -- */
+
+static struct arp_bucket* arp_bucket_for(struct sr_core* sr, uint32_t ip)
+{
+    return &sr->arp_subsystem.arp_cache->
+        bucket[arp_hash(ip) & (SR_ARP_CACHE_BUCKETS - 1)];
+} /* -- arp_bucket_for -- */
+
+static struct arp_shard* arp_shard_for(struct sr_core* sr, uint32_t ip)
+{
+    return &sr->arp_subsystem.arp_queue->
+        shard[arp_hash(ip) & (SR_ARP_QUEUE_SHARDS - 1)];
+} /* -- arp_shard_for -- */
+
+/* -- callers hold arp_cache_mutex -- */
+static void arp_bucket_write_begin(struct arp_bucket* b)
+{
+    b->seq++;
+    __sync_synchronize();
+} /* -- arp_bucket_write_begin -- */
+
+static void arp_bucket_write_end(struct arp_bucket* b)
+{
+    __sync_synchronize();
+    b->seq++;
+} /* -- arp_bucket_write_end -- */
+
+static void arp_print_mac(const char* mac)
+{
+    int i;
+    for(i = 0; i < ETHER_ADDR_LEN; ++i)
+    { printf("%s%02x", i ? ":" : "", (unsigned char)mac[i]); }
+} /* -- arp_print_mac -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_arp_subsystem_startup(..)
+ * Scope: Global
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_arp_subsystem_startup(struct sr_core* sr)
+{
+    struct arp_state* as = 0;
+    int i;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    as = &sr->arp_subsystem;
+
+    as->arp_cache = (struct arp_cache*)malloc(sizeof(struct arp_cache));
+    as->arp_queue = (struct arp_queue*)malloc(sizeof(struct arp_queue));
+    if(as->arp_cache == 0 || as->arp_queue == 0)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    memset(as->arp_cache, 0, sizeof(struct arp_cache));
+    memset(as->arp_queue, 0, sizeof(struct arp_queue));
+
+    for(i = 0; i < SR_ARP_QUEUE_SHARDS; ++i)
+    { pthread_mutex_init(&as->arp_queue->shard[i].mutex, 0); }
+
+    pthread_mutex_init(&as->arp_cache_mutex, 0);
+
+    as->thread_exit_condition = 0;
+    as->arp_cache_timeout     = DEFAULT_ARP_CACHE_TIMEOUT;
+    as->arp_queue_timeout     = DEFAULT_ARP_QUEUE_TIMEOUT;
+
+    if(pthread_create(&as->arp_worker_thread, 0, sr_arp_thread, sr))
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+} /* -- sr_arp_subsystem_startup -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_arp_subsystem_shutdown(..)
+ * Scope: Global
+ *
+ * Stops the worker and releases all state.  No other thread may be using
+ * the subsystem.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_arp_subsystem_shutdown(struct sr_core* sr)
+{
+    struct arp_state* as = 0;
+    int i;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    as = &sr->arp_subsystem;
+
+    as->thread_exit_condition = 1;
+    pthread_join(as->arp_worker_thread, 0);
+
+    sr_clean_arp_cache(sr);
+    sr_clean_arp_queue(sr);
+
+    for(i = 0; i < SR_ARP_QUEUE_SHARDS; ++i)
+    { pthread_mutex_destroy(&as->arp_queue->shard[i].mutex); }
+    pthread_mutex_destroy(&as->arp_cache_mutex);
+
+    free(as->arp_cache);
+    free(as->arp_queue);
+    as->arp_cache = 0;
+    as->arp_queue = 0;
+} /* -- sr_arp_subsystem_shutdown -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_get_arp_entry(..)
+ * Scope: Global
+ *
+ * Lock free lookup, copies the MAC address for ip into mac.  Returns 1 if
+ * found, 0 otherwise.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_get_arp_entry(struct sr_core* sr,
+                     uint32_t ip /* nbo */,
+                     char mac[ETHER_ADDR_LEN])
+{
+    struct arp_bucket* b = 0;
+    volatile struct arp_slot* s = 0;
+    char     tmp[ETHER_ADDR_LEN];
+    uint32_t seq;
+    int      i, j, found;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(mac);
+
+    b = arp_bucket_for(sr, ip);
+
+    do
+    {
+        while((seq = b->seq) & 1)
+        { /* -- writer in progress -- */ }
+        __sync_synchronize();
+
+        found = 0;
+        for(i = 0; i < SR_ARP_CACHE_WAYS; ++i)
+        {
+            s = &b->slot[i];
+            if(s->in_use && s->ip == ip)
+            {
+                for(j = 0; j < ETHER_ADDR_LEN; ++j)
+                { tmp[j] = s->mac[j]; }
+                found = 1;
+                break;
+            }
+        }
+
+        __sync_synchronize();
+    } while(b->seq != seq);
+
+    if(found)
+    { memcpy(mac, tmp, ETHER_ADDR_LEN); }
+
+    return found;
+} /* -- sr_get_arp_entry -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_arp_cache_add_entry(..)
+ * Scope: Global
+ *
+ * Add or refresh the cache entry for entry->ip, then send any packets that
+ * were waiting on it.  Static entries never time out.  If the bucket is
+ * full the oldest dynamic entry is replaced.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_arp_cache_add_entry(struct sr_core* sr,
+                            struct arp_entry* entry, /* given */
+                            uint8_t is_static)
+{
+    struct arp_bucket* b    = 0;
+    struct arp_slot*   slot = 0;
+    struct arp_slot*   s    = 0;
+    struct in_addr     ip_addr;
+    char               mac[ETHER_ADDR_LEN];
+    uint32_t           ip;
+    int i;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(entry);
+
+    ip = entry->ip;
+    memcpy(mac, entry->mac, ETHER_ADDR_LEN);
+    free(entry);
+
+    b = arp_bucket_for(sr, ip);
+
+    pthread_mutex_lock(&sr->arp_subsystem.arp_cache_mutex);
+
+    for(i = 0; i < SR_ARP_CACHE_WAYS; ++i)
+    {
+        s = &b->slot[i];
+        if(s->in_use && s->ip == ip)
+        {
+            printf("* changing arp entry for ip ");
+            ip_addr.s_addr = ip;
+            printf("%s", inet_ntoa(ip_addr));
+            printf("\n");
+            slot = s;
+            break;
+        }
+        if(slot == 0 && !s->in_use)
+        { slot = s; }
+    }
+
+    if(slot == 0)
+    {
+        /* -- bucket full, evict the oldest dynamic entry -- */
+        for(i = 0; i < SR_ARP_CACHE_WAYS; ++i)
+        {
+            s = &b->slot[i];
+            if(s->is_static)
+            { continue; }
+            if(slot == 0 || s->tv.tv_sec < slot->tv.tv_sec)
+            { slot = s; }
+        }
+    }
+
+    if(slot == 0)
+    {
+        pthread_mutex_unlock(&sr->arp_subsystem.arp_cache_mutex);
+        ip_addr.s_addr = ip;
+        fprintf(stderr, "* arp cache bucket full of static entries, "
+                "not caching %s\n", inet_ntoa(ip_addr));
+        return;
+    }
+
+    arp_bucket_write_begin(b);
+    slot->ip        = ip;
+    slot->in_use    = 1;
+    slot->is_static = is_static ? 1 : 0;
+    memcpy(slot->mac, mac, ETHER_ADDR_LEN);
+    if(is_static)
+    {
+        slot->tv.tv_sec  = 0;
+        slot->tv.tv_usec = 0;
+    }
+    else
+    { gettimeofday(&slot->tv, 0); }
+    arp_bucket_write_end(b);
+
+    pthread_mutex_unlock(&sr->arp_subsystem.arp_cache_mutex);
+
+    arp_send_queued_packets(sr, ip, mac);
+} /* -- sr_arp_cache_add_entry -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_delete_cache_entry(..)
+ * Scope: Global
+ *
+ * Returns 1 if an entry for ip was removed, 0 otherwise.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_delete_cache_entry(struct sr_core* sr, uint32_t ip)
+{
+    struct arp_bucket* b = 0;
+    struct in_addr ip_addr;
+    int i;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    b = arp_bucket_for(sr, ip);
+
+    pthread_mutex_lock(&sr->arp_subsystem.arp_cache_mutex);
+
+    for(i = 0; i < SR_ARP_CACHE_WAYS; ++i)
+    {
+        if(b->slot[i].in_use && b->slot[i].ip == ip)
+        {
+            printf("* deleting arp entry with ip ");
+            ip_addr.s_addr = ip;
+            printf("%s", inet_ntoa(ip_addr));
+            printf("\n");
+
+            arp_bucket_write_begin(b);
+            b->slot[i].in_use = 0;
+            arp_bucket_write_end(b);
+
+            pthread_mutex_unlock(&sr->arp_subsystem.arp_cache_mutex);
+            return 1;
+        }
+    }
+
+    pthread_mutex_unlock(&sr->arp_subsystem.arp_cache_mutex);
+    return 0;
+} /* -- sr_delete_cache_entry -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_arp_queue_add_entry(..)
+ * Scope: Global
+ *
+ * Queue packet until next_hop has been ARPed for.  If the reply raced us
+ * into the cache, the packet is sent right away.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_arp_queue_add_entry(struct sr_core* sr,
+                            uint8_t* packet /* given */,
+                            uint32_t next_hop,
+                            char* interface)
+{
+    struct ip_entry*  ipe   = 0;
+    struct arp_shard* shard = 0;
+    struct in_addr    ip_addr;
+    char mac[ETHER_ADDR_LEN];
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(packet);
+    assert(interface);
+
+    ipe = (struct ip_entry*)malloc(sizeof(struct ip_entry));
+    assert(ipe);
+
+    ipe->packet      = packet;
+    ipe->next_hop_ip = next_hop;
+    strncpy(ipe->interface, interface, SR_IFACE_NAMELEN);
+    ipe->next        = 0;
+    gettimeofday(&ipe->tv, 0);
+
+    shard = arp_shard_for(sr, next_hop);
+
+    pthread_mutex_lock(&shard->mutex);
+    if(shard->tail)
+    { shard->tail->next = ipe; }
+    else
+    { shard->head = ipe; }
+    shard->tail = ipe;
+    pthread_mutex_unlock(&shard->mutex);
+
+    printf("* added ip packet for ");
+    ip_addr.s_addr = next_hop;
+    printf("%s", inet_ntoa(ip_addr));
+    printf(" to arp queue\n");
+
+    if(sr_get_arp_entry(sr, next_hop, mac))
+    { arp_send_queued_packets(sr, next_hop, mac); }
+} /* -- sr_arp_queue_add_entry -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: arp_send_queued_packets(..)
+ * Scope: Local
+ *
+ * Unlink every packet waiting on ip from its shard, then send them in the
+ * order they were queued.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void arp_send_queued_packets(struct sr_core* sr, uint32_t ip,
+                                    const char mac[ETHER_ADDR_LEN])
+{
+    struct arp_shard* shard = 0;
+    struct ip_entry*  ipe   = 0;
+    struct ip_entry*  prev  = 0;
+    struct ip_entry*  ready = 0;
+    struct ip_entry** ready_tail = &ready;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(mac);
+
+    shard = arp_shard_for(sr, ip);
+
+    pthread_mutex_lock(&shard->mutex);
+    ipe = shard->head;
+    while(ipe)
+    {
+        if(ipe->next_hop_ip != ip)
+        {
+            prev = ipe;
+            ipe  = ipe->next;
+            continue;
+        }
+
+        if(prev)
+        { prev->next = ipe->next; }
+        else
+        { shard->head = ipe->next; }
+        if(shard->tail == ipe)
+        { shard->tail = prev; }
+
+        *ready_tail = ipe;
+        ready_tail  = &ipe->next;
+        ipe         = ipe->next;
+        *ready_tail = 0;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    while(ready)
+    {
+        ipe   = ready;
+        ready = ready->next;
+
+        printf("<- sending queued packet ");
+        printf("\n");
+        sr_ethernet_output(sr, mac, ipe->packet, ipe->interface);
+        free(ipe);
+    }
+} /* -- arp_send_queued_packets -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_prune_arp_cache_queue(..)
+ * Scope: Global
+ *
+ * Expire dynamic cache entries and queued packets older than their
+ * timeouts.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_prune_arp_cache_queue(struct sr_core* sr)
+{
+    struct arp_state*  as    = 0;
+    struct arp_bucket* b     = 0;
+    struct arp_slot*   s     = 0;
+    struct arp_shard*  shard = 0;
+    struct ip_entry*   ipe   = 0;
+    struct ip_entry*   prev  = 0;
+    struct ip_entry*   dead  = 0;
+    struct in_addr     ip_addr;
+    struct timeval     now;
+    int i, j;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    as = &sr->arp_subsystem;
+
+    pthread_mutex_lock(&as->arp_cache_mutex);
+    gettimeofday(&now, 0);
+    now.tv_sec++;
+
+    for(i = 0; i < SR_ARP_CACHE_BUCKETS; ++i)
+    {
+        b = &as->arp_cache->bucket[i];
+        for(j = 0; j < SR_ARP_CACHE_WAYS; ++j)
+        {
+            s = &b->slot[j];
+            if(!s->in_use || s->is_static ||
+               now.tv_sec - s->tv.tv_sec < as->arp_cache_timeout)
+            { continue; }
+
+            printf("* arp cache entry for ");
+            ip_addr.s_addr = s->ip;
+            printf("%s", inet_ntoa(ip_addr));
+            printf(" timed out.. deleting \n");
+
+            arp_bucket_write_begin(b);
+            s->in_use = 0;
+            arp_bucket_write_end(b);
+        }
+    }
+    pthread_mutex_unlock(&as->arp_cache_mutex);
+
+    gettimeofday(&now, 0);
+
+    for(i = 0; i < SR_ARP_QUEUE_SHARDS; ++i)
+    {
+        shard = &as->arp_queue->shard[i];
+
+        pthread_mutex_lock(&shard->mutex);
+        prev = 0;
+        ipe  = shard->head;
+        while(ipe)
+        {
+            if(now.tv_sec - ipe->tv.tv_sec < as->arp_queue_timeout)
+            {
+                prev = ipe;
+                ipe  = ipe->next;
+                continue;
+            }
+
+            if(prev)
+            { prev->next = ipe->next; }
+            else
+            { shard->head = ipe->next; }
+            if(shard->tail == ipe)
+            { shard->tail = prev; }
+
+            dead = ipe;
+            ipe  = ipe->next;
+            dead->next = 0;
+
+            printf("* no arp response for queued packet  ");
+            printf("\n");
+            printf("* deleting packet\n");
+            free(dead->packet);
+            free(dead);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+} /* -- sr_prune_arp_cache_queue -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_clean_arp_queue(..)
+ * Scope: Global
+ *
+ * Drop every queued packet.  Returns the number dropped.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_clean_arp_queue(struct sr_core* sr)
+{
+    struct arp_shard* shard = 0;
+    struct ip_entry*  ipe   = 0;
+    int count = 0;
+    int i;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    for(i = 0; i < SR_ARP_QUEUE_SHARDS; ++i)
+    {
+        shard = &sr->arp_subsystem.arp_queue->shard[i];
+
+        pthread_mutex_lock(&shard->mutex);
+        while((ipe = shard->head) != 0)
+        {
+            shard->head = ipe->next;
+            if(ipe->packet)
+            { free(ipe->packet); }
+            free(ipe);
+            ++count;
+        }
+        shard->tail = 0;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    return count;
+} /* -- sr_clean_arp_queue -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_clean_arp_cache(..)
+ * Scope: Global
+ *
+ * Remove every cache entry, static ones included.  Returns the number
+ * removed.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_clean_arp_cache(struct sr_core* sr)
+{
+    struct arp_bucket* b = 0;
+    int count = 0;
+    int i, j;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    pthread_mutex_lock(&sr->arp_subsystem.arp_cache_mutex);
+    for(i = 0; i < SR_ARP_CACHE_BUCKETS; ++i)
+    {
+        b = &sr->arp_subsystem.arp_cache->bucket[i];
+        arp_bucket_write_begin(b);
+        for(j = 0; j < SR_ARP_CACHE_WAYS; ++j)
+        {
+            if(b->slot[j].in_use)
+            {
+                b->slot[j].in_use = 0;
+                ++count;
+            }
+        }
+        arp_bucket_write_end(b);
+    }
+    pthread_mutex_unlock(&sr->arp_subsystem.arp_cache_mutex);
+
+    return count;
+} /* -- sr_clean_arp_cache -- */
+
+static void* sr_arp_thread(void* arg)
+{
+    struct sr_core* sr = (struct sr_core*)arg;
+
+    while(!sr->arp_subsystem.thread_exit_condition)
+    {
+        sr_prune_arp_cache_queue(sr);
+        sleep(1);
+    }
+
+    return 0;
+} /* -- sr_arp_thread -- */
+
+void sr_print_arp_cache(struct sr_core* sr)
+{
+    struct arp_bucket* b = 0;
+    struct in_addr ip_addr;
+    int i, j;
+
+    pthread_mutex_lock(&sr->arp_subsystem.arp_cache_mutex);
+    for(i = 0; i < SR_ARP_CACHE_BUCKETS; ++i)
+    {
+        b = &sr->arp_subsystem.arp_cache->bucket[i];
+        for(j = 0; j < SR_ARP_CACHE_WAYS; ++j)
+        {
+            if(!b->slot[j].in_use)
+            { continue; }
+            printf("[");
+            ip_addr.s_addr = b->slot[j].ip;
+            printf("%s ", inet_ntoa(ip_addr));
+            arp_print_mac(b->slot[j].mac);
+            printf("%s]\n", b->slot[j].is_static ? " static" : "");
+        }
+    }
+    pthread_mutex_unlock(&sr->arp_subsystem.arp_cache_mutex);
+} /* -- sr_print_arp_cache -- */
+
+void sr_print_arp_queue(struct sr_core* sr)
+{
+    struct arp_shard* shard = 0;
+    struct ip_entry*  ipe   = 0;
+    struct in_addr ip_addr;
+    int i;
+
+    for(i = 0; i < SR_ARP_QUEUE_SHARDS; ++i)
+    {
+        shard = &sr->arp_subsystem.arp_queue->shard[i];
+        pthread_mutex_lock(&shard->mutex);
+        for(ipe = shard->head; ipe; ipe = ipe->next)
+        {
+            printf("[");
+            ip_addr.s_addr = ipe->next_hop_ip;
+            printf("%s", inet_ntoa(ip_addr));
+            printf(" %s]\n", ipe->interface);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+} /* -- sr_print_arp_queue -- */
@@ -0,0 +1,413 @@
+/*-----------------------------------------------------------------------------
+ * file:   sr_demux.c
+ * date:   Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * Table driven ingress demultiplexer, see sr_demux.h.
+ *
+ * sr_demux_input(..) does what sr_ethernet_input(..) does, and
+ * sr_demux_ip_input(..) what sr_ip_input(..) does (same sanity checks,
+ * same drop reasons), except that the final dispatch goes through the
+ * tables below and every stage is counted and timed.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_ip.h"
+#include "sr_icmp.h"
+#include "sr_arp.h"
+#include "sr_blackhole.h"
+#include "sr_transport.h"
+#include "sr_protocol.h"
+#include "sr_demux.h"
+
+#define SR_DEMUX_MIN_IP_FRAME \
+    (sizeof(struct sr_ethernet_hdr) + sizeof(struct ip))
+
+/* frames shorter than the ethernet minimum are padded, so below this the
+ * ip total length can't be compared with the frame length */
+#define SR_DEMUX_MIN_PADDED_IP 46
+
+struct sr_demux_eth_entry
+{
+    uint16_t              type;     /* nbo */
+    const char*           name;
+    sr_demux_eth_handler  handler;
+    struct sr_demux_stats stats;
+};
+
+struct sr_demux_ip_entry
+{
+    const char*           name;
+    sr_demux_ip_handler   handler;
+    struct sr_demux_stats stats;
+};
+
+static struct sr_demux_eth_entry sr_demux_eth[SR_DEMUX_MAX_ETHERTYPES];
+static int                       sr_demux_neth = 0;
+
+static struct sr_demux_ip_entry  sr_demux_ip[256];
+static struct sr_demux_stats     sr_demux_forward;
+static struct sr_demux_stats     sr_demux_unknown;
+
+static int sr_demux_ready = 0;
+
+/*-----------------------------------------------------------------------------
+ * Timers
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_DEMUX_NO_TIMING
+
+#if defined(__i386__) || defined(__x86_64__)
+#define SR_DEMUX_TIME_UNITS "cycles"
+static uint64_t sr_demux_now(void)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+} /* -- sr_demux_now -- */
+#else
+#define SR_DEMUX_TIME_UNITS "usec"
+static uint64_t sr_demux_now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+} /* -- sr_demux_now -- */
+#endif
+
+#define SR_DEMUX_TIMER_START(t) ((t) = sr_demux_now())
+#define SR_DEMUX_TIMER_STOP(t, st) \
+    do { uint64_t d_ = sr_demux_now() - (t); \
+         (st)->time += d_; \
+         if(d_ > (st)->max_time) { (st)->max_time = d_; } } while(0)
+
+#else /* -- SR_DEMUX_NO_TIMING -- */
+
+#define SR_DEMUX_TIME_UNITS "-"
+#define SR_DEMUX_TIMER_START(t)    ((t) = 0)
+#define SR_DEMUX_TIMER_STOP(t, st) do{ (void)(t); }while(0)
+
+#endif /* -- SR_DEMUX_NO_TIMING -- */
+
+#define SR_DEMUX_COUNT(st, len) \
+    do { (st)->packets++; (st)->bytes += (len); } while(0)
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_demux_init(..)
+ * Scope: Local
+ *
+ * Install the built in handlers.  Registered handlers replace them.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_demux_init(void)
+{
+    if(sr_demux_ready)
+    { return; }
+    sr_demux_ready = 1;
+
+    /* -- most frequent first -- */
+    sr_demux_register_ethertype(ETHERTYPE_IP,  "ip",  sr_demux_ip_input);
+    sr_demux_register_ethertype(ETHERTYPE_ARP, "arp", sr_arp_input);
+
+    sr_demux_register_ipproto(IPPROTO_ICMP, "icmp", sr_icmp_input);
+    sr_demux_register_ipproto(IPPROTO_TCP,  "tcp",  sr_transport_input);
+    sr_demux_register_ipproto(IPPROTO_UDP,  "udp",  sr_transport_input);
+} /* -- sr_demux_init -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_demux_register_ethertype(..)
+ * Scope: Global
+ *
+ * Returns 0 on success, -1 if the table is full.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_demux_register_ethertype(uint16_t type,
+                                const char* name,
+                                sr_demux_eth_handler handler)
+{
+    int i;
+
+    /* -- REQUIRES -- */
+    assert(name);
+    assert(handler);
+
+    sr_demux_init();
+
+    for(i = 0; i < sr_demux_neth; ++i)
+    {
+        if(sr_demux_eth[i].type == htons(type))
+        { break; }
+    }
+
+    if(i == SR_DEMUX_MAX_ETHERTYPES)
+    {
+        fprintf(stderr, "sr_demux: ethertype table full, can't add %s\n",
+                name);
+        return -1;
+    }
+
+    if(i == sr_demux_neth)
+    {
+        memset(&sr_demux_eth[i], 0, sizeof(struct sr_demux_eth_entry));
+        sr_demux_eth[i].type = htons(type);
+        ++sr_demux_neth;
+    }
+
+    sr_demux_eth[i].name    = name;
+    sr_demux_eth[i].handler = handler;
+    return 0;
+} /* -- sr_demux_register_ethertype -- */
+
+int sr_demux_register_ipproto(uint8_t proto,
+                              const char* name,
+                              sr_demux_ip_handler handler)
+{
+    /* -- REQUIRES -- */
+    assert(name);
+    assert(handler);
+
+    sr_demux_init();
+
+    sr_demux_ip[proto].name    = name;
+    sr_demux_ip[proto].handler = handler;
+    return 0;
+} /* -- sr_demux_register_ipproto -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_demux_input(..)
+ * Scope: Global
+ *
+ * Entry point for frames from the link layer.  Copies the frame and
+ * dispatches it on ethertype.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_demux_input(struct sr_core* sr,
+                    const uint8_t* frame /* borrowed */,
+                    unsigned int len,
+                    const char* interface /* borrowed */)
+{
+    const struct sr_ethernet_hdr* e_hdr = 0;
+    struct sr_demux_eth_entry* ent = 0;
+    struct sr_if* iface = 0;
+    uint8_t* copy = 0;
+    uint64_t t;
+    int i;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(frame);
+    assert(interface);
+
+    sr_demux_init();
+
+    iface = sr_get_interface(sr, interface);
+    assert(iface);
+
+    if(!iface->enabled)
+    { return; }
+    iface->packets_in++;
+
+    copy = (uint8_t*)malloc(len);
+    assert(copy);
+    memcpy(copy, frame, len);
+
+    e_hdr = (const struct sr_ethernet_hdr*)frame;
+
+    for(i = 0; i < sr_demux_neth; ++i)
+    {
+        if(sr_demux_eth[i].type == e_hdr->ether_type)
+        {
+            ent = &sr_demux_eth[i];
+            break;
+        }
+    }
+
+    if(ent == 0)
+    {
+        SR_DEMUX_COUNT(&sr_demux_unknown, len);
+        sr_blackhole(sr, copy, DROP_ETH_UNKNOWN);
+        return;
+    }
+
+    SR_DEMUX_COUNT(&ent->stats, len);
+    SR_DEMUX_TIMER_START(t);
+    ent->handler(sr, copy, (int)len, iface);
+    SR_DEMUX_TIMER_STOP(t, &ent->stats);
+} /* -- sr_demux_input -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_demux_ip_sanity_check(..)
+ * Scope: Local
+ *
+ * Returns 0 if the header looks sane, otherwise the drop reason.
+ *
+ *---------------------------------------------------------------------------*/
+
+static uint8_t sr_demux_ip_sanity_check(uint8_t* frame, int len)
+{
+    struct ip* ip_hdr = 0;
+    unsigned int tot_len;
+
+    if(len < (int)SR_DEMUX_MIN_IP_FRAME)
+    { return DROP_IP_BADLEN; }
+
+    ip_hdr = (struct ip*)(frame + sizeof(struct sr_ethernet_hdr));
+
+    if(sr_calculate_ip_checksum(ip_hdr) != ip_hdr->ip_sum)
+    { return DROP_IP_CSUM; }
+    if(ip_hdr->ip_v != 4)
+    { return DROP_IP_VERSION; }
+    if(ip_hdr->ip_hl != 5)
+    { return DROP_IP_BADHDL; }
+
+    tot_len = ntohs(ip_hdr->ip_len);
+    if(tot_len >= SR_DEMUX_MIN_PADDED_IP &&
+       tot_len != len - sizeof(struct sr_ethernet_hdr))
+    { return DROP_IP_BADTOTLEN; }
+
+    return 0;
+} /* -- sr_demux_ip_sanity_check -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_demux_ip_input(..)
+ * Scope: Global
+ *
+ * Built in ETHERTYPE_IP handler.  Strips the ethernet header, then either
+ * dispatches on IP protocol (addressed to us) or forwards.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_demux_ip_input(struct sr_core* sr,
+                       uint8_t* frame /* given */,
+                       int len,
+                       const struct sr_if* iface)
+{
+    struct sr_demux_ip_entry* ent = 0;
+    struct sr_if* if_walker = 0;
+    struct ip* ip_hdr = 0;
+    uint8_t* packet = 0;
+    uint8_t  reason;
+    uint64_t t;
+
+    (void)iface; /* -- same signature as sr_ip_input(..) -- */
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(frame);
+
+    if((reason = sr_demux_ip_sanity_check(frame, len)) != 0)
+    {
+        sr_blackhole(sr, frame, reason);
+        return;
+    }
+
+    len -= sizeof(struct sr_ethernet_hdr);
+    packet = (uint8_t*)malloc(len);
+    assert(packet);
+    memcpy(packet, frame + sizeof(struct sr_ethernet_hdr), len);
+    free(frame);
+
+    ip_hdr = (struct ip*)packet;
+
+    for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+    {
+        if(if_walker->ip == ip_hdr->ip_dst.s_addr)
+        { break; }
+    }
+
+    if(if_walker == 0)
+    {
+        SR_DEMUX_COUNT(&sr_demux_forward, len);
+        SR_DEMUX_TIMER_START(t);
+        sr_ip_forward(sr, packet);
+        SR_DEMUX_TIMER_STOP(t, &sr_demux_forward);
+        return;
+    }
+
+    ent = &sr_demux_ip[ip_hdr->ip_p];
+    if(ent->handler == 0)
+    {
+        fprintf(stderr, "Unsupported IP protocol type %d\n", ip_hdr->ip_p);
+        SR_DEMUX_COUNT(&ent->stats, len);
+        free(packet);
+        return;
+    }
+
+    SR_DEMUX_COUNT(&ent->stats, len);
+    SR_DEMUX_TIMER_START(t);
+    ent->handler(sr, packet);
+    SR_DEMUX_TIMER_STOP(t, &ent->stats);
+} /* -- sr_demux_ip_input -- */
+
+/*-----------------------------------------------------------------------------
+ * Statistics
+ *---------------------------------------------------------------------------*/
+
+static void sr_demux_print_line(FILE* fp, const char* stage, const char* name,
+                                const struct sr_demux_stats* st)
+{
+    fprintf(fp, "%-6s %-10s %10lu %12lu %14.0f %10.0f %10.0f\n",
+            stage, name,
+            (unsigned long)st->packets, (unsigned long)st->bytes,
+            (double)st->time,
+            st->packets ? (double)st->time / st->packets : 0.0,
+            (double)st->max_time);
+} /* -- sr_demux_print_line -- */
+
+void sr_demux_print_stats(FILE* fp)
+{
+    char name[48];
+    int i;
+
+    sr_demux_init();
+
+    fprintf(fp, "%-6s %-10s %10s %12s %14s %10s %10s  (time in %s)\n",
+            "stage", "handler", "packets", "bytes", "total", "avg", "max",
+            SR_DEMUX_TIME_UNITS);
+
+    for(i = 0; i < sr_demux_neth; ++i)
+    {
+        sprintf(name, "%.32s/%04x", sr_demux_eth[i].name,
+                ntohs(sr_demux_eth[i].type));
+        sr_demux_print_line(fp, "eth", name, &sr_demux_eth[i].stats);
+    }
+    sr_demux_print_line(fp, "eth", "unknown", &sr_demux_unknown);
+
+    for(i = 0; i < 256; ++i)
+    {
+        if(sr_demux_ip[i].handler == 0 && sr_demux_ip[i].stats.packets == 0)
+        { continue; }
+        sprintf(name, "%.32s/%d",
+                sr_demux_ip[i].name ? sr_demux_ip[i].name : "?", i);
+        sr_demux_print_line(fp, "ip", name, &sr_demux_ip[i].stats);
+    }
+    sr_demux_print_line(fp, "ip", "forward", &sr_demux_forward);
+} /* -- sr_demux_print_stats -- */
+
+void sr_demux_reset_stats(void)
+{
+    int i;
+
+    for(i = 0; i < sr_demux_neth; ++i)
+    { memset(&sr_demux_eth[i].stats, 0, sizeof(struct sr_demux_stats)); }
+    for(i = 0; i < 256; ++i)
+    { memset(&sr_demux_ip[i].stats, 0, sizeof(struct sr_demux_stats)); }
+    memset(&sr_demux_forward, 0, sizeof(struct sr_demux_stats));
+    memset(&sr_demux_unknown, 0, sizeof(struct sr_demux_stats));
+} /* -- sr_demux_reset_stats -- */
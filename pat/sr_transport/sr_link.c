@@ -0,0 +1,329 @@
+/*-----------------------------------------------------------------------------
+ * file:   sr_link.c
+ * date:   Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * Backend independent half of the pluggable link layer.  Owns
+ * sr_low_level_output(..), which is the only path the core uses to put
+ * frames on the wire, and sr_link_input(..), the only path frames take
+ * into the core.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_ethernet.h"
+#include "sr_demux.h"
+#include "sr_link.h"
+
+static const struct sr_link_ops* sr_link_backends[] =
+{
+    &sr_link_vns_ops,
+    &sr_link_afpacket_ops,
+    &sr_link_tap_ops,
+    0
+};
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_link_find(..)
+ * Scope: Global
+ *
+ * Look up a backend by name, returns 0 if there is no such backend.
+ *
+ *---------------------------------------------------------------------------*/
+
+const struct sr_link_ops* sr_link_find(const char* backend)
+{
+    int i;
+
+    /* -- REQUIRES -- */
+    assert(backend);
+
+    for(i = 0; sr_link_backends[i]; ++i)
+    {
+        if(!strcmp(sr_link_backends[i]->name, backend))
+        { return sr_link_backends[i]; }
+    }
+
+    return 0;
+} /* -- sr_link_find -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_link_open(..)
+ * Scope: Global
+ *
+ * Initialize core so that its network is link, then bring up the named
+ * backend.  Returns 0 on success, -1 on error.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_link_open(struct sr_link* link, struct sr_core* core,
+                 const char* backend, const char* spec)
+{
+    const struct sr_link_ops* ops = 0;
+
+    /* -- REQUIRES -- */
+    assert(link);
+    assert(core);
+    assert(backend);
+
+    if((ops = sr_link_find(backend)) == 0)
+    {
+        fprintf(stderr, "sr_link_open: unknown link backend %s\n", backend);
+        return -1;
+    }
+
+    memset(link, 0, sizeof(struct sr_link));
+    link->ops  = ops;
+    link->core = core;
+
+    sr_core_init(core, link);
+
+    if(ops->open(link, spec ? spec : "") != 0)
+    {
+        fprintf(stderr, "sr_link_open: could not open %s link (%s)\n",
+                backend, spec ? spec : "");
+        link->ops = 0;
+        return -1;
+    }
+
+    link->running = 1;
+    return 0;
+} /* -- sr_link_open -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_link_run(..)
+ * Scope: Global
+ *
+ * Receive loop.  Doesn't return until sr_link_stop(..) is called or the
+ * backend reports that the link went away.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_link_run(struct sr_link* link)
+{
+    /* -- REQUIRES -- */
+    assert(link);
+    assert(link->ops);
+
+    while(link->running)
+    {
+        if(link->ops->poll(link, SR_LINK_POLL_MS) < 0)
+        {
+            link->running = 0;
+            return -1;
+        }
+    }
+
+    return 0;
+} /* -- sr_link_run -- */
+
+void sr_link_stop(struct sr_link* link)
+{
+    assert(link);
+    link->running = 0;
+} /* -- sr_link_stop -- */
+
+void sr_link_close(struct sr_link* link)
+{
+    assert(link);
+
+    link->running = 0;
+    if(link->ops)
+    { link->ops->close(link); }
+    link->ops  = 0;
+    link->impl = 0;
+} /* -- sr_link_close -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_link_hw_ready(..)
+ * Scope: Global
+ *
+ * Called once all interfaces are known.  Makes sure the routing table only
+ * refers to interfaces the link actually has.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_link_hw_ready(struct sr_link* link)
+{
+    /* -- REQUIRES -- */
+    assert(link);
+    assert(link->core);
+
+    if(sr_verify_routing_table(link->core) != 0)
+    {
+        fprintf(stderr,"Routing table not consistent with hardware\n");
+        return -1;
+    }
+
+    printf(" <---------- Router Table (%s link) ---------->\n",
+           link->ops ? link->ops->name : "?");
+    sr_print_if_list(link->core);
+    return 0;
+} /* -- sr_link_hw_ready -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_link_add_interface(..)
+ * Scope: Global
+ *
+ * Register an interface discovered by a backend with the core.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_link_add_interface(struct sr_link* link,
+                           const char* name,
+                           const unsigned char* mac,
+                           uint32_t ip_nbo)
+{
+    /* -- REQUIRES -- */
+    assert(link);
+    assert(link->core);
+    assert(name);
+    assert(mac);
+
+    /* sr_set_ether_* act on the most recently added interface */
+    sr_add_interface(link->core, name);
+    sr_set_ether_ip(link->core, ip_nbo);
+    sr_set_ether_addr(link->core, mac);
+} /* -- sr_link_add_interface -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_link_input(..)
+ * Scope: Global
+ *
+ * Hand a received frame up to the core through the ingress demux.  The
+ * frame is borrowed; the demux copies it before holding on to it.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_link_input(struct sr_link* link,
+                   const uint8_t* frame /* borrowed */,
+                   unsigned int len,
+                   const char* iface /* borrowed */)
+{
+    /* -- REQUIRES -- */
+    assert(link);
+    assert(frame);
+    assert(iface);
+
+    if(len < sizeof(struct sr_ethernet_hdr))
+    { return; }
+
+    link->frames_in++;
+    sr_demux_input(link->core, frame, len, iface);
+} /* -- sr_link_input -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_link_parse_spec(..)
+ * Scope: Global
+ *
+ * Parse "if0[=a.b.c.d],if1[=a.b.c.d],.." into ifs.  Returns the number of
+ * interfaces parsed or -1 on a malformed spec.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_link_parse_spec(const char* spec,
+                       struct sr_link_ifspec* ifs,
+                       int max_ifs)
+{
+    char  buf[256];
+    char* tok  = 0;
+    char* next = 0;
+    char* ip   = 0;
+    int   count = 0;
+    struct in_addr addr;
+
+    /* -- REQUIRES -- */
+    assert(spec);
+    assert(ifs);
+
+    strncpy(buf, spec, sizeof(buf));
+    buf[sizeof(buf) - 1] = 0;
+
+    for(tok = buf; tok && *tok; tok = next)
+    {
+        if((next = strchr(tok, ',')) != 0)
+        { *next++ = 0; }
+
+        if(count == max_ifs)
+        {
+            fprintf(stderr, "sr_link: too many interfaces (max %d)\n",
+                    max_ifs);
+            return -1;
+        }
+
+        ifs[count].ip = 0;
+        if((ip = strchr(tok, '=')) != 0)
+        {
+            *ip++ = 0;
+            if(inet_aton(ip, &addr) == 0)
+            {
+                fprintf(stderr, "sr_link: bad address %s\n", ip);
+                return -1;
+            }
+            ifs[count].ip = addr.s_addr;
+        }
+
+        if(*tok == 0 || strlen(tok) >= SR_IFACE_NAMELEN)
+        {
+            fprintf(stderr, "sr_link: bad interface name \"%s\"\n", tok);
+            return -1;
+        }
+        strncpy(ifs[count].name, tok, SR_IFACE_NAMELEN);
+        ++count;
+    }
+
+    return count;
+} /* -- sr_link_parse_spec -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_low_level_output(..)
+ * Scope: Global
+ *
+ * The core's only way out to the network.  Dispatches to the backend
+ * owning the core.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_low_level_output(struct sr_core* core /* borrowed */,
+                        uint8_t* buf /* borrowed */ ,
+                        unsigned int len,
+                        const char* iface /* borrowed */)
+{
+    struct sr_link* link = 0;
+    int ret = 0;
+
+    /* -- REQUIRES -- */
+    assert(core);
+    assert(buf);
+    assert(iface);
+
+    link = (struct sr_link*)core->network;
+    assert(link);
+    assert(link->ops);
+
+    if(sr_ether_addrs_match_interface(core, buf, iface) == 0)
+    {
+        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+        link->errors_out++;
+        return -1;
+    }
+
+    if((ret = link->ops->send(link, buf, len, iface)) == 0)
+    { link->frames_out++; }
+    else
+    { link->errors_out++; }
+
+    return ret;
+} /* -- sr_low_level_output -- */
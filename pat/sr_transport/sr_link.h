@@ -0,0 +1,145 @@
+/*-----------------------------------------------------------------------------
+ * file:   sr_link.h
+ * date:   Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * Pluggable link layer for sr_core.  A link backend moves raw ethernet
+ * frames between the router core and some "physical" network.  The core
+ * only ever talks to the network through sr_low_level_output(..), and the
+ * backend hands received frames up with sr_link_input(..).
+ *
+ * struct sr_core's void* network member points at the struct sr_link
+ * that owns the core.
+ *
+ * Backends:
+ *
+ *   vns      - the Stanford Virtual Network System.  spec is
+ *              "server[:port][/topo[/vhost]]".  This replaces the old
+ *              sr_vns_integration.o glue and provides the sr_vns_integ_*
+ *              callbacks expected by libsr_vns.a.
+ *
+ *   afpacket - Linux AF_PACKET sockets with a TPACKET_V3 mmap()ed receive
+ *              ring per interface.  spec is "eth1[=ip],eth2[=ip],.."; if
+ *              an address is not given, the interface's current IPv4
+ *              address is used.
+ *
+ *   tap      - Linux TAP devices (e.g. for use inside network namespaces).
+ *              spec is "tap0=ip,tap1=ip,..".  The router side of each tap
+ *              gets a locally administered MAC address.
+ *
+ * Typical use:
+ *
+ *   struct sr_core  core;
+ *   struct sr_link  link;
+ *
+ *   sr_link_open(&link, &core, "afpacket", "veth1,veth2");
+ *   sr_load_rt(&core, "rtable");
+ *   sr_link_hw_ready(&link);
+ *   sr_arp_subsystem_startup(&core);
+ *   sr_link_run(&link);
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_LINK_H
+#define SR_LINK_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#else
+#include <inttypes.h>
+#endif
+
+#include "sr_if.h"
+
+#define SR_LINK_MAX_IFACES 8
+#define SR_LINK_MAX_FRAME  1514
+#define SR_LINK_POLL_MS    100   /* how often sr_link_run(..) checks for stop */
+
+struct sr_core; /* -- forward declaration -- */
+struct sr_link;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_link_ops
+ *
+ * Operations implemented by each link backend.
+ *
+ * open  - bring up the backend and register its interfaces with the core
+ *         using sr_link_add_interface(..).  returns 0 on success.
+ * send  - transmit one frame (borrowed) on the named interface.  returns 0
+ *         on success.
+ * poll  - wait up to timeout_ms for frames and pass each one to
+ *         sr_link_input(..).  returns the number of frames handled or -1 if
+ *         the link is gone.
+ * close - release all backend resources.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_link_ops
+{
+    const char* name;
+    int  (*open) (struct sr_link* link, const char* spec);
+    int  (*send) (struct sr_link* link, uint8_t* buf /* borrowed */,
+                  unsigned int len, const char* iface /* borrowed */);
+    int  (*poll) (struct sr_link* link, int timeout_ms);
+    void (*close)(struct sr_link* link);
+};
+
+/* ----------------------------------------------------------------------------
+ * struct sr_link
+ *
+ * One link per sr_core.  impl is private to the backend.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_link
+{
+    const struct sr_link_ops* ops;
+    struct sr_core* core;
+    void* impl;
+
+    volatile uint8_t  running;
+    volatile uint32_t frames_in;
+    volatile uint32_t frames_out;
+    volatile uint32_t errors_out;
+};
+
+/* ----------------------------------------------------------------------------
+ * Interface name/address pairs parsed from a backend spec string
+ * -------------------------------------------------------------------------- */
+
+struct sr_link_ifspec
+{
+    char     name[SR_IFACE_NAMELEN];
+    uint32_t ip;    /* nbo, 0 if not given */
+};
+
+extern const struct sr_link_ops sr_link_vns_ops;
+extern const struct sr_link_ops sr_link_afpacket_ops;
+extern const struct sr_link_ops sr_link_tap_ops;
+
+const struct sr_link_ops* sr_link_find(const char* backend);
+
+int  sr_link_open(struct sr_link* link, struct sr_core* core,
+                  const char* backend, const char* spec);
+int  sr_link_run(struct sr_link* link);
+void sr_link_stop(struct sr_link* link);
+void sr_link_close(struct sr_link* link);
+
+int  sr_link_hw_ready(struct sr_link* link);
+
+void sr_link_add_interface(struct sr_link* link,
+                           const char* name,
+                           const unsigned char* mac,
+                           uint32_t ip_nbo);
+
+void sr_link_input(struct sr_link* link,
+                   const uint8_t* frame /* borrowed */,
+                   unsigned int len,
+                   const char* iface /* borrowed */);
+
+int  sr_link_parse_spec(const char* spec,
+                        struct sr_link_ifspec* ifs,
+                        int max_ifs);
+
+#endif /* -- SR_LINK_H -- */
@@ -0,0 +1,346 @@
+/*-----------------------------------------------------------------------------
+ * file:   sr_link_afpacket.c
+ * date:   Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * AF_PACKET link backend.  One raw socket per interface with a TPACKET_V3
+ * receive ring mmap()ed into our address space, so receiving a frame costs
+ * no system call and no copy until sr_ethernet_input(..) takes its own.
+ * Frames are transmitted with a plain send(..) on the same socket.
+ *
+ * Needs CAP_NET_RAW.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_link.h"
+
+#define SR_AFP_BLOCK_SIZE (1 << 22)  /* 4MB per block */
+#define SR_AFP_BLOCK_NR   16
+#define SR_AFP_FRAME_SIZE 2048
+#define SR_AFP_BLOCK_TMO  10         /* ms before a partly full block retires */
+
+struct sr_afp_if
+{
+    char      name[SR_IFACE_NAMELEN];
+    int       fd;
+    int       ifindex;
+    uint8_t*  ring;       /* mmap()ed rx ring */
+    size_t    ring_len;
+    unsigned  block;      /* next block to look at */
+};
+
+struct sr_afp
+{
+    int              nifs;
+    struct sr_afp_if ifs[SR_LINK_MAX_IFACES];
+    struct pollfd    pfds[SR_LINK_MAX_IFACES];
+};
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afp_open_if(..)
+ * Scope: Local
+ *
+ * Create the socket and rx ring for one interface and register it with
+ * the core.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_afp_open_if(struct sr_link* link, struct sr_afp_if* afi,
+                          const struct sr_link_ifspec* spec)
+{
+    struct ifreq        ifr;
+    struct tpacket_req3 req;
+    struct sockaddr_ll  sll;
+    unsigned char       mac[ETHER_ADDR_LEN];
+    uint32_t            ip  = spec->ip;
+    int                 ver = TPACKET_V3;
+
+    strncpy(afi->name, spec->name, SR_IFACE_NAMELEN);
+    afi->ring  = MAP_FAILED;
+    afi->block = 0;
+
+    if((afi->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0)
+    {
+        perror("socket(AF_PACKET)");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, spec->name, IFNAMSIZ - 1);
+
+    if(ioctl(afi->fd, SIOCGIFINDEX, &ifr) < 0)
+    {
+        fprintf(stderr, "sr_link_afpacket: no such interface %s\n", spec->name);
+        return -1;
+    }
+    afi->ifindex = ifr.ifr_ifindex;
+
+    if(ioctl(afi->fd, SIOCGIFHWADDR, &ifr) < 0)
+    {
+        perror("SIOCGIFHWADDR");
+        return -1;
+    }
+    memcpy(mac, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+
+    if(ip == 0)
+    {
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, spec->name, IFNAMSIZ - 1);
+        ifr.ifr_addr.sa_family = AF_INET;
+        if(ioctl(afi->fd, SIOCGIFADDR, &ifr) < 0)
+        {
+            fprintf(stderr, "sr_link_afpacket: %s has no IPv4 address, "
+                    "give one as %s=a.b.c.d\n", spec->name, spec->name);
+            return -1;
+        }
+        ip = ((struct sockaddr_in*)&ifr.ifr_addr)->sin_addr.s_addr;
+    }
+
+    if(setsockopt(afi->fd, SOL_PACKET, PACKET_VERSION,
+                  &ver, sizeof(ver)) < 0)
+    {
+        perror("setsockopt(PACKET_VERSION)");
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size       = SR_AFP_BLOCK_SIZE;
+    req.tp_block_nr         = SR_AFP_BLOCK_NR;
+    req.tp_frame_size       = SR_AFP_FRAME_SIZE;
+    req.tp_frame_nr         = (SR_AFP_BLOCK_SIZE / SR_AFP_FRAME_SIZE)
+                              * SR_AFP_BLOCK_NR;
+    req.tp_retire_blk_tov   = SR_AFP_BLOCK_TMO;
+    req.tp_feature_req_word = 0;
+
+    if(setsockopt(afi->fd, SOL_PACKET, PACKET_RX_RING,
+                  &req, sizeof(req)) < 0)
+    {
+        perror("setsockopt(PACKET_RX_RING)");
+        return -1;
+    }
+
+    afi->ring_len = (size_t)req.tp_block_size * req.tp_block_nr;
+    afi->ring = (uint8_t*)mmap(0, afi->ring_len, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_LOCKED, afi->fd, 0);
+    if(afi->ring == MAP_FAILED)
+    {
+        /* -- MAP_LOCKED fails without enough RLIMIT_MEMLOCK, retry -- */
+        afi->ring = (uint8_t*)mmap(0, afi->ring_len, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, afi->fd, 0);
+    }
+    if(afi->ring == MAP_FAILED)
+    {
+        perror("mmap(PACKET_RX_RING)");
+        return -1;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = afi->ifindex;
+
+    if(bind(afi->fd, (struct sockaddr*)&sll, sizeof(sll)) < 0)
+    {
+        perror("bind(AF_PACKET)");
+        return -1;
+    }
+
+#ifdef PACKET_IGNORE_OUTGOING
+    {
+        int one = 1;
+        /* -- best effort, sr_afp_walk_block(..) filters them as well -- */
+        setsockopt(afi->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+                   &one, sizeof(one));
+    }
+#endif
+
+    sr_link_add_interface(link, spec->name, mac, ip);
+    return 0;
+} /* -- sr_afp_open_if -- */
+
+static void sr_afp_close_if(struct sr_afp_if* afi)
+{
+    if(afi->ring != MAP_FAILED)
+    { munmap(afi->ring, afi->ring_len); }
+    if(afi->fd >= 0)
+    { close(afi->fd); }
+    afi->ring = MAP_FAILED;
+    afi->fd   = -1;
+} /* -- sr_afp_close_if -- */
+
+static void sr_link_afpacket_close(struct sr_link* link)
+{
+    struct sr_afp* afp = (struct sr_afp*)link->impl;
+    int i;
+
+    if(afp == 0)
+    { return; }
+
+    for(i = 0; i < afp->nifs; ++i)
+    { sr_afp_close_if(&afp->ifs[i]); }
+
+    free(afp);
+    link->impl = 0;
+} /* -- sr_link_afpacket_close -- */
+
+static int sr_link_afpacket_open(struct sr_link* link, const char* spec)
+{
+    struct sr_link_ifspec ifs[SR_LINK_MAX_IFACES];
+    struct sr_afp* afp = 0;
+    int n, i;
+
+    if((n = sr_link_parse_spec(spec, ifs, SR_LINK_MAX_IFACES)) <= 0)
+    {
+        fprintf(stderr, "sr_link_afpacket: need at least one interface\n");
+        return -1;
+    }
+
+    if((afp = (struct sr_afp*)malloc(sizeof(struct sr_afp))) == 0)
+    { return -1; }
+    memset(afp, 0, sizeof(struct sr_afp));
+    link->impl = afp;
+
+    for(i = 0; i < n; ++i)
+    {
+        afp->ifs[i].fd = -1;
+        afp->nifs = i + 1;
+        if(sr_afp_open_if(link, &afp->ifs[i], &ifs[i]) != 0)
+        {
+            sr_link_afpacket_close(link);
+            return -1;
+        }
+        afp->pfds[i].fd     = afp->ifs[i].fd;
+        afp->pfds[i].events = POLLIN | POLLERR;
+    }
+
+    return 0;
+} /* -- sr_link_afpacket_open -- */
+
+static int sr_link_afpacket_send(struct sr_link* link, uint8_t* buf,
+                                 unsigned int len, const char* iface)
+{
+    struct sr_afp* afp = (struct sr_afp*)link->impl;
+    int i;
+
+    for(i = 0; i < afp->nifs; ++i)
+    {
+        if(strncmp(afp->ifs[i].name, iface, SR_IFACE_NAMELEN) == 0)
+        {
+            if(send(afp->ifs[i].fd, buf, len, 0) != (ssize_t)len)
+            {
+                perror("sr_link_afpacket: send");
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "sr_link_afpacket: no interface %s\n", iface);
+    return -1;
+} /* -- sr_link_afpacket_send -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afp_walk_block(..)
+ * Scope: Local
+ *
+ * Hand every frame in a block the kernel has retired to us up to the core,
+ * then give the block back.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_afp_walk_block(struct sr_link* link, struct sr_afp_if* afi,
+                             struct tpacket_block_desc* bd)
+{
+    struct tpacket3_hdr* hdr = 0;
+    struct sockaddr_ll*  sll = 0;
+    uint32_t i, n;
+
+    n   = bd->hdr.bh1.num_pkts;
+    hdr = (struct tpacket3_hdr*)((uint8_t*)bd + bd->hdr.bh1.offset_to_first_pkt);
+
+    for(i = 0; i < n; ++i)
+    {
+        sll = (struct sockaddr_ll*)((uint8_t*)hdr + TPACKET_ALIGN(sizeof(*hdr)));
+
+        /* -- don't route our own transmissions -- */
+        if(sll->sll_pkttype != PACKET_OUTGOING &&
+           hdr->tp_snaplen == hdr->tp_len)
+        {
+            sr_link_input(link, (uint8_t*)hdr + hdr->tp_mac,
+                          hdr->tp_snaplen, afi->name);
+        }
+
+        hdr = (struct tpacket3_hdr*)((uint8_t*)hdr + hdr->tp_next_offset);
+    }
+
+    __sync_synchronize();
+    bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+    return (int)n;
+} /* -- sr_afp_walk_block -- */
+
+static int sr_link_afpacket_poll(struct sr_link* link, int timeout_ms)
+{
+    struct sr_afp* afp = (struct sr_afp*)link->impl;
+    struct sr_afp_if* afi = 0;
+    struct tpacket_block_desc* bd = 0;
+    int i, handled = 0;
+
+    if(poll(afp->pfds, afp->nifs, timeout_ms) < 0)
+    {
+        if(errno == EINTR)
+        { return 0; }
+        perror("sr_link_afpacket: poll");
+        return -1;
+    }
+
+    for(i = 0; i < afp->nifs; ++i)
+    {
+        afi = &afp->ifs[i];
+
+        for(;;)
+        {
+            bd = (struct tpacket_block_desc*)
+                 (afi->ring + (size_t)afi->block * SR_AFP_BLOCK_SIZE);
+
+            if((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0)
+            { break; }
+            __sync_synchronize();
+
+            handled += sr_afp_walk_block(link, afi, bd);
+            afi->block = (afi->block + 1) % SR_AFP_BLOCK_NR;
+        }
+    }
+
+    return handled;
+} /* -- sr_link_afpacket_poll -- */
+
+const struct sr_link_ops sr_link_afpacket_ops =
+{
+    "afpacket",
+    sr_link_afpacket_open,
+    sr_link_afpacket_send,
+    sr_link_afpacket_poll,
+    sr_link_afpacket_close
+};
@@ -0,0 +1,144 @@
+/*-----------------------------------------------------------------------------
+ * file:   sr_link_main.c
+ * date:   Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * Driver for a standalone router over any of the link backends (see
+ * sr_link.h), e.g. to forward between network namespaces with
+ *
+ *   sr -b tap -i tap0=10.0.1.254,tap1=10.0.2.254 -r rtable
+ *
+ * There is no transport above a standalone router, so this also supplies
+ * sr_transport_input(..), which drops TCP and UDP addressed to the router.
+ * Applications with a transport (e.g. stcp over VNS) supply their own and
+ * link libsr.a without this file.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_arp.h"
+#include "sr_demux.h"
+#include "sr_link.h"
+#include "sr_transport.h"
+
+#define DEFAULT_BACKEND "vns"
+#define DEFAULT_RTABLE  "rtable"
+
+static struct sr_link sr_link_main_link;
+
+static void usage(char* argv0)
+{
+    printf("Simple Router over a pluggable link\n");
+    printf("Format: %s [-h] [-b backend] [-i spec] [-r routing table] [-s]\n",
+           argv0);
+    printf("   backend is vns, afpacket or tap (default %s)\n",
+           DEFAULT_BACKEND);
+    printf("   spec is backend specific, see sr_link.h\n");
+    printf("   -s prints per handler demux statistics on exit\n");
+} /* -- usage -- */
+
+static void sr_link_main_stop(int sig)
+{
+    (void)sig;
+    sr_link_stop(&sr_link_main_link);
+} /* -- sr_link_main_stop -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_transport_input(..)
+ * Scope: Global
+ *
+ * Nothing listens on a standalone router; packet is given, so free it.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_transport_input(struct sr_core* sr, uint8_t* packet)
+{
+    (void)sr;
+    free(packet);
+} /* -- sr_transport_input -- */
+
+int main(int argc, char **argv)
+{
+    int c;
+    char* backend = DEFAULT_BACKEND;
+    char* spec    = 0;
+    char* rtable  = DEFAULT_RTABLE;
+    int   stats   = 0;
+    int   ret     = 0;
+    struct sr_core core;
+    struct sigaction sa;
+
+    while ((c = getopt(argc, argv, "hb:i:r:s")) != EOF)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+                break;
+            case 'b':
+                backend = optarg;
+                break;
+            case 'i':
+                spec = optarg;
+                break;
+            case 'r':
+                rtable = optarg;
+                break;
+            case 's':
+                stats = 1;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        } /* switch */
+    } /* -- while -- */
+
+    if(sr_link_open(&sr_link_main_link, &core, backend, spec) != 0)
+    { return 1; }
+
+    if(sr_load_rt(&core, rtable) != 0)
+    {
+        fprintf(stderr,"Error setting up routing table from file %s\n",
+                rtable);
+        sr_link_close(&sr_link_main_link);
+        return 1;
+    }
+
+    if(sr_link_hw_ready(&sr_link_main_link) != 0)
+    {
+        sr_link_close(&sr_link_main_link);
+        return 1;
+    }
+
+    /* -- stop the receive loop cleanly, so stats can be printed -- */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sr_link_main_stop;
+    sigaction(SIGINT,  &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+
+    sr_arp_subsystem_startup(&core);
+    printf("sr: forwarding\n");
+    fflush(stdout);
+
+    ret = sr_link_run(&sr_link_main_link);
+
+    sr_arp_subsystem_shutdown(&core);
+    if(stats)
+    { sr_demux_print_stats(stdout); }
+    sr_link_close(&sr_link_main_link);
+
+    return ret == 0 ? 0 : 1;
+} /* -- main -- */
@@ -0,0 +1,207 @@
+/*-----------------------------------------------------------------------------
+ * file:   sr_link_tap.c
+ * date:   Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * TAP link backend.  Opens (or creates) one TAP device per interface; the
+ * router owns the device's "wire" side, so it needs its own MAC address
+ * and an explicit IP.  Handy for running the router inside a network
+ * namespace without VNS.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_link.h"
+
+struct sr_tap_if
+{
+    char name[SR_IFACE_NAMELEN];
+    int  fd;
+};
+
+struct sr_tap
+{
+    int              nifs;
+    struct sr_tap_if ifs[SR_LINK_MAX_IFACES];
+    struct pollfd    pfds[SR_LINK_MAX_IFACES];
+};
+
+static int sr_tap_open_if(struct sr_link* link, struct sr_tap_if* ti,
+                          const struct sr_link_ifspec* spec, int index)
+{
+    struct ifreq  ifr;
+    unsigned char mac[6];
+    const char*   c = 0;
+
+    strncpy(ti->name, spec->name, SR_IFACE_NAMELEN);
+
+    if(spec->ip == 0)
+    {
+        fprintf(stderr, "sr_link_tap: give an address as %s=a.b.c.d\n",
+                spec->name);
+        return -1;
+    }
+
+    if((ti->fd = open("/dev/net/tun", O_RDWR)) < 0)
+    {
+        perror("open(/dev/net/tun)");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, spec->name, IFNAMSIZ - 1);
+
+    if(ioctl(ti->fd, TUNSETIFF, &ifr) < 0)
+    {
+        perror("ioctl(TUNSETIFF)");
+        return -1;
+    }
+
+    /* -- locally administered unicast, stable for a given name -- */
+    mac[0] = 0x02; mac[1] = 0x53; mac[2] = 0x52;
+    mac[3] = 0;    mac[4] = 0;    mac[5] = (unsigned char)index;
+    for(c = spec->name; *c; ++c)
+    {
+        mac[3] = (unsigned char)(mac[3] * 31 + *c);
+        mac[4] = (unsigned char)(mac[4] ^ *c);
+    }
+
+    sr_link_add_interface(link, spec->name, mac, spec->ip);
+    return 0;
+} /* -- sr_tap_open_if -- */
+
+static void sr_link_tap_close(struct sr_link* link)
+{
+    struct sr_tap* tap = (struct sr_tap*)link->impl;
+    int i;
+
+    if(tap == 0)
+    { return; }
+
+    for(i = 0; i < tap->nifs; ++i)
+    {
+        if(tap->ifs[i].fd >= 0)
+        { close(tap->ifs[i].fd); }
+    }
+
+    free(tap);
+    link->impl = 0;
+} /* -- sr_link_tap_close -- */
+
+static int sr_link_tap_open(struct sr_link* link, const char* spec)
+{
+    struct sr_link_ifspec ifs[SR_LINK_MAX_IFACES];
+    struct sr_tap* tap = 0;
+    int n, i;
+
+    if((n = sr_link_parse_spec(spec, ifs, SR_LINK_MAX_IFACES)) <= 0)
+    {
+        fprintf(stderr, "sr_link_tap: need at least one interface\n");
+        return -1;
+    }
+
+    if((tap = (struct sr_tap*)malloc(sizeof(struct sr_tap))) == 0)
+    { return -1; }
+    memset(tap, 0, sizeof(struct sr_tap));
+    link->impl = tap;
+
+    for(i = 0; i < n; ++i)
+    {
+        tap->ifs[i].fd = -1;
+        tap->nifs = i + 1;
+        if(sr_tap_open_if(link, &tap->ifs[i], &ifs[i], i) != 0)
+        {
+            sr_link_tap_close(link);
+            return -1;
+        }
+        tap->pfds[i].fd     = tap->ifs[i].fd;
+        tap->pfds[i].events = POLLIN;
+    }
+
+    return 0;
+} /* -- sr_link_tap_open -- */
+
+static int sr_link_tap_send(struct sr_link* link, uint8_t* buf,
+                            unsigned int len, const char* iface)
+{
+    struct sr_tap* tap = (struct sr_tap*)link->impl;
+    int i;
+
+    for(i = 0; i < tap->nifs; ++i)
+    {
+        if(strncmp(tap->ifs[i].name, iface, SR_IFACE_NAMELEN) == 0)
+        {
+            if(write(tap->ifs[i].fd, buf, len) != (ssize_t)len)
+            {
+                perror("sr_link_tap: write");
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "sr_link_tap: no interface %s\n", iface);
+    return -1;
+} /* -- sr_link_tap_send -- */
+
+static int sr_link_tap_poll(struct sr_link* link, int timeout_ms)
+{
+    struct sr_tap* tap = (struct sr_tap*)link->impl;
+    uint8_t frame[SR_LINK_MAX_FRAME + 4];
+    ssize_t len;
+    int i, handled = 0;
+
+    if(poll(tap->pfds, tap->nifs, timeout_ms) < 0)
+    {
+        if(errno == EINTR)
+        { return 0; }
+        perror("sr_link_tap: poll");
+        return -1;
+    }
+
+    for(i = 0; i < tap->nifs; ++i)
+    {
+        if((tap->pfds[i].revents & POLLIN) == 0)
+        { continue; }
+
+        if((len = read(tap->ifs[i].fd, frame, sizeof(frame))) < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN)
+            { continue; }
+            perror("sr_link_tap: read");
+            return -1;
+        }
+
+        sr_link_input(link, frame, (unsigned int)len, tap->ifs[i].name);
+        ++handled;
+    }
+
+    return handled;
+} /* -- sr_link_tap_poll -- */
+
+const struct sr_link_ops sr_link_tap_ops =
+{
+    "tap",
+    sr_link_tap_open,
+    sr_link_tap_send,
+    sr_link_tap_poll,
+    sr_link_tap_close
+};
@@ -0,0 +1,228 @@
+/*-----------------------------------------------------------------------------
+ * file:   sr_link_vns.c
+ * date:   Mon Oct 19 2026
+ *
+ * Description:
+ *
+ * VNS link backend.  Also supplies the sr_vns_integ_* callbacks that
+ * libsr_vns.a calls into, so this replaces sr_vns_integration.o.
+ *
+ * The sr_instance's subsystem is still the sr_core (sr_api_init(..) relies
+ * on that), so the link for an instance is found through core->network.
+ * Instances created outside of sr_link_open(..) (e.g. by sr_api_init(..))
+ * get a link allocated for them in sr_vns_integ_init(..).
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_ethernet.h"
+#include "sr_vns.h"
+#include "sr_link.h"
+
+#define SR_LINK_VNS_DEFAULT_PORT   12345
+#define SR_LINK_VNS_DEFAULT_SERVER "171.67.71.18"
+#define SR_LINK_VNS_DEFAULT_HOST   "vrhost"
+
+/* link being opened by sr_link_vns_open(..), picked up by
+ * sr_vns_integ_init(..) which sr_init_instance(..) calls */
+static struct sr_link* sr_link_vns_pending = 0;
+
+static struct sr_link* sr_link_vns_get(struct sr_instance* sr)
+{
+    struct sr_core* core = (struct sr_core*)sr_get_subsystem(sr);
+    assert(core);
+    return (struct sr_link*)core->network;
+} /* -- sr_link_vns_get -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_link_vns_open(..)
+ * Scope: Local
+ *
+ * spec is "server[:port][/topo[/vhost]]", every part optional.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_link_vns_open(struct sr_link* link, const char* spec)
+{
+    struct sr_instance* sr = 0;
+    char  server[128];
+    char* port  = 0;
+    char* topo  = 0;
+    char* vhost = 0;
+
+    /* -- REQUIRES -- */
+    assert(link);
+    assert(spec);
+
+    strncpy(server, spec, sizeof(server));
+    server[sizeof(server) - 1] = 0;
+
+    if((topo = strchr(server, '/')) != 0)
+    {
+        *topo++ = 0;
+        if((vhost = strchr(topo, '/')) != 0)
+        { *vhost++ = 0; }
+    }
+    if((port = strchr(server, ':')) != 0)
+    { *port++ = 0; }
+
+    if((sr = (struct sr_instance*)malloc(sizeof(struct sr_instance))) == 0)
+    { return -1; }
+
+    sr_link_vns_pending = link;
+    sr_init_instance(sr, link->core);
+    sr_link_vns_pending = 0;
+
+    sr_set_user(sr);
+    sr->topo_id = (topo && *topo) ? (unsigned short)atoi(topo) : 0;
+    strncpy(sr->vhost, (vhost && *vhost) ? vhost : SR_LINK_VNS_DEFAULT_HOST,
+            sizeof(sr->vhost));
+    sr->vhost[sizeof(sr->vhost) - 1] = 0;
+
+    if(sr_connect_to_server(sr,
+                (port && *port) ? (unsigned short)atoi(port)
+                                : SR_LINK_VNS_DEFAULT_PORT,
+                *server ? server : SR_LINK_VNS_DEFAULT_SERVER) == -1)
+    {
+        free(sr);
+        link->impl = 0;
+        return -1;
+    }
+
+    /* -- block until VNS has told us about our interfaces -- */
+    while(sr->hw_init == 0)
+    {
+        if(sr_read_from_server(sr) != 1)
+        {
+            free(sr);
+            link->impl = 0;
+            return -1;
+        }
+    }
+
+    return 0;
+} /* -- sr_link_vns_open -- */
+
+static int sr_link_vns_send(struct sr_link* link, uint8_t* buf,
+                            unsigned int len, const char* iface)
+{
+    assert(link->impl);
+    return sr_vns_send_packet((struct sr_instance*)link->impl, buf, len, iface);
+} /* -- sr_link_vns_send -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_link_vns_poll(..)
+ * Scope: Local
+ *
+ * sr_read_from_server(..) blocks until a complete VNS command has been
+ * read, so timeout_ms is not honoured.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_link_vns_poll(struct sr_link* link, int timeout_ms)
+{
+    (void)timeout_ms;
+    assert(link->impl);
+    return (sr_read_from_server((struct sr_instance*)link->impl) == 1) ? 1 : -1;
+} /* -- sr_link_vns_poll -- */
+
+static void sr_link_vns_close(struct sr_link* link)
+{
+    struct sr_instance* sr = (struct sr_instance*)link->impl;
+
+    if(sr)
+    {
+        sr_destroy_instance(sr);
+        free(sr);
+    }
+} /* -- sr_link_vns_close -- */
+
+const struct sr_link_ops sr_link_vns_ops =
+{
+    "vns",
+    sr_link_vns_open,
+    sr_link_vns_send,
+    sr_link_vns_poll,
+    sr_link_vns_close
+};
+
+/*-----------------------------------------------------------------------------
+ * libsr_vns.a integration callbacks
+ *---------------------------------------------------------------------------*/
+
+void sr_vns_integ_init(struct sr_instance* sr)
+{
+    struct sr_core* core = 0;
+    struct sr_link* link = sr_link_vns_pending;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    core = (struct sr_core*)sr_get_subsystem(sr);
+    assert(core);
+
+    if(link == 0)
+    {
+        /* -- instance not created through sr_link_open(..) -- */
+        link = (struct sr_link*)malloc(sizeof(struct sr_link));
+        assert(link);
+        memset(link, 0, sizeof(struct sr_link));
+        link->ops     = &sr_link_vns_ops;
+        link->core    = core;
+        link->running = 1;
+        sr_core_init(core, link);
+    }
+
+    link->impl = sr;
+} /* -- sr_vns_integ_init -- */
+
+void sr_vns_integ_hw_setup(struct sr_instance* sr)
+{
+    if(sr_link_hw_ready(sr_link_vns_get(sr)) != 0)
+    { exit(1); }
+} /* -- sr_vns_integ_hw_setup -- */
+
+void sr_vns_integ_input(struct sr_instance* sr,
+                        const uint8_t * packet/* borrowed */,
+                        unsigned int len,
+                        const char* interface/* borrowed */)
+{
+    sr_link_input(sr_link_vns_get(sr), packet, len, interface);
+} /* -- sr_vns_integ_input -- */
+
+void sr_vns_integ_add_interface(struct sr_instance* sr,
+                                struct sr_vns_if* vns_if /* borrowed */)
+{
+    assert(vns_if);
+    sr_link_add_interface(sr_link_vns_get(sr), vns_if->name,
+                          vns_if->addr, vns_if->ip);
+} /* -- sr_vns_integ_add_interface -- */
+
+int sr_vns_integ_output(struct sr_instance* sr /* borrowed */,
+                        uint8_t* buf /* borrowed */ ,
+                        unsigned int len,
+                        const char* iface /* borrowed */)
+{
+    return sr_low_level_output(sr_link_vns_get(sr)->core, buf, len, iface);
+} /* -- sr_vns_integ_output -- */
+
+void sr_vns_integ_close(struct sr_instance* sr)
+{
+    /* -- connection to VNS closed, stop sr_link_run(..) -- */
+    sr_link_stop(sr_link_vns_get(sr));
+} /* -- sr_vns_integ_close -- */
+
+void sr_vns_integ_destroy(struct sr_instance* sr)
+{
+    struct sr_link* link = sr_link_vns_get(sr);
+
+    if(link->impl == sr)
+    { link->impl = 0; }
+} /* -- sr_vns_integ_destroy -- */
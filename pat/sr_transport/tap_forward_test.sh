@@ -0,0 +1,126 @@
+#!/bin/sh
+#------------------------------------------------------------------------------
+# File: tap_forward_test.sh
+#
+# Forwards UDP between two network namespaces through sr over the tap
+# backend, and checks that every datagram comes back:
+#
+#   ns sr_test_a               sr                ns sr_test_b
+#   10.0.1.1  --- srtap0 [10.0.1.254  10.0.2.254] srtap1 ---  10.0.2.1
+#
+# sr creates the tap devices, then their kernel ends are moved into the
+# namespaces.  sr has to ARP for the hosts and answer their ARPs, so this
+# exercises the link, the demux and the ARP state as well as forwarding.
+# The demux's forward counter has to account for every echoed datagram.
+#
+# usage: tap_forward_test.sh [sr] [datagrams]     (needs root and python3)
+#------------------------------------------------------------------------------
+
+SR=${1:-./sr}
+COUNT=${2:-200}
+NS_A=sr_test_a
+NS_B=sr_test_b
+TMP=`mktemp -d /tmp/sr_tap_test.XXXXXX` || exit 1
+SR_PID=
+ECHO_PID=
+
+cleanup()
+{
+    [ -n "$ECHO_PID" ] && kill $ECHO_PID 2>/dev/null
+    [ -n "$SR_PID" ] && kill -INT $SR_PID 2>/dev/null && wait $SR_PID
+    ip netns del $NS_A 2>/dev/null
+    ip netns del $NS_B 2>/dev/null
+    rm -rf $TMP
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "FAIL: $*"
+    echo "---- sr output ----"
+    tail -20 $TMP/sr.log
+    exit 1
+}
+
+if [ `id -u` -ne 0 ]; then
+    echo "SKIP: needs root (network namespaces, /dev/net/tun)"
+    exit 0
+fi
+
+ip netns del $NS_A 2>/dev/null
+ip netns del $NS_B 2>/dev/null
+ip netns add $NS_A || fail "ip netns add"
+ip netns add $NS_B || fail "ip netns add"
+
+cat > $TMP/rtable <<EOF
+10.0.1.1 10.0.1.1 255.255.255.255 srtap0
+10.0.2.1 10.0.2.1 255.255.255.255 srtap1
+EOF
+
+$SR -s -b tap -i srtap0=10.0.1.254,srtap1=10.0.2.254 -r $TMP/rtable \
+    > $TMP/sr.log 2>&1 &
+SR_PID=$!
+
+i=0
+until grep -q "sr: forwarding" $TMP/sr.log; do
+    i=`expr $i + 1`
+    [ $i -gt 50 ] && fail "sr did not come up"
+    kill -0 $SR_PID 2>/dev/null || fail "sr exited"
+    sleep 0.1
+done
+
+# -- the router keeps its end (the tap fd); the hosts get the netdevs --
+ip link set srtap0 netns $NS_A || fail "moving srtap0"
+ip link set srtap1 netns $NS_B || fail "moving srtap1"
+
+ip -n $NS_A link set lo up
+ip -n $NS_A addr add 10.0.1.1/24 dev srtap0
+ip -n $NS_A link set srtap0 up
+ip -n $NS_A route add default via 10.0.1.254
+ip -n $NS_B link set lo up
+ip -n $NS_B addr add 10.0.2.1/24 dev srtap1
+ip -n $NS_B link set srtap1 up
+ip -n $NS_B route add default via 10.0.2.254
+
+ip netns exec $NS_B python3 -c '
+import socket
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.bind(("10.0.2.1", 9000))
+while True:
+    data, peer = s.recvfrom(2048)
+    s.sendto(data, peer)
+' &
+ECHO_PID=$!
+
+ip netns exec $NS_A python3 - $COUNT <<'EOF' || fail "datagrams lost"
+import socket, sys
+count = int(sys.argv[1])
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.settimeout(0.5)
+lost = 0
+for i in range(count):
+    msg = ("%d " % i).encode() + b"x" * (i % 1400)
+    for attempt in range(5):
+        s.sendto(msg, ("10.0.2.1", 9000))
+        try:
+            while s.recv(2048) != msg:
+                pass
+            break
+        except socket.timeout:
+            pass
+    else:
+        lost += 1
+print("%d/%d datagrams echoed through sr" % (count - lost, count))
+sys.exit(1 if lost else 0)
+EOF
+
+kill -0 $SR_PID 2>/dev/null || fail "sr died"
+kill -INT $SR_PID
+wait $SR_PID
+SR_PID=
+
+sed -n '/^stage /,$p' $TMP/sr.log
+FORWARDED=`awk '$1 == "ip" && $2 == "forward" { print $3 }' $TMP/sr.log`
+[ "${FORWARDED:-0}" -ge `expr 2 \* $COUNT` ] || \
+    fail "demux forwarded ${FORWARDED:-no} packets, expected $COUNT each way"
+echo "PASS"
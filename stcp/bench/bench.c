@@ -0,0 +1,180 @@
+/* bench.c--helpers shared by the STCP benchmarks */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "bench.h"
+
+
+double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+mysocket_t bench_listen(bool_t reliable, int backlog, unsigned short *port)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    mysocket_t sd;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(0);
+
+    if ((sd = mysocket(reliable)) < 0 ||
+        mybind(sd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        mylisten(sd, backlog) < 0 ||
+        mygetsockname(sd, (struct sockaddr *) &sin, &len) < 0)
+    {
+        perror("bench_listen");
+        exit(EXIT_FAILURE);
+    }
+
+    *port = ntohs(sin.sin_port);
+    return sd;
+}
+
+
+mysocket_t bench_connect(bool_t reliable, unsigned short port, int nodelay)
+{
+    struct sockaddr_in sin;
+    mysocket_t sd;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+    sin.sin_port = htons(port);
+
+    if ((sd = mysocket(reliable)) < 0 ||
+        (nodelay && mysetsockopt(sd, MYSOCK_NODELAY, 1) < 0) ||
+        myconnect(sd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+    {
+        perror("bench_connect");
+        exit(EXIT_FAILURE);
+    }
+    return sd;
+}
+
+
+void bench_write_all(mysocket_t sd, const char *buf, size_t len,
+                     size_t chunk)
+{
+    while (len > 0)
+    {
+        int rc = mywrite(sd, buf, MIN(len, chunk));
+
+        if (rc <= 0)
+        {
+            fprintf(stderr, "mywrite: %s with %lu bytes to go\n",
+                    rc < 0 ? strerror(errno) : "no progress",
+                    (unsigned long) len);
+            exit(EXIT_FAILURE);
+        }
+        len -= rc;
+    }
+}
+
+
+void bench_read_all(mysocket_t sd, char *buf, size_t len, size_t chunk)
+{
+    while (len > 0)
+    {
+        int rc = myread(sd, buf, MIN(len, chunk));
+
+        if (rc <= 0)
+        {
+            fprintf(stderr, "myread: %s with %lu bytes to go\n",
+                    rc < 0 ? strerror(errno) : "end of stream",
+                    (unsigned long) len);
+            exit(EXIT_FAILURE);
+        }
+        len -= rc;
+    }
+}
+
+
+pid_t bench_fork(void (*server)(void *arg, int fd), void *arg, int *fd)
+{
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) < 0 || (pid = fork()) < 0)
+    {
+        perror("bench_fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        server(arg, fds[1]);
+        exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    *fd = fds[0];
+    return pid;
+}
+
+
+void bench_wait(pid_t pid)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) < 0 ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "server process failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void bench_send(int fd, const void *rec, size_t len)
+{
+    if (write(fd, rec, len) != (ssize_t) len)
+    {
+        perror("bench_send");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void bench_recv(int fd, void *rec, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len)
+    {
+        ssize_t rc = read(fd, (char *) rec + got, len - got);
+
+        if (rc <= 0)
+        {
+            fprintf(stderr, "server process went away\n");
+            exit(EXIT_FAILURE);
+        }
+        got += rc;
+    }
+}
+
+
+void bench_usage(bench_usage_t *usage)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    usage->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+                 ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    usage->ctx_switches = ru.ru_nvcsw + ru.ru_nivcsw;
+}
@@ -0,0 +1,56 @@
+/*
+ * bench.h
+ *
+ * Helpers shared by the STCP benchmarks in this directory: timing, the
+ * loopback listen/connect boilerplate, a server child process to measure
+ * against, and what the kernel says a process cost.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "mysock.h"
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+/* what a process used, from getrusage(); all threads included */
+typedef struct
+{
+    double cpu;             /* user + system seconds */
+    long   ctx_switches;    /* voluntary + involuntary */
+} bench_usage_t;
+
+double bench_now(void);
+
+/* a mysocket listening on any port of INADDR_ANY, with its port (host
+ * byte order) in *port.  exits on failure, as do the other helpers.
+ */
+mysocket_t bench_listen(bool_t reliable, int backlog, unsigned short *port);
+
+/* a mysocket connected to port on 127.0.0.1 */
+mysocket_t bench_connect(bool_t reliable, unsigned short port, int nodelay);
+
+/* write or read exactly len bytes, at most chunk per call */
+void bench_write_all(mysocket_t sd, const char *buf, size_t len,
+                     size_t chunk);
+void bench_read_all(mysocket_t sd, char *buf, size_t len, size_t chunk);
+
+/* fork a child that runs server(arg, fd), then exits.  the child writes
+ * whatever it reports (at least the port it listens on) to fd; the
+ * parent reads it from the returned descriptor.  mysockets must only be
+ * created after the fork.
+ */
+pid_t bench_fork(void (*server)(void *arg, int fd), void *arg, int *fd);
+void bench_wait(pid_t pid);
+
+/* write/read a fixed size record over the pipe from bench_fork() */
+void bench_send(int fd, const void *rec, size_t len);
+void bench_recv(int fd, void *rec, size_t len);
+
+void bench_usage(bench_usage_t *usage);
+
+#endif  /* __BENCH_H__ */
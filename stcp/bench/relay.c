@@ -0,0 +1,482 @@
+/* relay.c--delays, rate limits and loses the packets on STCP's TCP
+ * tunnels, for the benchmarks
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "bench.h"
+#include "relay.h"
+
+#define MAX_RELAY_CONNS 1024
+#define FRAME_HDR_LEN   2                   /* network_io_tcp.c's length */
+#define PARSE_BUF_SIZE  (FRAME_HDR_LEN + 65536)
+#define MAX_LOST_RANGES 256     /* per direction, forgetting the oldest */
+
+/* sequence numbers wrap, so compare their difference */
+#define SEQ_LT(a,b) ((int32_t) ((a) - (b)) < 0)
+#define SEQ_MAX(a,b) (SEQ_LT(a,b) ? (b) : (a))
+#define SEQ_MIN(a,b) (SEQ_LT(a,b) ? (a) : (b))
+
+/* packets go client to server (TO_SERVER) or back (TO_CLIENT) */
+enum { TO_SERVER, TO_CLIENT, NUM_DIRS };
+
+/* a packet on its way, with the framing it arrived in.  len 0 passes on
+ * the end of the stream instead.
+ */
+typedef struct relay_frame
+{
+    struct relay_frame *next;
+    double due;                     /* when it's passed on */
+    int out_fd;
+    size_t len;
+    char data[1];
+} relay_frame_t;
+
+typedef struct
+{
+    tcp_seq start, end;
+} seq_range_t;
+
+/* a relayed connection.  fd[d] is the socket packets going in direction d
+ * are read from, and fd[1 - d] the one they're written to.
+ */
+typedef struct
+{
+    int fd[NUM_DIRS];
+    bool_t eof[NUM_DIRS];           /* end of stream read from fd[d] */
+    int num_shut;                   /* ...and passed on */
+    bool_t seen_syn[NUM_DIRS];
+    tcp_seq snd_max[NUM_DIRS];      /* highest sequence sent, after SYN */
+    seq_range_t lost[NUM_DIRS][MAX_LOST_RANGES];   /* and not sent again */
+    int num_lost[NUM_DIRS];
+    size_t parse_len[NUM_DIRS];
+    char parse_buf[NUM_DIRS][PARSE_BUF_SIZE];
+} relay_conn_t;
+
+/* frames leave in the order they arrive in each direction: they're all
+ * held for the same time, after (going to the server) waiting their turn
+ * on the bottleneck
+ */
+typedef struct
+{
+    relay_frame_t *head, *tail;
+} relay_fifo_t;
+
+struct relay
+{
+    relay_params_t params;
+    struct sockaddr_in server_addr;
+    int listen_fd;
+    relay_conn_t *conns[MAX_RELAY_CONNS];
+    int num_conns;
+    relay_fifo_t fifo[NUM_DIRS];
+    double link_free;               /* when the bottleneck's next free */
+    unsigned int seed;              /* for rand_r(), losing packets */
+
+    pthread_mutex_t stats_lock;
+    relay_stats_t stats;
+};
+
+
+static void *relay_thread_func(void *arg);
+
+
+relay_t *relay_start(unsigned short server_port,
+                     const relay_params_t *params, unsigned short *port)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    pthread_t thread;
+    relay_t *relay;
+
+    relay = (relay_t *) calloc(1, sizeof(relay_t));
+    assert(relay);
+    relay->params = *params;
+    relay->seed = 1;
+    pthread_mutex_init(&relay->stats_lock, NULL);
+
+    memset(&relay->server_addr, 0, sizeof(relay->server_addr));
+    relay->server_addr.sin_family = AF_INET;
+    relay->server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    relay->server_addr.sin_port = htons(server_port);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    if ((relay->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(relay->listen_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        listen(relay->listen_fd, MAX_RELAY_CONNS) < 0 ||
+        getsockname(relay->listen_fd, (struct sockaddr *) &sin, &len) < 0)
+    {
+        perror("relay_start");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_create(&thread, NULL, relay_thread_func, relay))
+    {
+        perror("pthread_create (relay)");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+
+    *port = ntohs(sin.sin_port);
+    return relay;
+}
+
+
+void relay_get_stats(relay_t *relay, relay_stats_t *stats)
+{
+    pthread_mutex_lock(&relay->stats_lock);
+    *stats = relay->stats;
+    pthread_mutex_unlock(&relay->stats_lock);
+}
+
+
+static void accept_conn(relay_t *relay)
+{
+    relay_conn_t *conn;
+    int one = 1;
+    int d;
+
+    conn = (relay_conn_t *) calloc(1, sizeof(relay_conn_t));
+    assert(conn);
+
+    if ((conn->fd[TO_SERVER] = accept(relay->listen_fd, NULL, NULL)) < 0 ||
+        (conn->fd[TO_CLIENT] = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        connect(conn->fd[TO_CLIENT],
+                (struct sockaddr *) &relay->server_addr,
+                sizeof(relay->server_addr)) < 0)
+    {
+        perror("relay accept/connect");
+        exit(EXIT_FAILURE);
+    }
+
+    /* as the endpoints do: every write is a whole packet */
+    for (d = 0; d < NUM_DIRS; ++d)
+        setsockopt(conn->fd[d], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    assert(relay->num_conns < MAX_RELAY_CONNS);
+    relay->conns[relay->num_conns++] = conn;
+}
+
+
+/* returns FALSE if the bottleneck drops the frame */
+static bool_t enqueue_frame(relay_t *relay, int dir, int out_fd,
+                            const char *data, size_t len, double now)
+{
+    relay_fifo_t *fifo = &relay->fifo[dir];
+    relay_frame_t *frame;
+    double sent = now;
+
+    /* the bottleneck sends a frame once it's sent everything ahead of
+     * it, and there's only room for so much ahead of it
+     */
+    if (dir == TO_SERVER && relay->params.rate > 0)
+    {
+        if (relay->link_free > now)
+        {
+            if (len > 0 &&
+                (relay->link_free - now) * relay->params.rate >=
+                relay->params.queue)
+            {
+                pthread_mutex_lock(&relay->stats_lock);
+                ++relay->stats.dropped;
+                pthread_mutex_unlock(&relay->stats_lock);
+                return FALSE;
+            }
+            sent = relay->link_free;
+        }
+        sent += len / relay->params.rate;
+        relay->link_free = sent;
+    }
+
+    frame = (relay_frame_t *) malloc(sizeof(relay_frame_t) + len);
+    assert(frame);
+    frame->next   = NULL;
+    frame->due    = sent + relay->params.delay;
+    frame->out_fd = out_fd;
+    frame->len    = len;
+    memcpy(frame->data, data, len);
+
+    if (fifo->tail)
+        fifo->tail->next = frame;
+    else
+        fifo->head = frame;
+    fifo->tail = frame;
+    return TRUE;
+}
+
+
+/* the sequence numbers of the data in an STCP packet, which is in the
+ * struct tcphdr wire format of both <netinet/tcp.h> and transport.h.
+ * returns FALSE for a packet with no data, or before the SYN's been seen
+ * (which it takes note of).
+ */
+static bool_t packet_data(relay_conn_t *conn, int dir, const char *packet,
+                          size_t len, seq_range_t *range)
+{
+    const struct tcphdr *hdr = (const struct tcphdr *) packet;
+    tcp_seq seq;
+
+    if (len < sizeof(struct tcphdr) || len < hdr->th_off * 4U)
+        return FALSE;
+    seq = ntohl(hdr->th_seq);
+
+    if (hdr->th_flags & TH_SYN)
+    {
+        conn->seen_syn[dir] = TRUE;
+        conn->snd_max[dir] = seq + 1;
+        return FALSE;
+    }
+
+    range->start = seq;
+    range->end = seq + (len - hdr->th_off * 4);
+    return conn->seen_syn[dir] && range->start != range->end;
+}
+
+
+/* count the data in a packet going in direction dir, and how much of it
+ * was sent before, either after being lost (needed) or not (spurious).
+ * what's sent again comes out of the lost ranges.
+ */
+static void count_packet(relay_t *relay, relay_conn_t *conn, int dir,
+                         const seq_range_t *data)
+{
+    seq_range_t *lost = conn->lost[dir];
+    size_t rexmit_len = 0, needed_len = 0;
+    int k, n = conn->num_lost[dir];
+
+    if (SEQ_LT(data->start, conn->snd_max[dir]))
+        rexmit_len = SEQ_MIN(data->end, conn->snd_max[dir]) - data->start;
+    if (SEQ_LT(conn->snd_max[dir], data->end))
+        conn->snd_max[dir] = data->end;
+
+    for (k = 0; k < n && rexmit_len > 0; ++k)
+    {
+        tcp_seq start = SEQ_MAX(lost[k].start, data->start);
+        tcp_seq end = SEQ_MIN(lost[k].end, data->end);
+
+        if (!SEQ_LT(start, end))
+            continue;
+        needed_len += end - start;
+
+        /* keep what's either side of the data, if anything */
+        if (SEQ_LT(lost[k].start, data->start) &&
+            SEQ_LT(data->end, lost[k].end) && n < MAX_LOST_RANGES)
+        {
+            lost[n].start = data->end;
+            lost[n++].end = lost[k].end;
+        }
+        if (SEQ_LT(lost[k].start, data->start))
+            lost[k].end = data->start;
+        else if (SEQ_LT(data->end, lost[k].end))
+            lost[k].start = data->end;
+        else
+        {
+            lost[k--] = lost[--n];
+        }
+    }
+    conn->num_lost[dir] = n;
+
+    pthread_mutex_lock(&relay->stats_lock);
+    relay->stats.data_bytes += data->end - data->start;
+    relay->stats.rexmit_bytes += rexmit_len;
+    relay->stats.spurious_bytes += rexmit_len - MIN(needed_len, rexmit_len);
+    pthread_mutex_unlock(&relay->stats_lock);
+}
+
+
+static void lose_packet(relay_conn_t *conn, int dir, const seq_range_t *data)
+{
+    seq_range_t *lost = conn->lost[dir];
+
+    if (conn->num_lost[dir] == MAX_LOST_RANGES)
+    {
+        memmove(lost, lost + 1, (MAX_LOST_RANGES - 1) * sizeof(*lost));
+        --conn->num_lost[dir];
+    }
+    lost[conn->num_lost[dir]++] = *data;
+}
+
+
+/* read what's arrived on conn->fd[dir], and queue the whole frames in it */
+static void read_conn(relay_t *relay, relay_conn_t *conn, int dir)
+{
+    char *buf = conn->parse_buf[dir];
+    size_t *len = &conn->parse_len[dir];
+    int out_fd = conn->fd[1 - dir];
+    double now = bench_now();
+    size_t start = 0;
+    ssize_t rc;
+
+    rc = recv(conn->fd[dir], buf + *len, PARSE_BUF_SIZE - *len, 0);
+    if (rc <= 0)
+    {
+        conn->eof[dir] = TRUE;
+        enqueue_frame(relay, dir, out_fd, NULL, 0, now);
+        return;
+    }
+    *len += rc;
+
+    while (*len - start >= FRAME_HDR_LEN)
+    {
+        seq_range_t data;
+        bool_t has_data, lost;
+        size_t frame_len = FRAME_HDR_LEN +
+            (((unsigned char) buf[start] << 8) |
+             (unsigned char) buf[start + 1]);
+
+        if (*len - start < frame_len)
+            break;
+
+        has_data = packet_data(conn, dir, buf + start + FRAME_HDR_LEN,
+                               frame_len - FRAME_HDR_LEN, &data);
+        if (has_data)
+            count_packet(relay, conn, dir, &data);
+
+        if (relay->params.loss > 0 &&
+            rand_r(&relay->seed) < relay->params.loss * RAND_MAX)
+        {
+            pthread_mutex_lock(&relay->stats_lock);
+            ++relay->stats.lost;
+            pthread_mutex_unlock(&relay->stats_lock);
+            lost = TRUE;
+        }
+        else
+        {
+            lost = !enqueue_frame(relay, dir, out_fd, buf + start,
+                                  frame_len, now);
+        }
+
+        if (lost && has_data)
+            lose_packet(conn, dir, &data);
+        start += frame_len;
+    }
+
+    memmove(buf, buf + start, *len - start);
+    *len -= start;
+}
+
+
+static void close_conn(relay_t *relay, int fd)
+{
+    int k;
+
+    for (k = 0; k < relay->num_conns; ++k)
+    {
+        relay_conn_t *conn = relay->conns[k];
+
+        if (conn->fd[TO_SERVER] != fd && conn->fd[TO_CLIENT] != fd)
+            continue;
+
+        if (++conn->num_shut == NUM_DIRS)
+        {
+            close(conn->fd[TO_SERVER]);
+            close(conn->fd[TO_CLIENT]);
+            free(conn);
+            relay->conns[k] = relay->conns[--relay->num_conns];
+        }
+        return;
+    }
+    assert(0);
+}
+
+
+/* pass on the frames that are due, and return how long until the next
+ * one is (-1 if there isn't one)
+ */
+static int send_due_frames(relay_t *relay)
+{
+    double now = bench_now();
+    double next = -1;
+    int d;
+
+    for (d = 0; d < NUM_DIRS; ++d)
+    {
+        relay_fifo_t *fifo = &relay->fifo[d];
+        relay_frame_t *frame;
+
+        while ((frame = fifo->head) && frame->due <= now)
+        {
+            if (!(fifo->head = frame->next))
+                fifo->tail = NULL;
+
+            if (frame->len > 0)
+            {
+                /* a peer that's gone just loses the packet */
+                (void) send(frame->out_fd, frame->data, frame->len,
+                            MSG_NOSIGNAL);
+            }
+            else
+            {
+                shutdown(frame->out_fd, SHUT_WR);
+                close_conn(relay, frame->out_fd);
+            }
+            free(frame);
+        }
+
+        if (frame && (next < 0 || frame->due < next))
+            next = frame->due;
+    }
+
+    /* round up, so the frame is due when poll() returns */
+    return (next < 0) ? -1 : (int) ((next - now) * 1000) + 1;
+}
+
+
+static void *relay_thread_func(void *arg)
+{
+    relay_t *relay = (relay_t *) arg;
+    struct pollfd fds[1 + MAX_RELAY_CONNS * NUM_DIRS];
+
+    for (;;)
+    {
+        int timeout = send_due_frames(relay);
+        int num_fds = 0;
+        int k, d;
+
+        fds[num_fds].fd = relay->listen_fd;
+        fds[num_fds++].events = POLLIN;
+        for (k = 0; k < relay->num_conns; ++k)
+        {
+            for (d = 0; d < NUM_DIRS; ++d)
+            {
+                /* a closed side's descriptor is left out with -1 */
+                fds[num_fds].fd = relay->conns[k]->eof[d] ?
+                    -1 : relay->conns[k]->fd[d];
+                fds[num_fds++].events = POLLIN;
+            }
+        }
+
+        if (poll(fds, num_fds, timeout) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll (relay)");
+            exit(EXIT_FAILURE);
+        }
+
+        for (k = 1; k < num_fds; ++k)
+        {
+            relay_conn_t *conn = relay->conns[(k - 1) / NUM_DIRS];
+
+            if (fds[k].revents)
+                read_conn(relay, conn, (k - 1) % NUM_DIRS);
+        }
+
+        if (fds[0].revents & POLLIN)
+            accept_conn(relay);
+    }
+    return NULL;
+}
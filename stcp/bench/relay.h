@@ -0,0 +1,52 @@
+/*
+ * relay.h
+ *
+ * A stand-in for a real path between two STCP endpoints, for the
+ * benchmarks.  Over the TCP network layer each STCP connection is a TCP
+ * connection carrying length-prefixed packets (see network_io_tcp.c); the
+ * relay accepts those connections on a port of its own, opens one to the
+ * server for each, and passes the packets across after a delay.  Going
+ * to the server, the packets can also be made to share a bottleneck: a
+ * link of a given rate, with a drop-tail queue in front of it.  Packets
+ * in either direction can be lost at random, and the relay counts how
+ * much of the data it sees is sent again, and how much of that it hadn't
+ * lost in the first place.
+ *
+ * It runs as a thread of whichever process starts it.  It only works
+ * with the TCP network layer.
+ */
+
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <stddef.h>
+
+typedef struct relay relay_t;
+
+typedef struct
+{
+    double delay;           /* one way, in seconds, both directions */
+    double rate;            /* of the bottleneck, bytes/sec; 0 for none */
+    size_t queue;           /* bytes the bottleneck queues before dropping */
+    double loss;            /* chance of losing each packet, 0 to 1 */
+} relay_params_t;
+
+typedef struct
+{
+    unsigned long dropped;  /* packets the bottleneck queue had no room for */
+    unsigned long lost;     /* packets lost at random */
+    unsigned long data_bytes;       /* sent, counting retransmissions */
+    unsigned long rexmit_bytes;     /* ...below the highest sequence sent */
+    unsigned long spurious_bytes;   /* ...that the relay hadn't lost */
+} relay_stats_t;
+
+/* start relaying connections from *port (host byte order) to server_port
+ * on 127.0.0.1.  exits on failure.
+ */
+relay_t *relay_start(unsigned short server_port,
+                     const relay_params_t *params, unsigned short *port);
+
+/* the counts so far, over all connections */
+void relay_get_stats(relay_t *relay, relay_stats_t *stats);
+
+#endif  /* __RELAY_H__ */
@@ -0,0 +1,310 @@
+/*
+ * stcp_bulk.c
+ *
+ * Bulk transfer benchmark.  A server process is forked and the client
+ * writes it -s bytes over loopback on each of -n connections (flows) at
+ * once; the server answers on a flow with a byte once it has read them
+ * all, and the time from the flow's first write to that answer gives its
+ * goodput.  The flows' total, and Jain's fairness index over them (1 when
+ * they all get the same, 1/n when one gets everything), are reported
+ * with each side's CPU time, since on loopback the transfer is usually
+ * CPU bound.
+ *
+ *   stcp_bulk [-U] [-s bytes] [-n flows] [-w write size]
+ *             [-d delay ms] [-b bottleneck Mbit/s] [-q queue bytes]
+ *             [-l loss %]
+ *
+ * -U runs over the unreliable network layer (drops, duplicates and
+ * reordering, see network.c).  -d passes the flows through a relay
+ * (relay.h) that holds packets that many milliseconds each way, so the
+ * round trip is twice that; with the TCP network layer only.  The
+ * throughput is then at most the window over the round trip, and
+ * STCP_BUF_MAX sets the window (see transport.c).  -b makes the relay a
+ * bottleneck the flows share going to the server, dropping what won't
+ * fit in a -q byte queue, so the congestion control (STCP_CC) decides
+ * how they share it.  -l has the relay lose that percentage of packets,
+ * each way.  With the relay, the data bytes it saw sent are reported,
+ * how many of them were retransmissions, and how many of those were
+ * spurious (the relay had delivered them the first time).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bench.h"
+#include "relay.h"
+
+#define BUF_SIZE  (1024 * 1024)
+#define MAX_FLOWS 256
+
+typedef struct
+{
+    bool_t reliable;
+    size_t bytes;           /* -s, per flow */
+    int num_flows;          /* -n */
+    size_t write_size;      /* -w */
+    relay_params_t relay;   /* -d, -b, -q, -l; delay < 0 without the relay */
+} bulk_params_t;
+
+typedef struct
+{
+    const bulk_params_t *params;
+    mysocket_t sd;
+    pthread_barrier_t *start_barrier;
+    double start, end;
+    char *buf;
+} bulk_flow_t;
+
+static char usage[] =
+    "usage: %s [-U] [-s bytes] [-n flows] [-w write size]\n"
+    "          [-d delay ms] [-b bottleneck Mbit/s] [-q queue bytes]\n"
+    "          [-l loss %%]\n";
+
+
+static void *server_flow_func(void *arg)
+{
+    bulk_flow_t *flow = (bulk_flow_t *) arg;
+    char done = 1;
+
+    bench_read_all(flow->sd, flow->buf, flow->params->bytes, BUF_SIZE);
+    bench_write_all(flow->sd, &done, 1, 1);
+    return NULL;
+}
+
+
+static void *client_flow_func(void *arg)
+{
+    bulk_flow_t *flow = (bulk_flow_t *) arg;
+
+    pthread_barrier_wait(flow->start_barrier);
+
+    flow->start = bench_now();
+    bench_write_all(flow->sd, flow->buf, flow->params->bytes,
+                    flow->params->write_size);
+    bench_read_all(flow->sd, flow->buf, 1, 1);
+    flow->end = bench_now();
+    return NULL;
+}
+
+
+/* run fn on each flow in a thread of its own, and wait for them all */
+static void run_flows(bulk_flow_t *flows, int num_flows,
+                      void *(*fn)(void *))
+{
+    pthread_t threads[MAX_FLOWS];
+    int k;
+
+    for (k = 0; k < num_flows; ++k)
+    {
+        if (pthread_create(&threads[k], NULL, fn, &flows[k]))
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (k = 0; k < num_flows; ++k)
+        pthread_join(threads[k], NULL);
+}
+
+
+static bulk_flow_t *new_flows(const bulk_params_t *params)
+{
+    bulk_flow_t *flows;
+    int k;
+
+    flows = (bulk_flow_t *) calloc(params->num_flows, sizeof(bulk_flow_t));
+    assert(flows);
+    for (k = 0; k < params->num_flows; ++k)
+    {
+        flows[k].params = params;
+        flows[k].buf = (char *) calloc(1, BUF_SIZE);
+        assert(flows[k].buf);
+    }
+    return flows;
+}
+
+
+static void bulk_server(void *arg, int fd)
+{
+    bulk_params_t *params = (bulk_params_t *) arg;
+    bulk_flow_t *flows = new_flows(params);
+    bench_usage_t usage;
+    unsigned short port;
+    mysocket_t bindsd;
+    int k;
+
+    bindsd = bench_listen(params->reliable, params->num_flows, &port);
+    bench_send(fd, &port, sizeof(port));
+
+    for (k = 0; k < params->num_flows; ++k)
+    {
+        if ((flows[k].sd = myaccept(bindsd, NULL, NULL)) < 0)
+        {
+            perror("myaccept");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    run_flows(flows, params->num_flows, server_flow_func);
+
+    bench_usage(&usage);
+    bench_send(fd, &usage, sizeof(usage));
+
+    for (k = 0; k < params->num_flows; ++k)
+        myclose(flows[k].sd);
+    myclose(bindsd);
+}
+
+
+int main(int argc, char *argv[])
+{
+    bulk_params_t params;
+    bulk_flow_t *flows;
+    bench_usage_t client_usage, server_usage;
+    pthread_barrier_t start_barrier;
+    unsigned short port;
+    double start, end, sum = 0, sum_sq = 0;
+    relay_t *relay = NULL;
+    pid_t pid;
+    int fd, opt, k;
+
+    params.reliable     = TRUE;
+    params.bytes        = 64 * 1024 * 1024;
+    params.num_flows    = 1;
+    params.write_size   = 64 * 1024;
+    params.relay.delay  = -1;
+    params.relay.rate   = 0;
+    params.relay.queue  = 64 * 1024;
+    params.relay.loss   = 0;
+
+    while ((opt = getopt(argc, argv, "Us:n:w:d:b:q:l:")) != EOF)
+    {
+        switch (opt)
+        {
+        case 'U':
+            params.reliable = FALSE;
+            break;
+        case 's':
+            params.bytes = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            params.num_flows = atoi(optarg);
+            break;
+        case 'w':
+            params.write_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            params.relay.delay = atof(optarg) / 1000;
+            break;
+        case 'b':
+            params.relay.rate = atof(optarg) * 1e6 / 8;
+            break;
+        case 'q':
+            params.relay.queue = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            params.relay.loss = atof(optarg) / 100;
+            break;
+        default:
+            fprintf(stderr, usage, argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc || !params.bytes ||
+        params.num_flows < 1 || params.num_flows > MAX_FLOWS ||
+        !params.write_size || params.write_size > BUF_SIZE)
+    {
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* a bottleneck or loss needs the relay, if with no delay */
+    if ((params.relay.rate > 0 || params.relay.loss > 0) &&
+        params.relay.delay < 0)
+        params.relay.delay = 0;
+
+    pid = bench_fork(bulk_server, &params, &fd);
+    bench_recv(fd, &port, sizeof(port));
+
+    if (params.relay.delay >= 0)
+        relay = relay_start(port, &params.relay, &port);
+
+    flows = new_flows(&params);
+    pthread_barrier_init(&start_barrier, NULL, params.num_flows);
+    for (k = 0; k < params.num_flows; ++k)
+    {
+        flows[k].sd = bench_connect(params.reliable, port, FALSE);
+        flows[k].start_barrier = &start_barrier;
+    }
+
+    run_flows(flows, params.num_flows, client_flow_func);
+
+    bench_usage(&client_usage);
+    bench_recv(fd, &server_usage, sizeof(server_usage));
+
+    printf("stcp_bulk: %d x %lu bytes in %lu byte writes%s\n",
+           params.num_flows, (unsigned long) params.bytes,
+           (unsigned long) params.write_size,
+           params.reliable ? "" : ", unreliable network");
+    if (relay)
+    {
+        relay_stats_t stats;
+
+        relay_get_stats(relay, &stats);
+        printf("  through the relay, %.1f ms round trip, STCP_BUF_MAX %s\n",
+               2 * params.relay.delay * 1000,
+               getenv("STCP_BUF_MAX") ? getenv("STCP_BUF_MAX") : "unset");
+        if (params.relay.rate > 0)
+        {
+            printf("  %.1f Mbit/s bottleneck, %lu byte queue, STCP_CC %s: "
+                   "%lu packets dropped\n",
+                   params.relay.rate * 8 / 1e6,
+                   (unsigned long) params.relay.queue,
+                   getenv("STCP_CC") ? getenv("STCP_CC") : "unset",
+                   stats.dropped);
+        }
+        if (params.relay.loss > 0)
+        {
+            printf("  %.2f%% loss each way: %lu packets lost\n",
+                   params.relay.loss * 100, stats.lost);
+        }
+        printf("  %lu data bytes sent, %lu retransmitted (%.2f%% of the "
+               "bytes transferred),\n    %lu of them spurious\n",
+               stats.data_bytes, stats.rexmit_bytes,
+               100.0 * stats.rexmit_bytes / (params.num_flows * params.bytes),
+               stats.spurious_bytes);
+    }
+
+    start = flows[0].start;
+    end = flows[0].end;
+    for (k = 0; k < params.num_flows; ++k)
+    {
+        double goodput = params.bytes / (flows[k].end - flows[k].start);
+
+        if (params.num_flows > 1)
+            printf("  flow %d: %.2f MB/s\n", k, goodput / 1e6);
+        sum += goodput;
+        sum_sq += goodput * goodput;
+        start = MIN(start, flows[k].start);
+        end = (flows[k].end > end) ? flows[k].end : end;
+    }
+
+    printf("  %.3f s, %.2f MB/s\n",
+           end - start, params.num_flows * params.bytes / (end - start) / 1e6);
+    if (params.num_flows > 1)
+    {
+        printf("  fairness (Jain): %.3f\n",
+               sum * sum / (params.num_flows * sum_sq));
+    }
+    printf("  cpu: client %.3f s, server %.3f s\n",
+           client_usage.cpu, server_usage.cpu);
+
+    for (k = 0; k < params.num_flows; ++k)
+        myclose(flows[k].sd);
+    bench_wait(pid);
+    return 0;
+}
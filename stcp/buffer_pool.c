@@ -0,0 +1,108 @@
+/* buffer_pool.c--reference-counted data buffers for the mysocket layer.
+ * see buffer_pool.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "mysock_impl.h"
+#include "buffer_pool.h"
+
+/* free buffers a pool holds on to; any more are given back to malloc() */
+#define MAX_FREE_BUFFERS    32
+
+
+void _buffer_pool_init(buffer_pool_t *pool)
+{
+    assert(pool);
+
+    memset(pool, 0, sizeof(*pool));
+    PTHREAD_CALL(pthread_mutex_init(&pool->lock, NULL));
+}
+
+void _buffer_pool_destroy(buffer_pool_t *pool)
+{
+    mysock_buffer_t *buf;
+
+    assert(pool);
+    assert(pool->num_outstanding == 0);
+
+    while ((buf = pool->free_list) != NULL)
+    {
+        pool->free_list = buf->next_free;
+        free(buf);
+    }
+    pool->num_free = 0;
+
+    PTHREAD_CALL(pthread_mutex_destroy(&pool->lock));
+}
+
+mysock_buffer_t *_buffer_alloc(buffer_pool_t *pool, size_t size)
+{
+    mysock_buffer_t *buf = NULL;
+
+    assert(pool);
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool->lock));
+    if (size <= BUFFER_POOL_SIZE && (buf = pool->free_list) != NULL)
+    {
+        pool->free_list = buf->next_free;
+        --pool->num_free;
+    }
+    ++pool->num_outstanding;
+    PTHREAD_CALL(pthread_mutex_unlock(&pool->lock));
+
+    if (!buf)
+    {
+        /* packet-sized requests all get a buffer that can go back on the
+         * free list; anything bigger gets exactly what it asked for.
+         */
+        if (size < BUFFER_POOL_SIZE)
+            size = BUFFER_POOL_SIZE;
+
+        buf = (mysock_buffer_t *)
+            malloc(offsetof(mysock_buffer_t, data) + size);
+        assert(buf);
+
+        buf->pool = pool;
+        buf->size = size;
+    }
+
+    assert(buf->pool == pool && buf->size >= size);
+    buf->refcount  = 1;
+    buf->next_free = NULL;
+    return buf;
+}
+
+void _buffer_ref(mysock_buffer_t *buf)
+{
+    assert(buf && buf->refcount > 0);
+    (void) __atomic_add_fetch(&buf->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void _buffer_release(mysock_buffer_t *buf)
+{
+    buffer_pool_t *pool;
+
+    assert(buf && buf->refcount > 0);
+    if (__atomic_sub_fetch(&buf->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    pool = buf->pool;
+    assert(pool);
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool->lock));
+    assert(pool->num_outstanding > 0);
+    --pool->num_outstanding;
+    if (buf->size == BUFFER_POOL_SIZE && pool->num_free < MAX_FREE_BUFFERS)
+    {
+        buf->next_free  = pool->free_list;
+        pool->free_list = buf;
+        ++pool->num_free;
+        buf = NULL;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&pool->lock));
+
+    free(buf);
+}
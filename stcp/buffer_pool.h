@@ -0,0 +1,68 @@
+/* buffer_pool.h--reference-counted data buffers for the mysocket layer's
+ * queues.  this is an internal header, used only by the mysocket layer.
+ *
+ * a buffer holds a packet (or a chunk of application data) just once,
+ * however many queue entries refer to it.  e.g. a packet read from the
+ * network is queued for the transport layer, which reads it in place
+ * (stcp_network_recv_packet()), and any of its payload passed up with
+ * stcp_app_send() is queued for myread() by reference rather than copied.
+ * the buffer goes back to its pool once the last reference is dropped.
+ *
+ * each mysocket has a pool of its own, which keeps a few free packet-sized
+ * buffers around so a busy connection needn't malloc() for every packet.
+ * larger buffers are allocated and freed as they're needed.
+ */
+
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <stddef.h>
+#include <pthread.h>
+#include "network_io.h"
+
+/* size of the buffers kept in a pool; big enough for any packet */
+#define BUFFER_POOL_SIZE    MAX_IP_PAYLOAD_LEN
+
+
+typedef struct mysock_buffer
+{
+    struct buffer_pool   *pool;         /* returned here when released */
+    int                   refcount;
+    size_t                size;         /* bytes available in data[] */
+    struct mysock_buffer *next_free;    /* on the pool's free list */
+    char                  data[1];
+} mysock_buffer_t;
+
+typedef struct buffer_pool
+{
+    pthread_mutex_t  lock;
+    mysock_buffer_t *free_list;
+    unsigned int     num_free;
+    unsigned int     num_outstanding;   /* allocated and not yet released */
+} buffer_pool_t;
+
+
+void _buffer_pool_init(buffer_pool_t *pool);
+
+/* free the pool's buffers.  every buffer allocated from it must have been
+ * released by now.
+ */
+void _buffer_pool_destroy(buffer_pool_t *pool);
+
+/* allocate a buffer with room for at least size bytes, holding a single
+ * reference (the caller's).
+ */
+mysock_buffer_t *_buffer_alloc(buffer_pool_t *pool, size_t size);
+
+/* take another reference to the buffer, e.g. for a queue entry */
+void _buffer_ref(mysock_buffer_t *buf);
+
+/* drop a reference.  any thread may drop the last one. */
+void _buffer_release(mysock_buffer_t *buf);
+
+/* TRUE if the len bytes at ptr lie within the buffer */
+#define BUFFER_CONTAINS(buf, ptr, len) \
+    ((const char *) (ptr) >= (buf)->data && \
+     (const char *) (ptr) + (len) <= (buf)->data + (buf)->size)
+
+#endif  /* __BUFFER_POOL_H__ */
@@ -36,7 +36,7 @@
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
-static char usage[] = "usage: client [-U] [-q] [-f <filename>] server:port\n";
+static char usage[] = "usage: client [-U] [-N] [-q] [-f <filename>] server:port\n";
 static char *filename;
 static int quiet_opt = 0;
 
@@ -53,6 +53,7 @@ main(int argc, char *argv[])
     char opt;
     char *pline;
     char reliable = 1;
+    char nodelay = 0;
     int errflg = 0;
     int sd;
 
@@ -60,7 +61,7 @@ main(int argc, char *argv[])
 
     filename = NULL;
     /* Parse command line options */
-    while ((opt = getopt(argc, argv, "f:qU")) != EOF)
+    while ((opt = getopt(argc, argv, "f:qUN")) != EOF)
     {
         switch (opt)
         {
@@ -75,6 +76,10 @@ main(int argc, char *argv[])
             reliable = 0;
             break;
 
+        case 'N':
+            nodelay = 1;
+            break;
+
         case '?':
             ++errflg;
             break;
@@ -107,6 +112,12 @@ main(int argc, char *argv[])
         exit(1);
     }
 
+    if (nodelay && mysetsockopt(sd, MYSOCK_NODELAY, 1) < 0)
+    {
+        perror("mysetsockopt");
+        exit(1);
+    }
+
     sd = myconnect(sd, (struct sockaddr *) &sin, sizeof(struct sockaddr_in));
     if (sd < 0)
     {
@@ -0,0 +1,266 @@
+/*
+ * congestion.c
+ *
+ * Congestion control algorithms for the STCP layer: NewReno (RFC 5681)
+ * and CUBIC (RFC 8312).  See congestion.h for the interface.
+ *
+ */
+
+#include <string.h>
+#include <sys/time.h>
+#include <math.h>
+#include "congestion.h"
+#include "transport.h"
+
+/************** CONSTANTS ********************************/
+#define INIT_CWND_SEGS 10		/* RFC 6928 initial window */
+#define INIT_CWND_BYTES 14600
+#define MIN_SSTHRESH_SEGS 2
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7			/* multiplicative decrease factor */
+#define ABC_LIMIT 2				/* slow start growth cap per ACK in segments, RFC 3465 */
+
+/* ***************************************************
+ * Function: cc_init
+ * ***************************************************
+ * Initial window is min(10*MSS, max(2*MSS, 14600)) as in RFC 6928,
+ * and ssthresh starts out arbitrarily high so we slow start until
+ * the first loss.
+ */
+void cc_init(const struct cc_ops *ops, struct cc_state *cc,
+			 uint32_t mss, uint32_t cwnd_clamp)
+{
+	memset(cc, 0, sizeof(*cc));
+	cc->mss = mss;
+	cc->cwnd_clamp = cwnd_clamp;
+	cc->cwnd = MIN(INIT_CWND_SEGS*mss, MAX(2*mss, INIT_CWND_BYTES));
+	cc->cwnd = MIN(cc->cwnd, cwnd_clamp);
+	cc->ssthresh = cwnd_clamp;
+	ops->init(cc);
+}
+
+/* ***************************************************
+ * Function: slow_start
+ * ***************************************************
+ * Shared by both algorithms: grow cwnd by the bytes acked, but by
+ * no more than ABC_LIMIT segments per ACK (RFC 3465; L=2 makes up
+ * for the receiver only acking every other segment). Returns the
+ * acked bytes left over once we pass ssthresh.
+ */
+static uint32_t slow_start(struct cc_state *cc, uint32_t acked)
+{
+	uint32_t grow = MIN(MIN(acked, ABC_LIMIT*cc->mss), cc->ssthresh - cc->cwnd);
+	cc->cwnd += grow;
+	return (grow < MIN(acked, ABC_LIMIT*cc->mss)) ? acked - grow : 0;
+}
+
+/* ***************************************************
+ * Function: reduce_ssthresh
+ * ***************************************************
+ * ssthresh after a loss: factor times what was in flight,
+ * but never below two segments.
+ */
+static void reduce_ssthresh(struct cc_state *cc, uint32_t in_flight, double factor)
+{
+	cc->ssthresh = MAX((uint32_t)(in_flight*factor), MIN_SSTHRESH_SEGS*cc->mss);
+}
+
+/* ***************************************************
+ * Function: newreno_init
+ * ***************************************************
+ */
+static void newreno_init(struct cc_state *cc)
+{
+	cc->bytes_acked = 0;
+}
+
+/* ***************************************************
+ * Function: newreno_on_ack
+ * ***************************************************
+ * Slow start below ssthresh, then one MSS per window's worth of
+ * acked bytes (appropriate byte counting, RFC 3465).
+ */
+static void newreno_on_ack(struct cc_state *cc, uint32_t acked, double rtt_ms)
+{
+	if (cc->cwnd < cc->ssthresh) {
+		acked = slow_start(cc, acked);
+	}
+	cc->bytes_acked += acked;
+	if (cc->bytes_acked >= cc->cwnd) {
+		cc->bytes_acked -= cc->cwnd;
+		cc->cwnd += cc->mss;
+	}
+	cc->cwnd = MIN(cc->cwnd, cc->cwnd_clamp);
+}
+
+/* ***************************************************
+ * Function: newreno_on_loss
+ * ***************************************************
+ * Halve the window (fast recovery is left to the caller).
+ */
+static void newreno_on_loss(struct cc_state *cc, uint32_t in_flight)
+{
+	reduce_ssthresh(cc, in_flight, 0.5);
+	cc->cwnd = cc->ssthresh;
+	cc->bytes_acked = 0;
+}
+
+/* ***************************************************
+ * Function: newreno_on_timeout
+ * ***************************************************
+ * Back to one segment and slow start.
+ */
+static void newreno_on_timeout(struct cc_state *cc, uint32_t in_flight)
+{
+	reduce_ssthresh(cc, in_flight, 0.5);
+	cc->cwnd = cc->mss;
+	cc->bytes_acked = 0;
+}
+
+const struct cc_ops cc_newreno = {
+	"newreno",
+	newreno_init,
+	newreno_on_ack,
+	newreno_on_loss,
+	newreno_on_timeout
+};
+
+/* ***************************************************
+ * Function: now_secs
+ * ***************************************************
+ */
+static double now_secs(void)
+{
+	struct timeval curr_time;
+	gettimeofday(&curr_time, NULL);
+	return curr_time.tv_sec + curr_time.tv_usec/1000000.0;
+}
+
+/* ***************************************************
+ * Function: cubic_init
+ * ***************************************************
+ */
+static void cubic_init(struct cc_state *cc)
+{
+	cc->w_max = 0;
+	cc->k = 0;
+	cc->origin = 0;
+	cc->epoch_start = 0;
+	cc->w_est = 0;
+	cc->bytes_acked = 0;
+}
+
+/* ***************************************************
+ * Function: cubic_on_ack
+ * ***************************************************
+ * In congestion avoidance the window follows
+ *     W(t) = C*(t - K)^3 + origin
+ * where t is the time since the last reduction, aiming for where
+ * the curve will be one RTT from now.  To be no worse than Reno on
+ * short RTTs, we also track what Reno would have (w_est) and grow
+ * towards whichever is larger.  Growth is spread over the ACKs: one
+ * MSS for every cnt segments acked.
+ */
+static void cubic_on_ack(struct cc_state *cc, uint32_t acked, double rtt_ms)
+{
+	if (cc->cwnd < cc->ssthresh) {
+		acked = slow_start(cc, acked);
+		if (acked == 0) {
+			return;
+		}
+	}
+	double cwnd_segs = (double)cc->cwnd / cc->mss;
+	double now = now_secs();
+	if (cc->epoch_start == 0) {
+		cc->epoch_start = now;
+		if (cwnd_segs < cc->w_max) {
+			cc->k = cbrt((cc->w_max - cwnd_segs) / CUBIC_C);
+			cc->origin = cc->w_max;
+		}
+		else {
+			cc->k = 0;
+			cc->origin = cwnd_segs;
+		}
+		cc->w_est = cwnd_segs;
+	}
+	double t = now - cc->epoch_start + rtt_ms/1000.0;
+	double target = cc->origin + CUBIC_C*(t - cc->k)*(t - cc->k)*(t - cc->k);
+	double cnt = (target > cwnd_segs) ? cwnd_segs / (target - cwnd_segs) : 100*cwnd_segs;
+
+	/* Reno friendly region */
+	cc->w_est += (3*(1 - CUBIC_BETA)/(1 + CUBIC_BETA)) * ((double)acked/cc->mss) / cwnd_segs;
+	if (cc->w_est > cwnd_segs) {
+		cnt = MIN(cnt, cwnd_segs / (cc->w_est - cwnd_segs));
+	}
+
+	cc->bytes_acked += acked;
+	if (cc->bytes_acked >= cnt*cc->mss) {
+		cc->bytes_acked = 0;
+		cc->cwnd += cc->mss;
+	}
+	cc->cwnd = MIN(cc->cwnd, cc->cwnd_clamp);
+}
+
+/* ***************************************************
+ * Function: cubic_reduce
+ * ***************************************************
+ * Remember where we were (a bit less if we hadn't even got back
+ * to the last maximum: fast convergence), and start a new epoch.
+ */
+static void cubic_reduce(struct cc_state *cc, uint32_t in_flight)
+{
+	double cwnd_segs = (double)cc->cwnd / cc->mss;
+	if (cwnd_segs < cc->w_max) {
+		cc->w_max = cwnd_segs * (1 + CUBIC_BETA) / 2;
+	}
+	else {
+		cc->w_max = cwnd_segs;
+	}
+	cc->epoch_start = 0;
+	cc->bytes_acked = 0;
+	reduce_ssthresh(cc, in_flight, CUBIC_BETA);
+}
+
+/* ***************************************************
+ * Function: cubic_on_loss
+ * ***************************************************
+ */
+static void cubic_on_loss(struct cc_state *cc, uint32_t in_flight)
+{
+	cubic_reduce(cc, in_flight);
+	cc->cwnd = cc->ssthresh;
+}
+
+/* ***************************************************
+ * Function: cubic_on_timeout
+ * ***************************************************
+ */
+static void cubic_on_timeout(struct cc_state *cc, uint32_t in_flight)
+{
+	cubic_reduce(cc, in_flight);
+	cc->cwnd = cc->mss;
+}
+
+const struct cc_ops cc_cubic = {
+	"cubic",
+	cubic_init,
+	cubic_on_ack,
+	cubic_on_loss,
+	cubic_on_timeout
+};
+
+/* ***************************************************
+ * Function: cc_find
+ * ***************************************************
+ */
+const struct cc_ops *cc_find(const char *name)
+{
+	static const struct cc_ops *algorithms[] = { &cc_newreno, &cc_cubic };
+	unsigned int i;
+	for (i = 0; name && i < sizeof(algorithms)/sizeof(algorithms[0]); i++) {
+		if (!strcmp(name, algorithms[i]->name)) {
+			return algorithms[i];
+		}
+	}
+	return &cc_newreno;
+}
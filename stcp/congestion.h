@@ -0,0 +1,56 @@
+/*
+ * congestion.h
+ *
+ * Congestion control for the STCP layer.  transport.c keeps a
+ * struct cc_state in each connection's context and calls into one of
+ * the algorithms below through its cc_ops table whenever new data is
+ * acknowledged or a loss is detected.  The algorithm only adjusts
+ * cwnd/ssthresh; deciding what to (re)send stays in transport.c.
+ *
+ */
+
+#ifndef __CONGESTION_H__
+#define __CONGESTION_H__
+
+#include "mysock.h"
+
+struct cc_state
+{
+	uint32_t cwnd;			/* congestion window in bytes */
+	uint32_t ssthresh;		/* slow start threshold in bytes */
+	uint32_t mss;
+	uint32_t cwnd_clamp;	/* cwnd never grows past this (size of the send ring) */
+	uint32_t bytes_acked;	/* acked bytes not yet turned into cwnd growth */
+
+	/* CUBIC only */
+	double w_max;			/* cwnd in segments before the last reduction */
+	double k;				/* seconds it takes to grow back to w_max */
+	double origin;			/* segments, plateau of the cubic function */
+	double epoch_start;		/* seconds, 0 until the first ack after a loss */
+	double w_est;			/* segments, what Reno would have by now */
+};
+
+struct cc_ops
+{
+	const char *name;
+	void (*init)(struct cc_state *cc);
+	/* acked bytes of new data were cumulatively acknowledged */
+	void (*on_ack)(struct cc_state *cc, uint32_t acked, double rtt_ms);
+	/* a loss was detected without a timeout (fast retransmit) */
+	void (*on_loss)(struct cc_state *cc, uint32_t in_flight);
+	/* the retransmission timer expired */
+	void (*on_timeout)(struct cc_state *cc, uint32_t in_flight);
+};
+
+extern const struct cc_ops cc_newreno;
+extern const struct cc_ops cc_cubic;
+
+/* Look up an algorithm by name.  NULL or an unknown name gets the
+ * default, NewReno. */
+const struct cc_ops *cc_find(const char *name);
+
+/* Fill in the parts of cc common to all algorithms and call ops->init */
+void cc_init(const struct cc_ops *ops, struct cc_state *cc,
+			 uint32_t mss, uint32_t cwnd_clamp);
+
+#endif  /* __CONGESTION_H__ */
@@ -6,16 +6,25 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef LINUX
+#include <sys/random.h>
+#endif
 #include "mysock_impl.h"
 #include "mysock_hash.h"
 #include "network_io.h"
+#include "tcp_sum.h"
 #include "transport.h"
 #include "connection_demux.h"
+#include "myepoll.h"
 
 
 
 /* state maintained per single pending connection */
-typedef struct
+typedef struct connect_request
 {
     /* the connecting peer's address */
     struct sockaddr peer_addr;
@@ -26,95 +35,199 @@ typedef struct
 
     /* network layer data associated with connection request */
     void *user_data;
+
+    struct connect_request *completed_next; /* completed, not yet accepted */
 } connect_request_t;
 
-/* queue entry for a completed connection */
-typedef struct completed_connect
+/* pending requests are looked up by the peer's address and port.  the
+ * hash is keyed with a random secret picked when the listen queue's
+ * created, and mixed over the whole key, so a flood of SYNs can't be aimed
+ * at one part of the table.
+ */
+typedef struct
+{
+    uint32_t addr;      /* network byte order */
+    uint16_t port;
+} peer_key_t;
+
+/* murmur3's 64-bit finaliser:  every bit of x affects every bit of the
+ * result, so a secret xored in anywhere keys all of it.
+ */
+static inline uint64_t _mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+struct peer_key_hash
 {
-    connect_request_t        *request;
-    struct completed_connect *next;
-} completed_connect_t;
+    explicit peer_key_hash(uint64_t secret = 0) : secret(secret) { }
 
-/* connection backlog maintained per listening socket */
+    size_t operator()(const peer_key_t &key) const
+    {
+        return _mix64((((uint64_t) key.addr << 16) | key.port) ^ secret);
+    }
+
+    uint64_t secret;
+};
+
+struct peer_key_equal
+{
+    bool operator()(const peer_key_t &a, const peer_key_t &b) const
+    {
+        return a.addr == b.addr && a.port == b.port;
+    }
+};
+
+typedef mysock_hash_map<peer_key_t, connect_request_t *,
+                        peer_key_hash, peer_key_equal> pending_table_t;
+
+/* SYN cookies.  once a listening socket's backlog is full, a SYN is
+ * answered with a SYN-ACK all the same, but without any state being kept:
+ * its sequence number is a keyed hash of the peer, the peer's sequence
+ * number and the time (the cookie), so the peer's ACK of it can be
+ * recognised when it comes back, and the connection set up then if
+ * there's room.  the cookie's good for between one and two periods of
+ * SYN_COOKIE_PERIOD seconds.  it's kept to 24 bits, as STCP doesn't expect
+ * sequence numbers to wrap around (its own start below 256); an ACK can
+ * guess it with a chance of one in 2^24.
+ */
+#define SYN_COOKIE_PERIOD 64
+#define SYN_COOKIE_MASK   0x00ffffff
+
+/* a SYN cookie that a connection's been set up from, by peer.  until the
+ * peer hears from the new connection, it goes on sending to the listening
+ * socket, and a copy of the ACK the cookie came back in mustn't set up
+ * another one once the first has been accepted.
+ */
 typedef struct
+{
+    uint32_t cookie;
+    uint64_t period;    /* when it was sent */
+} used_cookie_t;
+
+typedef mysock_hash_map<peer_key_t, used_cookie_t,
+                        peer_key_hash, peer_key_equal> used_cookie_table_t;
+
+/* connection backlog maintained per listening socket.  it hangs off the
+ * listening mysocket itself, so connection requests for one port never
+ * take a lock another port's requests (or accepts) need.
+ */
+typedef struct listen_queue
 {
     unsigned int         local_port;    /* host byte order */
     unsigned int         max_len;       /* # of allowed pending requests */
     unsigned int         cur_len;       /* curent # of pending requests */
+    bool_t               closing;       /* listening mysocket being closed */
+    uint64_t             cookie_secret; /* SYN cookies' key */
+    used_cookie_table_t *used_cookies;
 
-    /* connection_queue contains up to max_len pending connections that
-     * have not been accepted by the application yet.  completed entries in
-     * the queue are pointed to by completed_queue.
+    /* pending contains the (up to max_len) connection requests that have
+     * not been accepted by the application yet, by peer.  those that have
+     * completed are also on completed_queue, in order.
      */
-    connect_request_t   *connection_queue;
-    completed_connect_t *completed_queue;
+    pending_table_t     *pending;
+    connect_request_t   *completed_queue;
+    connect_request_t   *completed_tail;
+
     pthread_cond_t       connection_cond;
     pthread_mutex_t      connection_lock;
 } listen_queue_t;
 
-#define INVALIDATE_CONNECT_REQUEST(r) \
-    { \
-        memset(r, 0, sizeof(connect_request_t)); \
-        (r)->sd = -1; \
-    }
-
-/* maintains queue of pending connections per listening socket.
- * there is one entry in listen_table per passive (listening) socket.
- */
-HASH_TABLE_DECLARE(listen_table, mysocket_t, listen_queue_t *,
-                   MAX_NUM_CONNECTIONS);
-static pthread_rwlock_t listen_lock; /* XXX: see notes in network_io_vns.c */
+/* the requests taken out of a listen queue being closed */
+typedef struct
+{
+    connect_request_t **requests;
+    size_t              num_requests;
+} request_list_t;
 
-static listen_queue_t *_get_connection_queue(mysock_context_t *ctx);
+/* the used SYN cookies that have expired by the given period */
+typedef struct
+{
+    peer_key_t *keys;
+    size_t      num_keys;
+    uint64_t    period;
+} key_list_t;
+
+static peer_key_t _peer_key(const struct sockaddr *peer_addr);
+static uint64_t _random_secret(void);
+static uint32_t _syn_cookie(const listen_queue_t *q, const peer_key_t &key,
+                            uint32_t peer_seq, uint64_t period);
+static uint64_t _syn_cookie_period(void);
+static void _send_syn_cookie(mysock_context_t *ctx, listen_queue_t *q,
+                             const struct tcphdr *syn,
+                             const struct sockaddr *peer_addr,
+                             int peer_addr_len);
+static bool_t _check_syn_cookie(const listen_queue_t *q,
+                                const struct tcphdr *ack,
+                                const struct sockaddr *peer_addr,
+                                used_cookie_t *used);
+static void _use_syn_cookie(listen_queue_t *q,
+                            const struct sockaddr *peer_addr,
+                            const used_cookie_t *used);
+static void _collect_expired_cookie(const peer_key_t &key,
+                                    used_cookie_t &used, void *arg);
+static void _collect_request(const peer_key_t &key,
+                             connect_request_t *&request, void *arg);
 
 
 /* called by myaccept() to grab the first completed connection off the
- * given mysocket's connection queue, or block until one completes.
+ * given mysocket's connection queue, or block until one completes.  if
+ * block is FALSE, this returns FALSE at once if none has completed yet.
  */
-void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
-                                mysock_context_t **new_ctx)
+bool_t _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
+                                  mysock_context_t **new_ctx,
+                                  bool_t             block)
 {
     listen_queue_t *q;
-    completed_connect_t *r;
+    connect_request_t *r;
 
     assert(accept_ctx && new_ctx);
     assert(accept_ctx->listening && accept_ctx->bound);
 
     DEBUG_LOG(("waiting for new connection...\n"));
-    PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
-    q = _get_connection_queue(accept_ctx);
+    q = accept_ctx->listen_queue;
     assert(q);
 
     PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
     while (!q->completed_queue)
     {
+        if (!block)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+            return FALSE;
+        }
+
         PTHREAD_CALL(pthread_cond_wait(&q->connection_cond,
                                        &q->connection_lock));
     }
 
     r = q->completed_queue;
-    q->completed_queue = q->completed_queue->next;
+    if (!(q->completed_queue = r->completed_next))
+        q->completed_tail = NULL;
 
     DEBUG_LOG(("dequeueing established connection from %s:%hu\n",
-               inet_ntoa(((struct sockaddr_in *)
-                          &r->request->peer_addr)->sin_addr),
-               ntohs(((struct sockaddr_in *)
-                      &r->request->peer_addr)->sin_port)));
+               inet_ntoa(((struct sockaddr_in *) &r->peer_addr)->sin_addr),
+               ntohs(((struct sockaddr_in *) &r->peer_addr)->sin_port)));
 
-    assert(r->request);
-    *new_ctx = _mysock_get_context(r->request->sd);
+    *new_ctx = _mysock_get_context(r->sd);
     assert(*new_ctx);
 
     /* free up this entry from the listen queue */
-    INVALIDATE_CONNECT_REQUEST(r->request);
-    memset(r, 0, sizeof(*r));
+    if (!q->pending->erase(_peer_key(&r->peer_addr)))
+        assert(0);
     free(r);
 
     assert(q->cur_len > 0);
     --q->cur_len;
+    __atomic_sub_fetch(&accept_ctx->connections_ready, 1, __ATOMIC_RELAXED);
 
     PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
-    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+    return TRUE;
 }
 
 static void _debug_print_connection(const char *msg, const char *reason,
@@ -148,7 +261,11 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 {
     listen_queue_t *q;
     connect_request_t *queue_entry = NULL;
-    unsigned int k;
+    mysock_context_t *new_ctx;
+    const struct tcphdr *hdr = (const struct tcphdr *) packet;
+    struct tcphdr cookie_syn;
+    used_cookie_t cookie;
+    bool_t is_syn;
 
     assert(ctx && ctx->listening && ctx->bound);
     assert(packet && peer_addr);
@@ -157,101 +274,139 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 #define DEBUG_CONNECTION_MSG(msg, reason) \
     _debug_print_connection(msg, reason, ctx, peer_addr)
 
-    PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
+    /* a SYN, or possibly the ACK of a SYN-ACK we sent with a SYN cookie */
     if (packet_len < sizeof(struct tcphdr) ||
-        !(((struct tcphdr *) packet)->th_flags & TH_SYN))
+        !(hdr->th_flags & (TH_SYN | TH_ACK)))
     {
         DEBUG_CONNECTION_MSG("received non-SYN packet", "(ignoring)");
-        goto done;  /* not a connection setup request */
+        return FALSE;   /* not a connection setup request */
     }
+    is_syn = (hdr->th_flags & TH_SYN) != 0;
 
-    if (!(q = _get_connection_queue(ctx)))
+    if (!(q = ctx->listen_queue))
     {
         DEBUG_CONNECTION_MSG("dropping SYN packet", "(socket not listening)");
-        goto done;  /* the socket was closed or not listening */
+        return FALSE;   /* the socket was closed or not listening */
     }
 
-    /* see if this is a retransmission of an existing request */
-    for (k = 0; k < q->max_len; ++k)
+    PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
+
+    /* see if this is a retransmission of an existing request (or, for an
+     * ACK, something the peer sent before hearing from the connection)
+     */
+    if (q->pending->find(_peer_key(peer_addr)))
     {
-        connect_request_t *r = &q->connection_queue[k];
+        DEBUG_CONNECTION_MSG("dropping packet",
+                             "(retransmission of queued request)");
+        goto done;  /* retransmission */
+    }
 
-        assert(r->sd == -1 ||
-               peer_addr_len == r->peer_addr_len);  /* both are sockaddr_in */
-        if (!memcmp(&r->peer_addr, peer_addr, peer_addr_len))
-        {
-            DEBUG_CONNECTION_MSG("dropping SYN packet",
-                                 "(retransmission of queued request)");
-            goto done;  /* retransmission */
-        }
+    if (!is_syn && !_check_syn_cookie(q, hdr, peer_addr, &cookie))
+    {
+        DEBUG_CONNECTION_MSG("received non-SYN packet", "(ignoring)");
+        goto done;
     }
 
-    /* if it's not a retransmission, find an empty slot in the incomplete
-     * connection table
+    /* if it's not a retransmission, it takes one of the backlog's slots.
+     * once they're all taken, further SYNs are answered with a SYN cookie,
+     * without any state being kept for them; an ACK of one that finds the
+     * backlog still full is dropped, and the peer will try again.
      */
-    if (q->cur_len < q->max_len)
+    if (q->cur_len >= q->max_len)
     {
-        for (k = 0; k < q->max_len && !queue_entry; ++k)
-        {
-            if (q->connection_queue[k].sd < 0)
-                queue_entry = &q->connection_queue[k];
-        }
-
-        assert(queue_entry);
-        ++q->cur_len;
+        /* the packet is dropped (maximum backlog reached) */
+        DEBUG_CONNECTION_MSG("dropping packet", "(queue full)");
+        if (is_syn)
+            _send_syn_cookie(ctx, q, hdr, peer_addr, peer_addr_len);
+        goto done;
     }
 
-    if (queue_entry)
+    queue_entry = (connect_request_t *) calloc(1, sizeof(connect_request_t));
+    assert(queue_entry);
+
+    /* establish the connection */
+    if ((queue_entry->sd =
+         _mysock_new_mysocket(ctx->network_state.is_reliable)) < 0)
     {
-        mysock_context_t *new_ctx;
+        DEBUG_CONNECTION_MSG("dropping SYN packet",
+                             "(couldn't allocate new mysocket)");
+        free(queue_entry);
+        queue_entry = NULL;
+        goto done;
+    }
 
-        /* establish the connection */
-        assert(queue_entry->sd == -1);
-        if ((queue_entry->sd =
-             _mysock_new_mysocket(ctx->network_state.is_reliable)) < 0)
-        {
-            DEBUG_CONNECTION_MSG("dropping SYN packet",
-                                 "(couldn't allocate new mysocket)");
-            INVALIDATE_CONNECT_REQUEST(queue_entry);
-            --q->cur_len;
-            queue_entry = NULL;
-            goto done;
-        }
+    new_ctx = _mysock_get_context(queue_entry->sd);
+    new_ctx->listen_sd        = ctx->my_sd;
+    new_ctx->nodelay          = ctx->nodelay;
+    new_ctx->nonblocking      = ctx->nonblocking;
+    new_ctx->send_buffer_size = ctx->send_buffer_size;
 
-        new_ctx = _mysock_get_context(queue_entry->sd);
-        new_ctx->listen_sd = ctx->my_sd;
+    new_ctx->network_state.peer_addr       = *peer_addr;
+    new_ctx->network_state.peer_addr_len   = peer_addr_len;
+    new_ctx->network_state.peer_addr_valid = TRUE;
 
-        new_ctx->network_state.peer_addr       = *peer_addr;
-        new_ctx->network_state.peer_addr_len   = peer_addr_len;
-        new_ctx->network_state.peer_addr_valid = TRUE;
+    queue_entry->peer_addr     = *peer_addr;
+    queue_entry->peer_addr_len = peer_addr_len;
+    queue_entry->user_data     = (void *) user_data;
 
-        queue_entry->peer_addr     = *peer_addr;
-        queue_entry->peer_addr_len = peer_addr_len;
-        queue_entry->user_data     = (void *) user_data;
+    if (!q->pending->insert(_peer_key(peer_addr), queue_entry))
+        assert(0);
+    ++q->cur_len;
 
-        DEBUG_CONNECTION_MSG("establishing connection", "");
+    DEBUG_CONNECTION_MSG("establishing connection",
+                         is_syn ? "" : "(from SYN cookie)");
 
-        /* update any additional network layer state based on the initial
-         * packet, e.g. remapped sequence numbers, etc.
+    if (!is_syn)
+    {
+        /* STCP is passed the peer's SYN, as the ACK tells us it was, and
+         * the ACK after it.
          */
-        _network_update_passive_state(&new_ctx->network_state,
-                                      &ctx->network_state,
-                                      user_data, packet, packet_len);
-
-        _mysock_transport_init(queue_entry->sd, FALSE);
-
-        /* pass the SYN packet on to the main STCP code */
-        _mysock_enqueue_buffer(new_ctx, &new_ctx->network_recv_queue,
-                               packet, packet_len);
+        memset(&cookie_syn, 0, sizeof(cookie_syn));
+        cookie_syn.th_sport = hdr->th_sport;
+        cookie_syn.th_dport = hdr->th_dport;
+        cookie_syn.th_seq   = htonl(ntohl(hdr->th_seq) - 1);
+        cookie_syn.th_off   = sizeof(cookie_syn) / sizeof(uint32_t);
+        cookie_syn.th_flags = TH_SYN;
+        cookie_syn.th_win   = hdr->th_win;
+        cookie_syn.th_sum   = _mysock_tcp_checksum(
+            ((const struct sockaddr_in *) peer_addr)->sin_addr.s_addr,
+            _network_get_local_addr(&new_ctx->network_state),
+            &cookie_syn, sizeof(cookie_syn));
+
+        new_ctx->syn_cookie     = TRUE;
+        new_ctx->syn_cookie_isn = cookie.cookie;
+        _use_syn_cookie(q, peer_addr, &cookie);
     }
-    else
+
+    /* update any additional network layer state based on the initial
+     * packet, e.g. remapped sequence numbers, etc.
+     */
+    _network_update_passive_state(&new_ctx->network_state,
+                                  &ctx->network_state, user_data,
+                                  is_syn ? packet : &cookie_syn,
+                                  is_syn ? packet_len : sizeof(cookie_syn));
+
+    /* pass the SYN packet on to the main STCP code.  this is queued
+     * before the connection's threads start, so that the queue only
+     * ever has one producer at a time.
+     */
+    if (!is_syn)
     {
-        /* the packet is dropped (maximum backlog reached) */
-        DEBUG_CONNECTION_MSG("dropping SYN packet", "(queue full)");
+        _mysock_enqueue_buffer(new_ctx, &new_ctx->network_recv_queue,
+                               &cookie_syn, sizeof(cookie_syn));
     }
+    _mysock_enqueue_buffer(new_ctx, &new_ctx->network_recv_queue,
+                           packet, packet_len);
 
 done:
-    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+
+    /* the connection completes (_mysock_passive_connection_complete())
+     * from the connection's own thread, which takes the queue's lock too.
+     */
+    if (queue_entry)
+        _mysock_transport_init(queue_entry->sd, FALSE);
+
     return (queue_entry != NULL);
 
 #undef DEBUG_CONNECTION_MSG
@@ -259,48 +414,48 @@ done:
 
 void _mysock_passive_connection_complete(mysock_context_t *ctx)
 {
+    mysock_context_t *listen_ctx;
+    connect_request_t **connection_req;
     listen_queue_t *q;
 
     assert(ctx);
 
-    PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
+    /* the listening mysocket isn't freed until every connection still in
+     * its queue (this one included) has been closed, so it's safe to use.
+     */
     assert(ctx->listen_sd >= 0);
-    if ((q = _get_connection_queue(_mysock_get_context(ctx->listen_sd))))
-    {
-        completed_connect_t *tail, *new_entry;
-        connect_request_t *connection_req = NULL;
-        unsigned int k;
-
-        /* find this connection in the incomplete connection queue */
-        for (k = 0; k < q->max_len && !connection_req; ++k)
-        {
-            if (q->connection_queue[k].sd == ctx->my_sd)
-                connection_req = &q->connection_queue[k];
-        }
-
-        assert(connection_req);
+    listen_ctx = _mysock_get_context(ctx->listen_sd);
+    assert(listen_ctx);
+    q = listen_ctx->listen_queue;
+    assert(q);
 
-        new_entry = (completed_connect_t *)malloc(sizeof(completed_connect_t));
-        assert(new_entry);
+    PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
+    if (q->closing)
+    {
+        /* myclose() on the listening socket is about to close this one */
+        PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+        return;
+    }
 
-        new_entry->request = connection_req;
-        new_entry->next = NULL;
+    /* find this connection among the pending requests */
+    connection_req = q->pending->find(
+        _peer_key(&ctx->network_state.peer_addr));
+    assert(connection_req && (*connection_req)->sd == ctx->my_sd);
 
-        PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
+    /* add established connection to tail of completed connection queue */
+    (*connection_req)->completed_next = NULL;
+    if (q->completed_tail)
+        q->completed_tail->completed_next = *connection_req;
+    else
+        q->completed_queue = *connection_req;
+    q->completed_tail = *connection_req;
 
-        /* add established connection to tail of completed connection queue */
-        for (tail = q->completed_queue; tail && tail->next; tail = tail->next)
-            ;
+    __atomic_add_fetch(&listen_ctx->connections_ready, 1, __ATOMIC_RELEASE);
 
-        if (tail)
-            tail->next = new_entry;
-        else
-            q->completed_queue = new_entry;
+    PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+    PTHREAD_CALL(pthread_cond_signal(&q->connection_cond));
 
-        PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
-        PTHREAD_CALL(pthread_cond_signal(&q->connection_cond));
-    }
-    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+    _myepoll_notify(listen_ctx);
 }
 
 /* called by mylisten() to specify the number of pending connection
@@ -309,7 +464,7 @@ void _mysock_passive_connection_complete(mysock_context_t *ctx)
  */
 void _mysock_set_backlog(mysock_context_t *ctx, unsigned int backlog)
 {
-    unsigned int k, max_len = backlog + 1;
+    unsigned int max_len = backlog + 1;
     uint16_t local_port;
     listen_queue_t *q;
 
@@ -318,10 +473,11 @@ void _mysock_set_backlog(mysock_context_t *ctx, unsigned int backlog)
     local_port = ntohs(_network_get_port(&ctx->network_state));
     assert(local_port > 0);
 
-    PTHREAD_CALL(pthread_rwlock_wrlock(&listen_lock));
-    if ((q = _get_connection_queue(ctx)) == NULL)
+    if ((q = ctx->listen_queue) == NULL)
     {
-        /* first backlog specified for new listening socket */
+        /* first backlog specified for new listening socket.  nothing else
+         * looks at the queue until the socket's started listening.
+         */
         DEBUG_LOG(("allocating connection queue for local port %hu\n",
                    local_port));
 
@@ -329,78 +485,265 @@ void _mysock_set_backlog(mysock_context_t *ctx, unsigned int backlog)
         assert(q);
 
         q->local_port = local_port;
+        q->pending    = new pending_table_t(peer_key_hash(_random_secret()));
+        q->cookie_secret = _random_secret();
+        q->used_cookies  = new used_cookie_table_t(
+            peer_key_hash(_random_secret()));
 
         PTHREAD_CALL(pthread_cond_init(&q->connection_cond, NULL));
         PTHREAD_CALL(pthread_mutex_init(&q->connection_lock, NULL));
-        HASH_INSERT(listen_table, ctx->my_sd, q);
+        ctx->listen_queue = q;
     }
 
-    assert(q);
     assert(q->local_port == local_port);
 
+    PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
     if (max_len > q->max_len)
     {
-        q->connection_queue = (connect_request_t *)
-            realloc(q->connection_queue,
-                    max_len * sizeof(connect_request_t));
-        assert(q->connection_queue);
-
-        memset(q->connection_queue + q->max_len, 0,
-               (max_len - q->max_len) * sizeof(connect_request_t));
+        q->pending->reserve(max_len);
+        q->max_len = max_len;
     }
-
-    for (k = q->max_len; k < max_len; ++k)
-        q->connection_queue[k].sd = -1;
-    q->max_len = max_len;
-
-    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
 }
 
-/* called by myclose() on a passive socket */
+/* called by myclose() on a passive socket, once no more connection
+ * requests can arrive for it.
+ */
 void _mysock_close_passive_socket(mysock_context_t *ctx)
 {
     listen_queue_t *q;
+    request_list_t list;
+    size_t k;
 
     assert(ctx && ctx->listening && ctx->bound);
 
-    PTHREAD_CALL(pthread_rwlock_wrlock(&listen_lock));
-    if ((q = _get_connection_queue(ctx)) != NULL)
+    if ((q = ctx->listen_queue) == NULL)
+        return;
+
+    /* take every queued connection that hasn't been passed up to the user
+     * via myaccept()...
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
+    q->closing = TRUE;
+
+    list.requests = (connect_request_t **)
+        malloc((q->pending->size() + 1) * sizeof(connect_request_t *));
+    assert(list.requests);
+    list.num_requests = 0;
+
+    q->pending->for_each(_collect_request, &list);
+    assert(list.num_requests == q->pending->size());
+    q->pending->clear();
+    PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+
+    /* ...and close them.  this is done without the lock, as any of them
+     * may be on its way to _mysock_passive_connection_complete().
+     */
+    for (k = 0; k < list.num_requests; ++k)
     {
-        /* close any queued connections that haven't been passed up to the
-         * user via myaccept()...
-         */
-        unsigned int k;
-        completed_connect_t *connect_iter;
+        myclose(list.requests[k]->sd);
+        free(list.requests[k]);
+    }
+    free(list.requests);
 
-        for (k = 0; k < q->max_len; ++k)
-        {
-            if (q->connection_queue[k].sd != -1)
-                myclose(q->connection_queue[k].sd);
-        }
-        free(q->connection_queue);
+    PTHREAD_CALL(pthread_cond_destroy(&q->connection_cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&q->connection_lock));
 
-        for (connect_iter = q->completed_queue; connect_iter; )
-        {
-            /* note: socket was closed by the preceding loop */
-            completed_connect_t *next = connect_iter->next;
-            free(connect_iter);
-            connect_iter = next;
-        }
+    delete q->pending;
+    delete q->used_cookies;
+    memset(q, 0, sizeof(*q));
+    free(q);
+    ctx->listen_queue = NULL;
+}
+
+/* the key a pending request from the given peer is kept under */
+static peer_key_t _peer_key(const struct sockaddr *peer_addr)
+{
+    const struct sockaddr_in *peer = (const struct sockaddr_in *) peer_addr;
+    peer_key_t key;
+
+    assert(peer_addr && peer_addr->sa_family == AF_INET);
+    key.addr = peer->sin_addr.s_addr;
+    key.port = peer->sin_port;
+    return key;
+}
+
+/* the SYN cookie for a SYN from the given peer with the sequence number
+ * peer_seq, in the given period (see SYN_COOKIE_PERIOD).
+ */
+static uint32_t _syn_cookie(const listen_queue_t *q, const peer_key_t &key,
+                            uint32_t peer_seq, uint64_t period)
+{
+    uint64_t h;
+
+    assert(q);
+    h = _mix64((((uint64_t) key.addr << 16) | key.port) ^ q->cookie_secret);
+    h = _mix64(h ^ (((uint64_t) peer_seq << 32) | (uint32_t) period));
+    return (uint32_t) (h >> 32) & SYN_COOKIE_MASK;
+}
+
+/* the current SYN cookie period */
+static uint64_t _syn_cookie_period(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec / SYN_COOKIE_PERIOD;
+}
+
+/* answer a SYN that found the backlog full with a SYN-ACK carrying a SYN
+ * cookie, from the listening socket.  nothing is kept.  q is locked.
+ */
+static void _send_syn_cookie(mysock_context_t *ctx, listen_queue_t *q,
+                             const struct tcphdr *syn,
+                             const struct sockaddr *peer_addr,
+                             int peer_addr_len)
+{
+    uint32_t reply[sizeof(struct tcphdr) / sizeof(uint32_t)];
+    struct tcphdr *hdr = (struct tcphdr *) reply;
+    uint32_t peer_ip;
+    size_t len;
+
+    assert(ctx && q && syn && peer_addr);
+    assert(peer_addr->sa_family == AF_INET);
+
+    peer_ip = ((const struct sockaddr_in *) peer_addr)->sin_addr.s_addr;
+    len = transport_syn_cookie_reply(syn,
+                                     _syn_cookie(q, _peer_key(peer_addr),
+                                                 ntohl(syn->th_seq),
+                                                 _syn_cookie_period()),
+                                     reply);
 
-        PTHREAD_CALL(pthread_cond_destroy(&q->connection_cond));
-        PTHREAD_CALL(pthread_mutex_destroy(&q->connection_lock));
+    hdr->th_sport = _network_get_port(&ctx->network_state);
+    hdr->th_dport = ((const struct sockaddr_in *) peer_addr)->sin_port;
+    hdr->th_sum   = _mysock_tcp_checksum(_network_get_interface_ip(peer_ip),
+                                         peer_ip, reply, len);
 
-        HASH_DELETE(listen_table, ctx->my_sd);
-        memset(q, 0, sizeof(*q));
-        free(q);
+    if (_network_send_reply(&ctx->network_state, peer_addr, peer_addr_len,
+                            reply, len) < 0)
+    {
+        DEBUG_LOG(("couldn't send SYN cookie (errno=%d)\n", errno));
     }
-    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
 }
 
-/* assumes calling code has locked the listen table */
-static listen_queue_t *_get_connection_queue(mysock_context_t *ctx)
+/* if the given packet acknowledges a SYN-ACK we sent with a SYN cookie
+ * recently enough, and no connection's been set up from it yet, fill in
+ * *used and return TRUE:  its ACK number is one past the cookie for the
+ * SYN before its sequence number, in this period or the last.  q is
+ * locked.
+ */
+static bool_t _check_syn_cookie(const listen_queue_t *q,
+                                const struct tcphdr *ack,
+                                const struct sockaddr *peer_addr,
+                                used_cookie_t *used)
 {
-    assert(ctx && ctx->listening && ctx->bound);
-    return HASH_LOOKUP_PTR(listen_table, ctx->my_sd);
+    peer_key_t key = _peer_key(peer_addr);
+    uint64_t period = _syn_cookie_period();
+    uint32_t peer_seq = ntohl(ack->th_seq) - 1;
+    const used_cookie_t *prev_used;
+
+    assert(q && ack && used);
+
+    used->cookie = ntohl(ack->th_ack) - 1;
+    if (!(ack->th_flags & TH_ACK) || (ack->th_flags & (TH_SYN | TH_RST)) ||
+        (used->cookie & ~SYN_COOKIE_MASK))
+        return FALSE;
+
+    if (used->cookie == _syn_cookie(q, key, peer_seq, period))
+        used->period = period;
+    else if (used->cookie == _syn_cookie(q, key, peer_seq, period - 1))
+        used->period = period - 1;
+    else
+        return FALSE;
+
+    prev_used = q->used_cookies->find(key);
+    return !prev_used || prev_used->cookie != used->cookie ||
+           prev_used->period + 1 < period;
+}
+
+/* a connection's been set up from the given SYN cookie.  cookies too old
+ * to come back anyway are cleared out first, once there are as many as
+ * the backlog holds.  q is locked.
+ */
+static void _use_syn_cookie(listen_queue_t *q,
+                            const struct sockaddr *peer_addr,
+                            const used_cookie_t *used)
+{
+    peer_key_t key = _peer_key(peer_addr);
+    used_cookie_t *prev_used;
+    key_list_t expired;
+    size_t k;
+
+    assert(q && used);
+
+    if ((prev_used = q->used_cookies->find(key)) != NULL)
+    {
+        *prev_used = *used;
+        return;
+    }
+
+    if (q->used_cookies->size() >= q->max_len)
+    {
+        expired.keys = (peer_key_t *)
+            malloc(q->used_cookies->size() * sizeof(peer_key_t));
+        assert(expired.keys);
+        expired.num_keys = 0;
+        expired.period   = _syn_cookie_period();
+
+        q->used_cookies->for_each(_collect_expired_cookie, &expired);
+        for (k = 0; k < expired.num_keys; ++k)
+            q->used_cookies->erase(expired.keys[k]);
+        free(expired.keys);
+    }
+
+    if (!q->used_cookies->insert(key, *used))
+        assert(0);
+}
+
+/* a secret the peer can't guess, from the kernel's random number generator
+ * (getrandom(), or /dev/urandom where that isn't available).  failing both,
+ * the time and an address will have to do.
+ */
+static uint64_t _random_secret(void)
+{
+    uint64_t secret = 0;
+    FILE *fp;
+
+#ifdef LINUX
+    if (getrandom(&secret, sizeof(secret), 0) == sizeof(secret))
+        return secret;
+#endif
+    if ((fp = fopen("/dev/urandom", "r")) != NULL)
+    {
+        size_t n = fread(&secret, sizeof(secret), 1, fp);
+
+        fclose(fp);
+        if (n == 1)
+            return secret;
+    }
+
+    DEBUG_LOG(("no random secret available, using the time\n"));
+    return _mix64(((uint64_t) time(NULL) << 32) ^ (uint64_t) getpid() ^
+                  (uint64_t) (uintptr_t) &secret);
+}
+
+/* for_each() callback, adding the peer of a used SYN cookie that's
+ * expired to the key_list_t at arg
+ */
+static void _collect_expired_cookie(const peer_key_t &key,
+                                    used_cookie_t &used, void *arg)
+{
+    key_list_t *list = (key_list_t *) arg;
+
+    if (used.period + 1 < list->period)
+        list->keys[list->num_keys++] = key;
 }
 
+/* for_each() callback, adding a request to the request_list_t at arg */
+static void _collect_request(const peer_key_t &key,
+                             connect_request_t *&request, void *arg)
+{
+    request_list_t *list = (request_list_t *) arg;
+
+    list->requests[list->num_requests++] = request;
+}
@@ -7,8 +7,9 @@
 
 struct mysock_context;
 
-void _mysock_dequeue_connection(struct mysock_context  *accept_ctx,
-                                struct mysock_context **new_ctx);
+bool_t _mysock_dequeue_connection(struct mysock_context  *accept_ctx,
+                                  struct mysock_context **new_ctx,
+                                  bool_t                  block);
 
 bool_t _mysock_enqueue_connection(struct mysock_context *ctx,
                                   const void            *packet,
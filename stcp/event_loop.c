@@ -0,0 +1,476 @@
+/* event_loop.c--event loop engine for the mysocket layer.  see event_loop.h.
+ *
+ * each loop thread has an epoll instance, with the sockets of the
+ * mysockets it runs plus an eventfd that other threads write to wake it,
+ * a timer wheel shared by all its connections, and a list of mysockets
+ * it has been asked to look at (new ones, ones the application has given
+ * data or a close request to, ones being removed).  a connection is only
+ * ever touched by its own loop's thread, so the transport layer needs no
+ * locking of its own.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "event_loop.h"
+
+#ifdef LINUX
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "transport.h"
+#include "timer.h"
+
+#define MAX_EVENT_LOOPS     64
+#define MAX_LOOP_EVENTS     64  /* returned by one epoll_wait() */
+#define MAX_SERVICE_ROUNDS  16  /* before a busy mysocket lets others go */
+
+
+typedef struct event_loop
+{
+    pthread_t          thread;
+    int                epoll_fd;
+    int                wakeup_fd;   /* eventfd, to interrupt epoll_wait() */
+    struct timer_wheel timers;      /* for all of this loop's connections */
+
+    /* mysockets the loop has been asked to look at */
+    pthread_mutex_t    lock;
+    pthread_cond_t     removed_cond;    /* signaled as mysockets are let go */
+    mysock_context_t  *pending_head;
+    mysock_context_t  *pending_tail;
+    bool_t             sleeping;        /* in epoll_wait(), needs waking */
+} event_loop_t;
+
+
+static void init_loops(void);
+static void *event_loop_thread_func(void *arg_ptr);
+static void queue_pending(event_loop_t *loop, mysock_context_t *ctx,
+                          bool_t wake);
+static void run_pending(event_loop_t *loop);
+static void run_timers(event_loop_t *loop);
+static void service(event_loop_t *loop, mysock_context_t *ctx);
+static void finish(event_loop_t *loop, mysock_context_t *ctx);
+static void watch(event_loop_t *loop, mysock_context_t *ctx);
+static void unwatch(event_loop_t *loop, mysock_context_t *ctx);
+static int poll_timeout(event_loop_t *loop);
+
+
+static event_loop_t  *loops;
+static unsigned int   num_loops;    /* zero if the loops aren't used */
+static pthread_once_t loops_once = PTHREAD_ONCE_INIT;
+
+
+bool_t _event_loop_enabled(void)
+{
+    PTHREAD_CALL(pthread_once(&loops_once, init_loops));
+    return num_loops > 0;
+}
+
+void _event_loop_add(mysock_context_t *ctx)
+{
+    assert(ctx && !ctx->loop);
+    assert(_event_loop_enabled());
+
+    ctx->loop = &loops[ctx->my_sd % num_loops];
+    queue_pending(ctx->loop, ctx, TRUE);
+}
+
+void _event_loop_notify(mysock_context_t *ctx)
+{
+    event_loop_t *loop;
+
+    assert(ctx);
+
+    /* the loop looks at a mysocket again after doing anything with it,
+     * so it needn't tell itself.
+     */
+    if (!(loop = ctx->loop) || pthread_equal(pthread_self(), loop->thread))
+        return;
+
+    queue_pending(loop, ctx, TRUE);
+}
+
+void _event_loop_remove(mysock_context_t *ctx)
+{
+    event_loop_t *loop;
+
+    assert(ctx && ctx->loop);
+    assert(!ctx->transport_running);
+    loop = ctx->loop;
+
+    PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+    ctx->loop_remove = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+    queue_pending(loop, ctx, TRUE);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+    while (ctx->loop)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&loop->removed_cond, &loop->lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+}
+
+
+/* start the loops, if STCP_ENGINE=loop; called once, by whichever mysocket
+ * gets to _event_loop_enabled() first.
+ */
+static void init_loops(void)
+{
+    const char *engine = getenv("STCP_ENGINE");
+    const char *loops_env = getenv("STCP_LOOPS");
+    struct epoll_event ev;
+    unsigned int k;
+
+    if (!engine || strcmp(engine, "loop"))
+        return;
+
+    num_loops = loops_env ? (unsigned int) atoi(loops_env) : 1;
+    num_loops = (num_loops < 1) ? 1 : MIN(num_loops, MAX_EVENT_LOOPS);
+
+    /* as in the receive threads, a peer going away shows up as a failed
+     * write rather than killing the process.
+     */
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal(SIGPIPE)");
+        assert(0);
+    }
+
+    loops = (event_loop_t *) calloc(num_loops, sizeof(event_loop_t));
+    assert(loops);
+
+    for (k = 0; k < num_loops; ++k)
+    {
+        event_loop_t *loop = &loops[k];
+
+        if ((loop->epoll_fd = epoll_create(MAX_LOOP_EVENTS)) < 0 ||
+            (loop->wakeup_fd = eventfd(0, 0)) < 0)
+        {
+            perror("epoll_create/eventfd");
+            assert(0);
+            abort();
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;     /* i.e. the wakeup descriptor */
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            assert(0);
+            abort();
+        }
+
+        timer_wheel_init(&loop->timers);
+        PTHREAD_CALL(pthread_mutex_init(&loop->lock, NULL));
+        PTHREAD_CALL(pthread_cond_init(&loop->removed_cond, NULL));
+    }
+
+    for (k = 0; k < num_loops; ++k)
+    {
+        loops[k].thread = _mysock_create_thread(event_loop_thread_func,
+                                                &loops[k], TRUE);
+    }
+}
+
+/* the loop itself.  each time around, it reads whatever has arrived on
+ * the sockets that are ready, then deals with the mysockets it's been
+ * asked to look at, then runs any timers that have gone off.  it sleeps
+ * no longer than until the next timer is due, and not at all if there's
+ * anything still waiting to be looked at.
+ */
+static void *event_loop_thread_func(void *arg_ptr)
+{
+    event_loop_t *loop = (event_loop_t *) arg_ptr;
+    struct epoll_event events[MAX_LOOP_EVENTS];
+
+    assert(loop);
+
+    for (;;)
+    {
+        int timeout = poll_timeout(loop);
+        int num_events, k;
+
+        PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+        if (loop->pending_head)
+            timeout = 0;
+        loop->sleeping = (timeout != 0);
+        PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+
+        num_events = epoll_wait(loop->epoll_fd, events,
+                                MAX_LOOP_EVENTS, timeout);
+
+        PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+        loop->sleeping = FALSE;
+        PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+
+        if (num_events < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            assert(0);
+        }
+
+        for (k = 0; k < num_events; ++k)
+        {
+            mysock_context_t *ctx = (mysock_context_t *) events[k].data.ptr;
+
+            if (!ctx)
+            {
+                uint64_t count;
+
+                /* just woken up; what for is on the pending list */
+                if (read(loop->wakeup_fd, &count, sizeof(count)) < 0)
+                    perror("read (wakeup_fd)");
+                continue;
+            }
+
+            if (!ctx->loop_watching)
+                continue;
+
+            /* this doesn't block on a connection; a listening socket
+             * still reads a whole SYN at a time, though.
+             */
+            if (_network_recv_dispatch(ctx) < 0)
+                unwatch(loop, ctx);
+
+            service(loop, ctx);
+        }
+
+        run_pending(loop);
+        run_timers(loop);
+    }
+
+    return NULL;
+}
+
+/* put the mysocket on the loop's pending list, if it isn't there already,
+ * waking up the loop if wake is set.
+ */
+static void queue_pending(event_loop_t *loop, mysock_context_t *ctx,
+                          bool_t wake)
+{
+    bool_t poke = FALSE;
+
+    PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+    if (!ctx->loop_pending)
+    {
+        ctx->loop_pending = TRUE;
+        ctx->loop_next = NULL;
+        if (loop->pending_tail)
+            loop->pending_tail->loop_next = ctx;
+        else
+            loop->pending_head = ctx;
+        loop->pending_tail = ctx;
+    }
+
+    if (wake && loop->sleeping)
+    {
+        /* once is enough */
+        loop->sleeping = FALSE;
+        poke = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+
+    if (poke)
+    {
+        uint64_t one = 1;
+
+        if (write(loop->wakeup_fd, &one, sizeof(one)) < 0)
+            perror("write (wakeup_fd)");
+    }
+}
+
+/* go through the mysockets that were pending when we got here; any that
+ * are queued again meanwhile wait for the next time around.
+ */
+static void run_pending(event_loop_t *loop)
+{
+    mysock_context_t *ctx, *next;
+
+    PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+    ctx = loop->pending_head;
+    loop->pending_head = loop->pending_tail = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+
+    for (; ctx; ctx = next)
+    {
+        bool_t remove, start;
+
+        PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+        next = ctx->loop_next;
+        ctx->loop_next = NULL;
+        ctx->loop_pending = FALSE;
+        remove = ctx->loop_remove;
+        start = !ctx->loop_started;
+        ctx->loop_started = TRUE;
+        PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+
+        if (remove)
+        {
+            /* myclose() is waiting to free the context */
+            unwatch(loop, ctx);
+
+            PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+            ctx->loop = NULL;
+            PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+            PTHREAD_CALL(pthread_cond_broadcast(&loop->removed_cond));
+            continue;
+        }
+
+        if (start)
+        {
+            if (!ctx->listening)
+                transport_open(ctx->my_sd, ctx->is_active, &loop->timers);
+            watch(loop, ctx);
+        }
+
+        service(loop, ctx);
+    }
+}
+
+/* hand each timer that's gone off to the connection it belongs to */
+static void run_timers(event_loop_t *loop)
+{
+    stcp_time_t now = stcp_now();
+    struct stcp_timer *t;
+
+    while ((t = timer_expire(&loop->timers, now)) != NULL)
+    {
+        mysock_context_t *ctx = _mysock_get_context(transport_timer(t));
+
+        assert(ctx && ctx->loop == loop);
+        if (transport_done(ctx->my_sd))
+            finish(loop, ctx);
+        else
+            service(loop, ctx);
+    }
+}
+
+/* pass the transport layer whatever it's ready for, until there's nothing
+ * left (or it has had its share of the loop, in which case it goes to the
+ * back of the pending list).
+ */
+static void service(event_loop_t *loop, mysock_context_t *ctx)
+{
+    mysocket_t sd = ctx->my_sd;
+    unsigned int rounds;
+
+    if (ctx->listening || !ctx->transport_running)
+        return;
+
+    for (rounds = 0; rounds < MAX_SERVICE_ROUNDS; ++rounds)
+    {
+        unsigned int events = _mysock_ready_events(ctx,
+                                                   transport_wait_flags(sd));
+
+        if (!events)
+            break;
+
+        transport_event(sd, events);
+        if (transport_done(sd))
+        {
+            finish(loop, ctx);
+            return;
+        }
+    }
+
+    if (rounds == MAX_SERVICE_ROUNDS)
+        queue_pending(loop, ctx, FALSE);
+
+    /* whatever STCP sent meanwhile goes out together */
+    _network_flush(&ctx->network_state);
+}
+
+/* the connection is over; the rest is as when transport_init() returns */
+static void finish(event_loop_t *loop, mysock_context_t *ctx)
+{
+    transport_close(ctx->my_sd);
+    _network_flush(&ctx->network_state);
+    unwatch(loop, ctx);
+    _mysock_transport_finished(ctx);
+}
+
+static void watch(event_loop_t *loop, mysock_context_t *ctx)
+{
+    struct epoll_event ev;
+    int fd;
+
+    if ((fd = _network_poll_fd(&ctx->network_state)) < 0)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = ctx;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        assert(0);
+        return;
+    }
+
+    ctx->loop_watching = TRUE;
+}
+
+static void unwatch(event_loop_t *loop, mysock_context_t *ctx)
+{
+    struct epoll_event ev;  /* ignored, but older kernels want one */
+
+    if (!ctx->loop_watching)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL,
+                  _network_poll_fd(&ctx->network_state), &ev) < 0)
+    {
+        perror("epoll_ctl");
+        assert(0);
+    }
+
+    ctx->loop_watching = FALSE;
+}
+
+/* milliseconds until the loop's next timer is due, or -1 if none is */
+static int poll_timeout(event_loop_t *loop)
+{
+    stcp_time_t next = timer_next_expiry(&loop->timers);
+    stcp_time_t now;
+
+    if (next == 0)
+        return -1;
+
+    now = stcp_now();
+    return (next <= now) ? 0 : (int) ((next - now + 999) / 1000);
+}
+
+#else   /* !LINUX */
+
+/* no epoll; every connection gets its own threads */
+bool_t _event_loop_enabled(void)
+{
+    return FALSE;
+}
+
+void _event_loop_add(mysock_context_t *ctx)
+{
+    assert(0);
+}
+
+void _event_loop_notify(mysock_context_t *ctx)
+{
+}
+
+void _event_loop_remove(mysock_context_t *ctx)
+{
+    assert(0);
+}
+
+#endif  /* LINUX */
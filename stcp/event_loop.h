@@ -0,0 +1,39 @@
+/* event_loop.h--run many mysockets' STCP state machines from a few threads.
+ * this is an internal header, used only by the mysocket layer.
+ *
+ * by default, each connection gets an STCP thread of its own (plus a
+ * network receive thread), which sleeps in stcp_wait_for_event() until it
+ * has something to do.  with STCP_ENGINE=loop in the environment, the
+ * connections are instead shared out over STCP_LOOPS (default 1) event
+ * loop threads, each of which polls its connections' sockets with epoll
+ * and keeps all their timers in one wheel, calling into the transport
+ * layer through the non-blocking interface in transport.h.  either way,
+ * the application sees the same mysocket/stcp_api.h behaviour.
+ */
+
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+struct mysock_context;
+
+/* TRUE if mysockets are to be run by the event loops */
+bool_t _event_loop_enabled(void);
+
+/* hand a mysocket over to its event loop:  a connection, whose transport
+ * layer the loop starts, or a listening mysocket, whose socket it polls
+ * for connection requests.
+ */
+void _event_loop_add(struct mysock_context *ctx);
+
+/* let the loop know there's something new for the mysocket's transport
+ * layer, e.g. data or a close request from the application.
+ */
+void _event_loop_notify(struct mysock_context *ctx);
+
+/* take the mysocket away from its loop.  for a connection, the transport
+ * layer must have finished already.  doesn't return until the loop has
+ * let go of it, so the context can then be freed.
+ */
+void _event_loop_remove(struct mysock_context *ctx);
+
+#endif  /* __EVENT_LOOP_H__ */
@@ -0,0 +1,542 @@
+/* myepoll.c--readiness notification for many mysockets at once, after
+ * epoll().  see mysock.h for the application interface.
+ *
+ * each myepoll instance keeps a list of the mysockets it watches that may
+ * have become ready, much as epoll does:  a mysocket is put on the list
+ * whenever its state changes (_myepoll_notify(), called by the mysocket
+ * layer as data or end of file is passed up, as a connection is
+ * established or finishes, as a connection becomes ready to accept, or as
+ * room is made in a full send buffer),
+ * and myepoll_wait() works out what's actually ready as it goes through
+ * the list.  a level-triggered mysocket that's still ready goes back on
+ * the list for next time; an edge-triggered one waits for its next change.
+ *
+ * the instance's descriptor is an eventfd (or a pipe), which is kept
+ * readable while the list is non-empty.  myepoll_wait() sleeps on it with
+ * poll(), and an application may equally well add it to its own epoll set
+ * (or poll() it) alongside kernel sockets.
+ *
+ * instances_lock guards the instance table, each mysocket's list of the
+ * instances watching it, and each instance's list of the mysockets it
+ * watches; notifications only read those, so they can come from several
+ * mysockets at once.  an instance's ready list has a lock of its own.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "myepoll.h"
+
+#ifdef LINUX
+#include <sys/eventfd.h>
+#endif
+
+
+/* a mysocket watched by an instance */
+typedef struct myepoll_item
+{
+    struct myepoll      *ep;
+    mysock_context_t    *ctx;
+    uint32_t             events;        /* MYEPOLLIN etc., plus MYEPOLLET */
+    myepoll_data_t       data;
+
+    /* the instance's list of everything it watches */
+    struct myepoll_item *ep_prev;
+    struct myepoll_item *ep_next;
+
+    /* the instance's ready list, if ready is set */
+    bool_t               ready;
+    struct myepoll_item *ready_prev;
+    struct myepoll_item *ready_next;
+
+    /* the mysocket's list of instances watching it */
+    struct myepoll_item *watch_next;
+} myepoll_item_t;
+
+typedef struct myepoll
+{
+    int             fd;             /* the myepoll descriptor */
+    int             signal_fd;      /* written to make fd readable */
+
+    myepoll_item_t *items;          /* under instances_lock */
+
+    pthread_mutex_t lock;           /* for the ready list */
+    myepoll_item_t *ready_head;
+    myepoll_item_t *ready_tail;
+    bool_t          signaled;       /* fd has been made readable */
+} myepoll_t;
+
+
+static myepoll_t *lookup_instance(int epd);
+static uint32_t ready_events(mysock_context_t *ctx, uint32_t wanted);
+static void add_ready(myepoll_item_t *item);
+static void remove_ready(myepoll_item_t *item);
+static void update_signal(myepoll_t *ep);
+static void unlink_item(myepoll_item_t *item);
+static int collect_events(myepoll_t *ep, struct myepoll_event *events,
+                          int maxevents);
+
+
+static pthread_rwlock_t instances_lock = PTHREAD_RWLOCK_INITIALIZER;
+static myepoll_t      **instances;      /* indexed by descriptor */
+static int              num_instances;  /* size of that table */
+
+/* as in mysock_api.c */
+#define MYSOCK_ERROR_EXIT(rc) { errno = rc; return -1; }
+#define MYSOCK_CHECK(cond,rc)   { if (!(cond)) MYSOCK_ERROR_EXIT(rc); }
+
+
+int myepoll_create(void)
+{
+    myepoll_t *ep;
+    int fds[2];
+
+#ifdef LINUX
+    if ((fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+    fds[1] = fds[0];
+#else
+    if (pipe(fds) < 0)
+        return -1;
+    (void) fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    (void) fcntl(fds[1], F_SETFL, O_NONBLOCK);
+#endif
+
+    ep = (myepoll_t *) calloc(1, sizeof(myepoll_t));
+    assert(ep);
+    ep->fd = fds[0];
+    ep->signal_fd = fds[1];
+    PTHREAD_CALL(pthread_mutex_init(&ep->lock, NULL));
+
+    PTHREAD_CALL(pthread_rwlock_wrlock(&instances_lock));
+    if (ep->fd >= num_instances)
+    {
+        int new_size = num_instances ? num_instances : 16;
+
+        while (ep->fd >= new_size)
+            new_size *= 2;
+
+        instances = (myepoll_t **)
+            realloc(instances, new_size * sizeof(myepoll_t *));
+        assert(instances);
+        memset(instances + num_instances, 0,
+               (new_size - num_instances) * sizeof(myepoll_t *));
+        num_instances = new_size;
+    }
+    assert(!instances[ep->fd]);
+    instances[ep->fd] = ep;
+    PTHREAD_CALL(pthread_rwlock_unlock(&instances_lock));
+
+    return ep->fd;
+}
+
+int myepoll_close(int epd)
+{
+    myepoll_t *ep;
+
+    PTHREAD_CALL(pthread_rwlock_wrlock(&instances_lock));
+    if (!(ep = lookup_instance(epd)))
+    {
+        PTHREAD_CALL(pthread_rwlock_unlock(&instances_lock));
+        MYSOCK_ERROR_EXIT(EBADF);
+    }
+    instances[epd] = NULL;
+
+    while (ep->items)
+    {
+        myepoll_item_t *item = ep->items;
+
+        unlink_item(item);
+        free(item);
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&instances_lock));
+
+    PTHREAD_CALL(pthread_mutex_destroy(&ep->lock));
+    if (ep->signal_fd != ep->fd)
+        (void) close(ep->signal_fd);
+    (void) close(ep->fd);
+    free(ep);
+    return 0;
+}
+
+int myepoll_ctl(int epd, int op, mysocket_t sd, struct myepoll_event *event)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    myepoll_item_t *item;
+    myepoll_t *ep;
+    int error = 0;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(event || op == MYEPOLL_CTL_DEL, EINVAL);
+
+    PTHREAD_CALL(pthread_rwlock_wrlock(&instances_lock));
+    if (!(ep = lookup_instance(epd)))
+    {
+        PTHREAD_CALL(pthread_rwlock_unlock(&instances_lock));
+        MYSOCK_ERROR_EXIT(EBADF);
+    }
+
+    for (item = ctx->epoll_items; item && item->ep != ep;
+         item = item->watch_next)
+        ;
+
+    switch (op)
+    {
+    case MYEPOLL_CTL_ADD:
+        if (item)
+        {
+            error = EEXIST;
+            break;
+        }
+
+        item = (myepoll_item_t *) calloc(1, sizeof(myepoll_item_t));
+        assert(item);
+        item->ep  = ep;
+        item->ctx = ctx;
+
+        item->ep_next = ep->items;
+        if (ep->items)
+            ep->items->ep_prev = item;
+        ep->items = item;
+
+        /* notifications look at the list without the lock; the fence
+         * pairs with theirs, so either they see the new item or we see
+         * whatever they were announcing below.
+         */
+        item->watch_next = ctx->epoll_items;
+        __atomic_store_n(&ctx->epoll_items, item, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        /* fall through */
+
+    case MYEPOLL_CTL_MOD:
+        if (!item)
+        {
+            error = ENOENT;
+            break;
+        }
+
+        PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+        item->events = event->events;
+        item->data   = event->data;
+        if (!item->ready && ready_events(ctx, item->events))
+            add_ready(item);
+        update_signal(ep);
+        PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+        break;
+
+    case MYEPOLL_CTL_DEL:
+        if (!item)
+        {
+            error = ENOENT;
+            break;
+        }
+
+        unlink_item(item);
+        free(item);
+        break;
+
+    default:
+        error = EINVAL;
+        break;
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&instances_lock));
+
+    MYSOCK_CHECK(error == 0, error);
+    return 0;
+}
+
+int myepoll_wait(int epd, struct myepoll_event *events, int maxevents,
+                 int timeout)
+{
+    struct timespec deadline;
+    myepoll_t *ep;
+
+    MYSOCK_CHECK(events && maxevents > 0, EINVAL);
+
+    PTHREAD_CALL(pthread_rwlock_rdlock(&instances_lock));
+    ep = lookup_instance(epd);
+    PTHREAD_CALL(pthread_rwlock_unlock(&instances_lock));
+    MYSOCK_CHECK(ep != NULL, EBADF);
+
+    if (timeout > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec  += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_nsec -= 1000000000;
+            ++deadline.tv_sec;
+        }
+    }
+
+    for (;;)
+    {
+        struct pollfd pfd;
+        int n;
+
+        PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+        n = collect_events(ep, events, maxevents);
+        PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+
+        if (n > 0 || timeout == 0)
+            return n;
+
+        if (timeout > 0)
+        {
+            struct timespec now;
+            long remaining;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining = (deadline.tv_sec - now.tv_sec) * 1000 +
+                        (deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+            if (remaining <= 0)
+                return 0;
+            timeout = remaining;
+        }
+
+        /* sleep until something is put on the ready list */
+        pfd.fd = ep->fd;
+        pfd.events = POLLIN;
+        if ((n = poll(&pfd, 1, timeout)) < 0)
+            return -1;
+        if (n == 0)
+            return 0;
+    }
+}
+
+void _myepoll_notify(mysock_context_t *ctx)
+{
+    myepoll_item_t *item;
+
+    assert(ctx);
+
+    /* whatever's being announced has been published by now; see
+     * myepoll_ctl().
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&ctx->epoll_items, __ATOMIC_ACQUIRE))
+        return;
+
+    PTHREAD_CALL(pthread_rwlock_rdlock(&instances_lock));
+    for (item = ctx->epoll_items; item; item = item->watch_next)
+    {
+        myepoll_t *ep = item->ep;
+
+        PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+        if (!item->ready)
+        {
+            add_ready(item);
+            update_signal(ep);
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&instances_lock));
+}
+
+void _myepoll_forget(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    if (!__atomic_load_n(&ctx->epoll_items, __ATOMIC_ACQUIRE))
+        return;
+
+    PTHREAD_CALL(pthread_rwlock_wrlock(&instances_lock));
+    while (ctx->epoll_items)
+    {
+        myepoll_item_t *item = ctx->epoll_items;
+
+        unlink_item(item);
+        free(item);
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&instances_lock));
+}
+
+
+/* assumes calling code has locked the instance table */
+static myepoll_t *lookup_instance(int epd)
+{
+    if (epd < 0 || epd >= num_instances)
+        return NULL;
+    return instances[epd];
+}
+
+/* those of the wanted events that are ready for the given mysocket right
+ * now, along with any error or hangup.
+ */
+static uint32_t ready_events(mysock_context_t *ctx, uint32_t wanted)
+{
+    uint32_t events = 0;
+
+    assert(ctx);
+
+    if (ctx->listening)
+    {
+        if (__atomic_load_n(&ctx->connections_ready, __ATOMIC_ACQUIRE) > 0)
+            events |= MYEPOLLIN;
+        return events & wanted;
+    }
+
+    /* data or end of file to read */
+    if (ctx->eof || !_mysock_queue_empty(&ctx->app_send_queue))
+        events |= MYEPOLLIN;
+
+    /* nothing else until the connection is established (or fails) */
+    if (!__atomic_load_n(&ctx->blocking, __ATOMIC_ACQUIRE))
+    {
+        if (ctx->stcp_errno)
+            events |= MYEPOLLERR | MYEPOLLHUP;
+        else if (!__atomic_load_n(&ctx->transport_running, __ATOMIC_ACQUIRE))
+            events |= MYEPOLLHUP;
+        else if ((wanted & MYEPOLLOUT) && _mysock_can_send(ctx))
+            events |= MYEPOLLOUT;   /* else STCP says when there's room */
+    }
+
+    return events & (wanted | MYEPOLLERR | MYEPOLLHUP);
+}
+
+/* put the item on the end of its instance's ready list.  assumes calling
+ * code has locked the instance.
+ */
+static void add_ready(myepoll_item_t *item)
+{
+    myepoll_t *ep = item->ep;
+
+    assert(!item->ready);
+    item->ready = TRUE;
+    item->ready_next = NULL;
+    item->ready_prev = ep->ready_tail;
+
+    if (ep->ready_tail)
+        ep->ready_tail->ready_next = item;
+    else
+        ep->ready_head = item;
+    ep->ready_tail = item;
+}
+
+/* take the item off its instance's ready list.  assumes calling code has
+ * locked the instance.
+ */
+static void remove_ready(myepoll_item_t *item)
+{
+    myepoll_t *ep = item->ep;
+
+    assert(item->ready);
+    item->ready = FALSE;
+
+    if (item->ready_prev)
+        item->ready_prev->ready_next = item->ready_next;
+    else
+        ep->ready_head = item->ready_next;
+
+    if (item->ready_next)
+        item->ready_next->ready_prev = item->ready_prev;
+    else
+        ep->ready_tail = item->ready_prev;
+}
+
+/* make the instance's descriptor readable if and only if its ready list is
+ * non-empty.  assumes calling code has locked the instance.
+ */
+static void update_signal(myepoll_t *ep)
+{
+    if (ep->ready_head && !ep->signaled)
+    {
+        uint64_t one = 1;
+
+        if (write(ep->signal_fd, &one, sizeof(one)) < 0)
+            assert(errno == EAGAIN);
+        ep->signaled = TRUE;
+    }
+    else if (!ep->ready_head && ep->signaled)
+    {
+        char drain[64];
+
+        while (read(ep->fd, drain, sizeof(drain)) > 0)
+            ;
+        ep->signaled = FALSE;
+    }
+}
+
+/* take the item off all the lists it's on.  assumes calling code has
+ * write-locked the instance table.
+ */
+static void unlink_item(myepoll_item_t *item)
+{
+    myepoll_t *ep = item->ep;
+    myepoll_item_t **link;
+
+    for (link = &item->ctx->epoll_items; *link != item;
+         link = &(*link)->watch_next)
+        assert(*link);
+    __atomic_store_n(link, item->watch_next, __ATOMIC_RELAXED);
+
+    if (item->ep_prev)
+        item->ep_prev->ep_next = item->ep_next;
+    else
+        ep->items = item->ep_next;
+    if (item->ep_next)
+        item->ep_next->ep_prev = item->ep_prev;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+    if (item->ready)
+    {
+        remove_ready(item);
+        update_signal(ep);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+}
+
+/* go through the ready list, filling in events for up to maxevents of the
+ * mysockets on it that turn out to be ready.  level-triggered ones go back
+ * on the end of the list.  assumes calling code has locked the instance.
+ */
+static int collect_events(myepoll_t *ep, struct myepoll_event *events,
+                          int maxevents)
+{
+    myepoll_item_t *requeue_head = NULL, *requeue_tail = NULL;
+    int n = 0;
+
+    while (n < maxevents && ep->ready_head)
+    {
+        myepoll_item_t *item = ep->ready_head;
+        uint32_t ready;
+
+        remove_ready(item);
+
+        ready = ready_events(item->ctx, item->events);
+        if (!ready)
+            continue;
+
+        events[n].events = ready;
+        events[n].data   = item->data;
+        ++n;
+
+        if (!(item->events & MYEPOLLET))
+        {
+            item->ready_next = NULL;
+            if (requeue_tail)
+                requeue_tail->ready_next = item;
+            else
+                requeue_head = item;
+            requeue_tail = item;
+        }
+    }
+
+    while (requeue_head)
+    {
+        myepoll_item_t *item = requeue_head;
+
+        requeue_head = item->ready_next;
+        add_ready(item);
+    }
+    update_signal(ep);
+
+    return n;
+}
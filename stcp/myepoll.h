@@ -0,0 +1,23 @@
+/* myepoll.h--readiness notification for mysockets; the application interface
+ * is in mysock.h.  this is an internal header, used only by the mysocket
+ * layer.
+ */
+
+#ifndef __MYEPOLL_H__
+#define __MYEPOLL_H__
+
+struct mysock_context;
+
+/* something about the mysocket's readiness may have changed (data or end
+ * of file passed up, connection established or finished, a connection
+ * ready to accept); let any myepoll instances watching it know.  this is
+ * cheap if nothing is watching.
+ */
+void _myepoll_notify(struct mysock_context *ctx);
+
+/* the mysocket is being closed; drop it from any myepoll instances
+ * watching it.  no more notifications may come for it by now.
+ */
+void _myepoll_forget(struct mysock_context *ctx);
+
+#endif  /* __MYEPOLL_H__ */
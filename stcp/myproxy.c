@@ -65,6 +65,7 @@ void writen(int sd, const void *ptr, size_t n, bool use_stcp);
 
 
 #define BUFF_SIZE 100 //Buffer length for network reads
+#define SENDFILE_SIZE 65536 //Most bytes forwarded per mysendfile() call
 
 
 /* Function: main
@@ -503,8 +504,6 @@ void process_request(int conn_sd, http_request req)
 	string request = req.method + " " + req.path + " " + req.version + "\r\n";
 	writen(client_sd, request.c_str(), request.length(), false);
 	writen(client_sd, req.headers.c_str(), req.headers.length(), false);
-	ssize_t n;
-	char buf[BUFF_SIZE];
 	string response = read_until(client_sd,false, false);
 	string status = response.substr(0,response.find("\r\n"));
 	if (!parse_status(status)){
@@ -512,9 +511,9 @@ void process_request(int conn_sd, http_request req)
 	}
 	else {
 		writen(conn_sd, response.c_str(), response.length(), true);
-		while ((n=read(client_sd, buf, BUFF_SIZE))>0){
-			 writen(conn_sd,buf,n, true);
-		}
+		/* the rest of the response goes from the server's socket
+		 * straight into the mysocket's send queue */
+		while (mysendfile(conn_sd, client_sd, NULL, SENDFILE_SIZE) > 0);
 	}
 }
 
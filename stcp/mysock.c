@@ -7,11 +7,14 @@
 #include <assert.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <time.h>
 #include "mysock.h"
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "stcp_api.h"
 #include "transport.h"
+#include "event_loop.h"
+#include "myepoll.h"
 
 
 #ifdef NDEBUG
@@ -29,17 +32,52 @@ static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
                                        mysocket_t        my_sd);
 static mysock_context_t *_mysock_allocate_context(void);
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq);
+static void init_queue(packet_queue_t *pq, mysock_waiter_t *waiter);
+static void enqueue_slot(mysock_context_t *ctx, packet_queue_t *pq,
+                         mysock_buffer_t *buf, char *data, size_t data_len);
+static void init_waiter(mysock_waiter_t *waiter);
+static void destroy_waiter(mysock_waiter_t *waiter);
+static bool_t grow_descriptor_table(void);
+static mysock_context_t *lookup_descriptor(mysocket_t sd);
+
+/* mysocket descriptor table, one entry per STCP connection.  the table is
+ * a fixed spine of pointers to chunks of entries, which are allocated as
+ * more descriptors are needed and are never moved or freed.  a lookup
+ * therefore takes no lock, just an (atomic) load of the chunk and then of
+ * the entry.  free entries are kept on a freelist threaded through the
+ * table, so handing out and releasing descriptors is O(1); both are done
+ * under table_lock.
+ */
+#define TABLE_CHUNK_BITS 10
+#define TABLE_CHUNK_SIZE (1 << TABLE_CHUNK_BITS)
+#define TABLE_CHUNK_MASK (TABLE_CHUNK_SIZE - 1)
+#define TABLE_NUM_CHUNKS (MAX_NUM_CONNECTIONS / TABLE_CHUNK_SIZE)
+
+#if (MAX_NUM_CONNECTIONS % TABLE_CHUNK_SIZE) != 0
+    #error MAX_NUM_CONNECTIONS should be a multiple of TABLE_CHUNK_SIZE
+#endif
+
+typedef struct
+{
+    mysock_context_t *ctx;          /* NULL if the descriptor is free */
+    mysocket_t        next_free;    /* next entry on freelist, or -1 */
+} descriptor_entry_t;
 
+static descriptor_entry_t *descriptor_table[TABLE_NUM_CHUNKS];
+static mysocket_t          table_size;      /* # of entries allocated */
+static mysocket_t          table_freelist = -1;
+static pthread_mutex_t     table_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* mysocket descriptor table, one entry per STCP connection */
-static mysock_context_t *global_ctx[MAX_NUM_CONNECTIONS];
+#define TABLE_ENTRY(sd) \
+    (&descriptor_table[(sd) >> TABLE_CHUNK_BITS][(sd) & TABLE_CHUNK_MASK])
 
 
 /* create a new mysocket, and find space in our mysocket descriptor table */
 mysocket_t _mysock_new_mysocket(bool_t is_reliable)
 {
     mysock_context_t *connection_context = _mysock_allocate_context();
-    int k;
+    descriptor_entry_t *entry;
+    mysocket_t sd;
 
     if (!connection_context)
     {
@@ -50,20 +88,76 @@ mysocket_t _mysock_new_mysocket(bool_t is_reliable)
     /* propagates down to new connections arriving on a listening socket */
     connection_context->network_state.is_reliable = is_reliable;
 
-    /* search for a free mysocket descriptor */
-    for (k = 0; k < MAX_NUM_CONNECTIONS; ++k)
+    /* take a free mysocket descriptor, growing the table if there are none */
+    PTHREAD_CALL(pthread_mutex_lock(&table_lock));
+    if (table_freelist < 0 && !grow_descriptor_table())
     {
-        if (!global_ctx[k])
-        {
-            global_ctx[k] = connection_context;
-            connection_context->my_sd = k;
-            return k;
-        }
+        PTHREAD_CALL(pthread_mutex_unlock(&table_lock));
+        _mysock_free_context(connection_context);
+        errno = EMFILE;
+        return -1;
+    }
+
+    sd = table_freelist;
+    entry = TABLE_ENTRY(sd);
+    assert(!entry->ctx);
+    table_freelist = entry->next_free;
+    entry->next_free = -1;
+
+    connection_context->my_sd = sd;
+    __atomic_store_n(&entry->ctx, connection_context, __ATOMIC_RELEASE);
+    PTHREAD_CALL(pthread_mutex_unlock(&table_lock));
+
+    return sd;
+}
+
+/* add another chunk of free entries to the descriptor table.  the caller
+ * holds table_lock, and the freelist is empty.  returns FALSE if the table
+ * is already as big as it gets.
+ */
+static bool_t grow_descriptor_table(void)
+{
+    descriptor_entry_t *chunk;
+    int k;
+
+    assert(table_freelist < 0);
+    if (table_size >= MAX_NUM_CONNECTIONS)
+        return FALSE;
+
+    chunk = (descriptor_entry_t *) calloc(TABLE_CHUNK_SIZE,
+                                          sizeof(descriptor_entry_t));
+    assert(chunk);
+
+    /* a new chunk's descriptors are handed out in increasing order */
+    for (k = 0; k < TABLE_CHUNK_SIZE; ++k)
+    {
+        chunk[k].next_free = (k + 1 < TABLE_CHUNK_SIZE)
+            ? table_size + k + 1 : -1;
     }
 
-    _mysock_free_context(connection_context);
-    errno = EMFILE;
-    return -1;
+    /* the chunk is complete before lookups can see it */
+    __atomic_store_n(&descriptor_table[table_size >> TABLE_CHUNK_BITS],
+                     chunk, __ATOMIC_RELEASE);
+    table_freelist = table_size;
+    table_size += TABLE_CHUNK_SIZE;
+    return TRUE;
+}
+
+/* the context for the given descriptor, or NULL if it isn't in use.  this
+ * may be called without table_lock.
+ */
+static mysock_context_t *lookup_descriptor(mysocket_t sd)
+{
+    descriptor_entry_t *chunk;
+
+    if (sd < 0 || sd >= MAX_NUM_CONNECTIONS)
+        return NULL;
+
+    chunk = __atomic_load_n(&descriptor_table[sd >> TABLE_CHUNK_BITS],
+                            __ATOMIC_ACQUIRE);
+    return chunk
+        ? __atomic_load_n(&chunk[sd & TABLE_CHUNK_MASK].ctx, __ATOMIC_ACQUIRE)
+        : NULL;
 }
 
 /* obtain a pointer to the connection context for the given mysocket
@@ -72,8 +166,7 @@ mysocket_t _mysock_new_mysocket(bool_t is_reliable)
 mysock_context_t *_mysock_get_context(mysocket_t sd)
 {
     ASSERT_VALID_MYSOCKET_DESCRIPTOR(NULL, sd);
-    return (sd >= 0 && sd < (int)ARRAY_DIM(global_ctx))
-        ? global_ctx[sd] : NULL;
+    return lookup_descriptor(sd);
 }
 
 /* initiate a new STCP connection; called by myconnect() and myaccept() */
@@ -83,6 +176,16 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
 
     assert(!connection_context->listening);
     connection_context->is_active = is_active;
+    connection_context->transport_running = TRUE;
+
+    /* with the event loop engine, a loop thread does the work of both of
+     * the threads below (see event_loop.h).
+     */
+    if (_event_loop_enabled())
+    {
+        _event_loop_add(connection_context);
+        return;
+    }
 
     /* start a new network thread; this handles incoming data, passing it
      * up to the transport layer.  (the network input is threaded so we can
@@ -125,109 +228,391 @@ int _mysock_wait_for_connection(mysock_context_t *ctx)
  * application is ready to use it, depending on the queue to which
  * the buffer (or packet) is added.
  *
- * in the interest of simplicity (and since we aren't writing a high
- * performance TCP stack), this just copies the specified buffer for its own
- * use, so the calling code can do whatever it wants with the packet
- * afterwards.  the copied buffer is freed later by dequeue_buffer().
+ * this copies the specified buffer (into one from the mysocket's pool), so
+ * the calling code can do whatever it wants with the packet afterwards.
+ * data that's already in a pool buffer can be queued without a copy with
+ * _mysock_enqueue_reference() instead.
  */
 void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             packet_queue_t   *pq,
                             const void       *packet,
                             size_t            packet_len)
 {
-    packet_queue_node_t *node;
+    mysock_buffer_t *buf = NULL;
 
     assert(ctx && pq && (packet || !packet_len));
 
-    node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
-    assert(node);
+    if (packet_len > 0)
+    {
+        buf = _buffer_alloc(&ctx->buffer_pool, packet_len);
+        memcpy(buf->data, packet, packet_len);
+    }
 
-    node->data = (char *) malloc(packet_len * sizeof(char));
-    assert(node->data);
+    enqueue_slot(ctx, pq, buf, buf ? buf->data : NULL, packet_len);
+}
 
-    if (packet_len > 0)
-        memcpy(node->data, packet, packet_len);
-    node->data_len = packet_len;
+/* add data_len bytes at data, which lie within the buffer buf, to a queue.
+ * the queue takes a reference of its own to the buffer, rather than a copy
+ * of the data.
+ */
+void _mysock_enqueue_reference(mysock_context_t *ctx,
+                               packet_queue_t   *pq,
+                               mysock_buffer_t  *buf,
+                               const void       *data,
+                               size_t            data_len)
+{
+    assert(ctx && pq && buf);
+    assert(BUFFER_CONTAINS(buf, data, data_len));
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    if (!pq->head)
+    if (data_len == 0)
+        buf = NULL;
+    else
+        _buffer_ref(buf);
+
+    enqueue_slot(ctx, pq, buf, (char *) data, data_len);
+}
+
+/* set up an empty queue, whose consumer sleeps on the given waiter */
+static void init_queue(packet_queue_t *pq, mysock_waiter_t *waiter)
+{
+    assert(pq && waiter);
+
+    memset(pq, 0, sizeof(*pq));
+    pq->head_chunk = pq->tail_chunk =
+        (packet_chunk_t *) calloc(1, sizeof(packet_chunk_t));
+    assert(pq->head_chunk);
+    pq->waiter = waiter;
+}
+
+/* append a packet to the queue, handing it the caller's reference to buf.
+ * only the queue's producer may call this.
+ */
+static void enqueue_slot(mysock_context_t *ctx,
+                         packet_queue_t   *pq,
+                         mysock_buffer_t  *buf,
+                         char             *data,
+                         size_t            data_len)
+{
+    packet_slot_t *slot;
+    unsigned long  tail = pq->tail;
+
+    slot = &pq->tail_chunk->slots[tail % QUEUE_CHUNK_SLOTS];
+    slot->buffer   = buf;
+    slot->data     = data;
+    slot->data_len = data_len;
+
+    if ((tail + 1) % QUEUE_CHUNK_SLOTS == 0)
     {
-        assert(!pq->tail);
-        pq->head = pq->tail = node;
+        /* that filled the last chunk.  link up the next one before the
+         * consumer can get to the end of this one, reusing the chunk it
+         * emptied last if there is one.
+         */
+        packet_chunk_t *chunk =
+            __atomic_exchange_n(&pq->spare, (packet_chunk_t *) NULL,
+                                __ATOMIC_ACQUIRE);
+
+        if (!chunk)
+        {
+            chunk = (packet_chunk_t *) malloc(sizeof(packet_chunk_t));
+            assert(chunk);
+        }
+        chunk->next = NULL;
+        pq->tail_chunk->next = chunk;
+        pq->tail_chunk = chunk;
     }
-    else
+
+    __atomic_store_n(&pq->bytes_in, pq->bytes_in + data_len,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&pq->tail, tail + 1, __ATOMIC_RELEASE);
+
+    _mysock_wake(pq->waiter);
+
+    /* an event loop doesn't sleep on the waiter, so it has to be told
+     * (data passed up to the app is of no interest to it, but may be to
+     * the app's myepoll instances).
+     */
+    if (pq == &ctx->app_send_queue)
+        _myepoll_notify(ctx);
+    else if (ctx->loop)
+        _event_loop_notify(ctx);
+}
+
+/* TRUE if nothing is queued.  with the consumer's own queue, a FALSE is
+ * final; anyone else gets a snapshot.
+ */
+bool_t _mysock_queue_empty(const packet_queue_t *pq)
+{
+    assert(pq);
+    return __atomic_load_n(&pq->head, __ATOMIC_RELAXED) ==
+           __atomic_load_n(&pq->tail, __ATOMIC_ACQUIRE);
+}
+
+/* number of bytes queued and not yet dequeued */
+size_t _mysock_queue_bytes(const packet_queue_t *pq)
+{
+    assert(pq);
+    return __atomic_load_n(&pq->bytes_in, __ATOMIC_RELAXED) -
+           __atomic_load_n(&pq->bytes_out, __ATOMIC_RELAXED);
+}
+
+/* room left in the send buffer, i.e. how much more mywrite() may queue
+ * before STCP takes some of what's there already.
+ */
+size_t _mysock_send_space(const mysock_context_t *ctx)
+{
+    size_t queued;
+
+    assert(ctx);
+
+    queued = _mysock_queue_bytes(&ctx->app_recv_queue);
+    return (queued < ctx->send_buffer_size) ?
+        ctx->send_buffer_size - queued : 0;
+}
+
+/* TRUE if there's room in the send buffer.  if there isn't, the STCP
+ * thread is asked to say when there is (_mysock_send_space_freed()); the
+ * flag is set before looking again, with a full fence on both sides, so
+ * either we see the room or the STCP thread sees the flag.
+ */
+bool_t _mysock_can_send(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    if (_mysock_send_space(ctx) > 0)
+        return TRUE;
+
+    __atomic_store_n(&ctx->send_blocked, TRUE, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return _mysock_send_space(ctx) > 0;
+}
+
+/* called by the STCP thread after taking data from the send buffer; wake
+ * a writer waiting for room, and let myepoll know.  that waits until half
+ * the buffer is free, as the kernel does, rather than waking the writer for
+ * every segment STCP takes.
+ */
+void _mysock_send_space_freed(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctx->send_blocked, __ATOMIC_RELAXED) &&
+        _mysock_send_space(ctx) >= (ctx->send_buffer_size + 1) / 2)
     {
-        assert(pq->tail);
-        assert(!pq->tail->next);
-        assert(!node->next);
-        pq->tail->next = node;
-        pq->tail = node;
+        __atomic_store_n(&ctx->send_blocked, FALSE, __ATOMIC_RELAXED);
+        _mysock_wake(&ctx->writer_waiter);
+        _myepoll_notify(ctx);
     }
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+}
+
+/* called after myread() takes data from app_send_queue; if STCP asked to
+ * hear about it (stcp_app_read_notify()) and enough has been read, post
+ * APP_READ and wake the STCP thread or the event loop.
+ */
+void _mysock_data_read(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctx->read_blocked, __ATOMIC_RELAXED) &&
+        _mysock_queue_bytes(&ctx->app_send_queue) <=
+        __atomic_load_n(&ctx->read_wake_unread, __ATOMIC_RELAXED))
+    {
+        if (__atomic_exchange_n(&ctx->read_blocked, FALSE, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&ctx->read_event, TRUE, __ATOMIC_RELEASE);
+            _mysock_wake(&ctx->transport_waiter);
+            if (ctx->loop)
+                _event_loop_notify(ctx);
+        }
+    }
+}
+
+static bool_t queue_ready(void *arg)
+{
+    return !_mysock_queue_empty((const packet_queue_t *) arg);
+}
+
+/* block until a queue is non-empty, and return the slot at its head.  only
+ * the queue's consumer may call this.
+ */
+static packet_slot_t *wait_head_slot(packet_queue_t *pq)
+{
+    if (_mysock_queue_empty(pq))
+        (void) _mysock_wait(pq->waiter, queue_ready, pq, NULL);
+
+    return &pq->head_chunk->slots[pq->head % QUEUE_CHUNK_SLOTS];
+}
+
+/* take the slot at the head of the queue off it, once the consumer is done
+ * with all of it but its buffer reference, which passes to the caller.
+ */
+static mysock_buffer_t *remove_head_slot(packet_queue_t *pq,
+                                         packet_slot_t  *slot)
+{
+    mysock_buffer_t *buf = slot->buffer;
+    unsigned long    head = pq->head + 1;
+
+    __atomic_store_n(&pq->bytes_out, pq->bytes_out + slot->data_len,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&pq->head, head, __ATOMIC_RELAXED);
+
+    if (head % QUEUE_CHUNK_SLOTS == 0)
+    {
+        /* done with this chunk; the producer linked up the next before
+         * publishing the slot we just took.  keep the old one for the
+         * producer to reuse.
+         */
+        packet_chunk_t *chunk = pq->head_chunk;
+
+        pq->head_chunk = chunk->next;
+        assert(pq->head_chunk);
+
+        free(__atomic_exchange_n(&pq->spare, chunk, __ATOMIC_RELEASE));
+    }
+
+    return buf;
+}
+
+/* remove one packet from the head of the queue without copying it.  *data
+ * and *data_len are set to the packet's contents, which stay valid until the
+ * caller releases the returned buffer (NULL if the packet is empty).
+ */
+mysock_buffer_t *_mysock_dequeue_reference(mysock_context_t *ctx,
+                                           packet_queue_t   *pq,
+                                           char            **data,
+                                           size_t           *data_len)
+{
+    packet_slot_t *slot;
+
+    assert(ctx && pq && data && data_len);
+
+    slot = wait_head_slot(pq);
+    *data     = slot->data;
+    *data_len = slot->data_len;
+
+    return remove_head_slot(pq, slot);
 }
 
 /* remove one packet from the head of the waiting packet queue, copying the
- * packet's payload into the specified buffer.  returns the number of bytes
- * copied.  if remove_partial is true, and there is insufficient room in the
- * destination buffer for the packet at the head of the queue, it is only
- * partially dequeued, and the remaining contents remain at the queue's head
- * for a subsequent call to dequeue_buffer().
+ * packet's payload into the specified buffer.  returns the packet's length;
+ * anything beyond max_len bytes is discarded.
  */
 size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               packet_queue_t   *pq,
                               void             *dst,
-                              size_t            max_len,
-                              bool_t            remove_partial)
+                              size_t            max_len)
 {
-    packet_queue_node_t *node;
-    size_t               packet_len;
+    packet_slot_t   *slot;
+    mysock_buffer_t *buf;
+    size_t           packet_len;
 
     assert(ctx && pq && dst);
 
     /* block until queue is non-empty */
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    while (!pq->head)
-    {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                       &ctx->data_ready_lock));
-    }
+    slot = wait_head_slot(pq);
+    assert(slot->data || !slot->data_len);
 
-    node = pq->head;
-    assert(node && node->data);
+    packet_len = slot->data_len;
+    if (packet_len > 0)
+        memcpy(dst, slot->data, MIN(max_len, packet_len));
 
-    if (node->data_len > max_len && remove_partial)
-    {
-        /* remove only a portion of the packet at the head of the queue,
-         * leaving the rest around for the next call to dequeue_buffer().
-         */
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    if ((buf = remove_head_slot(pq, slot)) != NULL)
+        _buffer_release(buf);
 
-        memcpy(dst, node->data, max_len);
-        memcpy(node->data, node->data + max_len, node->data_len - max_len);
-        node->data_len -= max_len;
-        packet_len = max_len;
+    return packet_len;
+}
+
+/* read the queue as a byte stream:  block until it's non-empty, then fill
+ * the specified buffers, in order, with bytes from as many of the queued
+ * packets as it takes.  a packet that doesn't fit is only partially
+ * dequeued, with the rest left at the queue's head for the next call; its
+ * data pointer just moves along, so reading a large packet a little at a
+ * time costs no more than reading it all at once.  an empty packet (an
+ * end-of-file marker) isn't read past:  it's dequeued on its own, giving
+ * a return value of zero.  returns the number of bytes copied.
+ */
+size_t _mysock_dequeue_streamv(mysock_context_t   *ctx,
+                               packet_queue_t     *pq,
+                               const struct iovec *iov,
+                               int                 iovcnt)
+{
+    packet_slot_t   *slot;
+    mysock_buffer_t *buf;
+    size_t           copied = 0;
+    size_t           iov_offset = 0;    /* bytes already filled in iov[k] */
+    int              k = 0;
+
+    assert(ctx && pq && (iov || !iovcnt));
+
+    /* block until queue is non-empty */
+    slot = wait_head_slot(pq);
+    if (slot->data_len == 0)
+    {
+        if ((buf = remove_head_slot(pq, slot)) != NULL)
+            _buffer_release(buf);
+        return 0;
     }
-    else
+
+    for (;;)
     {
-        /* dequeue the entire packet at the head of the queue */
-        if (!(pq->head = pq->head->next))
+        size_t taken = 0;
+
+        assert(slot->data);
+        while (taken < slot->data_len && k < iovcnt)
         {
-            assert(pq->tail == node);
-            pq->tail = NULL;
+            size_t len = MIN(iov[k].iov_len - iov_offset,
+                             slot->data_len - taken);
+
+            memcpy((char *) iov[k].iov_base + iov_offset,
+                   slot->data + taken, len);
+            taken += len;
+
+            if ((iov_offset += len) == iov[k].iov_len)
+            {
+                ++k;
+                iov_offset = 0;
+            }
         }
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        copied += taken;
 
-        memcpy(dst, node->data, MIN(max_len, node->data_len));
-        packet_len = node->data_len;
+        if (taken < slot->data_len)
+        {
+            /* the rest stays queued */
+            slot->data     += taken;
+            slot->data_len -= taken;
+            __atomic_store_n(&pq->bytes_out, pq->bytes_out + taken,
+                             __ATOMIC_RELAXED);
+            break;
+        }
+
+        if ((buf = remove_head_slot(pq, slot)) != NULL)
+            _buffer_release(buf);
 
-        free(node->data);
+        if (k == iovcnt || _mysock_queue_empty(pq))
+            break;
 
-        memset(node, 0, sizeof(*node));
-        free(node);
+        slot = &pq->head_chunk->slots[pq->head % QUEUE_CHUNK_SLOTS];
+        if (slot->data_len == 0)
+            break;  /* end of file, for the next call */
     }
 
-    return packet_len;
+    return copied;
+}
+
+/* as above, into a single buffer */
+size_t _mysock_dequeue_stream(mysock_context_t *ctx,
+                              packet_queue_t   *pq,
+                              void             *dst,
+                              size_t            max_len)
+{
+    struct iovec iov;
+
+    assert(dst);
+
+    iov.iov_base = dst;
+    iov.iov_len  = max_len;
+    return _mysock_dequeue_streamv(ctx, pq, &iov, 1);
 }
 
 /* free any last buffers in the specified queue, discarding the contents.
@@ -237,27 +622,120 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
  */
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
 {
-    packet_queue_node_t *node;
     bool_t result = FALSE;
 
     assert(ctx && pq);
-    result = (pq->head != NULL);
-    for (node = pq->head; node; )
+    if (!pq->head_chunk)
+        return FALSE;   /* never set up */
+
+    while (!_mysock_queue_empty(pq))
     {
-        packet_queue_node_t *next = node->next;
+        packet_slot_t *slot = &pq->head_chunk->slots[pq->head %
+                                                     QUEUE_CHUNK_SLOTS];
+        mysock_buffer_t *buf;
 
-        if (node->data_len > 0)
+        if (slot->data_len > 0)
             result = TRUE;
 
-        free(node->data);
-        free(node);
-        node = next;
+        if ((buf = remove_head_slot(pq, slot)) != NULL)
+            _buffer_release(buf);
     }
 
-    pq->head = pq->tail = NULL;
+    assert(pq->head_chunk == pq->tail_chunk);
+    free(pq->head_chunk);
+    free(pq->spare);
+    memset(pq, 0, sizeof(*pq));
     return result;
 }
 
+
+/* sleep on the waiter until ready(arg) is TRUE, or the (monotonic) time
+ * abstime is reached if that's non-NULL.  returns the last ready(arg).
+ *
+ * the waker publishes whatever it has before looking at the sleeping flag,
+ * and the sleeper sets the flag before looking for it, with a full fence
+ * on both sides; so either the sleeper finds it, or the waker finds the
+ * flag set and signals (under the lock, so not before the sleeper waits).
+ */
+bool_t _mysock_wait(mysock_waiter_t *waiter,
+                    bool_t (*ready)(void *arg), void *arg,
+                    const struct timespec *abstime)
+{
+    bool_t rc;
+
+    assert(waiter && ready);
+
+    PTHREAD_CALL(pthread_mutex_lock(&waiter->lock));
+    for (;;)
+    {
+        __atomic_store_n(&waiter->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if ((rc = ready(arg)) != FALSE)
+            break;
+
+        if (abstime)
+        {
+            /* wait with timeout */
+            int wait_rc = pthread_cond_timedwait(&waiter->cond,
+                                                 &waiter->lock, abstime);
+
+            if (wait_rc == ETIMEDOUT)
+            {
+                rc = ready(arg);
+                break;
+            }
+            assert(wait_rc == 0 || wait_rc == EINTR);
+        }
+        else
+        {
+            /* block indefinitely */
+            PTHREAD_CALL(pthread_cond_wait(&waiter->cond, &waiter->lock));
+        }
+    }
+    __atomic_store_n(&waiter->sleeping, 0, __ATOMIC_RELAXED);
+    PTHREAD_CALL(pthread_mutex_unlock(&waiter->lock));
+
+    return rc;
+}
+
+/* wake the waiter, if it's asleep, once there's something new for it */
+void _mysock_wake(mysock_waiter_t *waiter)
+{
+    assert(waiter);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiter->sleeping, __ATOMIC_RELAXED))
+    {
+        /* once we have the lock, the waiter is either waiting on the
+         * condition variable or will find what we've published.  signal
+         * only after letting go, so it doesn't wake up to a held lock.
+         */
+        PTHREAD_CALL(pthread_mutex_lock(&waiter->lock));
+        PTHREAD_CALL(pthread_mutex_unlock(&waiter->lock));
+        PTHREAD_CALL(pthread_cond_signal(&waiter->cond));
+    }
+}
+
+static void init_waiter(mysock_waiter_t *waiter)
+{
+    pthread_condattr_t cond_attr;
+
+    /* timed waits (stcp_wait_for_event()) are against the monotonic clock */
+    PTHREAD_CALL(pthread_condattr_init(&cond_attr));
+    PTHREAD_CALL(pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC));
+    PTHREAD_CALL(pthread_cond_init(&waiter->cond, &cond_attr));
+    PTHREAD_CALL(pthread_condattr_destroy(&cond_attr));
+    PTHREAD_CALL(pthread_mutex_init(&waiter->lock, NULL));
+    waiter->sleeping = 0;
+}
+
+static void destroy_waiter(mysock_waiter_t *waiter)
+{
+    PTHREAD_CALL(pthread_cond_destroy(&waiter->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&waiter->lock));
+}
+
 /* allocate a new connection context.  this keeps track of the working state
  * between the transport and network layers for a particular connection.  the
  * context is subsequently freed on the network layer's exit.
@@ -271,6 +749,10 @@ static mysock_context_t *_mysock_allocate_context(void)
 
     /* by default, sockets are active */
     ctx->listen_sd = -1;
+    ctx->my_sd = -1;    /* until it has a descriptor */
+    ctx->send_buffer_size = DEFAULT_SEND_BUFFER_SIZE;
+
+    _buffer_pool_init(&ctx->buffer_pool);
 
     /* initialise connection condition variable.  this is signaled when the
      * connection is established, i.e. myconnect() or myaccept() should
@@ -279,11 +761,15 @@ static mysock_context_t *_mysock_allocate_context(void)
     PTHREAD_CALL(pthread_cond_init(&ctx->blocking_cond, NULL));
     PTHREAD_CALL(pthread_mutex_init(&ctx->blocking_lock, NULL));
 
-    /* initialise data ready condition variable.  this is signaled when
-     * data is ready from the application or the network.
+    /* the STCP thread consumes data from the network and the application,
+     * and the application consumes the data STCP passes up to it.
      */
-    PTHREAD_CALL(pthread_cond_init(&ctx->data_ready_cond, NULL));
-    PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
+    init_waiter(&ctx->transport_waiter);
+    init_waiter(&ctx->app_waiter);
+    init_waiter(&ctx->writer_waiter);
+    init_queue(&ctx->network_recv_queue, &ctx->transport_waiter);
+    init_queue(&ctx->app_recv_queue, &ctx->transport_waiter);
+    init_queue(&ctx->app_send_queue, &ctx->app_waiter);
 
     ctx->blocking = TRUE;   /* we unblock once we're connected */
 
@@ -314,8 +800,9 @@ void _mysock_free_context(mysock_context_t *ctx)
     PTHREAD_CALL(pthread_cond_destroy(&ctx->blocking_cond));
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->blocking_lock));
 
-    PTHREAD_CALL(pthread_cond_destroy(&ctx->data_ready_cond));
-    PTHREAD_CALL(pthread_mutex_destroy(&ctx->data_ready_lock));
+    destroy_waiter(&ctx->transport_waiter);
+    destroy_waiter(&ctx->app_waiter);
+    destroy_waiter(&ctx->writer_waiter);
 
     /* free any last buffers that might be lying around (e.g. retransmitted
      * packets from the peer).  normally, the application from/to queues
@@ -326,12 +813,30 @@ void _mysock_free_context(mysock_context_t *ctx)
     (void) _mysock_free_queue(ctx, &ctx->app_recv_queue);
     (void) _mysock_free_queue(ctx, &ctx->app_send_queue);
 
+    if (ctx->transport_packet)
+        _buffer_release(ctx->transport_packet);
+
+    /* the network layer may have buffers of its own to give back */
     _network_close(&ctx->network_state);
 
-    /* clear mysocket descriptor table entry */
+    _buffer_pool_destroy(&ctx->buffer_pool);
+
+    /* clear mysocket descriptor table entry, and put it on the freelist */
     sd = ctx->my_sd;
-    if (global_ctx[sd] == ctx)
-        global_ctx[sd] = 0;
+    if (sd >= 0)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&table_lock));
+        if (lookup_descriptor(sd) == ctx)
+        {
+            descriptor_entry_t *entry = TABLE_ENTRY(sd);
+
+            __atomic_store_n(&entry->ctx, (mysock_context_t *) NULL,
+                             __ATOMIC_RELEASE);
+            entry->next_free = table_freelist;
+            table_freelist = sd;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&table_lock));
+    }
 
     memset(ctx, 0, sizeof(*ctx));
     free(ctx);
@@ -343,7 +848,6 @@ void _mysock_free_context(mysock_context_t *ctx)
 static void *transport_thread_func(void *arg_ptr)
 {
     mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
-    char eof_packet;
 
     assert(ctx);
     ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, ctx->my_sd);
@@ -361,6 +865,18 @@ static void *transport_thread_func(void *arg_ptr)
     /* transport_init() has returned; both sides have closed the connection,
      * do some final cleanup here...
      */
+    _mysock_transport_finished(ctx);
+    return NULL;
+}
+
+/* the transport layer is done with the connection, whichever engine ran
+ * it.  errno is as STCP left it.
+ */
+void _mysock_transport_finished(mysock_context_t *ctx)
+{
+    char eof_packet;
+
+    assert(ctx);
 
     PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
     if (ctx->blocking)
@@ -385,11 +901,23 @@ static void *transport_thread_func(void *arg_ptr)
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
     }
 
+    /* the transport layer is done with the last packet it received */
+    if (ctx->transport_packet)
+    {
+        _buffer_release(ctx->transport_packet);
+        ctx->transport_packet = NULL;
+    }
+
     /* force final myread() to return 0 bytes (this should have been done
      * by the transport layer already in response to the peer's FIN).
      */
     _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, &eof_packet, 0);
-    return NULL;
+
+    /* myclose() waits for this with the event loop engine */
+    __atomic_store_n(&ctx->transport_running, FALSE, __ATOMIC_RELEASE);
+    _mysock_wake(&ctx->app_waiter);
+    _mysock_wake(&ctx->writer_waiter);  /* the send buffer won't drain now */
+    _myepoll_notify(ctx);
 }
 
 
@@ -402,8 +930,8 @@ static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
 {
     mysock_context_t *ctx;
 
-    assert(my_sd >= 0 && my_sd < (int)ARRAY_DIM(global_ctx));
-    ctx = global_ctx[my_sd];
+    assert(my_sd >= 0 && my_sd < MAX_NUM_CONNECTIONS);
+    ctx = lookup_descriptor(my_sd);
 
     assert(ctx);
     assert(ctx->my_sd == my_sd);
@@ -13,6 +13,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 
 #ifndef FALSE
@@ -27,8 +28,10 @@ typedef int bool_t;
 typedef int mysocket_t;     /* mysocket descriptor */
 
 
-/* maximum number of mysockets per process */
-#define MAX_NUM_CONNECTIONS 64
+/* maximum number of mysockets per process.  the descriptor table only
+ * grows as far as the mysockets actually open at once need it to.
+ */
+#define MAX_NUM_CONNECTIONS (1 << 20)
 
 #if (MAX_NUM_CONNECTIONS & (MAX_NUM_CONNECTIONS - 1)) != 0
     #error MAX_NUM_CONNECTIONS should be a power of two
@@ -41,13 +44,113 @@ extern int mylisten(mysocket_t sd, int backlog);
 extern int myconnect(mysocket_t sd, struct sockaddr* name, int namelen);
 extern int myaccept(mysocket_t sd, struct sockaddr* addr, int *addrlen);
 extern int myclose(mysocket_t sd);
+
+/* one thread may be reading a mysocket while another writes to it, but
+ * two threads mustn't myread() (or mywrite()) the same mysocket at once.
+ * once the connection is over (e.g. the peer stopped answering), mywrite()
+ * and the other writes below fail with EPIPE, blocking or not, and queue
+ * nothing.
+ */
 extern int myread(mysocket_t sd, void *buffer, size_t length);
 extern int mywrite(mysocket_t sd, const void *buffer, size_t length);
+
+/* the analogues of readv() and writev().  myreadv() fills the buffers in
+ * turn, as one myread() would; mywritev() queues the buffers' contents as
+ * a single write.
+ */
+extern int myreadv(mysocket_t sd, const struct iovec *iov, int iovcnt);
+extern int mywritev(mysocket_t sd, const struct iovec *iov, int iovcnt);
+
+/* the analogue of sendfile():  queue up to count bytes read from the file
+ * (or socket) fd for sending.  the data is read straight into the
+ * mysocket's buffers, with no copy through the caller.  if offset isn't
+ * NULL, reading starts at *offset, which is updated, and fd's file
+ * position is left alone; otherwise fd is read from its current position.
+ * like sendfile(), this may queue fewer than count bytes, e.g. if fd is a
+ * socket with no more data for the moment; returns the number of bytes
+ * queued, 0 at end of file, or -1 on error.
+ */
+extern ssize_t mysendfile(mysocket_t sd, int fd, off_t *offset, size_t count);
 extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 
+/* mysetsockopt() options.  a listening mysocket passes its options on to
+ * the connections it accepts.
+ *
+ * MYSOCK_NODELAY is the analogue of TCP_NODELAY:  a non-zero value sends
+ * small writes at once rather than holding them back until earlier data
+ * is acknowledged.
+ *
+ * MYSOCK_NONBLOCK is the analogue of O_NONBLOCK:  with a non-zero value,
+ * myread() (or myreadv()) fails with EAGAIN if there's nothing to read,
+ * mywrite() (or mywritev(), mysendfile()) queues only what fits in the
+ * send buffer and fails with EAGAIN if nothing does, myaccept() fails with
+ * EAGAIN if no connection is ready, and myconnect() fails with
+ * EINPROGRESS, leaving the connection to be made in the background; a
+ * later myconnect() gives EALREADY while it's under way, then EISCONN
+ * once it's made or the error if it failed.  see myepoll below for
+ * finding out when to try again.
+ *
+ * MYSOCK_SNDBUF is the analogue of SO_SNDBUF:  the bytes that mywrite()
+ * may queue up ahead of STCP (64KB by default).  once that many are
+ * queued, a blocking mywrite() waits for STCP to take some of them.
+ */
+#define MYSOCK_NODELAY  1
+#define MYSOCK_NONBLOCK 2
+#define MYSOCK_SNDBUF   3
+
+extern int mysetsockopt(mysocket_t sd, int option, int value);
+
+/* myepoll:  readiness notification for many mysockets at once, after
+ * epoll(), so one thread can serve many connections.  a myepoll descriptor
+ * is a real file descriptor, which polls readable whenever myepoll_wait()
+ * has something to report, so it can itself be added to an epoll (or
+ * poll()/select()) set alongside kernel sockets; close it with
+ * myepoll_close(), though, not close().  mysockets are dropped from any
+ * myepoll instances watching them when they're closed.
+ *
+ * events are level-triggered, i.e. reported for as long as they hold, by
+ * default; with MYEPOLLET, a mysocket is only reported again once
+ * something new happens to it, so everything there is to read should be
+ * read each time it's reported.  MYEPOLLERR and MYEPOLLHUP are reported
+ * whether they're asked for or not.  timeout is in milliseconds; -1 waits
+ * indefinitely.
+ */
+#define MYEPOLLIN       0x001   /* data or end of file for myread(), or
+                                 * a connection for myaccept() */
+#define MYEPOLLOUT      0x004   /* connection established, with room in
+                                 * the send buffer for mywrite() */
+#define MYEPOLLERR      0x008   /* connection couldn't be established */
+#define MYEPOLLHUP      0x010   /* connection is over */
+#define MYEPOLLET       (1U << 31)
+
+#define MYEPOLL_CTL_ADD 1
+#define MYEPOLL_CTL_DEL 2
+#define MYEPOLL_CTL_MOD 3
+
+typedef union myepoll_data
+{
+    void     *ptr;
+    int       fd;
+    uint32_t  u32;
+    uint64_t  u64;
+} myepoll_data_t;
+
+struct myepoll_event
+{
+    uint32_t       events;
+    myepoll_data_t data;    /* returned with the mysocket's events */
+};
+
+extern int myepoll_create(void);
+extern int myepoll_ctl(int epd, int op, mysocket_t sd,
+                       struct myepoll_event *event);
+extern int myepoll_wait(int epd, struct myepoll_event *events,
+                        int maxevents, int timeout);
+extern int myepoll_close(int epd);
+
 /* return IP address of interface on which packets to/from peer_addr are
  * delivered.  peer_addr is in network byte order.
  */
@@ -12,6 +12,8 @@
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "connection_demux.h"
+#include "event_loop.h"
+#include "myepoll.h"
 
 
 /* MYSOCK_CHECK(cond,rc) checks that 'cond' is true; if it isn't, error
@@ -20,6 +22,15 @@
 #define MYSOCK_ERROR_EXIT(rc) { errno = rc; return -1; }
 #define MYSOCK_CHECK(cond,rc)   { if (!(cond)) MYSOCK_ERROR_EXIT(rc); }
 
+/* most mysendfile() reads from its file at once */
+#define SENDFILE_CHUNK_SIZE     (64 * 1024)
+
+
+static bool_t transport_finished(void *arg);
+static size_t wait_for_send_space(mysock_context_t *ctx);
+static int queue_write(mysock_context_t *ctx,
+                       const struct iovec *iov, int iovcnt);
+
 
 /* create a new mysocket; returns the corresponding mysocket descriptor */
 mysocket_t mysocket(bool_t is_reliable)
@@ -49,7 +60,17 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
     mysock_context_t *ctx = _mysock_get_context(sd);
 
     MYSOCK_CHECK(ctx != NULL, EINVAL);
-    MYSOCK_CHECK((ctx->network_state.peer_addr_len == 0), EISCONN);
+
+    if (ctx->network_state.peer_addr_len > 0)
+    {
+        /* a non-blocking mysocket's connection may still be under way;
+         * otherwise, it's made (or failed) already.
+         */
+        MYSOCK_CHECK(!__atomic_load_n(&ctx->blocking, __ATOMIC_ACQUIRE),
+                     EALREADY);
+        MYSOCK_CHECK(ctx->stcp_errno == 0, ctx->stcp_errno);
+        MYSOCK_ERROR_EXIT(EISCONN);
+    }
 
 #ifdef DEBUG
     struct sockaddr_in *sin = (struct sockaddr_in *) name;
@@ -80,6 +101,11 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
     /* time for kick off */
     _mysock_transport_init(sd, TRUE);
 
+    /* a non-blocking mysocket leaves the rest to STCP; MYEPOLLOUT (or
+     * MYEPOLLERR) says when it's done.
+     */
+    MYSOCK_CHECK(!ctx->nonblocking, EINPROGRESS);
+
     /* block until connection is established, or we hit an error */
     return _mysock_wait_for_connection(ctx);
 }
@@ -100,9 +126,12 @@ mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
 #endif  /*DEBUG*/
 
     /* the new socket is created on an incoming SYN.  block here until we
-     * establish a connection, or STCP indicates an error condition.
+     * establish a connection, or STCP indicates an error condition (unless
+     * the mysocket doesn't block).
      */
-    _mysock_dequeue_connection(accept_ctx, &ctx);
+    MYSOCK_CHECK(_mysock_dequeue_connection(accept_ctx, &ctx,
+                                            !accept_ctx->nonblocking),
+                 EAGAIN);
     assert(ctx);
 
     if (!ctx->stcp_errno)
@@ -139,6 +168,13 @@ int mylisten(mysocket_t sd, int backlog)
     if (_network_listen(&ctx->network_state, backlog) < 0)
         return -1;
 
+    if (_event_loop_enabled())
+    {
+        /* the loop polls the socket for connection requests instead */
+        _event_loop_add(ctx);
+        return 0;
+    }
+
     /* since we don't spawn an STCP worker thread for passive sockets
      * (there's no transport layer related work to do, so
      * _mysock_transport_init() is never called for such sockets), we
@@ -153,6 +189,15 @@ int mylisten(mysocket_t sd, int backlog)
     return 0;
 }
 
+/* myclose() waits for this with the event loop engine; writes check it
+ * before queueing anything.
+ */
+static bool_t transport_finished(void *arg)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg;
+    return !__atomic_load_n(&ctx->transport_running, __ATOMIC_ACQUIRE);
+}
+
 /* close the given mysocket.  note that the semantics of myclose() differ
  * slightly from a regular close(); STCP doesn't implement TIME_WAIT, so
  * myclose() simply discards all knowledge of the connection once the
@@ -166,10 +211,20 @@ int myclose(mysocket_t sd)
     MYSOCK_CHECK(ctx != NULL, EBADF);
 
     /* stcp_wait_for_event() needs to wake up on a socket close request */
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    ctx->close_requested = TRUE;
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    __atomic_store_n(&ctx->close_requested, TRUE, __ATOMIC_RELEASE);
+    _mysock_wake(&ctx->transport_waiter);
+
+    if (ctx->loop)
+    {
+        /* the loop runs STCP instead; wait for it to finish with the
+         * connection, then to let go of the mysocket altogether.
+         */
+        _event_loop_notify(ctx);
+
+        (void) _mysock_wait(&ctx->app_waiter, transport_finished, ctx, NULL);
+
+        _event_loop_remove(ctx);
+    }
 
     /* block until STCP thread exits */
     if (ctx->transport_thread_started)
@@ -188,6 +243,9 @@ int myclose(mysocket_t sd)
         _mysock_close_passive_socket(ctx);
     }
 
+    /* no more news of it for any myepoll instances watching it */
+    _myepoll_forget(ctx);
+
     /* free all resources associated with this mysocket */
     _mysock_free_context(ctx);
 
@@ -198,15 +256,16 @@ int myclose(mysocket_t sd)
 int mywrite(mysocket_t sd, const void *buf, size_t buf_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    struct iovec iov;
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
 
     assert(!ctx->close_requested);
-    _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
 
-    /* XXX: all bytes are queued, irrespective of current sender window */
-    return buf_len;
+    iov.iov_base = (void *) buf;
+    iov.iov_len  = buf_len;
+    return queue_write(ctx, &iov, 1);
 }
 
 int myread(mysocket_t sd, void *buf, size_t buf_len)
@@ -222,16 +281,253 @@ int myread(mysocket_t sd, void *buf, size_t buf_len)
     if (ctx->eof)
         return 0;
 
-    if ((len = _mysock_dequeue_buffer(ctx, &ctx->app_send_queue,
-                                      buf, buf_len, TRUE)) == 0)
+    MYSOCK_CHECK(!ctx->nonblocking ||
+                 !_mysock_queue_empty(&ctx->app_send_queue), EAGAIN);
+
+    if ((len = _mysock_dequeue_stream(ctx, &ctx->app_send_queue,
+                                      buf, buf_len)) == 0)
     {
         /* make sure repeated calls to myread() return 0 on EOF */
         ctx->eof = TRUE;
     }
+    else
+    {
+        _mysock_data_read(ctx);
+    }
+
+    return len;
+}
+
+int mywritev(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(iovcnt >= 0 && (iov || !iovcnt), EINVAL);
+
+    assert(!ctx->close_requested);
+    return queue_write(ctx, iov, iovcnt);
+}
+
+int myreadv(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int len;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(iovcnt >= 0 && (iov || !iovcnt), EINVAL);
+
+    assert(!ctx->close_requested);
+
+    if (ctx->eof)
+        return 0;
+
+    MYSOCK_CHECK(!ctx->nonblocking ||
+                 !_mysock_queue_empty(&ctx->app_send_queue), EAGAIN);
+
+    if ((len = _mysock_dequeue_streamv(ctx, &ctx->app_send_queue,
+                                       iov, iovcnt)) == 0)
+    {
+        /* make sure repeated calls to myreadv() return 0 on EOF */
+        ctx->eof = TRUE;
+    }
+    else
+    {
+        _mysock_data_read(ctx);
+    }
 
     return len;
 }
 
+ssize_t mysendfile(mysocket_t sd, int fd, off_t *offset, size_t count)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t queued = 0;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+
+    assert(!ctx->close_requested);
+
+    /* nothing's read from fd for a connection that's over */
+    MYSOCK_CHECK(!transport_finished(ctx), EPIPE);
+
+    while (queued < count)
+    {
+        size_t chunk_len = MIN(count - queued, SENDFILE_CHUNK_SIZE);
+        size_t space = wait_for_send_space(ctx);
+        mysock_buffer_t *buf;
+        ssize_t n;
+
+        if (space == 0)
+        {
+            MYSOCK_CHECK(queued > 0, (ctx->nonblocking &&
+                                      !transport_finished(ctx)) ?
+                                     EAGAIN : EPIPE);
+            break;
+        }
+
+        chunk_len = MIN(chunk_len, space);
+        buf = _buffer_alloc(&ctx->buffer_pool, chunk_len);
+
+        do
+        {
+            n = offset ? pread(fd, buf->data, chunk_len, *offset) :
+                         read(fd, buf->data, chunk_len);
+        } while (n < 0 && errno == EINTR);
+
+        if (n <= 0)
+        {
+            _buffer_release(buf);
+            if (n < 0 && queued == 0)
+                return -1;
+            break;
+        }
+
+        if ((size_t) n <= BUFFER_POOL_SIZE && buf->size > BUFFER_POOL_SIZE)
+        {
+            /* a short read into a large buffer; a copy into a packet-sized
+             * one frees the large one now, rather than once it's sent.
+             */
+            _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf->data, n);
+        }
+        else
+        {
+            _mysock_enqueue_reference(ctx, &ctx->app_recv_queue,
+                                      buf, buf->data, n);
+        }
+        _buffer_release(buf);
+
+        queued += n;
+        if (offset)
+            *offset += n;
+
+        if ((size_t) n < chunk_len)
+            break;  /* nothing more for now, or end of file */
+    }
+
+    return queued;
+}
+
+/* a blocking mywrite() waits for this */
+static bool_t send_space_ready(void *arg)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg;
+
+    return _mysock_can_send(ctx) ||
+           !__atomic_load_n(&ctx->transport_running, __ATOMIC_ACQUIRE);
+}
+
+/* room in the send buffer, waiting for some if the mysocket blocks.
+ * returns zero if there's none to be had, i.e. the mysocket doesn't block,
+ * or the connection's over.  the latter is checked first, and again after
+ * waiting, so nothing is ever queued that STCP will never send.
+ */
+static size_t wait_for_send_space(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    if (transport_finished(ctx))
+        return 0;
+
+    if (!_mysock_can_send(ctx))
+    {
+        if (ctx->nonblocking)
+            return 0;
+        (void) _mysock_wait(&ctx->writer_waiter, send_space_ready, ctx, NULL);
+        if (transport_finished(ctx))
+            return 0;
+    }
+    return _mysock_send_space(ctx);
+}
+
+/* queue the application's data for STCP, gathered from iovcnt buffers, as
+ * far as there's room in the send buffer.  a blocking mysocket waits for
+ * room for the rest.  returns the number of bytes queued, as for mywrite().
+ */
+static int queue_write(mysock_context_t *ctx,
+                       const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0, queued = 0;
+    size_t iov_offset = 0;  /* bytes already queued from iov[k] */
+    int k;
+
+    assert(ctx && (iov || !iovcnt));
+
+    /* a connection that's over takes no more data, even if there's room */
+    MYSOCK_CHECK(!transport_finished(ctx), EPIPE);
+
+    for (k = 0; k < iovcnt; ++k)
+        total += iov[k].iov_len;
+
+    for (k = 0; queued < total; )
+    {
+        size_t chunk_len = MIN(total - queued, wait_for_send_space(ctx));
+        size_t len = 0;
+        mysock_buffer_t *buf;
+
+        if (chunk_len == 0)
+        {
+            MYSOCK_CHECK(queued > 0, (ctx->nonblocking &&
+                                      !transport_finished(ctx)) ?
+                                     EAGAIN : EPIPE);
+            break;
+        }
+
+        /* gather the pieces straight into the buffer that's queued */
+        buf = _buffer_alloc(&ctx->buffer_pool, chunk_len);
+        while (len < chunk_len)
+        {
+            size_t n = MIN(iov[k].iov_len - iov_offset, chunk_len - len);
+
+            memcpy(buf->data + len, (char *) iov[k].iov_base + iov_offset, n);
+            len += n;
+
+            if ((iov_offset += n) == iov[k].iov_len)
+            {
+                ++k;
+                iov_offset = 0;
+            }
+        }
+
+        _mysock_enqueue_reference(ctx, &ctx->app_recv_queue,
+                                  buf, buf->data, chunk_len);
+        _buffer_release(buf);
+        queued += chunk_len;
+    }
+
+    return queued;
+}
+
+/* set an option on the mysocket; see mysock.h for the options supported */
+int mysetsockopt(mysocket_t sd, int option, int value)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+
+    switch (option)
+    {
+    case MYSOCK_NODELAY:
+        ctx->nodelay = (value != 0);
+        break;
+    case MYSOCK_NONBLOCK:
+        ctx->nonblocking = (value != 0);
+        break;
+    case MYSOCK_SNDBUF:
+        MYSOCK_CHECK(value > 0, EINVAL);
+        ctx->send_buffer_size = value;
+        /* there may be room now for a writer waiting on a smaller size */
+        _mysock_send_space_freed(ctx);
+        break;
+    default:
+        MYSOCK_ERROR_EXIT(ENOPROTOOPT);
+    }
+    return 0;
+}
+
 /* fills in addr with current port associated with the mysocket descriptor.
  * like the regular getsockname(), this does not fill in the local IP
  * address unless it's known.
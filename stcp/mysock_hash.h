@@ -1,164 +1,350 @@
-/* ugh, an ugly approximation to std::map (or rather, std::hash_map).
- * this is what happens when I use C rather than C++...
+/* mysock_hash.h--an open addressing hash map, for the mysocket layer's
+ * lookups by key (e.g. a listener's pending connection requests, by peer).
+ * the tree is built with g++, so this is a template rather than macros.
+ *
+ * the table is laid out much like a "Swiss table":  alongside the array
+ * of entries is an array of one control byte per entry, which says whether
+ * the entry's empty, deleted, or full, and for a full entry holds seven
+ * bits of its key's hash.  a lookup scans the control bytes a group of
+ * eight at a time, as a single 64-bit word, for those matching its hash,
+ * and only compares keys for those; it stops at the first group with an
+ * empty entry in it.  groups are probed quadratically (by group) from the
+ * one the rest of the hash picks.  the table size is a power of two, and
+ * doubles once it's 7/8 full (counting deleted entries, which a rehash
+ * clears out).
+ *
+ * example usage, to map uint16_t -> mysock_context_t *:
+ *
+ * mysock_hash_map<uint16_t, mysock_context_t *> port_table;
+ * ...
+ * port_table.insert(new_port, new_ctx);
+ * assert(*port_table.find(new_port) == new_ctx);
+ * port_table.erase(new_port);
+ * assert(!port_table.find(new_port));
+ *
+ * like the rest of the mysocket layer's tables, a map does not handle
+ * thread safety; the calling code should lock it as needed.  hash
+ * functions needn't mix their bits; the map does that itself.
  */
 
 #ifndef __MYSOCK_HASH_H__
 #define __MYSOCK_HASH_H__
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <assert.h>
-#include "mysock.h"
+#include <new>
 
 
-/* these macros do not handle thread safety; the calling code should
- * lock/unlock the hash table as needed.
- *
- * HASH_TABLE_DECLARE and HASH_TABLE_DECLARE_EXTENDED must be invoked in
- * the global namespace, before any use of the hash table.  HASH_INSERT,
- * HASH_DELETE, and HASH_LOOKUP perform the usual insertion, delete, and
- * lookup operations, using chaining for conflict resolution.  data items
- * are copied into the hash table; this is a shallow copy for pointers.
- * insertion does not check for duplicates; HASH_LOOKUP is valid for a key
- * only if HASH_ENTRY_EXISTS returns true for the corresponding key.
- * HASH_LOOKUP_PTR is a special version of HASH_LOOKUP for the case where
- * the data type stored in the hash is a pointer; it permits queries
- * without checking for key existence first, and returns NULL on a key's
- * absence from the table.  (if the key exists, it behaves identically to
- * HASH_LOOKUP).
- *
- * example usage, to map uint16_t -> mysock_context_t * using a hash
- * function unsigned int port_hash(uint16_t key, unsigned int table_size):
- *
- * static __inline bool_t key_equal(uint16_t a, uint16_t b)
- *   { return (a) == (b); }
- * static __inline unsigned int port_hash(uint16_t key, unsigned int size)
- *   { return (key) % (size); }
- *
- * HASH_TABLE_DECLARE_EXTENDED(port_table, uint16_t, mysock_context_t *,
- *                             port_hash, key_equal, 1024);
- *
- * --or (simpler)--
- * HASH_TABLE_DECLARE(port_table, uint16_t, mysock_context_t *, 1024);
- *
- * ...
- * uint16_t new_port;
- * mysock_context_t *new_ctx;
- * ...
- * HASH_INSERT(port_table, new_port, new_ctx);
- * assert(HASH_ENTRY_EXISTS(port_table, new_port));
- * assert(HASH_LOOKUP(port_table, new_port) == new_ctx);
- * HASH_DELETE(port_table, new_port);
- * assert(!HASH_ENTRY_EXISTS(port_table, new_port));
- * assert(!HASH_LOOKUP_PTR(port_table, new_port));
- *
- */
+/* defaults, for integer and pointer keys */
+template <class K>
+struct mysock_hash_fn
+{
+    size_t operator()(const K &key) const { return (size_t) key; }
+};
 
-#define HASH_TABLE_DECLARE_EXTENDED(tbl,keytype,datatype,hashfn,keyequal,size)\
-typedef struct tbl##_entry \
-{ \
-    keytype             key; \
-    datatype            data; \
-    struct tbl##_entry *next; \
-} __##tbl##_entry_t; \
-static __##tbl##_entry_t *tbl[size]; \
-\
-static __##tbl##_entry_t *_hash_get_entry_##tbl(keytype key) \
-{ \
-    __##tbl##_entry_t *e; \
-    unsigned int ndx; \
-    \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
-    \
-    for (e = tbl[ndx]; e && !keyequal(e->key, key); e = e->next) ; \
-    return (e && keyequal(e->key, key)) ? e : NULL; \
-} \
-\
-static void _hash_insert_##tbl(keytype key, datatype data) \
-{ \
-    unsigned int ndx; \
-    __##tbl##_entry_t *old_head; \
-    \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
-    old_head = tbl[ndx]; \
-    \
-    tbl[ndx] = (__##tbl##_entry_t *) malloc(sizeof(__##tbl##_entry_t)); \
-    assert(tbl[ndx]); \
-    \
-    tbl[ndx]->key  = key; \
-    tbl[ndx]->data = data; \
-    tbl[ndx]->next = old_head; \
-    \
-    assert(_hash_get_entry_##tbl(key) == tbl[ndx]); \
-} \
-\
-static datatype _hash_lookup_##tbl(keytype key) \
-{ \
-    __##tbl##_entry_t *e = _hash_get_entry_##tbl(key); \
-    assert(e); \
-    return e->data; \
-} \
-\
-static datatype _hash_lookup_ptr_##tbl(keytype key) \
-{ \
-    __##tbl##_entry_t *e = _hash_get_entry_##tbl(key); \
-    return e ? e->data : NULL; \
-} \
-\
-static bool_t _hash_entry_exists_##tbl(keytype key) \
-{ \
-    __##tbl##_entry_t *e = _hash_get_entry_##tbl(key); \
-    return (e != NULL); \
-} \
-\
-static void _hash_set_entry_##tbl(keytype key, datatype data) \
-{ \
-    __##tbl##_entry_t *e = _hash_get_entry_##tbl(key); \
-    if (e != NULL) \
-        e->data = data; \
-    else \
-        _hash_insert_##tbl(key, data); \
-} \
-\
-static void _hash_delete_##tbl(keytype key) \
-{ \
-    __##tbl##_entry_t *prev = 0, *e; \
-    unsigned int ndx; \
-    \
-    ndx = hashfn(key, size); \
-    assert(ndx < size); \
-    \
-    for (e = tbl[ndx]; e; e = e->next) \
-    { \
-        if (keyequal(e->key, key)) \
-        { \
-            *((e == tbl[ndx]) ? &tbl[ndx] : &prev->next) = e->next; \
-            break; \
-        } \
-        prev = e; \
-    } \
-    \
-    free(e); \
-    assert(!_hash_get_entry_##tbl(key)); \
-}
-
-
-#define HASH_INSERT(tbl,key,entry)      _hash_insert_##tbl(key, entry)
-#define HASH_DELETE(tbl,key)            _hash_delete_##tbl(key)
-#define HASH_ENTRY_EXISTS(tbl,key)      _hash_entry_exists_##tbl(key)
-#define HASH_SET_ENTRY(tbl,key,entry)   _hash_set_entry_##tbl(key, entry)
-#define HASH_LOOKUP(tbl,key)            _hash_lookup_##tbl(key)
-#define HASH_LOOKUP_PTR(tbl,key)        _hash_lookup_ptr_##tbl(key)
-
-#define HASH_DEFAULT_KEY_EQUALS(a,b)    ((a) == (b))
-#define HASH_DEFAULT_HASH_FN(key,size)  ((key) % (size))
-
-#define HASH_TABLE_DECLARE(tbl,keytype,datatype,size) \
-    HASH_TABLE_DECLARE_EXTENDED(tbl, keytype, datatype, \
-                                HASH_DEFAULT_HASH_FN, \
-                                HASH_DEFAULT_KEY_EQUALS,size)
+template <class K>
+struct mysock_key_equal
+{
+    bool operator()(const K &a, const K &b) const { return a == b; }
+};
 
 
-#endif  /* __MYSOCK_HASH_H__ */
+template <class K, class V,
+          class Hash = mysock_hash_fn<K>, class Equal = mysock_key_equal<K> >
+class mysock_hash_map
+{
+public:
+    explicit mysock_hash_map(const Hash  &hash_fn  = Hash(),
+                             const Equal &equal_fn = Equal())
+        : ctrl(NULL), slots(NULL), capacity(0), num_entries(0),
+          num_deleted(0), hash_fn(hash_fn), equal_fn(equal_fn)
+    {
+    }
+
+    ~mysock_hash_map()
+    {
+        clear();
+        free(ctrl);
+        free(slots);
+    }
+
+    size_t size() const { return num_entries; }
+
+    /* the value for key, or NULL if it isn't in the map.  the pointer is
+     * good until the map is next changed.
+     */
+    V *find(const K &key)
+    {
+        size_t ndx = find_slot(key, mix(hash_fn(key)));
+        return (ndx < capacity) ? &slots[ndx].value : NULL;
+    }
+
+    /* add key, unless it's there already; returns false (leaving the map
+     * as it was) if so.
+     */
+    bool insert(const K &key, const V &value)
+    {
+        size_t h = mix(hash_fn(key));
+        size_t ndx;
+
+        if (find_slot(key, h) < capacity)
+            return false;
+
+        if ((num_entries + num_deleted + 1) * 8 > capacity * 7)
+            rehash(num_deleted >= num_entries ? capacity : 2 * capacity);
+
+        ndx = free_slot(h);
+        if (ctrl[ndx] == CTRL_DELETED)
+            --num_deleted;
+
+        new (&slots[ndx]) slot_t(key, value);
+        ctrl[ndx] = h2(h);
+        ++num_entries;
+        return true;
+    }
+
+    /* remove key; returns false if it wasn't in the map */
+    bool erase(const K &key)
+    {
+        size_t ndx = find_slot(key, mix(hash_fn(key)));
+
+        if (ndx >= capacity)
+            return false;
+
+        slots[ndx].~slot_t();
+        --num_entries;
+
+        /* a group that's never been full has never been probed past, so
+         * the entry can go back to being empty; otherwise it has to stay
+         * in the way of lookups that continue to later groups.
+         */
+        if (group_mask_empty(load_group(ndx & ~(size_t) (GROUP_SIZE - 1))))
+        {
+            ctrl[ndx] = CTRL_EMPTY;
+        }
+        else
+        {
+            ctrl[ndx] = CTRL_DELETED;
+            ++num_deleted;
+        }
+
+        return true;
+    }
+
+    /* make room for n entries, so they can be added without a rehash */
+    void reserve(size_t n)
+    {
+        size_t new_capacity = capacity ? capacity : (size_t) GROUP_SIZE;
+
+        while (n * 8 > new_capacity * 7)
+            new_capacity *= 2;
+        if (new_capacity > capacity)
+            rehash(new_capacity);
+    }
+
+    /* call fn for each entry, in no particular order.  fn mustn't change
+     * the map.
+     */
+    void for_each(void (*fn)(const K &key, V &value, void *arg), void *arg)
+    {
+        size_t k;
+
+        assert(fn);
+        for (k = 0; k < capacity; ++k)
+        {
+            if (is_full(ctrl[k]))
+                fn(slots[k].key, slots[k].value, arg);
+        }
+    }
+
+    void clear()
+    {
+        size_t k;
 
+        for (k = 0; k < capacity; ++k)
+        {
+            if (is_full(ctrl[k]))
+                slots[k].~slot_t();
+        }
+
+        if (ctrl)
+            memset(ctrl, CTRL_EMPTY, capacity);
+        num_entries = num_deleted = 0;
+    }
+
+private:
+    struct slot_t
+    {
+        slot_t(const K &key, const V &value) : key(key), value(value) { }
+
+        K key;
+        V value;
+    };
+
+    /* control bytes:  a full entry's is the low seven bits of its hash */
+    enum
+    {
+        CTRL_EMPTY   = 0x80,
+        CTRL_DELETED = 0xfe,
+        GROUP_SIZE   = 8
+    };
+
+    static const uint64_t LSBS = 0x0101010101010101ULL;
+    static const uint64_t MSBS = 0x8080808080808080ULL;
+
+    uint8_t *ctrl;
+    slot_t  *slots;
+    size_t   capacity;      /* 0, or a power of two of at least GROUP_SIZE */
+    size_t   num_entries;
+    size_t   num_deleted;
+    Hash     hash_fn;
+    Equal    equal_fn;
+
+    /* not copyable */
+    mysock_hash_map(const mysock_hash_map &);
+    mysock_hash_map &operator=(const mysock_hash_map &);
+
+    static bool is_full(uint8_t c) { return !(c & 0x80); }
+
+    static size_t mix(size_t h)
+    {
+        uint64_t x = (uint64_t) h * 0x9e3779b97f4a7c15ULL;
+        return (size_t) (x ^ (x >> 32));
+    }
+
+    static uint8_t h2(size_t h) { return (uint8_t) (h & 0x7f); }
+    static size_t  h1(size_t h) { return h >> 7; }
+
+    /* the eight control bytes of the group starting at ndx, with the first
+     * in the least significant byte.
+     */
+    uint64_t load_group(size_t ndx) const
+    {
+        uint64_t group;
+
+        memcpy(&group, ctrl + ndx, sizeof(group));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        group = __builtin_bswap64(group);
+#endif
+        return group;
+    }
+
+    /* the high bit of each byte is set in these masks for the entries that
+     * match.  group_mask_match() may have false positives, which a key
+     * comparison weeds out anyway.
+     */
+    static uint64_t group_mask_match(uint64_t group, uint8_t c)
+    {
+        uint64_t x = group ^ (LSBS * c);
+        return (x - LSBS) & ~x & MSBS;
+    }
+
+    static uint64_t group_mask_empty(uint64_t group)
+    {
+        return group & ~(group << 6) & MSBS;
+    }
+
+    static uint64_t group_mask_empty_or_deleted(uint64_t group)
+    {
+        return group & ~(group << 7) & MSBS;
+    }
+
+    static size_t lowest_byte(uint64_t mask)
+    {
+        return __builtin_ctzll(mask) >> 3;
+    }
+
+    /* the index of key's entry, or capacity if there's none */
+    size_t find_slot(const K &key, size_t h) const
+    {
+        size_t num_groups = capacity / GROUP_SIZE;
+        size_t g, k;
+
+        if (!capacity)
+            return capacity;
+
+        for (g = h1(h) & (num_groups - 1), k = 1; ;
+             g = (g + k++) & (num_groups - 1))
+        {
+            uint64_t group = load_group(g * GROUP_SIZE);
+            uint64_t match;
+
+            for (match = group_mask_match(group, h2(h)); match;
+                 match &= match - 1)
+            {
+                size_t ndx = g * GROUP_SIZE + lowest_byte(match);
+
+                if (is_full(ctrl[ndx]) && equal_fn(slots[ndx].key, key))
+                    return ndx;
+            }
+
+            if (group_mask_empty(group) || k > num_groups)
+                return capacity;
+        }
+    }
+
+    /* the first empty or deleted entry along h's probe sequence.  the
+     * table is never full, so there's always one.
+     */
+    size_t free_slot(size_t h) const
+    {
+        size_t num_groups = capacity / GROUP_SIZE;
+        size_t g, k;
+
+        assert(num_entries < capacity);
+        for (g = h1(h) & (num_groups - 1), k = 1; ;
+             g = (g + k++) & (num_groups - 1))
+        {
+            uint64_t avail = group_mask_empty_or_deleted(
+                load_group(g * GROUP_SIZE));
+
+            if (avail)
+                return g * GROUP_SIZE + lowest_byte(avail);
+        }
+    }
+
+    /* move everything into a table of new_capacity entries, leaving out
+     * any deleted ones.
+     */
+    void rehash(size_t new_capacity)
+    {
+        uint8_t *old_ctrl = ctrl;
+        slot_t  *old_slots = slots;
+        size_t   old_capacity = capacity;
+        size_t   k;
+
+        if (new_capacity < GROUP_SIZE)
+            new_capacity = GROUP_SIZE;
+        assert(!(new_capacity & (new_capacity - 1)));
+        assert(num_entries * 8 < new_capacity * 7);
+
+        ctrl = (uint8_t *) malloc(new_capacity);
+        slots = (slot_t *) malloc(new_capacity * sizeof(slot_t));
+        assert(ctrl && slots);
+        memset(ctrl, CTRL_EMPTY, new_capacity);
+        capacity = new_capacity;
+        num_deleted = 0;
+
+        for (k = 0; k < old_capacity; ++k)
+        {
+            if (is_full(old_ctrl[k]))
+            {
+                size_t h = mix(hash_fn(old_slots[k].key));
+                size_t ndx = free_slot(h);
+
+                new (&slots[ndx]) slot_t(old_slots[k].key,
+                                         old_slots[k].value);
+                ctrl[ndx] = h2(h);
+                old_slots[k].~slot_t();
+            }
+        }
+
+        free(old_ctrl);
+        free(old_slots);
+    }
+};
+
+
+#endif  /* __MYSOCK_HASH_H__ */
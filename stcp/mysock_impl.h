@@ -12,8 +12,10 @@
 #include <errno.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
 #include "mysock.h"
 #include "network_io.h"
+#include "buffer_pool.h"
 
 #ifdef __GNUC__
     #define INLINE __inline__
@@ -40,6 +42,9 @@ static INLINE void _pthread_call(int pthread_retval)
     #define MIN(a,b)    ((a) < (b) ? (a) : (b))
 #endif
 
+/* send buffer size (MYSOCK_SNDBUF) until the application says otherwise */
+#define DEFAULT_SEND_BUFFER_SIZE    (64 * 1024)
+
 #ifdef DEBUG
     /* usage:  DEBUG_LOG((fmt string, args, ...)) */
     #define DEBUG_LOG(args) { printf args; fflush(stdout); }
@@ -48,18 +53,56 @@ static INLINE void _pthread_call(int pthread_retval)
 #endif
 
 
-/* packet/buffer queue */
-typedef struct packet_queue_node
+/* a thread that may have to sleep until another thread has something for
+ * it.  the other thread only touches the lock and condition variable if
+ * the sleeper has said it's sleeping, so handing over data to a thread
+ * that's busy anyway costs nothing but a memory fence.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             sleeping;   /* waiter is (about to be) asleep */
+} mysock_waiter_t;
+
+/* packet/buffer queue.  each queue has exactly one producer and one
+ * consumer thread, so it's a lock-free ring:  a list of chunks of slots,
+ * to which the producer adds a chunk whenever the last one fills up, and
+ * from which the consumer drops chunks as it empties them.  the slots
+ * between head and tail are the queued packets; the producer publishes
+ * them by advancing tail.  each slot holds a reference to the buffer its
+ * data lies in (see buffer_pool.h); the data pointer moves along as the
+ * packet is partially dequeued.
+ */
+#define QUEUE_CHUNK_SLOTS 64
+
+typedef struct
+{
+    mysock_buffer_t *buffer;    /* NULL if data_len is zero */
+    char            *data;
+    size_t           data_len;
+} packet_slot_t;
+
+typedef struct packet_chunk
 {
-    char                     *data;
-    size_t                    data_len;
-    struct packet_queue_node *next;
-} packet_queue_node_t;
+    packet_slot_t        slots[QUEUE_CHUNK_SLOTS];
+    struct packet_chunk *next;
+} packet_chunk_t;
 
 typedef struct
 {
-    packet_queue_node_t *head;
-    packet_queue_node_t *tail;
+    /* consumer's end */
+    packet_chunk_t  *head_chunk;
+    unsigned long    head;
+    size_t           bytes_out;     /* total data_len ever dequeued */
+
+    /* producer's end */
+    packet_chunk_t  *tail_chunk;
+    unsigned long    tail;
+    size_t           bytes_in;      /* total data_len ever enqueued */
+
+    packet_chunk_t  *spare;         /* emptied chunk, for the producer */
+    mysock_waiter_t *waiter;        /* the consumer */
 } packet_queue_t;
 
 /* mysocket context (and the arguments provided to the transport layer
@@ -71,6 +114,9 @@ typedef struct mysock_context
 {
     /* connection parameters */
     int is_active;      /* true if we're connect()ing, false if accept()ing */
+    bool_t nodelay;     /* MYSOCK_NODELAY set with mysetsockopt() */
+    bool_t nonblocking; /* MYSOCK_NONBLOCK */
+    size_t send_buffer_size;    /* MYSOCK_SNDBUF */
 
     /* student's STCP implementation working state */
     void *stcp_state;
@@ -88,6 +134,12 @@ typedef struct mysock_context
      */
     mysocket_t listen_sd;
 
+    /* set up from a SYN cookie, i.e. the listening socket's SYN-ACK with
+     * this sequence number was acknowledged (see stcp_syn_cookie()).
+     */
+    bool_t   syn_cookie;
+    uint32_t syn_cookie_isn;
+
     /* block application until connected (or an error) */
     pthread_cond_t  blocking_cond;
     pthread_mutex_t blocking_lock;
@@ -98,9 +150,36 @@ typedef struct mysock_context
     pthread_t       transport_thread;
     bool_t          transport_thread_started;
 
-    /* is data ready from either network or the app? */
-    pthread_cond_t  data_ready_cond;
-    pthread_mutex_t data_ready_lock;
+    /* event loop running this mysocket instead, if any (event_loop.c) */
+    struct event_loop     *loop;
+    struct mysock_context *loop_next;   /* on the loop's pending list */
+    bool_t                 loop_pending;    /* on that list already */
+    bool_t                 loop_remove;     /* myclose() wants it dropped */
+    bool_t                 loop_started;    /* loop has taken it on */
+    bool_t                 loop_watching;   /* loop polls its socket */
+    bool_t                 transport_running;   /* not finished yet */
+
+    /* the STCP thread waits for data from either the network or the app,
+     * or a close request; the application waits for data from STCP, or
+     * for the connection to finish.
+     */
+    mysock_waiter_t transport_waiter;
+    mysock_waiter_t app_waiter;
+
+    /* a blocking mywrite() waits for room in the send buffer, i.e. for
+     * STCP to take some of app_recv_queue.  send_blocked says someone's
+     * interested in that (see _mysock_can_send()).
+     */
+    mysock_waiter_t writer_waiter;
+    bool_t          send_blocked;
+
+    /* the other way round: STCP closed its receive window, and wants to
+     * hear (APP_READ) once myread() has left no more than read_wake_unread
+     * bytes of app_send_queue (see stcp_app_read_notify()).
+     */
+    bool_t          read_blocked;
+    size_t          read_wake_unread;
+    bool_t          read_event;         /* APP_READ pending */
     bool_t          close_requested;    /* myclose() called by app? */
     bool_t          eof;                /* true once peer finishes writing */
 
@@ -112,6 +191,26 @@ typedef struct mysock_context
     packet_queue_t  network_recv_queue; /* data coming from peer */
     packet_queue_t  app_send_queue; /* data to be passed up to app */
     packet_queue_t  app_recv_queue; /* data coming from app */
+
+    /* buffers for the queues' data */
+    buffer_pool_t   buffer_pool;
+
+    /* myepoll instances watching this mysocket (myepoll.c), and for a
+     * listening mysocket, the established connections myaccept() hasn't
+     * taken yet.
+     */
+    struct myepoll_item *epoll_items;
+    unsigned int         connections_ready;
+
+    /* for a listening mysocket, its connection backlog, once mylisten()
+     * has been called (connection_demux.c).
+     */
+    struct listen_queue *listen_queue;
+
+    /* packet last taken by stcp_network_recv_packet(), which the transport
+     * layer may still be looking at.
+     */
+    mysock_buffer_t *transport_packet;
 } mysock_context_t;
 
 
@@ -131,15 +230,53 @@ void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             const void       *packet,
                             size_t            packet_len);
 
+void _mysock_enqueue_reference(mysock_context_t *ctx,
+                               packet_queue_t   *pq,
+                               mysock_buffer_t  *buf,
+                               const void       *data,
+                               size_t            data_len);
+
+mysock_buffer_t *_mysock_dequeue_reference(mysock_context_t *ctx,
+                                           packet_queue_t   *pq,
+                                           char            **data,
+                                           size_t           *data_len);
+
 size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               packet_queue_t   *pq,
                               void             *dst,
-                              size_t            max_len,
-                              bool_t            remove_partial);
+                              size_t            max_len);
+
+size_t _mysock_dequeue_stream(mysock_context_t *ctx,
+                              packet_queue_t   *pq,
+                              void             *dst,
+                              size_t            max_len);
+
+size_t _mysock_dequeue_streamv(mysock_context_t   *ctx,
+                               packet_queue_t     *pq,
+                               const struct iovec *iov,
+                               int                 iovcnt);
+
+bool_t _mysock_queue_empty(const packet_queue_t *pq);
+size_t _mysock_queue_bytes(const packet_queue_t *pq);
+
+size_t _mysock_send_space(const mysock_context_t *ctx);
+bool_t _mysock_can_send(mysock_context_t *ctx);
+void _mysock_send_space_freed(mysock_context_t *ctx);
+void _mysock_data_read(mysock_context_t *ctx);
+
+bool_t _mysock_wait(mysock_waiter_t *waiter,
+                    bool_t (*ready)(void *arg), void *arg,
+                    const struct timespec *abstime);
+void _mysock_wake(mysock_waiter_t *waiter);
+
+void _mysock_transport_finished(mysock_context_t *ctx);
 
 int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
 
+/* stcp_api.c */
+unsigned int _mysock_ready_events(mysock_context_t *ctx, unsigned int flags);
+
 #endif  /* __MYSOCK_INTERNAL_H__ */
 
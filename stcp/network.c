@@ -20,16 +20,23 @@
 
 /* helper function for stcp_network_send(); this takes care of unreliable
  * delivery simulation, etc, before passing a packet off to
- * _network_send_packet() for actual transmission over the network.
+ * _network_send_packet() for actual transmission over the network.  the
+ * packet is gathered from iovcnt buffers, which are only copied if the
+ * packet is held back to be sent later.
  */
-int _network_send(mysocket_t sd, const void *buf, size_t len)
+int _network_send(mysocket_t sd, const struct iovec *iov, int iovcnt)
 {
     mysock_context_t *sock_ctx = _mysock_get_context(sd);
     network_context_t *ctx;
+    struct iovec copy_iov;
+    size_t len = 0;
+    int k;
 
-    assert(sock_ctx && buf);
+    assert(sock_ctx && iov && iovcnt > 0);
     ctx = &sock_ctx->network_state;
 
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
 
     if (!ctx->is_reliable)
     {
@@ -43,15 +50,20 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
         case 1:
             /* send duplicate */
             dprintf("====>network_send:duplicating the packet\n");
-            _network_send_packet(ctx, buf, len);
+            _network_send_packet(ctx, iov, iovcnt);
             break;
 
         case 2:
             /* store the packet in our queue. Will send it later */
             dprintf("====>network_send:keeping the packet in our queue\n");
             assert(len <= sizeof(ctx->copy_buffer));
-            memcpy(&ctx->copy_buffer, buf, len);
-            ctx->copy_buf_len = len;
+            ctx->copy_buf_len = 0;
+            for (k = 0; k < iovcnt; ++k)
+            {
+                memcpy(ctx->copy_buffer + ctx->copy_buf_len,
+                       iov[k].iov_base, iov[k].iov_len);
+                ctx->copy_buf_len += iov[k].iov_len;
+            }
             ctx->copied = TRUE;
             return len;
 
@@ -63,12 +75,14 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
             {
                 dprintf("====>network_send:sending the packet stored "
                         "in our queue\n");
-                _network_send_packet(ctx, ctx->copy_buffer, ctx->copy_buf_len);
+                copy_iov.iov_base = ctx->copy_buffer;
+                copy_iov.iov_len  = ctx->copy_buf_len;
+                _network_send_packet(ctx, &copy_iov, 1);
             }
             else
             {
                 dprintf("====>network_send:duplicating the packet\n");
-                _network_send_packet(ctx, buf, len);
+                _network_send_packet(ctx, iov, iovcnt);
             }
             return len;
 
@@ -78,7 +92,7 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
         }
     }
 
-    return _network_send_packet(ctx, buf, len);
+    return _network_send_packet(ctx, iov, iovcnt);
 }
 
 /* helper function for stcp_network_recv() */
@@ -89,7 +103,7 @@ int _network_recv(mysocket_t sd, void *dst, size_t max_len)
 
     assert(ctx && dst);
     len = _mysock_dequeue_buffer(ctx, &ctx->network_recv_queue,
-                                 dst, max_len, FALSE);
+                                 dst, max_len);
 
     return len;
 }
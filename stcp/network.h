@@ -5,9 +5,10 @@
 #ifndef __NETWORK_H__
 #define __NETWORK_H__
 
+#include <sys/uio.h>
 #include "mysock.h"
 
-int _network_send(mysocket_t sd, const void *buf, size_t len);
+int _network_send(mysocket_t sd, const struct iovec *iov, int iovcnt);
 int _network_recv(mysocket_t sd, void *dst, size_t max_len);
 
 #endif  /* __NETWORK_H__ */
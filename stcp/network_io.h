@@ -9,10 +9,14 @@
 #ifdef LINUX
 #include <stdint.h>
 #endif
+#include <sys/uio.h>
 #include "mysock.h"
 
 #define MAX_IP_PAYLOAD_LEN 1500
 
+/* most buffers an outgoing packet may be gathered from */
+#define MAX_PACKET_IOV     16
+
 
 struct mysock_context;
 
@@ -65,9 +69,28 @@ uint32_t _network_get_local_addr(network_context_t *ctx);
  */
 uint32_t _network_get_interface_ip(uint32_t peer_addr);
 
-/* send an STCP packet to our peer */
+/* send an STCP packet to our peer, gathered from iovcnt (at most
+ * MAX_PACKET_IOV) buffers.  returns the packet length, or -1 on error.
+ */
 ssize_t _network_send_packet(network_context_t *ctx,
-                             const void *src, size_t len);
+                             const struct iovec *iov, int iovcnt);
+
+/* send a packet from a listening mysocket to the given peer, which has no
+ * mysocket of its own (a SYN-ACK carrying a SYN cookie; see
+ * connection_demux.c).  returns the packet length, or -1 if the network
+ * layer can't do that.
+ */
+ssize_t _network_send_reply(network_context_t *ctx,
+                            const struct sockaddr *peer_addr,
+                            socklen_t peer_addr_len,
+                            const void *packet, size_t len);
+
+/* send any packets the network layer has held back, so as to send several
+ * at once.  the event loop calls this when it's done with a mysocket for
+ * the time being; a mysocket with an STCP thread of its own has nothing
+ * held back.
+ */
+void _network_flush(network_context_t *ctx);
 
 /* start/stop per-mysocket network receive thread.  the stop() interface
  * must not return until the network receive thread has exited.
@@ -75,6 +98,17 @@ ssize_t _network_send_packet(network_context_t *ctx,
 int _network_start_recv_thread(struct mysock_context *ctx);
 void _network_stop_recv_thread(struct mysock_context *ctx);
 
+/* for the event loop, which does without receive threads:  the descriptor
+ * to poll for incoming packets (or -1 if there is none to poll), and a
+ * single round of what the receive thread does, i.e. read the packets that
+ * have arrived and pass them up to the mysocket (or the SYN demultiplexer,
+ * for a listening mysocket).  _network_recv_dispatch() returns < 0 once
+ * nothing more is coming, after which the descriptor needn't be polled any
+ * longer.
+ */
+int _network_poll_fd(network_context_t *ctx);
+ssize_t _network_recv_dispatch(struct mysock_context *ctx);
+
 /* called when a SYN packet is dequeued on a passive socket, to update any
  * state in the network layer.
  */
@@ -125,6 +125,16 @@ int _network_start_recv_thread(mysock_context_t *ctx)
         return -1;
     }
 
+    /* the pipe is only used to wake up the receive thread, so a mysocket
+     * run by the event loop never needs one.
+     */
+    if (pipe(net_ctx->exit_pipe) < 0)
+    {
+        perror("pipe");
+        assert(0);
+        return -1;
+    }
+
     net_ctx->recv_thread = _mysock_create_thread(network_recv_thread_func,
                                                  ctx, FALSE);
     net_ctx->recv_thread_started = TRUE;
@@ -193,6 +203,71 @@ int _network_bind_socket(network_context_t *ctx,
 }
 
 
+/* return the socket the event loop should poll for incoming packets */
+int _network_poll_fd(network_context_t *ctx)
+{
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+    return GET_SOCKET(ctx);
+}
+
+/* read the packets that have arrived from the network, and buffer them for
+ * later consumption by network_recv() (or, on a listening socket, pass them
+ * on to the SYN demultiplexer).  each is queued straight from the buffer it
+ * was read into.  returns the number of bytes read, or < 0 once the peer
+ * has gone away or the read failed.
+ */
+ssize_t _network_recv_dispatch(mysock_context_t *ctx)
+{
+    network_packet_t packets[MAX_RECV_BATCH];
+    ssize_t bytes_read = 0;
+    int num_packets, k;
+
+    assert(ctx);
+
+    /* a full batch may have left more behind, which the socket won't poll
+     * readable for again.
+     */
+    do
+    {
+        num_packets = _network_recv_batch(ctx, packets, MAX_RECV_BATCH);
+        if (num_packets < 0)
+        {
+            DEBUG_LOG(("_network_recv_batch failed, errno=%d\n", errno));
+            return -1;
+        }
+
+        for (k = 0; k < num_packets; ++k)
+        {
+            network_packet_t *packet = &packets[k];
+
+            assert(packet->len <= MAX_IP_PAYLOAD_LEN);
+            if (ctx->listening)
+            {
+                /* if the socket was accepting new connections, incoming
+                 * packets need to be demultiplexed and dispatched to the
+                 * appropriate mysocket context.
+                 */
+                _mysock_enqueue_connection(ctx, packet->data, packet->len,
+                                           &packet->peer_addr,
+                                           packet->peer_addr_len, NULL);
+            }
+            else
+            {
+                /* enqueue the packet directly for this context */
+                _mysock_enqueue_reference(ctx, &ctx->network_recv_queue,
+                                          packet->buffer, packet->data,
+                                          packet->len);
+            }
+
+            _buffer_release(packet->buffer);
+            bytes_read += packet->len;
+        }
+    } while (num_packets == MAX_RECV_BATCH);
+
+    return bytes_read;
+}
+
 /* process network input.
  * this just loops around, waiting for data to arrive, and buffering it
  * for later consumption by network_recv().  (outgoing data is sent
@@ -207,7 +282,6 @@ int _network_bind_socket(network_context_t *ctx,
  */
 static void *network_recv_thread_func(void *arg_ptr)
 {
-    char packet_buf[MAX_IP_PAYLOAD_LEN];
     mysock_context_t *ctx;
     network_context_socket_t *net_ctx;
 
@@ -220,7 +294,6 @@ static void *network_recv_thread_func(void *arg_ptr)
 
     for (;;)
     {
-        ssize_t bytes_read;
         bool_t packet_ready = FALSE;
         bool_t done = FALSE;
         struct pollfd fds[] =
@@ -257,34 +330,11 @@ static void *network_recv_thread_func(void *arg_ptr)
         if (done)
             break;
 
-        /* block, waiting for network input.  (the system call will be
-         * interrupted by the transport layer thread if we're to exit).
+        /* (the system call will be interrupted by the transport layer
+         * thread if we're to exit).
          */
-        if ((bytes_read = _network_recv_packet(&ctx->network_state,
-                                               packet_buf,
-                                               sizeof(packet_buf))) <= 0)
-        {
-            DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
+        if (_network_recv_dispatch(ctx) < 0)
             break;
-        }
-
-        assert(bytes_read <= (int)sizeof(packet_buf));
-        if (ctx->listening)
-        {
-            /* if the socket was accepting new connections, incoming
-             * packets need to be demultiplexed and dispatched to the
-             * appropriate mysocket context.
-             */
-            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
-                                       &ctx->network_state.peer_addr,
-                                       ctx->network_state.peer_addr_len, NULL);
-        }
-        else
-        {
-            /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
-        }
     }
 
     return NULL;
@@ -309,14 +359,6 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
     }
 
     ctx->exit_pipe[0] = ctx->exit_pipe[1] = -1;
-    if (pipe(ctx->exit_pipe) < 0)
-    {
-        perror("pipe");
-        assert(0);
-        _network_destroy_context_socket(ctx);
-        ctx = NULL;
-    }
-
     return ctx;
 }
 
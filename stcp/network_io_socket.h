@@ -28,7 +28,31 @@ typedef struct
     int                exit_pipe[2];    /* used to wake up read thread */
 } network_context_socket_t;
 
-typedef network_context_socket_t network_context_socket_udp_t;
+/* most packets moved by one recvmmsg()/sendmmsg() */
+#define MAX_RECV_BATCH 64
+#define MAX_SEND_BATCH 64
+
+typedef struct
+{
+    network_context_socket_t base;
+
+    /* additional state required by UDP-based network layer */
+    mysock_context_t *sock_ctx;
+    pthread_mutex_t   connect_lock;
+    bool_t            connected;    /* connect()ed to the peer */
+
+    /* buffers for the next batch read from the socket.  any that a batch
+     * didn't fill are kept for the next one.
+     */
+    mysock_buffer_t  *recv_buffers[MAX_RECV_BATCH];
+
+    /* packets held back until the next _network_flush() (event loop only),
+     * each copied into a buffer of its own.
+     */
+    mysock_buffer_t  *send_buffers[MAX_SEND_BATCH];
+    size_t            send_lens[MAX_SEND_BATCH];
+    int               send_count;
+} network_context_socket_udp_t;
 
 typedef struct
 {
@@ -39,6 +63,14 @@ typedef struct
     socket_t          new_socket;   /* temporary result of accept() */
     pthread_mutex_t   connect_lock;
     bool_t            connected;
+
+    /* the stream as read from the socket, as many frames at a time as have
+     * arrived.  packets are queued by reference straight out of it.
+     */
+    mysock_buffer_t  *recv_buffer;
+    size_t            recv_start;   /* first byte not yet parsed */
+    size_t            recv_end;     /* end of what's been read */
+    size_t            recv_discard; /* rest of an oversized frame, to skip */
 } network_context_socket_tcp_t;
 
 
@@ -69,11 +101,28 @@ int _network_bind_socket(network_context_t *ctx,
                          int                addrlen);
 
 
+/* a packet read from the network, in a buffer from the mysocket's pool */
+typedef struct
+{
+    mysock_buffer_t *buffer;    /* the reader's reference, to pass on */
+    char            *data;      /* where the packet lies within it */
+    size_t           len;
+
+    /* where it came from, for the SYN demultiplexer */
+    struct sockaddr  peer_addr;
+    socklen_t        peer_addr_len;
+} network_packet_t;
+
 /* this is not called directly.  use network_start_recv_thread() and
  * network_stop_recv_thread() instead.
+ *
+ * read up to max_packets packets, once the socket has polled readable.
+ * returns how many were read, which may be none (e.g. if the read was
+ * interrupted, or the peer reported an error), or -1 once nothing more is
+ * coming.
  */
-ssize_t _network_recv_packet(network_context_t *ctx,
-                             void *dst, size_t max_len);
+int _network_recv_batch(mysock_context_t *ctx,
+                        network_packet_t *packets, int max_packets);
 
 
 #endif  /* __NETWORK_IO_SOCKET_H__ */
@@ -5,9 +5,13 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <alloca.h>
+#include <string.h>
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
@@ -15,10 +19,22 @@
 
 #define MAX_NUM_PENDING_CONNECTIONS 10
 
+/* room for this many bytes of the stream at a time; the buffer's replaced
+ * (or its unparsed tail moved up) whenever less than a full frame fits.
+ */
+#define RECV_BUFFER_SIZE (64 * 1024)
+#define MAX_FRAME_LEN    (sizeof(uint16_t) + MAX_IP_PAYLOAD_LEN)
+
 typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
 
 static int _tcp_io(socket_t, void *, size_t, io_func_t);
+static int _tcp_writev(socket_t, struct iovec *, int);
 static int _tcp_connect(network_context_t *ctx);
+static void _tcp_nodelay(socket_t tcp_sd);
+static ssize_t _network_recv_packet(network_context_t *ctx,
+                                    void *dst, size_t max_len);
+static int _tcp_recv_frames(mysock_context_t *ctx,
+                            network_packet_t *packets, int max_packets);
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -33,6 +49,10 @@ static int _tcp_connect(network_context_t *ctx);
  *   - the passive side dispatches the SYN packet to the right STCP
  *     context, and updates the new context's TCP socket to be that of the
  *     newly accepted (real TCP) connection.
+ *   - Nagle is turned off on the connections: each write is a whole packet,
+ *     and STCP does its own pacing.  the reader, on the other hand, takes
+ *     as much of the stream as has arrived in one recv(), and splits it
+ *     into as many packets as it holds.
  */
 
 
@@ -57,6 +77,9 @@ int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
     tcp_io_ctx->sock_ctx = sock_ctx;
     tcp_io_ctx->new_socket = -1;
     tcp_io_ctx->connected = FALSE;
+    tcp_io_ctx->recv_buffer = NULL;
+    tcp_io_ctx->recv_start = tcp_io_ctx->recv_end = 0;
+    tcp_io_ctx->recv_discard = 0;
 
     PTHREAD_CALL(pthread_mutex_init(&tcp_io_ctx->connect_lock, NULL));
 
@@ -79,6 +102,9 @@ void _network_close(network_context_t *ctx)
         closesocket(tcp_io_ctx->new_socket);
     }
 
+    if (tcp_io_ctx->recv_buffer)
+        _buffer_release(tcp_io_ctx->recv_buffer);
+
     PTHREAD_CALL(pthread_mutex_destroy(&tcp_io_ctx->connect_lock));
 
     _network_close_socket(ctx);
@@ -131,14 +157,21 @@ void _network_update_passive_state(network_context_t *new_ctx,
 }
 
 
-/* send the given packet to the peer */
+/* send the given packet to the peer.  the length prefix and the packet's
+ * buffers go out in a single writev(), so the packet is neither flattened
+ * nor split across several TCP segments by the kernel.
+ */
 ssize_t _network_send_packet(network_context_t *ctx,
-                             const void *src, size_t len)
+                             const struct iovec *iov, int iovcnt)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
+    struct iovec frame[1 + MAX_PACKET_IOV];
     uint16_t packet_len;    /* network byte order */
+    size_t len = 0;
+    int k;
 
-    assert(ctx && src);
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= MAX_PACKET_IOV);
     assert(ctx->peer_addr_len > 0);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
@@ -150,60 +183,83 @@ ssize_t _network_send_packet(network_context_t *ctx,
     if (_tcp_connect(ctx) < 0)
         return -1;
 
+    for (k = 0; k < iovcnt; ++k)
+    {
+        frame[1 + k] = iov[k];
+        len += iov[k].iov_len;
+    }
+
     packet_len = htons(len);
-    if (_tcp_io(GET_SOCKET(ctx), &packet_len, sizeof(packet_len),
-                (io_func_t) write) < 0 ||
-        _tcp_io(GET_SOCKET(ctx), (void *) src, len, (io_func_t) write) < 0)
+    frame[0].iov_base = &packet_len;
+    frame[0].iov_len  = sizeof(packet_len);
+
+    if (_tcp_writev(GET_SOCKET(ctx), frame, 1 + iovcnt) < 0)
         return -1;
 
     return len;
 }
 
-/* read a packet from the peer */
-ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
+/* a peer only gets to the listening socket over a connection of its own,
+ * which is handed over to the new mysocket along with the SYN; there's no
+ * answering it otherwise.  (the kernel looks after floods of connection
+ * requests to the listening socket itself.)
+ */
+ssize_t _network_send_reply(network_context_t *ctx,
+                            const struct sockaddr *peer_addr,
+                            socklen_t peer_addr_len,
+                            const void *packet, size_t len)
+{
+    assert(ctx && peer_addr && packet);
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+/* nothing's ever held back; each packet is written as it's sent */
+void _network_flush(network_context_t *ctx)
+{
+    assert(ctx);
+}
+
+/* accept the connection a SYN arrives on, and read the SYN from it.  this
+ * reads exactly the one packet, since anything that follows belongs to the
+ * context the connection is about to be handed to.
+ */
+static ssize_t _network_recv_packet(network_context_t *ctx,
+                                    void *dst, size_t max_len)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
     uint16_t packet_len;
-    socket_t io_socket;
+    socket_t io_socket, tmp_sd;
     int rc;
 
     assert(ctx && dst);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
-    assert(tcp_io_ctx->sock_ctx);
+    assert(tcp_io_ctx->sock_ctx && tcp_io_ctx->sock_ctx->listening);
 
     VERIFY_SOCKET(ctx);
-    io_socket = tcp_io_ctx->base.socket;
 
-    if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
-        return -1;
-
-    if (tcp_io_ctx->sock_ctx->listening/* ||
-        (tcp_io_ctx->sock_ctx->is_active && !tcp_io_ctx->connected)*/)
+    ctx->peer_addr_len = sizeof(ctx->peer_addr);
+    if ((tmp_sd = accept(GET_SOCKET(ctx),
+                         &ctx->peer_addr,
+                         &ctx->peer_addr_len)) < 0)
     {
-        socket_t tmp_sd;
-
-        ctx->peer_addr_len = sizeof(ctx->peer_addr);
-        if ((tmp_sd = accept(GET_SOCKET(ctx),
-                             &ctx->peer_addr,
-                             &ctx->peer_addr_len)) < 0)
-        {
-            perror("accept (network_io_tcp)");
-            return tmp_sd;
-        }
+        perror("accept (network_io_tcp)");
+        return tmp_sd;
+    }
 
-        DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
+    DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
+    _tcp_nodelay(tmp_sd);
 
-        /* keep listening socket open for futher connection requests */
-        /* we will not reenter this function until this SYN packet has
-         * been dispatched to the right context, and that context's
-         * socket updated to be 'new_socket'
-         */
-        assert(tcp_io_ctx->new_socket == -1);
-        tcp_io_ctx->new_socket = tmp_sd;
-        io_socket = tmp_sd;
-    }
+    /* keep listening socket open for futher connection requests */
+    /* we will not reenter this function until this SYN packet has
+     * been dispatched to the right context, and that context's
+     * socket updated to be 'new_socket'
+     */
+    assert(tcp_io_ctx->new_socket == -1);
+    tcp_io_ctx->new_socket = tmp_sd;
+    io_socket = tmp_sd;
 
     DEBUG_PEER(ctx);
 
@@ -228,16 +284,189 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
         return rc;
     }
 
-    if (packet_len > max_len)
+    /* discard unread remainder of packet */
+    for (rc = packet_len - MIN(packet_len, max_len); rc > 0; )
     {
-        /* discard unread remainder of packet */
-        char *dummy = (char *) alloca(packet_len - max_len);
-        (void) _tcp_io(io_socket, dummy, packet_len - max_len, read);
+        char dummy[512];
+        int len = MIN(rc, (int) sizeof(dummy));
+
+        if (_tcp_io(io_socket, dummy, len, read) <= 0)
+            break;
+        rc -= len;
     }
 
     return packet_len;
 }
 
+/* make sure there's room after what's been read for at least one whole
+ * frame.  the unparsed tail is moved to the front of the buffer if nothing
+ * else refers to it any more, or copied into a fresh one if queued packets
+ * still do.
+ */
+static void _tcp_recv_room(mysock_context_t *ctx,
+                           network_context_socket_tcp_t *tcp_io_ctx)
+{
+    mysock_buffer_t *buf = tcp_io_ctx->recv_buffer;
+    size_t unparsed = tcp_io_ctx->recv_end - tcp_io_ctx->recv_start;
+
+    if (buf && RECV_BUFFER_SIZE - tcp_io_ctx->recv_end >= MAX_FRAME_LEN)
+        return;
+
+    if (buf && __atomic_load_n(&buf->refcount, __ATOMIC_ACQUIRE) == 1)
+    {
+        memmove(buf->data, buf->data + tcp_io_ctx->recv_start, unparsed);
+    }
+    else
+    {
+        tcp_io_ctx->recv_buffer = _buffer_alloc(&ctx->buffer_pool,
+                                                RECV_BUFFER_SIZE);
+        if (buf)
+        {
+            memcpy(tcp_io_ctx->recv_buffer->data,
+                   buf->data + tcp_io_ctx->recv_start, unparsed);
+            _buffer_release(buf);
+        }
+    }
+
+    tcp_io_ctx->recv_start = 0;
+    tcp_io_ctx->recv_end   = unparsed;
+}
+
+/* read whatever of the stream has arrived, without blocking, and split off
+ * as many whole packets as it holds (up to max_packets).  each packet takes
+ * its own reference to the receive buffer.  returns the number of packets,
+ * or -1 once the peer has gone away or the read failed.
+ */
+static int _tcp_recv_frames(mysock_context_t *ctx,
+                            network_packet_t *packets, int max_packets)
+{
+    network_context_t *net_ctx = &ctx->network_state;
+    network_context_socket_tcp_t *tcp_io_ctx;
+    mysock_buffer_t *buf;
+    int num_packets = 0;
+    ssize_t rc;
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) net_ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    VERIFY_SOCKET(net_ctx);
+
+    if (ctx->is_active && _tcp_connect(net_ctx) < 0)
+        return -1;
+
+    _tcp_recv_room(ctx, tcp_io_ctx);
+    buf = tcp_io_ctx->recv_buffer;
+
+    /* a previous batch may have filled up, leaving frames behind; there's
+     * no need to read more until those have been passed on.
+     */
+    if (tcp_io_ctx->recv_end - tcp_io_ctx->recv_start < MAX_FRAME_LEN)
+    {
+        rc = recv(GET_SOCKET(net_ctx), buf->data + tcp_io_ctx->recv_end,
+                  RECV_BUFFER_SIZE - tcp_io_ctx->recv_end, MSG_DONTWAIT);
+        if (rc == 0)
+        {
+            DEBUG_LOG(("_tcp_recv_frames: peer closed connection\n"));
+            return -1;
+        }
+        else if (rc < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                rc = 0;
+            else
+            {
+                DEBUG_LOG(("_tcp_recv_frames: recv failed, errno=%d\n",
+                           errno));
+                return -1;
+            }
+        }
+
+        tcp_io_ctx->recv_end += rc;
+    }
+
+    while (num_packets < max_packets)
+    {
+        size_t avail = tcp_io_ctx->recv_end - tcp_io_ctx->recv_start;
+        char *frame = buf->data + tcp_io_ctx->recv_start;
+        uint16_t packet_len;
+        size_t len;
+
+        if (tcp_io_ctx->recv_discard > 0)
+        {
+            len = MIN(tcp_io_ctx->recv_discard, avail);
+            tcp_io_ctx->recv_start   += len;
+            tcp_io_ctx->recv_discard -= len;
+            if (tcp_io_ctx->recv_discard > 0)
+                break;
+            continue;
+        }
+
+        if (avail < sizeof(packet_len))
+            break;
+
+        memcpy(&packet_len, frame, sizeof(packet_len));
+        packet_len = ntohs(packet_len);
+
+        /* anything past the largest packet is dropped, as it would be
+         * by the datagram service this stands in for.
+         */
+        len = MIN((size_t) packet_len, MAX_IP_PAYLOAD_LEN);
+        if (avail < sizeof(packet_len) + len)
+            break;
+
+        tcp_io_ctx->recv_start  += sizeof(packet_len) + len;
+        tcp_io_ctx->recv_discard = packet_len - len;
+
+        if (len == 0)
+            continue;
+
+        _buffer_ref(buf);
+        packets[num_packets].buffer        = buf;
+        packets[num_packets].data          = frame + sizeof(packet_len);
+        packets[num_packets].len           = len;
+        packets[num_packets].peer_addr     = net_ctx->peer_addr;
+        packets[num_packets].peer_addr_len = net_ctx->peer_addr_len;
+        ++num_packets;
+    }
+
+    return num_packets;
+}
+
+
+/* a connection hands up as many packets as have arrived on its stream; a
+ * listening socket reads a SYN at a time, from each connection it accepts.
+ */
+int _network_recv_batch(mysock_context_t *ctx,
+                        network_packet_t *packets, int max_packets)
+{
+    network_packet_t *packet = &packets[0];
+    ssize_t bytes_read;
+
+    assert(ctx && packets && max_packets > 0);
+
+    if (!ctx->listening)
+        return _tcp_recv_frames(ctx, packets, max_packets);
+
+    /* the packet is read straight into a buffer that can be queued as is */
+    packet->buffer = _buffer_alloc(&ctx->buffer_pool, MAX_IP_PAYLOAD_LEN);
+
+    /* block, waiting for the SYN */
+    if ((bytes_read = _network_recv_packet(&ctx->network_state,
+                                           packet->buffer->data,
+                                           MAX_IP_PAYLOAD_LEN)) <= 0)
+    {
+        DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
+        _buffer_release(packet->buffer);
+        return -1;
+    }
+
+    packet->data          = packet->buffer->data;
+    packet->len           = MIN((size_t) bytes_read, MAX_IP_PAYLOAD_LEN);
+    packet->peer_addr     = ctx->network_state.peer_addr;
+    packet->peer_addr_len = ctx->network_state.peer_addr_len;
+    return 1;
+}
+
 
 /* read/write count bytes into/from buf */
 static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
@@ -264,6 +493,43 @@ static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
     return count;
 }
 
+/* write all of the given buffers, picking up where a short write left off.
+ * iov is updated in the process.
+ */
+static int _tcp_writev(socket_t tcp_sd, struct iovec *iov, int iovcnt)
+{
+    size_t count = 0;
+    int k;
+
+    assert(iov && iovcnt > 0);
+    for (k = 0; k < iovcnt; ++k)
+        count += iov[k].iov_len;
+
+    while (iovcnt > 0)
+    {
+        ssize_t rc;
+
+        if ((rc = writev(tcp_sd, iov, iovcnt)) <= 0)
+        {
+            if (rc < 0 && errno == EINTR)
+                continue;
+            DEBUG_LOG(("_tcp_writev rc: %d\n", (int) rc));
+            return -1;
+        }
+
+        /* skip over whatever was written */
+        for (; iovcnt > 0 && (size_t) rc >= iov->iov_len; ++iov, --iovcnt)
+            rc -= iov->iov_len;
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return count;
+}
+
 static int _tcp_connect(network_context_t *ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
@@ -287,9 +553,11 @@ static int _tcp_connect(network_context_t *ctx)
         {
             perror("connect (_tcp_connect)");
             fprintf(stderr, "(errno=%d)\n", errno);
+            PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
             return -1;
         }
 
+        _tcp_nodelay(GET_SOCKET(ctx));
         tcp_io_ctx->connected = TRUE;
     }
     PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
@@ -297,3 +565,16 @@ static int _tcp_connect(network_context_t *ctx)
     return 0;
 }
 
+
+/* every write is a whole packet, which shouldn't wait on the ACK of the
+ * one before it.
+ */
+static void _tcp_nodelay(socket_t tcp_sd)
+{
+    int one = 1;
+
+    if (setsockopt(tcp_sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+    {
+        DEBUG_LOG(("_tcp_nodelay: setsockopt failed, errno=%d\n", errno));
+    }
+}
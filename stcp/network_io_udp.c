@@ -0,0 +1,479 @@
+/* network_io_udp.c: UDP instantiation of the underlying unreliable
+ * datagram service.  build with 'make NETWORK_IO=udp' to use this in place
+ * of the TCP version.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+
+
+static int _udp_connect(network_context_t *ctx,
+                        const struct sockaddr *peer_addr,
+                        socklen_t peer_addr_len);
+static void _udp_release_buffers(mysock_buffer_t **buffers, int count);
+static bool_t _udp_same_peer(const struct sockaddr *a,
+                             const struct sockaddr *b);
+
+
+/* a few words about the UDP network layer...
+ *
+ * every STCP packet is a datagram of its own.  a listening mysocket's
+ * socket only ever sees SYNs, which the demultiplexer uses to set up a new
+ * mysocket; that mysocket's socket is connect()ed to the peer, and
+ * everything after the SYN goes to and from it, at a port of its own.  the
+ * active side learns that port from the SYN-ACK, and connect()s to it in
+ * turn.  the kernel does the demultiplexing from then on, and each
+ * connection's packets are read by whichever thread runs it.
+ *
+ * packets are read up to MAX_RECV_BATCH at a time with recvmmsg(), into
+ * pool buffers that are queued for STCP as they are.  a mysocket run by
+ * the event loop also has the packets STCP sends held back until the loop
+ * is done with it, then sent together with sendmmsg(); one with an STCP
+ * thread of its own sends each one as it comes, since it has nobody to
+ * say when it's done.
+ */
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   SOCK_DGRAM,
+                                   sizeof(network_context_socket_udp_t))) < 0)
+        return rc;
+
+    udp_io_ctx = (network_context_socket_udp_t *) net_ctx->impl_data;
+    assert(udp_io_ctx);
+
+    udp_io_ctx->sock_ctx = sock_ctx;
+    udp_io_ctx->connected = FALSE;
+
+    PTHREAD_CALL(pthread_mutex_init(&udp_io_ctx->connect_lock, NULL));
+
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    /* the connection's over, so anything still held back can go */
+    _udp_release_buffers(udp_io_ctx->send_buffers, udp_io_ctx->send_count);
+    udp_io_ctx->send_count = 0;
+    _udp_release_buffers(udp_io_ctx->recv_buffers, MAX_RECV_BATCH);
+
+    PTHREAD_CALL(pthread_mutex_destroy(&udp_io_ctx->connect_lock));
+
+    _network_close_socket(ctx);
+}
+
+/* set the local port associated with the given network layer context */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    assert(ctx && addr);
+    VERIFY_SOCKET(ctx);
+
+    return _network_bind_socket(ctx, addr, addrlen);
+}
+
+/* the backlog is kept by the demultiplexer; there's nothing to do here */
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    return 0;
+}
+
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_udp_t *new_udp_ctx;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+
+    new_udp_ctx = (network_context_socket_udp_t *) new_ctx->impl_data;
+    assert(new_udp_ctx);
+
+    /* the new context's socket talks to the peer alone, at a port of its
+     * own.  the listening socket is left to new connection requests.
+     */
+    assert(!new_udp_ctx->sock_ctx->listening);
+    assert(!new_udp_ctx->sock_ctx->is_active);
+    assert(new_ctx->peer_addr_valid);
+    if (_udp_connect(new_ctx, &new_ctx->peer_addr, new_ctx->peer_addr_len) < 0)
+        assert(0);
+
+    /* the peer has only heard from the listening port, and must be told
+     * about this one (see above).
+     */
+    if (new_udp_ctx->sock_ctx->syn_cookie)
+    {
+        while (send(GET_SOCKET(new_ctx), NULL, 0, 0) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+/* send a SYN-ACK carrying a SYN cookie from the listening socket */
+ssize_t _network_send_reply(network_context_t *ctx,
+                            const struct sockaddr *peer_addr,
+                            socklen_t peer_addr_len,
+                            const void *packet, size_t len)
+{
+    ssize_t rc;
+
+    assert(ctx && peer_addr && packet);
+    assert(len <= MAX_IP_PAYLOAD_LEN);
+    VERIFY_SOCKET(ctx);
+
+    while ((rc = sendto(GET_SOCKET(ctx), packet, len, 0,
+                        peer_addr, peer_addr_len)) < 0 && errno == EINTR)
+        ;
+    return rc;
+}
+
+
+/* send the given packet to the peer, straight from its buffers (or, if the
+ * event loop runs this mysocket, copy it into the batch sent by the next
+ * _network_flush()).
+ */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const struct iovec *iov, int iovcnt)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    struct msghdr msg;
+    size_t len = 0;
+    ssize_t rc;
+    int k;
+
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= MAX_PACKET_IOV);
+    assert(ctx->peer_addr_len > 0);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+    assert(len <= MAX_IP_PAYLOAD_LEN);
+
+    if (udp_io_ctx->sock_ctx->loop)
+    {
+        mysock_buffer_t *buf;
+
+        if (udp_io_ctx->send_count == MAX_SEND_BATCH)
+            _network_flush(ctx);
+
+        buf = _buffer_alloc(&udp_io_ctx->sock_ctx->buffer_pool, len);
+        for (len = 0, k = 0; k < iovcnt; ++k)
+        {
+            memcpy(buf->data + len, iov[k].iov_base, iov[k].iov_len);
+            len += iov[k].iov_len;
+        }
+
+        udp_io_ctx->send_buffers[udp_io_ctx->send_count] = buf;
+        udp_io_ctx->send_lens[udp_io_ctx->send_count] = len;
+        ++udp_io_ctx->send_count;
+        return len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = (struct iovec *) iov;
+    msg.msg_iovlen = iovcnt;
+
+    /* until the peer's answered, the packet goes to the address we were
+     * given; the receive thread may connect() to the one that answers.
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&udp_io_ctx->connect_lock));
+    if (!udp_io_ctx->connected)
+    {
+        msg.msg_name    = &ctx->peer_addr;
+        msg.msg_namelen = ctx->peer_addr_len;
+    }
+
+    while ((rc = sendmsg(GET_SOCKET(ctx), &msg, 0)) < 0 && errno == EINTR)
+        ;
+    PTHREAD_CALL(pthread_mutex_unlock(&udp_io_ctx->connect_lock));
+
+    if (rc < 0)
+    {
+        DEBUG_LOG(("sendmsg failed (errno=%d)\n", errno));
+        return -1;
+    }
+
+    return len;
+}
+
+/* send the packets held back by _network_send_packet(), as few system calls
+ * as it takes.  a packet the kernel won't take is dropped, as it would be
+ * anywhere else along the way.
+ */
+void _network_flush(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    int sent = 0;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    if (udp_io_ctx->send_count == 0)
+        return;
+
+    VERIFY_SOCKET(ctx);
+    PTHREAD_CALL(pthread_mutex_lock(&udp_io_ctx->connect_lock));
+
+#ifdef LINUX
+    {
+        struct mmsghdr msgs[MAX_SEND_BATCH];
+        struct iovec iov[MAX_SEND_BATCH];
+        int k;
+
+        memset(msgs, 0, udp_io_ctx->send_count * sizeof(msgs[0]));
+        for (k = 0; k < udp_io_ctx->send_count; ++k)
+        {
+            iov[k].iov_base = udp_io_ctx->send_buffers[k]->data;
+            iov[k].iov_len  = udp_io_ctx->send_lens[k];
+
+            msgs[k].msg_hdr.msg_iov    = &iov[k];
+            msgs[k].msg_hdr.msg_iovlen = 1;
+            if (!udp_io_ctx->connected)
+            {
+                msgs[k].msg_hdr.msg_name    = &ctx->peer_addr;
+                msgs[k].msg_hdr.msg_namelen = ctx->peer_addr_len;
+            }
+        }
+
+        while (sent < udp_io_ctx->send_count)
+        {
+            int rc = sendmmsg(GET_SOCKET(ctx), msgs + sent,
+                              udp_io_ctx->send_count - sent, 0);
+
+            if (rc > 0)
+                sent += rc;
+            else if (rc == 0 || errno != EINTR)
+                ++sent;     /* skip the packet that failed */
+        }
+    }
+#else
+    for (; sent < udp_io_ctx->send_count; ++sent)
+    {
+        mysock_buffer_t *buf = udp_io_ctx->send_buffers[sent];
+
+        if (udp_io_ctx->connected)
+            (void) send(GET_SOCKET(ctx), buf->data,
+                        udp_io_ctx->send_lens[sent], 0);
+        else
+            (void) sendto(GET_SOCKET(ctx), buf->data,
+                          udp_io_ctx->send_lens[sent], 0,
+                          &ctx->peer_addr, ctx->peer_addr_len);
+    }
+#endif  /*LINUX*/
+
+    PTHREAD_CALL(pthread_mutex_unlock(&udp_io_ctx->connect_lock));
+
+    _udp_release_buffers(udp_io_ctx->send_buffers, udp_io_ctx->send_count);
+    udp_io_ctx->send_count = 0;
+}
+
+/* read the packets that have arrived, without waiting for more */
+int _network_recv_batch(mysock_context_t *ctx,
+                        network_packet_t *packets, int max_packets)
+{
+    network_context_t *net_ctx;
+    network_context_socket_udp_t *udp_io_ctx;
+    int num_read, num_packets = 0;
+    int k;
+
+    assert(ctx && packets && max_packets > 0);
+
+    net_ctx = &ctx->network_state;
+    udp_io_ctx = (network_context_socket_udp_t *) net_ctx->impl_data;
+    assert(udp_io_ctx);
+
+    VERIFY_SOCKET(net_ctx);
+    max_packets = MIN(max_packets, MAX_RECV_BATCH);
+
+    /* buffers the last batch used up are replaced; the rest are kept */
+    for (k = 0; k < max_packets; ++k)
+    {
+        if (!udp_io_ctx->recv_buffers[k])
+        {
+            udp_io_ctx->recv_buffers[k] =
+                _buffer_alloc(&ctx->buffer_pool, MAX_IP_PAYLOAD_LEN);
+        }
+    }
+
+#ifdef LINUX
+    {
+        struct mmsghdr msgs[MAX_RECV_BATCH];
+        struct iovec iov[MAX_RECV_BATCH];
+
+        memset(msgs, 0, max_packets * sizeof(msgs[0]));
+        for (k = 0; k < max_packets; ++k)
+        {
+            iov[k].iov_base = udp_io_ctx->recv_buffers[k]->data;
+            iov[k].iov_len  = MAX_IP_PAYLOAD_LEN;
+
+            msgs[k].msg_hdr.msg_iov     = &iov[k];
+            msgs[k].msg_hdr.msg_iovlen  = 1;
+            msgs[k].msg_hdr.msg_name    = &packets[k].peer_addr;
+            msgs[k].msg_hdr.msg_namelen = sizeof(packets[k].peer_addr);
+        }
+
+        num_read = recvmmsg(GET_SOCKET(net_ctx), msgs, max_packets,
+                            MSG_DONTWAIT, NULL);
+
+        for (k = 0; k < num_read; ++k)
+        {
+            packets[k].len           = msgs[k].msg_len;
+            packets[k].peer_addr_len = msgs[k].msg_hdr.msg_namelen;
+        }
+    }
+#else
+    packets[0].peer_addr_len = sizeof(packets[0].peer_addr);
+    if ((num_read = recvfrom(GET_SOCKET(net_ctx),
+                             udp_io_ctx->recv_buffers[0]->data,
+                             MAX_IP_PAYLOAD_LEN, MSG_DONTWAIT,
+                             &packets[0].peer_addr,
+                             &packets[0].peer_addr_len)) >= 0)
+    {
+        packets[0].len = num_read;
+        num_read = 1;
+    }
+#endif  /*LINUX*/
+
+    if (num_read < 0)
+    {
+        /* nothing there after all, or an ICMP error from the peer (which
+         * is no reason to stop listening to it); the socket can only fail
+         * for good once it's been shut down.
+         */
+        DEBUG_LOG(("recvmmsg failed (errno=%d)\n", errno));
+        return (errno == EBADF || errno == ENOTSOCK) ? -1 : 0;
+    }
+
+    /* the active side hears back from the port the passive side set aside
+     * for the connection, and talks to that from now on.  (the listening
+     * port itself only answers with a SYN cookie.)
+     */
+    for (k = 0; k < num_read && !ctx->listening && !udp_io_ctx->connected;
+         ++k)
+    {
+        if (_udp_same_peer(&packets[k].peer_addr, &net_ctx->peer_addr))
+            continue;
+        if (_udp_connect(net_ctx, &packets[k].peer_addr,
+                         packets[k].peer_addr_len) < 0)
+            return 0;
+    }
+
+    for (k = 0; k < num_read; ++k)
+    {
+        /* an empty datagram isn't an STCP packet */
+        if (packets[k].len == 0)
+            continue;
+
+        packets[num_packets] = packets[k];
+        packets[num_packets].buffer = udp_io_ctx->recv_buffers[k];
+        packets[num_packets].data = udp_io_ctx->recv_buffers[k]->data;
+        udp_io_ctx->recv_buffers[k] = NULL;
+        ++num_packets;
+    }
+
+    return num_packets;
+}
+
+
+/* talk to the given peer, and nobody else, from now on */
+static int _udp_connect(network_context_t *ctx,
+                        const struct sockaddr *peer_addr,
+                        socklen_t peer_addr_len)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    int rc = 0;
+
+    assert(ctx && peer_addr);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&udp_io_ctx->connect_lock));
+    if (!udp_io_ctx->connected)
+    {
+        assert(peer_addr->sa_family == AF_INET);
+
+        DEBUG_LOG(("_udp_connect (my_sd=%d): connecting on socket %d...\n",
+                   udp_io_ctx->sock_ctx->my_sd, (int) GET_SOCKET(ctx)));
+        if ((rc = connect(GET_SOCKET(ctx), peer_addr, peer_addr_len)) < 0)
+        {
+            perror("connect (_udp_connect)");
+        }
+        else
+        {
+            ctx->peer_addr     = *peer_addr;
+            ctx->peer_addr_len = peer_addr_len;
+            udp_io_ctx->connected = TRUE;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&udp_io_ctx->connect_lock));
+
+    return rc;
+}
+
+/* TRUE if both are the same address and port */
+static bool_t _udp_same_peer(const struct sockaddr *a,
+                             const struct sockaddr *b)
+{
+    const struct sockaddr_in *a_in = (const struct sockaddr_in *) a;
+    const struct sockaddr_in *b_in = (const struct sockaddr_in *) b;
+
+    assert(a && b);
+    return a->sa_family == AF_INET && b->sa_family == AF_INET &&
+           a_in->sin_addr.s_addr == b_in->sin_addr.s_addr &&
+           a_in->sin_port == b_in->sin_port;
+}
+
+/* let go of the buffers in the given array */
+static void _udp_release_buffers(mysock_buffer_t **buffers, int count)
+{
+    int k;
+
+    assert(buffers);
+    for (k = 0; k < count; ++k)
+    {
+        if (buffers[k])
+        {
+            _buffer_release(buffers[k]);
+            buffers[k] = NULL;
+        }
+    }
+}
+
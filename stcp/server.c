@@ -26,7 +26,7 @@
 
 
 
-static char usage[] = "usage: %s [-U]\n";
+static char usage[] = "usage: %s [-U] [-N]\n";
 
 static void do_connection(mysocket_t bindsd);
 static int get_nvt_line(int sd, char *);
@@ -42,16 +42,20 @@ main(int argc, char *argv[])
     int len, opt, errflg = 0;
     char localname[256];
     bool_t reliable = TRUE;
+    bool_t nodelay = FALSE;
 
 
     /* Parse the command line */
-    while ((opt = getopt(argc, argv, "U")) != EOF)
+    while ((opt = getopt(argc, argv, "UN")) != EOF)
     {
         switch (opt)
         {
         case 'U':
             reliable = FALSE;
             break;
+        case 'N':
+            nodelay = TRUE;
+            break;
         case '?':
             ++errflg;
             break;
@@ -71,6 +75,13 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    /* accepted connections inherit this */
+    if (nodelay && mysetsockopt(bindsd, MYSOCK_NODELAY, 1) < 0)
+    {
+        perror("mysetsockopt");
+        exit(EXIT_FAILURE);
+    }
+
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     sin.sin_addr.s_addr = htonl(INADDR_ANY);
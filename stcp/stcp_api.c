@@ -14,6 +14,7 @@
 #include "connection_demux.h"
 #include "tcp_sum.h"
 #include "transport.h"
+#include "myepoll.h"
 
 
 /* called by the transport layer thread to unblock the calling application,
@@ -45,9 +46,75 @@ void stcp_unblock_application(mysocket_t sd)
         /* move from incomplete to completed connection queue */
         _mysock_passive_connection_complete(ctx);
     }
+    else
+    {
+        /* connected (or not); either way, there's news for myepoll */
+        _myepoll_notify(ctx);
+    }
 }
 
 
+/* the events in flags that are ready for the given mysocket.  only the
+ * transport layer's thread may call this.
+ */
+static unsigned int ready_events(mysock_context_t *ctx, unsigned int flags)
+{
+    unsigned int rc = 0;
+
+    if ((flags & APP_DATA) && !_mysock_queue_empty(&ctx->app_recv_queue))
+        rc |= APP_DATA;
+
+    if ((flags & NETWORK_DATA) &&
+        !_mysock_queue_empty(&ctx->network_recv_queue))
+        rc |= NETWORK_DATA;
+
+    if ((flags & APP_READ) &&
+        __atomic_load_n(&ctx->read_event, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n(&ctx->read_event, FALSE, __ATOMIC_RELAXED);
+        rc |= APP_READ;
+    }
+
+    if (/*(flags & APP_CLOSE_REQUESTED) &&*/
+        __atomic_load_n(&ctx->close_requested, __ATOMIC_ACQUIRE) &&
+        _mysock_queue_empty(&ctx->app_recv_queue))
+    {
+        /* we should only wake up on this event once.  also, we don't
+         * pass the close event down to STCP until we've already passed
+         * it all outstanding data from the app.
+         */
+        __atomic_store_n(&ctx->close_requested, FALSE, __ATOMIC_RELAXED);
+        rc |= APP_CLOSE_REQUESTED;
+    }
+
+    return rc;
+}
+
+/* stcp_wait_for_event() without the waiting, for the event loop: returns
+ * the events in flags that are ready right now, or 0.
+ */
+unsigned int _mysock_ready_events(mysock_context_t *ctx, unsigned int flags)
+{
+    assert(ctx);
+    return ready_events(ctx, flags);
+}
+
+/* what stcp_wait_for_event() is waiting for */
+typedef struct
+{
+    mysock_context_t *ctx;
+    unsigned int      flags;
+    unsigned int      events;   /* the ones found ready */
+} event_wait_t;
+
+static bool_t events_ready(void *arg)
+{
+    event_wait_t *wait = (event_wait_t *) arg;
+
+    wait->events = ready_events(wait->ctx, wait->flags);
+    return wait->events != 0;
+}
+
 /* called by the transport layer to wait for new data, either from the network
  * or from the application, or for the application to request that the
  * mysocket be closed, depending on the value of flags.  abstime is the
@@ -63,67 +130,20 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
                                  unsigned int           flags,
                                  const struct timespec *abstime)
 {
-    unsigned int rc = 0;
     mysock_context_t *ctx = _mysock_get_context(sd);
+    event_wait_t wait;
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    for (;;)
-    {
-        if ((flags & APP_DATA) && (ctx->app_recv_queue.head != NULL))
-            rc |= APP_DATA;
-
-        if ((flags & NETWORK_DATA) && (ctx->network_recv_queue.head != NULL))
-            rc |= NETWORK_DATA;
-
-        if (/*(flags & APP_CLOSE_REQUESTED) &&*/
-            ctx->close_requested && (ctx->app_recv_queue.head == NULL))
-        {
-            /* we should only wake up on this event once.  also, we don't
-             * pass the close event down to STCP until we've already passed
-             * it all outstanding data from the app.
-             */
-            ctx->close_requested = FALSE;
-            rc |= APP_CLOSE_REQUESTED;
-        }
-
-        if (rc)
-            break;
-
-        if (abstime)
-        {
-            /* wait with timeout */
-            switch (pthread_cond_timedwait(&ctx->data_ready_cond,
-                                           &ctx->data_ready_lock,
-                                           abstime))
-            {
-            case 0: /* some data might be available */
-            case EINTR:
-                break;
-
-            case ETIMEDOUT: /* no data arrived in the specified time */
-                goto done;
-
-            case EINVAL:
-                assert(0);
-                break;
-
-            default:
-                assert(0);
-                break;
-            }
-        }
-        else
-        {
-            /* block indefinitely */
-            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                           &ctx->data_ready_lock));
-        }
-    }
+    assert(ctx);
+    wait.ctx    = ctx;
+    wait.flags  = flags;
+    wait.events = 0;
 
-done:
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    /* no need to go near the waiter if something's ready already */
+    if (!events_ready(&wait))
+        (void) _mysock_wait(&ctx->transport_waiter, events_ready, &wait,
+                            abstime);
 
-    return rc;
+    return wait.events;
 }
 
 /* allow STCP implementation to establish a context for a given mysocket
@@ -167,6 +187,46 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
     return len;
 }
 
+/* stcp_network_recv_packet
+ *
+ * Receive a datagram from the peer without copying it.  The call blocks
+ * until data is available.
+ *
+ * sd       Mysocket descriptor.
+ * packet   Set to point to the datagram.
+ *
+ * The datagram is the transport layer's to read or modify in place until
+ * its next call to stcp_network_recv_packet().  Until then, anything in it
+ * passed to stcp_app_send() is queued for the application by reference.
+ * This call returns the datagram's length.
+ */
+ssize_t stcp_network_recv_packet(mysocket_t sd, void **packet)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    char *data;
+    size_t len;
+
+    assert(ctx && packet);
+
+    if (ctx->transport_packet)
+    {
+        _buffer_release(ctx->transport_packet);
+        ctx->transport_packet = NULL;
+    }
+
+    ctx->transport_packet =
+        _mysock_dequeue_reference(ctx, &ctx->network_recv_queue, &data, &len);
+    assert(ctx->transport_packet || len == 0);
+
+    /* checksum should have been verified by underlying network layer in
+     * this implementation.
+     */
+    assert(len == 0 || _mysock_verify_checksum(ctx, data, len));
+
+    *packet = data;
+    return len;
+}
+
 /* stcp_network_send()
  *
  * Send data (unreliably) to the peer.
@@ -192,16 +252,35 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
-    char              packet[MAX_IP_PAYLOAD_LEN];
-    size_t            packet_len;
+    uint32_t          header_buf[0xf];  /* largest th_off: header, options */
+    struct iovec      iov[MAX_PACKET_IOV];
+    int               iovcnt;
+    size_t            header_len, packet_len;
     const void       *next_buf;
     va_list           argptr;
     struct tcphdr    *header;
 
     assert(ctx && src);
 
-    assert(src_len <= sizeof(packet));
-    memcpy(packet, src, src_len);
+    /* only the header is copied, as we fill in a few of its fields; the
+     * rest of the packet is gathered from the caller's buffers as it's
+     * sent.
+     */
+    assert(src_len >= sizeof(struct tcphdr));
+    header_len = MIN(src_len, TCP_DATA_START(src));
+    assert(header_len >= sizeof(struct tcphdr) &&
+           header_len <= sizeof(header_buf));
+    memcpy(header_buf, src, header_len);
+
+    iov[0].iov_base = header_buf;
+    iov[0].iov_len  = header_len;
+    iovcnt = 1;
+    if (src_len > header_len)
+    {
+        iov[iovcnt].iov_base = (char *) src + header_len;
+        iov[iovcnt].iov_len  = src_len - header_len;
+        ++iovcnt;
+    }
     packet_len = src_len;
 
     va_start(argptr, src_len);
@@ -209,15 +288,20 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
     {
         size_t next_len = va_arg(argptr, size_t);
 
-        assert(packet_len + next_len <= sizeof(packet));
-        memcpy(packet + packet_len, next_buf, next_len);
+        if (next_len == 0)
+            continue;
+
+        assert(iovcnt < MAX_PACKET_IOV);
+        iov[iovcnt].iov_base = (void *) next_buf;
+        iov[iovcnt].iov_len  = next_len;
+        ++iovcnt;
         packet_len += next_len;
     }
     va_end(argptr);
+    assert(packet_len <= MAX_IP_PAYLOAD_LEN);
 
     /* fill in fields in the TCP header that aren't handled by students */
-    assert(packet_len >= sizeof(struct tcphdr));
-    header = (struct tcphdr *) packet;
+    header = (struct tcphdr *) header_buf;
 
     header->th_sport = _network_get_port(&ctx->network_state);
     /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
@@ -230,8 +314,8 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
     header->th_sum = 0; /* set below */
     header->th_urp = 0; /* ignored */
 
-    _mysock_set_checksum(ctx, packet, packet_len);
-    return _network_send(sd, packet, packet_len);
+    _mysock_set_checksum_iov(ctx, iov, iovcnt);
+    return _network_send(sd, iov, iovcnt);
 }
 
 /* receive data from the application (sent to us using mywrite()).
@@ -240,29 +324,97 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t len;
+
     assert(ctx && dst);
 
     /* app may have passed in data of arbitrary length; all of it must be
      * passed down to the transport layer.  if it doesn't fit in the specified
-     * buffer, any left over is kept for the next call to app_recv().
+     * buffer, any left over is kept for the next call to app_recv().  small
+     * writes queued one after another come out together.
      */
-    return _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
-                                  dst, max_len, TRUE);
+    len = _mysock_dequeue_stream(ctx, &ctx->app_recv_queue, dst, max_len);
+
+    /* that made room in the send buffer for a waiting writer */
+    _mysock_send_space_freed(ctx);
+    return len;
+}
+
+/* number of bytes queued by mywrite() that stcp_app_recv() hasn't taken */
+size_t stcp_app_pending(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _mysock_queue_bytes(&ctx->app_recv_queue);
+}
+
+bool_t stcp_nodelay(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+    return ctx->nodelay;
 }
 
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    mysock_buffer_t *packet;
+
     assert(ctx && src);
     if (src_len > 0)
     {
         DEBUG_LOG(("stcp_app_send(%d):  sending %u bytes up to app\n",
                    sd, src_len));
-        _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, src, src_len);
+
+        /* payload straight out of a received packet needn't be copied */
+        packet = ctx->transport_packet;
+        if (packet && BUFFER_CONTAINS(packet, src, src_len))
+        {
+            _mysock_enqueue_reference(ctx, &ctx->app_send_queue,
+                                      packet, src, src_len);
+        }
+        else
+        {
+            _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, src, src_len);
+        }
     }
 }
 
+/* number of bytes passed up with stcp_app_send() that the application
+ * hasn't consumed with myread() yet.
+ */
+size_t stcp_app_unread(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _mysock_queue_bytes(&ctx->app_send_queue);
+}
+
+void stcp_app_read_notify(mysocket_t sd, size_t unread)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    __atomic_store_n(&ctx->read_event, FALSE, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->read_wake_unread, unread, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->read_blocked, TRUE, __ATOMIC_RELAXED);
+
+    /* the application may have read everything before the flag went up */
+    _mysock_data_read(ctx);
+}
+
+bool_t stcp_syn_cookie(mysocket_t sd, uint32_t *isn)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx && isn);
+    *isn = ctx->syn_cookie_isn;
+    return ctx->syn_cookie;
+}
+
 void stcp_fin_received(mysocket_t sd)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
@@ -17,6 +17,7 @@ typedef enum
     APP_DATA            = 1,
     NETWORK_DATA        = 2,
     APP_CLOSE_REQUESTED = 4,
+    APP_READ            = 8,    /* see stcp_app_read_notify() */
     ANY_EVENT           = APP_DATA | NETWORK_DATA | APP_CLOSE_REQUESTED
 } stcp_event_type_t;
 
@@ -32,11 +33,11 @@ void stcp_unblock_application(mysocket_t sd);
  * or from the application, or for the application to request that the
  * socket be closed via myclose(), depending on the value of wait_flags.
  * abstime is the absolute time at which the function should quit waiting
- * (i.e., the value of the system clock at which the timeout should be
- * indicated; it has the same origin as time(2) and gettimeofday(2), so a
- * structure containing all zeros corresponds to 00:00:00 GMT, January 1,
- * 1970); if the timeout pointer is NULL, the function blocks indefinitely
- * until data arrives.  the close event is triggered only once, once all
+ * (i.e., the value of the monotonic clock, clock_gettime(CLOCK_MONOTONIC),
+ * at which the timeout should be indicated; unlike time(2) and
+ * gettimeofday(2) it never jumps when the system time is changed); if the
+ * timeout pointer is NULL, the function blocks indefinitely until data
+ * arrives.  the close event is triggered only once, once all
  * pending data has been dequeued from the application.
  *
  * sd is the mysocket descriptor for the connection of interest.
@@ -81,6 +82,18 @@ void *stcp_get_context(mysocket_t my_sd);
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* Receive a datagram from the peer without copying it.
+ *
+ * sd       Mysocket descriptor.
+ * packet   Set to point to the datagram.
+ *
+ * The datagram may be read (and modified) in place until the next call to
+ * stcp_network_recv_packet() on this mysocket.  Any part of it passed to
+ * stcp_app_send() in the meantime goes up to the application without a
+ * copy.  This call returns the datagram's length.
+ */
+ssize_t stcp_network_recv_packet(mysocket_t sd, void **packet);
+
 /* Send data (unreliably) to the peer.
  *
  * sd           Mysocket descriptor
@@ -101,9 +114,42 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...);
 /* receive data from the application (sent to us using mywrite()) */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* number of bytes written by the application with mywrite() that have not
+ * yet been taken with stcp_app_recv().
+ */
+size_t stcp_app_pending(mysocket_t sd);
+
+/* TRUE if the application asked for small writes to go out at once
+ * (MYSOCK_NODELAY), i.e. the transport layer shouldn't coalesce them.
+ */
+bool_t stcp_nodelay(mysocket_t sd);
+
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len);
 
+/* number of bytes passed up with stcp_app_send() that the application has
+ * not yet read with myread().  the transport layer can use this to size
+ * the receive window it advertises.
+ */
+size_t stcp_app_unread(mysocket_t sd);
+
+/* ask for a single APP_READ event from stcp_wait_for_event() once the
+ * application has read enough that no more than unread bytes are left
+ * unread, e.g. so that a closed receive window can be reopened with a
+ * window update.  the event is delivered (if asked for in the wait flags)
+ * at once if that's already so.
+ */
+void stcp_app_read_notify(mysocket_t sd, size_t unread);
+
+/* TRUE if the connection was set up from a SYN cookie:  the listening
+ * mysocket's backlog was full, so it answered the peer's SYN itself, with
+ * *isn as the SYN-ACK's sequence number and no options, and kept nothing
+ * until the peer's ACK of that came back.  the SYN the transport layer is
+ * passed is rebuilt from that ACK, which is passed on after it; the SYN-ACK
+ * mustn't be sent again.
+ */
+bool_t stcp_syn_cookie(mysocket_t sd, uint32_t *isn);
+
 /* once you receive a FIN segment from the peer, we need to let the
  * application know there's no more data arriving (by returning 0 bytes for
  * subsequent myread() calls).  call stcp_fin_received() to indicate the
@@ -8,13 +8,64 @@
 #include "tcp_sum.h"
 
 
+/* running state of a ones' complement sum over a sequence of buffers.  a
+ * buffer may end partway through a 16-bit word, in which case its last byte
+ * is held back and paired with the first byte of the next buffer.
+ */
+typedef struct
+{
+    int32_t sum;
+    bool_t  odd;        /* TRUE if pending holds a byte */
+    uint8_t pending;
+} checksum_state_t;
+
+static void _checksum_add(checksum_state_t *state,
+                          const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+
+    if (state->odd && len > 0)
+    {
+        uint16_t tmp;
+
+        ((uint8_t *) &tmp)[0] = state->pending;
+        ((uint8_t *) &tmp)[1] = *p++;
+        --len;
+        state->sum += tmp;
+        state->odd = FALSE;
+    }
+
+    if (((long) p & 1) == 0)
+    {
+        for (; len >= 2; len -= 2, p += 2)
+            state->sum += *(const uint16_t *) p;
+    }
+    else
+    {
+        for (; len >= 2; len -= 2, p += 2)
+        {
+            uint16_t tmp;
+
+            ((uint8_t *) &tmp)[0] = p[0];
+            ((uint8_t *) &tmp)[1] = p[1];
+            state->sum += tmp;
+        }
+    }
+
+    if (len > 0)
+    {
+        state->pending = *p;
+        state->odd = TRUE;
+    }
+}
+
 /* computes checksum for TCP segment, based on description in RFCs 793 and
- * 1071, and Berkeley in_cksum().
+ * 1071, and Berkeley in_cksum().  the segment is gathered from iovcnt
+ * buffers, the first of which must hold the whole TCP header.
  */
-uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
-                              uint32_t dst_addr /*network byte order*/,
-                              const void *packet,
-                              size_t len /*host byte order*/)
+uint16_t _mysock_tcp_checksum_iov(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const struct iovec *iov, int iovcnt)
 {
     struct
     {
@@ -23,64 +74,103 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
         uint8_t  zero;
         uint8_t  protocol;
         uint16_t len;
-    } __attribute__ ((packed)) pseudo_header =
-    {
-        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
-    };
+    } __attribute__ ((packed)) pseudo_header;
 
-    unsigned int k;
-    int32_t sum = 0;
+    checksum_state_t state = { 0, FALSE, 0 };
+    const size_t sum_offset = offsetof(struct tcphdr, th_sum);
+    size_t len = 0;
+    int k;
 
-    assert(packet && len >= sizeof(struct tcphdr));
+    assert(iov && iovcnt > 0);
+    assert(iov[0].iov_len >= sizeof(struct tcphdr));
     assert(sizeof(pseudo_header) == 12);
 
-
     assert(src_addr > 0);
     assert(dst_addr > 0);
 
-    /* process 96-bit pseudo header */
-    for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
-        sum += ((uint16_t *) &pseudo_header)[k];
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
 
-    /* process TCP header and payload */
-    assert(((long)packet & 2) == 0);
-    assert((offsetof(struct tcphdr, th_sum) & 2) == 0);
-    for (k = 0; k < (len >> 1); ++k)
-    {
-        if (k == (offsetof(struct tcphdr, th_sum) >> 1))
-            continue;   /* th_sum == 0 during checksum computation */
-        sum += ((uint16_t *) packet)[k];
-    }
+    pseudo_header.src_addr = src_addr;
+    pseudo_header.dst_addr = dst_addr;
+    pseudo_header.zero     = 0;
+    pseudo_header.protocol = IPPROTO_TCP;
+    pseudo_header.len      = htons(len);
 
-    if (len & 1)
+    /* process 96-bit pseudo header */
+    _checksum_add(&state, &pseudo_header, sizeof(pseudo_header));
+
+    /* process TCP header and payload, skipping th_sum (which is taken to
+     * be zero during checksum computation).
+     */
+    assert((sum_offset & 1) == 0);
+    _checksum_add(&state, iov[0].iov_base, sum_offset);
+    _checksum_add(&state,
+                  (const char *) iov[0].iov_base + sum_offset + 2,
+                  iov[0].iov_len - sum_offset - 2);
+    for (k = 1; k < iovcnt; ++k)
+        _checksum_add(&state, iov[k].iov_base, iov[k].iov_len);
+
+    if (state.odd)
     {
         uint16_t tmp = 0;
-        *(uint8_t *) &tmp = ((uint8_t *) packet)[len - 1];
-        sum += tmp;
+        *(uint8_t *) &tmp = state.pending;
+        state.sum += tmp;
     }
 
     /* fold 32-bit sum to 16 bits */
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
+    state.sum = (state.sum >> 16) + (state.sum & 0xffff);
+    state.sum += (state.sum >> 16);
 
-    return (uint16_t) ~sum;
+    return (uint16_t) ~state.sum;
 }
 
-/* update checksum in the given STCP segment */
-void _mysock_set_checksum(const mysock_context_t *ctx,
-                          void *packet, size_t len)
+/* as above, for a segment held in a single buffer */
+uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
+                              uint32_t dst_addr /*network byte order*/,
+                              const void *packet,
+                              size_t len /*host byte order*/)
 {
-    assert(ctx && packet);
-    assert(len >= sizeof(struct tcphdr));
+    struct iovec iov;
+
+    assert(packet && len >= sizeof(struct tcphdr));
+
+    iov.iov_base = (void *) packet;
+    iov.iov_len  = len;
+    return _mysock_tcp_checksum_iov(src_addr, dst_addr, &iov, 1);
+}
+
+/* update checksum in the given STCP segment, gathered from iovcnt buffers;
+ * the first buffer holds the TCP header.
+ */
+void _mysock_set_checksum_iov(const mysock_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    assert(ctx && iov && iovcnt > 0);
+    assert(iov[0].iov_len >= sizeof(struct tcphdr));
 
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
 
-    ((struct tcphdr *) packet)->th_sum = _mysock_tcp_checksum(
+    ((struct tcphdr *) iov[0].iov_base)->th_sum = _mysock_tcp_checksum_iov(
         _network_get_local_addr((network_context_t *)
                                 &ctx->network_state), /*src*/
         ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*dst*/
             sin_addr.s_addr,
-        packet, len);
+        iov, iovcnt);
+}
+
+/* update checksum in the given STCP segment */
+void _mysock_set_checksum(const mysock_context_t *ctx,
+                          void *packet, size_t len)
+{
+    struct iovec iov;
+
+    assert(ctx && packet);
+    assert(len >= sizeof(struct tcphdr));
+
+    iov.iov_base = packet;
+    iov.iov_len  = len;
+    _mysock_set_checksum_iov(ctx, &iov, 1);
 }
 
 /* returns TRUE if checksum is correct, FALSE otherwise */
@@ -0,0 +1,203 @@
+/*
+ * timer.c
+ *
+ * Hashed timing wheel for the STCP layer's timers.  See timer.h for
+ * the interface.
+ *
+ */
+
+#include <time.h>
+#include <assert.h>
+#include "timer.h"
+#include "transport.h"
+
+#define TIMER_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+#if (TIMER_WHEEL_SLOTS & TIMER_SLOT_MASK) != 0
+#error TIMER_WHEEL_SLOTS must be a power of 2
+#endif
+
+/* ***************************************************
+ * Function: stcp_now
+ * ***************************************************
+ */
+stcp_time_t stcp_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (stcp_time_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* ***************************************************
+ * Function: stcp_abstime
+ * ***************************************************
+ */
+struct timespec stcp_abstime(stcp_time_t t)
+{
+	struct timespec ts;
+	ts.tv_sec = t/1000000;
+	ts.tv_nsec = (t%1000000)*1000;
+	return ts;
+}
+
+/* ***************************************************
+ * Function: timer_wheel_init
+ * ***************************************************
+ * Every slot is a circular list with a dummy head, so linking and
+ * unlinking never has to check for the ends.
+ */
+void timer_wheel_init(struct timer_wheel *wheel)
+{
+	unsigned int i;
+	for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+		wheel->slots[i].next = wheel->slots[i].prev = &wheel->slots[i];
+	}
+	wheel->now_tick = stcp_now()/TIMER_TICK_US;
+	wheel->next_hint = 0;
+	wheel->num_pending = 0;
+}
+
+/* ***************************************************
+ * Function: timer_add
+ * ***************************************************
+ * A timer goes in the slot for the tick it expires in, which it
+ * shares with timers a whole number of turns further out.  One that
+ * is already due goes in the current slot so the next timer_expire
+ * finds it.
+ */
+void timer_add(struct timer_wheel *wheel, struct stcp_timer *t, stcp_time_t expires)
+{
+	timer_cancel(wheel, t);
+	stcp_time_t tick = MAX(expires/TIMER_TICK_US, wheel->now_tick);
+	struct stcp_timer *head = &wheel->slots[tick & TIMER_SLOT_MASK];
+	t->expires = expires;
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+	if (wheel->num_pending == 0 || expires < wheel->next_hint) {
+		wheel->next_hint = expires;
+	}
+	wheel->num_pending+=1;
+}
+
+/* ***************************************************
+ * Function: timer_cancel
+ * ***************************************************
+ * next_hint is left alone; it only has to be a lower bound.
+ */
+void timer_cancel(struct timer_wheel *wheel, struct stcp_timer *t)
+{
+	if (!timer_pending(t)) {
+		return;
+	}
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	assert(wheel->num_pending > 0);
+	wheel->num_pending-=1;
+}
+
+/* ***************************************************
+ * Function: earliest_in_slot
+ * ***************************************************
+ * Earliest expiry among the timers in tick's slot that are due by
+ * the end of that tick (the rest are for a later turn), or 0.
+ */
+static stcp_time_t earliest_in_slot(struct timer_wheel *wheel, stcp_time_t tick)
+{
+	struct stcp_timer *head = &wheel->slots[tick & TIMER_SLOT_MASK];
+	struct stcp_timer *t;
+	stcp_time_t earliest = 0;
+	for (t = head->next; t != head; t = t->next) {
+		if (t->expires/TIMER_TICK_US <= tick && (earliest == 0 || t->expires < earliest)) {
+			earliest = t->expires;
+		}
+	}
+	return earliest;
+}
+
+/* ***************************************************
+ * Function: timer_next_expiry
+ * ***************************************************
+ * Walk forward from where nothing can be due (next_hint) to the
+ * first slot with a timer for this turn.  The walk only ever covers
+ * ticks with nothing to do, and the answer is kept as the new hint,
+ * so asking again costs a single slot.  If nothing comes up within a
+ * turn, every pending timer is further out than that and we look at
+ * them all.
+ */
+stcp_time_t timer_next_expiry(struct timer_wheel *wheel)
+{
+	if (wheel->num_pending == 0) {
+		return 0;
+	}
+	stcp_time_t tick = MAX(wheel->next_hint/TIMER_TICK_US, wheel->now_tick);
+	stcp_time_t end = tick + TIMER_WHEEL_SLOTS;
+	stcp_time_t earliest = 0;
+	for (; tick < end && earliest == 0; tick++) {
+		earliest = earliest_in_slot(wheel, tick);
+	}
+	if (earliest == 0) {
+		unsigned int i;
+		for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+			struct stcp_timer *head = &wheel->slots[i];
+			struct stcp_timer *t;
+			for (t = head->next; t != head; t = t->next) {
+				if (earliest == 0 || t->expires < earliest) {
+					earliest = t->expires;
+				}
+			}
+		}
+	}
+	assert(earliest != 0);
+	wheel->next_hint = earliest;
+	return earliest;
+}
+
+/* ***************************************************
+ * Function: timer_expire
+ * ***************************************************
+ * Run the wheel up to now.  Ticks before next_hint are skipped
+ * outright; the slot for the current tick is looked at on every
+ * call, but only timers that are actually due come out of it.
+ */
+struct stcp_timer *timer_expire(struct timer_wheel *wheel, stcp_time_t now)
+{
+	stcp_time_t target = now/TIMER_TICK_US;
+	if (wheel->num_pending == 0) {
+		wheel->now_tick = MAX(wheel->now_tick, target);
+		return NULL;
+	}
+	wheel->now_tick = MAX(wheel->now_tick, MIN(wheel->next_hint/TIMER_TICK_US, target));
+	if (target - wheel->now_tick >= TIMER_WHEEL_SLOTS) {
+		/* A whole turn has gone by, so every slot is due: look at all
+		 * of them once rather than tick by tick */
+		unsigned int i;
+		for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+			struct stcp_timer *head = &wheel->slots[i];
+			struct stcp_timer *t;
+			for (t = head->next; t != head; t = t->next) {
+				if (t->expires <= now) {
+					timer_cancel(wheel, t);
+					return t;
+				}
+			}
+		}
+		wheel->now_tick = target;
+	}
+	for (;;) {
+		struct stcp_timer *head = &wheel->slots[wheel->now_tick & TIMER_SLOT_MASK];
+		struct stcp_timer *t;
+		for (t = head->next; t != head; t = t->next) {
+			if (t->expires <= now && t->expires/TIMER_TICK_US <= wheel->now_tick) {
+				timer_cancel(wheel, t);
+				return t;
+			}
+		}
+		if (wheel->now_tick >= target) {
+			return NULL;
+		}
+		wheel->now_tick+=1;
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * timer.h
+ *
+ * Timers for the STCP layer, kept in a hashed timing wheel (Varghese
+ * and Lauck).  Time is in microseconds on the monotonic clock, so a
+ * change to the wall clock never fires or stalls a timer.  A timer is
+ * a struct stcp_timer embedded in whatever owns it; adding, moving or
+ * cancelling one is O(1), and expired timers are handed back one at a
+ * time by timer_expire() for the owner to act on.  Nothing in here
+ * locks: a wheel belongs to the thread that runs it.
+ *
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include "mysock.h"
+
+typedef uint64_t stcp_time_t;	/* microseconds, CLOCK_MONOTONIC */
+
+#define TIMER_TICK_US 1000		/* resolution of the wheel */
+#define TIMER_WHEEL_SLOTS 1024	/* a power of 2; one turn is about a second */
+
+struct stcp_timer
+{
+	struct stcp_timer *next;	/* slot list, prev is NULL when not pending */
+	struct stcp_timer *prev;
+	stcp_time_t expires;
+	void *data;					/* for the owner, the wheel never looks */
+};
+
+struct timer_wheel
+{
+	struct stcp_timer slots[TIMER_WHEEL_SLOTS];	/* list heads */
+	stcp_time_t now_tick;		/* ticks before this have been run */
+	stcp_time_t next_hint;		/* no timer expires before this */
+	unsigned int num_pending;
+};
+
+/* Current time on the monotonic clock */
+stcp_time_t stcp_now(void);
+
+/* The same instant as an absolute timespec for stcp_wait_for_event() */
+struct timespec stcp_abstime(stcp_time_t t);
+
+void timer_wheel_init(struct timer_wheel *wheel);
+
+/* (Re)arm t to go off at expires, whether or not it was pending */
+void timer_add(struct timer_wheel *wheel, struct stcp_timer *t, stcp_time_t expires);
+
+/* Disarm t; harmless if it isn't pending */
+void timer_cancel(struct timer_wheel *wheel, struct stcp_timer *t);
+
+#define timer_pending(t) ((t)->prev != NULL)
+
+/* When the earliest pending timer expires, or 0 if none is pending */
+stcp_time_t timer_next_expiry(struct timer_wheel *wheel);
+
+/* Disarm and return a timer that expired by now, or NULL once there
+ * are no more.  Call it in a loop. */
+struct stcp_timer *timer_expire(struct timer_wheel *wheel, stcp_time_t now);
+
+#endif  /* __TIMER_H__ */
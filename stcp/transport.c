@@ -15,14 +15,43 @@
 #include <stdlib.h>
 #include <ctime>
 #include <cstdlib> 
-#include <sys/time.h>
 #include <unistd.h>
 #include <assert.h>
 #include "mysock.h"
 #include "stcp_api.h"
 #include "transport.h"
+#include "congestion.h"
+#include "timer.h"
 #include <netinet/in.h>
-#include <math.h>
+
+/* Receive window.  It starts at STCP_INIT_RWIN and grows with the rate
+ * the application reads, up to STCP_MAX_RWIN.  Both can be overridden
+ * at compile time; STCP_MAX_RWIN must be a power of 2 */
+#ifndef STCP_MAX_RWIN
+#define STCP_MAX_RWIN (1 << 20)
+#endif
+#ifndef STCP_INIT_RWIN
+#define STCP_INIT_RWIN (16 * 1024)
+#endif
+#if (STCP_MAX_RWIN & (STCP_MAX_RWIN - 1)) || STCP_INIT_RWIN > STCP_MAX_RWIN
+#error STCP_MAX_RWIN must be a power of 2 no smaller than STCP_INIT_RWIN
+#endif
+
+/* Buffer sizes, all powers of 2.  The rings are allocated the first time
+ * they are needed and double as the windows they hold grow, each up to
+ * the per-connection budget: STCP_MAX_RWIN bytes, or less if set with
+ * STCP_BUF_MAX=bytes (see buffer_budget) */
+#define SEG_RING_INIT_SIZE 64	/* unacked segments to start with */
+#define SEG_RING_MAX_SIZE 4096	/* unacked segments we can track */
+#define MAX_OOO_RANGES 32		/* holes we are willing to keep track of */
+#define MAX_SACK_BLOCKS 4		/* as many as fit in 40 bytes of options */
+
+/* Loss recovery, see handle_ack */
+enum {
+		RECOVERY_NONE,
+		RECOVERY_FAST,		/* after three duplicate ACKs */
+		RECOVERY_RTO		/* after a timeout */
+		 };
 
 enum { 
 		CSTATE_CLOSED,
@@ -37,125 +66,254 @@ enum {
 		CSTATE_LAST_ACK
 		 };    
 
-struct p_entry
+/* One segment we sent and haven't had acked yet.  Its payload lives in
+ * the send ring at (seq & (size - 1)); segments never straddle the end of
+ * the ring, so the payload is always contiguous (a ring twice the size
+ * has no new end for them to straddle). */
+struct segment
 {
-	char* packet;
-	struct timeval tstart; /* Time that packet was sent */
-	int num_transmits; /* Number of time we sent this packet*/
-	size_t packet_size; /* Total packet size including header */
-	struct p_entry* next;
+	tcp_seq seq;
+	uint16_t len;			/* payload bytes */
+	uint8_t flags;			/* TH_FIN if this is our FIN */
+	uint8_t num_transmits;	/* Number of time we sent this segment */
+	bool sacked;			/* receiver told us it has it (SACK) */
+	stcp_time_t tstart;		/* Time that segment was (last) sent */
 };
 
+/* Sender's window: a byte ring holding everything from seq_base up to
+ * nxt_seq_num, and a ring of segment records in the order they were sent.
+ * head/tail are free running indices into segs. */
+struct send_buffer
+{
+	char* data;
+	size_t size;			/* bytes in data, 0 until the first send */
+	struct segment* segs;
+	unsigned int num_segs;	/* records in segs, 0 until the first send */
+	unsigned int head;
+	unsigned int tail;
+};
 
-struct window
+/* Receiver's window: a byte ring keyed by sequence number holding data
+ * that arrived ahead of last_ack_sent, and the sorted, disjoint ranges of
+ * it we have.  In-order data goes straight to the application and never
+ * touches the ring, which isn't allocated until something arrives out
+ * of order. */
+struct seq_range
 {
-  struct p_entry* start;
-  struct p_entry* end;
-  unsigned int num_entries;
+	tcp_seq start;
+	tcp_seq end;
+};
+
+struct recv_buffer
+{
+	char* data;
+	size_t size;		/* bytes in data (once allocated), covers rcv_space */
+	struct seq_range ooo[MAX_OOO_RANGES];
+	unsigned int num_ooo;
+	tcp_seq last_ooo_seq;	/* latest out-of-order arrival, reported first in SACKs */
+	bool fin_rcvd;		/* seen a FIN, delivered once we catch up to it */
+	tcp_seq fin_seq;	/* sequence number of the FIN */
+};
+
+/* What we found in the options of an incoming segment */
+struct tcp_options
+{
+	bool wscale_ok;
+	uint8_t wscale;
+	bool sack_ok;			/* SACK permitted, in a SYN */
+	unsigned int num_sacks;
+	struct seq_range sacks[MAX_SACK_BLOCKS];
 };
 
 /* this structure is global to a mysocket descriptor */
 typedef struct
 {
+    mysocket_t sd;
     bool_t done;    /* TRUE once connection is closed */
 
     int connection_state;   /* state of the connection (established, etc.) */
     tcp_seq initial_sequence_num;
     
     /* Receiving/Sending buffers */
-    window rbuffer;
-    window sbuffer;
+    struct recv_buffer rbuffer;
+    struct send_buffer sbuffer;
     
-    /* Retransmissions */
-    double rto;	 			/* current RTO value in miliseconds (up to microsec granularity)  */
-	double estimated_rtt;   /* estimated RTT for calculating RTO */
-	double devrtt; 			/* Deviation of RTT for calculation RTO*/
+    /* Retransmissions (RFC 6298), all in microseconds */
+    uint32_t rto;			/* current RTO, doubled on each timeout */
+    uint32_t srtt;			/* smoothed RTT, 0 until the first sample */
+    uint32_t rttvar;		/* RTT variation */
+
+    /* Timers, kept in the wheel of whoever runs us (see transport_open) */
+    struct timer_wheel* timers;
+    struct stcp_timer rexmit_timer;		/* oldest unacked segment (RFC 6298) */
+    struct stcp_timer delack_timer;		/* ACK we are holding back */
+    struct stcp_timer persist_timer;	/* window probes while the peer's window is shut */
+    struct stcp_timer time_wait_timer;
+    uint32_t persist_backoff;	/* us until the next window probe */
+    stcp_time_t give_up_time;	/* the head may be given up on from here, 0 until it times out */
+
+    /* Handshake (the rexmit_timer resends our SYN or SYN_ACK) */
+    unsigned int syn_tries;		/* times we have sent it */
+    stcp_time_t syn_tstart;		/* when it last went out */
+    bool fin_retry;				/* app asked to close but the window was full */
 	  
     /* Window control */
     /* Receiver window (controls my sending) */
     tcp_seq  seq_base;    	 /*smallest seq number of transmitted but unacked packet (window back) */
     tcp_seq  nxt_seq_num; 	 /*next sequence number to be used (window front)*/
-    uint16_t recv_win;		 /*Sampled receiver window - what remote guy is willing to accept */
+    uint32_t recv_win;		 /*Sampled receiver window in bytes - what remote guy is willing to accept */
+    uint8_t snd_wscale;		 /*shift the remote guy applies to his th_win */
+    uint8_t rcv_wscale;		 /*shift we apply to our th_win (0 unless negotiated) */
+    bool wscale_ok;			 /*window scaling offered/agreed on */
+    bool sack_ok;			 /*SACK offered/agreed on */
+    tcp_seq sack_high;		 /*end of the highest block the peer SACKed */
+    tcp_seq rexmit_next;	 /*retransmissions in this recovery have covered up to here */
+    const struct cc_ops* cc_ops; /*congestion control algorithm */
+    struct cc_state cc;		 /*cwnd and ssthresh, and the algorithm's own state */
+    unsigned int dupacks;	 /*duplicate ACKs in a row for seq_base */
+    int recovery;			 /*RECOVERY_* */
+    tcp_seq recover;		 /*nxt_seq_num when the current recovery started */
+    tcp_seq short_end;		 /*end of the last less than full segment sent (Nagle) */
+    /* Sender statistics */
+    unsigned long bytes_sent;
+    unsigned long bytes_retransmitted;
+    unsigned long fast_retransmits;
+    unsigned long timeouts;
+    /* Delayed ACKs (delack_timer is pending while we hold one) */
+    size_t bytes_unacked;	 /*in-order data that arrived since our last ACK */
+    /* Receiver statistics */
+    unsigned long data_segs_rcvd;
+    unsigned long acks_sent;		 /*pure ACKs */
+    unsigned long acks_piggybacked;	 /*ACKs that rode on our data instead */
+    /* Sender statistics */
+    unsigned long app_wakeups;	 /*APP_DATA events handled */
+    unsigned long data_segs_sent; /*new data segments they produced */
         
     /*Senders window (controls my receiving) */
     tcp_seq last_ack_sent;   /*last ack sent - next in-order expected seq from other side*/		
     tcp_seq fin_ack;         /*expected incoming ack for sent fin*/
+    uint32_t rcv_space;		 /*receive window we are prepared to offer, in bytes */
+    size_t buf_max;			 /*largest each ring may grow, the rcv_space and cwnd cap */
+    bool rcv_win_shut;		 /*we advertised a zero window; APP_READ reopens it */
+    stcp_time_t rcv_mark;	 /*start of the current read rate measurement */
+    tcp_seq rcv_mark_seq;	 /*last_ack_sent at rcv_mark */
+    size_t rcv_mark_unread;	 /*bytes the app hadn't read at rcv_mark */
 
 } context_t;
 
 /****************** Function Prototypes ********************/
 static void generate_initial_seq_num(context_t *ctx);
-static void control_loop(mysocket_t sd, context_t *ctx);
-static bool active_init(mysocket_t sd, context_t *ctx);
-static void init_window(struct window* win);
-static bool passive_init(mysocket_t sd, context_t *ctx);
+static void init_buffers(context_t *ctx);
+static size_t buffer_budget(void);
+static size_t ring_size(size_t bytes, size_t max);
+static void copy_ring(char* dst, size_t dst_size, const char* src, size_t src_size, tcp_seq seq, size_t len);
+static void grow_send_buffer(context_t *ctx, size_t bytes);
+static void grow_seg_ring(context_t *ctx);
+static void grow_recv_buffer(context_t *ctx);
+static void send_syn(mysocket_t sd, context_t *ctx);
+static void handle_handshake(mysocket_t sd, context_t *ctx);
+static void accept_options(context_t *ctx, struct tcphdr* syn);
+static void established(mysocket_t sd, context_t *ctx);
+static void handshake_timeout(mysocket_t sd, context_t *ctx);
 static void send_fin(mysocket_t sd, context_t *ctx);
 static void handle_network_data(mysocket_t sd, context_t *ctx);
+static void handle_segment(mysocket_t sd, context_t *ctx, char* pkt, size_t total_length);
 static void handle_app_data(mysocket_t sd, context_t *ctx);
-static void handle_ack(struct tcphdr* hdr,  mysocket_t sd, context_t* ctx);
+static void handle_ack(struct tcphdr* hdr, size_t data_length, mysocket_t sd, context_t* ctx);
 static void handle_fin(mysocket_t sd, context_t *ctx);
-static bool sendrcv_syn(mysocket_t sd, context_t *ctx, struct tcphdr* in_packet);
-static void add_to_send_buffer(context_t* ctx, char* pkt, size_t len);
-static void add_to_recv_buffer(context_t *ctx, char* pkt, size_t len);
-ssize_t network_recv(mysocket_t sd, void *dst);
+static struct segment* add_to_send_buffer(context_t* ctx, tcp_seq seq, size_t len, uint8_t flags);
+static void add_to_recv_buffer(mysocket_t sd, context_t *ctx, tcp_seq seq, const char* data, size_t len);
+ssize_t network_recv(mysocket_t sd, char **pkt);
 ssize_t network_send(mysocket_t sd, const void *src, size_t src_len);
+ssize_t network_send_data(mysocket_t sd, struct tcphdr* hdr, const void *data, size_t data_len);
+static void send_segment(mysocket_t sd, context_t *ctx, struct segment* seg);
 static void handle_recv_buffer(mysocket_t sd, context_t *ctx);
-static void remove_until_seq(context_t *ctx);
-static context_t* init_ctx(bool_t is_active);
-static unsigned int wait_with_rto(mysocket_t sd, 
-		unsigned int wait_flags, context_t *ctx);
+static struct segment* remove_until_seq(context_t *ctx);
+static size_t send_buffer_space(context_t *ctx);
+static context_t* init_ctx(mysocket_t sd, bool_t is_active, struct timer_wheel* timers);
+static uint32_t head_rto(context_t *ctx);
+static void arm_rexmit_timer(context_t *ctx);
 static void send_ack(mysocket_t sd, context_t* ctx);
-static void handle_timeout(mysocket_t sd, context_t *ctx);
-static void free_buffer(struct window* win);
+static void add_sack_blocks(struct tcphdr* hdr, context_t* ctx);
+static void delay_ack(mysocket_t sd, context_t* ctx, size_t len);
+static bool nagle_holds(mysocket_t sd, context_t *ctx);
+static void handle_rexmit_timeout(mysocket_t sd, context_t *ctx);
+static void check_persist(mysocket_t sd, context_t *ctx);
+static void send_window_probe(mysocket_t sd, context_t *ctx);
+static bool is_window_probe(struct tcphdr* hdr, size_t data_length, context_t *ctx);
 static void teardown_resources(context_t *ctx);
-unsigned int control_wait(mysocket_t sd, context_t *ctx, bool fin_retry);
-static unsigned int wait_for_event(mysocket_t sd, 
-					unsigned int wait_flags, context_t *ctx, struct timeval start_time);
-static void estimate_rto(context_t* ctx, tcp_seq incoming_ack);
-static bool send_syn_ack(mysocket_t sd, context_t *ctx, struct tcphdr* syn_packet);
-static bool is_valid_entry(context_t* ctx, tcp_seq target_seq, size_t data_len);
+static unsigned int wait_until(mysocket_t sd, unsigned int wait_flags, stcp_time_t deadline);
+static void estimate_rto(context_t* ctx, struct segment* seg);
+static void rtt_sample(context_t* ctx, uint32_t rtt);
+static uint16_t advertised_window(mysocket_t sd, context_t *ctx);
+static void tune_rcv_space(mysocket_t sd, context_t *ctx);
+static size_t send_window_space(context_t *ctx);
+static size_t bytes_in_flight(context_t *ctx);
+static unsigned int find_segment(context_t *ctx, tcp_seq seq);
+static void handle_dupack(mysocket_t sd, context_t *ctx);
+static size_t add_syn_options(struct tcphdr* hdr, context_t *ctx);
+static void parse_options(struct tcphdr* hdr, struct tcp_options* opts);
+static void update_scoreboard(context_t *ctx, struct tcp_options* opts);
+static struct segment* next_hole(context_t *ctx);
+static void retransmit_segment(mysocket_t sd, context_t *ctx, struct segment* seg);
 void our_dprintf(const char *format,...);
 
 /************** CONSTANTS ********************************/
 #define DEBUG 0
 #define TH_MIN_OFFSET 5 /*tcp_hdr + padding */
 #define TH_MAX_OFFSET 16 /*44 bytes of option + tcphdr + padding */
-#define RWIN  3072
-#define CWIN  3072
-#define INIT_RTO 100.0
+#define TCPOPT_EOL 0
+#define TCPOPT_NOP 1
+#define TCPOPT_WINDOW 3		/* window scale, RFC 7323 */
+#define TCPOLEN_WINDOW 3
+#define TCPOPT_SACK_PERMITTED 4	/* RFC 2018 */
+#define TCPOLEN_SACK_PERMITTED 2
+#define TCPOPT_SACK 5
+#define TCPOLEN_SACK_BLOCK 8
+#define TCP_MAX_WINSHIFT 14
+/* Times are in microseconds */
+#define MIN_TUNE_INTERVAL 1000 /* floor on how often the receive window is tuned */
+#define INIT_RTO 100000
 #define MAX_RT_TRIES 6 /*max number of retransmissions before having to kill someone */
-#define MAX_RTO 500.0
-#define ALPHA 0.125 /* Weight on sample_rtt vs. previous rtt */
-#define BETA 0.25   /* Weight on new deviation vs. old deviation */ 
-#define TIME_WAIT_VALUE 1000
+#define MIN_GIVE_UP_TIME 2000000 /*but not before this long after the first timeout */
+#define MAX_RTO 500000
+#define ALPHA_SHIFT 3 /* alpha = 1/8, weight of a new sample in srtt */
+#define BETA_SHIFT 2  /* beta = 1/4, weight of a new deviation in rttvar */
+#define TIME_WAIT_VALUE 1000000
+#define DUPACK_THRESHOLD 3 /* duplicate ACKs that trigger fast retransmit */
+#define DELACK_TIMEOUT 20000 /* we may sit on an ACK for in-order data this long */
 
 /* ***************************************************
  * Function: transport_init
  * ***************************************************
  * initialise the transport layer, and start the main loop, handling
  * any data from the peer or the application.  this function should not
- * return until the connection is closed.
+ * return until the connection is closed.  This is the thread per
+ * connection way of running STCP: the connection has a timer wheel
+ * to itself and we sleep in stcp_wait_for_event() until it needs us.
+ * The event loop engine (event_loop.c) calls the functions below
+ * for many connections from one thread instead.
  */
 void transport_init(mysocket_t sd, bool_t is_active)
 {
-    context_t *ctx = init_ctx(is_active);
-	bool success = false;
-    if (is_active) {
-		success = active_init(sd, ctx);		
-    }
-    else {
-    	success = passive_init(sd, ctx);    	
-    }
-	if (success){  	
-  	    ctx->connection_state = CSTATE_ESTABLISHED;
-	    stcp_unblock_application(sd);
-	    control_loop(sd, ctx);
-	}
-	else {
-		errno = ETIMEDOUT;
-		stcp_unblock_application(sd);
+	struct timer_wheel* timers = (struct timer_wheel *)malloc(sizeof(struct timer_wheel));
+	assert(timers);
+	timer_wheel_init(timers);
+	transport_open(sd, is_active, timers);
+	while (!transport_done(sd)) {
+		unsigned int event = wait_until(sd, transport_wait_flags(sd), 
+										timer_next_expiry(timers));
+		transport_event(sd, event);
+		/* Timers are run after every wakeup, not only when the wait
+		 * timed out, so a steady stream of packets can't hold one off */
+		stcp_time_t now = stcp_now();
+		struct stcp_timer* t;
+		while (!transport_done(sd) && (t = timer_expire(timers, now)) != NULL) {
+			transport_timer(t);
+		}
 	}
-	teardown_resources(ctx);
+	transport_close(sd);
+	free(timers);
 	/* Wait for potential pending processes in 
 	 * other side (this is to fix a bug in the starter code) */
 	sleep(1);		
@@ -163,45 +321,240 @@ void transport_init(mysocket_t sd, bool_t is_active)
 }
 
 /* ***************************************************
- * Function: teardown_resources
+ * Function: transport_open
  * ***************************************************
- * 	Free allocated memory such as sender/receiver window
+ * Set up the connection, with its timers going in the given wheel.
+ * The active side sends its SYN right away, the passive side waits
+ * for one (see handle_handshake).  Neither this nor any of the
+ * transport_* functions below ever blocks.
  */
-static void teardown_resources(context_t *ctx)
+void transport_open(mysocket_t sd, bool_t is_active, struct timer_wheel* timers)
 {
-	free_buffer(&(ctx->sbuffer));
-	free_buffer(&(ctx->rbuffer));
-	free(ctx);
+	context_t *ctx = init_ctx(sd, is_active, timers);
+	stcp_set_context(sd, ctx);
+	if (is_active) {
+		ctx->nxt_seq_num = ctx->initial_sequence_num + 1; /* SYN Packet =  1 byte */
+		ctx->connection_state = CSTATE_SYN_SENT;
+		send_syn(sd, ctx);
+	}
+	else {
+		ctx->connection_state = CSTATE_LISTEN;
+	}
+}
+
+/* ***************************************************
+ * Function: transport_wait_flags
+ * ***************************************************
+ * The events worth waking us up for, based on window size and
+ * connection state.
+ * If the window is full, or Nagle is holding back what the application
+ * wrote (nagle_holds), then we don't wait for application data as we know
+ * we won't send any.
+ * If we shut our receive window, we wait for the application to read
+ * (see advertised_window).
+ * During the handshake, and in TIME_WAIT, we only accept network data
+ * (in TIME_WAIT, a FIN that needs to be acknowledged again).
+ * The caller should wait no longer than until the earliest pending
+ * timer in the wheel; with none pending... take your sweet time.
+ */
+unsigned int transport_wait_flags(mysocket_t sd)
+{
+	context_t *ctx = (context_t *) stcp_get_context(sd);
+	assert(ctx);
+	/* The handshake states come before ESTABLISHED */
+	if (ctx->connection_state < CSTATE_ESTABLISHED ||
+		ctx->connection_state == CSTATE_TIME_WAIT) {
+		return NETWORK_DATA;
+	}
+	unsigned int wait_flags = NETWORK_DATA | APP_CLOSE_REQUESTED;
+	if (send_window_space(ctx) > 0 && !ctx->fin_retry && !nagle_holds(sd, ctx)) {
+		wait_flags |= APP_DATA;	
+	}
+	if (ctx->rcv_win_shut) {
+		wait_flags |= APP_READ;
+	}
+	return wait_flags;
+}
+
+/* ***************************************************
+ * Function: transport_event
+ * ***************************************************
+ * Handle what the wait turned up:
+ *   - incoming data from the peer
+ *   - new data from the application (via mywrite())
+ *   - the socket to be closed (via myclose()); if the window is full
+ *     the FIN waits for room (fin_retry)
+ *   - the application reading enough to reopen a window we shut, which
+ *     the peer hears about with a window update
+ * Until the connection is established only network data matters.
+ */
+void transport_event(mysocket_t sd, unsigned int event)
+{
+	context_t *ctx = (context_t *) stcp_get_context(sd);
+	assert(ctx);
+	if (ctx->done) {
+		return;
+	}
+	if (ctx->connection_state < CSTATE_ESTABLISHED) {
+		if (event & NETWORK_DATA) {
+			handle_handshake(sd, ctx);
+		}
+		return;
+	}
+	size_t win_space = send_window_space(ctx);
+	if (event & NETWORK_DATA) {
+	   handle_network_data(sd, ctx);
+	}
+	if ((event & APP_DATA) && !ctx->fin_retry) {
+		handle_app_data(sd, ctx); 
+	}
+	if ((event & APP_READ) && ctx->rcv_win_shut) {
+		ctx->rcv_win_shut = false;
+		our_dprintf("Application read, sending window update\n");
+		send_ack(sd, ctx);
+	}
+	if (ctx->done) {
+		return;
+	}
+	if ((event & APP_CLOSE_REQUESTED) || ctx->fin_retry) {
+		if (win_space>0){
+			send_fin(sd, ctx);
+			ctx->fin_retry = false;
+		}
+		else {
+			our_dprintf("App requested FIN but window is full\n");
+			ctx->fin_retry = true;	
+		}
+	}
+	check_persist(sd, ctx);
 }
 
 /* ***************************************************
- * Function: free_buffer
+ * Function: transport_timer
  * ***************************************************
- * 	Iterate through buffer freeing allocated memory
+ * One of our timers went off (the caller has taken it out of the
+ * wheel with timer_expire()): resend after a retransmission timeout
+ * or resend the SYN, send the ACK we held back, probe a shut window,
+ * or end TIME_WAIT.  Returns the mysocket the timer belongs to.
  */
-static void free_buffer(struct window* win)
+mysocket_t transport_timer(struct stcp_timer* t)
 {
-	struct p_entry* curr = win->start->next;	
-	struct p_entry* victim;
-	while (curr) {
-		victim = curr;
-		curr = curr->next;
-		free(victim->packet);
-		free(victim);
+	context_t *ctx = (context_t *) t->data;
+	mysocket_t sd = ctx->sd;
+	if (ctx->done) {
+		return sd;
+	}
+	if (t == &ctx->rexmit_timer) {
+		if (ctx->connection_state < CSTATE_ESTABLISHED) {
+			handshake_timeout(sd, ctx);
+		}
+		else {
+			handle_rexmit_timeout(sd, ctx);
+		}
+	}
+	else if (t == &ctx->delack_timer) {
+		send_ack(sd, ctx);
+	}
+	else if (t == &ctx->persist_timer) {
+		send_window_probe(sd, ctx);
+		ctx->persist_backoff = MIN(ctx->persist_backoff*2, MAX_RTO);
+		timer_add(ctx->timers, &ctx->persist_timer, stcp_now() + ctx->persist_backoff);
+	}
+	else {
+		assert(t == &ctx->time_wait_timer);
+		ctx->connection_state = CSTATE_CLOSED;
+		ctx->done = true;
 	}
-	free(win->start);
+	if (!ctx->done && ctx->connection_state >= CSTATE_ESTABLISHED) {
+		check_persist(sd, ctx);
+	}
+	return sd;
+}
+
+/* ***************************************************
+ * Function: transport_done
+ * ***************************************************
+ * TRUE once the connection is over (or never got established),
+ * at which point the caller should transport_close() it.
+ */
+bool_t transport_done(mysocket_t sd)
+{
+	context_t *ctx = (context_t *) stcp_get_context(sd);
+	assert(ctx);
+	return ctx->done;
+}
+
+/* ***************************************************
+ * Function: transport_close
+ * ***************************************************
+ * Take the connection's timers out of the wheel and free it.
+ */
+void transport_close(mysocket_t sd)
+{
+	context_t *ctx = (context_t *) stcp_get_context(sd);
+	assert(ctx);
+	timer_cancel(ctx->timers, &ctx->rexmit_timer);
+	timer_cancel(ctx->timers, &ctx->delack_timer);
+	timer_cancel(ctx->timers, &ctx->persist_timer);
+	timer_cancel(ctx->timers, &ctx->time_wait_timer);
+	teardown_resources(ctx);
+	stcp_set_context(sd, NULL);
+}
+
+/* ***************************************************
+ * Function: transport_syn_cookie_reply
+ * ***************************************************
+ * The SYN_ACK a listening mysocket with a full backlog answers
+ * syn with (see connection_demux.c), with the sequence number isn.
+ * Nothing is kept, so it offers no options: the options we would
+ * agree on can't be recovered from the peer's ACK.  Both packets
+ * are as on the wire, in network byte order.  Returns the length
+ * of the packet written to reply.
+ */
+size_t transport_syn_cookie_reply(const void *syn, uint32_t isn, void *reply)
+{
+	const struct tcphdr* syn_hdr = (const struct tcphdr *)syn;
+	struct tcphdr* hdr = (struct tcphdr *)reply;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->th_seq = htonl(isn);
+	hdr->th_ack = htonl(ntohl(syn_hdr->th_seq) + 1);
+	hdr->th_flags = TH_SYN | TH_ACK;
+	hdr->th_win = htons(MIN(STCP_INIT_RWIN, 0xffff));
+	hdr->th_off = TH_MIN_OFFSET;
+	return sizeof(*hdr);
+}
+
+/* ***************************************************
+ * Function: teardown_resources
+ * ***************************************************
+ * 	Free allocated memory such as sender/receiver window
+ */
+static void teardown_resources(context_t *ctx)
+{
+	our_dprintf("Sent %lu bytes, %lu retransmitted, %lu fast retransmits, %lu timeouts\n",
+				ctx->bytes_sent, ctx->bytes_retransmitted, ctx->fast_retransmits, ctx->timeouts);
+	our_dprintf("Received %lu data segments, sent %lu ACKs, %lu piggybacked\n",
+				ctx->data_segs_rcvd, ctx->acks_sent, ctx->acks_piggybacked);
+	our_dprintf("Sent %lu data segments in %lu application wakeups\n",
+				ctx->data_segs_sent, ctx->app_wakeups);
+	free(ctx->sbuffer.data);
+	free(ctx->sbuffer.segs);
+	free(ctx->rbuffer.data);
+	free(ctx);
 }
 
 /* ***************************************************
  * Function: init_ctx
  * ***************************************************
- * 	Initiate the connection context structure
+ * 	Initiate the connection context structure.  The timers' data
+ *  points back at it, so transport_timer() can tell whose they are.
  */
-static context_t* init_ctx(bool_t is_active)
+static context_t* init_ctx(mysocket_t sd, bool_t is_active, struct timer_wheel* timers)
 {
 	srand((unsigned)time(0));
 	context_t *ctx = (context_t *) calloc(1, sizeof(context_t));
 	assert(ctx);
+	ctx->sd = sd;
 	ctx->connection_state = CSTATE_CLOSED;
 	generate_initial_seq_num(ctx);
 	if (is_active){
@@ -209,162 +562,366 @@ static context_t* init_ctx(bool_t is_active)
 		 * granularity, call it again for one side */
 		generate_initial_seq_num(ctx); 
 	}
-	init_window(&(ctx->sbuffer));
-	init_window(&(ctx->rbuffer));
-	ctx->estimated_rtt = 0;
-	ctx->devrtt = 0;
+	init_buffers(ctx);
+	/* Smallest shift that lets th_win cover our largest window */
+	while ((STCP_MAX_RWIN >> ctx->rcv_wscale) > 0xffff) {
+		ctx->rcv_wscale+=1;
+	}
+	/* Options we offer; SACK can be turned off with STCP_SACK=0 */
+	ctx->wscale_ok = true;
+	ctx->sack_ok = !(getenv("STCP_SACK") && !strcmp(getenv("STCP_SACK"), "0"));
+	/* Congestion control algorithm can be picked with STCP_CC=cubic etc. */
+	ctx->cc_ops = cc_find(getenv("STCP_CC"));
+	cc_init(ctx->cc_ops, &ctx->cc, STCP_MSS, ctx->buf_max);
 	ctx->rto = INIT_RTO;
+	ctx->timers = timers;
+	ctx->rexmit_timer.data = ctx;
+	ctx->delack_timer.data = ctx;
+	ctx->persist_timer.data = ctx;
+	ctx->time_wait_timer.data = ctx;
 	return ctx;
 }
 
 /* ***************************************************
- * Function: init_window
+ * Function: init_buffers
  * ***************************************************
- * 	Helper function for initializing a buffer link list
- * chain
+ * 	Size the send and receive rings, without allocating
+ *  them: a connection that is idle, or only ever receives
+ *  in order, never needs them (see grow_send_buffer and
+ *  grow_recv_buffer).
  */
-static void init_window(struct window* win)
+static void init_buffers(context_t *ctx)
 {
-	win->start = (struct p_entry*)calloc(1,sizeof(struct p_entry));
-	win->end = win->start;
+	ctx->buf_max = buffer_budget();
+	ctx->rcv_space = STCP_INIT_RWIN;
+	ctx->rbuffer.size = ring_size(ctx->rcv_space, ctx->buf_max);
 }
 
 /* ***************************************************
- * Function: wait_with_rto
+ * Function: buffer_budget
  * ***************************************************
- * 	Wrapper function for wait_for_event that uses the time
- *  that the packet in the head of the window was sent
- *  as the starting time.
+ * 	The most each of a connection's rings may take, a
+ *  power of 2: STCP_MAX_RWIN, or the largest one no
+ *  bigger than STCP_BUF_MAX (but not below STCP_INIT_RWIN).
  */
-static unsigned int wait_with_rto(mysocket_t sd, 
-					unsigned int wait_flags, context_t *ctx)
+static size_t buffer_budget(void)
 {
-	assert(ctx->sbuffer.start->next || !DEBUG);
-	struct timeval start_time = ctx->sbuffer.start->next->tstart;
-	unsigned int event = wait_for_event(sd, wait_flags, ctx, start_time); 
-	return event;
+	size_t max = STCP_MAX_RWIN;
+	const char* env = getenv("STCP_BUF_MAX");
+	long budget = env ? atol(env) : 0;
+	while (budget > 0 && max > (size_t)budget && max/2 >= STCP_INIT_RWIN) {
+		max /= 2;
+	}
+	return max;
 }
 
 /* ***************************************************
- * Function: wait_for_event
+ * Function: ring_size
  * ***************************************************
- * 	This function does the dirty work of adding the starting time to the
- *  current RTO to determine the finish time at which stcp_wait_for_event
- *  should TIMEOUT.  
+ * 	The smallest power of 2 that holds bytes, up to max.
  */
-static unsigned int wait_for_event(mysocket_t sd, 
-					unsigned int wait_flags, context_t *ctx, struct timeval start_time)
-{
-	unsigned int total_microsecs = (int)(ctx->rto*1000.0) + start_time.tv_usec; 
-	unsigned int extra_seconds = (int)(total_microsecs/1000000);
-	struct timespec finish_time;
-	finish_time.tv_sec = start_time.tv_sec + extra_seconds;
-	unsigned int microseconds = total_microsecs - (extra_seconds*1000000);
-	finish_time.tv_nsec = (microseconds*1000);
-	struct timeval curr_time;
-	gettimeofday(&curr_time, NULL);
-/*	our_dprintf("Curr sec: %d  ,micro: %d \n", curr_time.tv_sec, curr_time.tv_usec);
-	our_dprintf("Start sec: %d ,micro: %d \n", start_time.tv_sec, start_time.tv_usec);
-	our_dprintf("End   sec: %d ,micro: %d \n", finish_time.tv_sec, finish_time.tv_nsec/1000);*/
-	unsigned int event = stcp_wait_for_event(sd,wait_flags,&finish_time);
-	return event; 
-						
-						
+static size_t ring_size(size_t bytes, size_t max)
+{
+	size_t size = 1;
+	while (size < bytes && size < max) {
+		size *= 2;
+	}
+	return size;
 }
 
 /* ***************************************************
- * Function: active_init
+ * Function: copy_ring
  * ***************************************************
- * 	Initiate the active side connection.  Send the SYN packet,
- * wait for the SYN_ACK and then send the final SYN. 
+ * 	Copy len bytes starting at sequence number seq from one
+ *  ring to another of a different size, each keyed by
+ *  sequence number.
  */
-static bool active_init(mysocket_t sd, context_t *ctx)
+static void copy_ring(char* dst, size_t dst_size, const char* src, size_t src_size, tcp_seq seq, size_t len)
 {
-	
-	struct tcphdr* syn_packet = (struct tcphdr *)calloc(1,(TH_MAX_OFFSET*sizeof(uint32_t)) + STCP_MSS);	
-	if (!sendrcv_syn(sd, ctx, syn_packet)) {
-		return false;	/* Timeout waiting for SYN_ACK*/
+	while (len > 0) {
+		size_t src_off = seq & (src_size - 1);
+		size_t dst_off = seq & (dst_size - 1);
+		size_t part = MIN(len, MIN(src_size - src_off, dst_size - dst_off));
+		memcpy(dst + dst_off, src + src_off, part);
+		seq += part;
+		len -= part;
 	}
-	
-	ctx->connection_state = CSTATE_SYN_SENT;
-	our_dprintf("Active - RVCD SYN_ACK Seq: %d, ACK: %d \n", syn_packet->th_seq, syn_packet->th_ack);
-	ctx->recv_win = MIN(syn_packet->th_win, CWIN);
-
-	/* Send final ACK ---- Prepare Headers */
-	syn_packet->th_ack = syn_packet->th_seq + 1; 
-	syn_packet->th_seq = ctx->nxt_seq_num;		 
-	syn_packet->th_flags = TH_ACK;
-	syn_packet->th_off = TH_MIN_OFFSET;
-	syn_packet->th_win = RWIN;
-	our_dprintf("Active - Sending Final ACK Seq: %d, ACK: %d \n", syn_packet->th_seq, syn_packet->th_ack);
-	
-	network_send(sd, syn_packet, (TH_MIN_OFFSET*sizeof(uint32_t)));
-	
-	/* Update connection state variables */
-	ctx->seq_base = ctx->nxt_seq_num;
-	ctx->last_ack_sent = syn_packet->th_ack;
-	free(syn_packet);
-	return true;
 }
 
 /* ***************************************************
- * Function: sendrcv_syn
+ * Function: grow_send_buffer
  * ***************************************************
- * 	Helper function for active-side network initiation.
- *   It sends the SYN packet and waits for the right SYN_ACK
+ * 	Make the send ring big enough for bytes in flight, as
+ *  far as the budget allows.  It starts out at the window
+ *  we can first send and doubles with it; whatever is in
+ *  flight moves over to the new ring.
  */
-static bool sendrcv_syn(mysocket_t sd, context_t *ctx, struct tcphdr* in_packet)
-{
-	/* Set SYN Headers */
-	struct tcphdr* out_packet = (struct tcphdr *)calloc(1,(TH_MIN_OFFSET*sizeof(uint32_t)));
-	out_packet->th_ack = 0; 
-	out_packet->th_seq = ctx->initial_sequence_num;
-  	out_packet->th_flags = TH_SYN;
-	out_packet->th_off = TH_MIN_OFFSET;
-	out_packet->th_win = RWIN;
-	ctx->nxt_seq_num = ctx->initial_sequence_num + 1; /* SYN Packet =  1 byte */
-	our_dprintf("Active Sending SYN.  Seq:%d\n", out_packet->th_seq);
-	
-	unsigned int event;
-	bool success = false;
-	int num_tries = 1;
-	struct timeval tstart;
-	gettimeofday(&tstart,NULL); /*start the timer */
-	network_send(sd, out_packet, (TH_MIN_OFFSET*sizeof(uint32_t)));
-	/* Try sending the SYN a total of 6 times before giving up */
-	while ((num_tries < MAX_RT_TRIES) && !success){
-		event = wait_for_event(sd, NETWORK_DATA, ctx, tstart);
-		if (event & NETWORK_DATA) {
-			network_recv(sd, in_packet);
-			/* Check to see if we got the right SYN_ACK */
-			success = ((in_packet->th_flags & (TH_SYN | TH_ACK)) &&
-			    	  (in_packet->th_ack == ctx->nxt_seq_num));
+static void grow_send_buffer(context_t *ctx, size_t bytes)
+{
+	struct send_buffer* win = &(ctx->sbuffer);
+	size_t size = ring_size(bytes, ctx->buf_max);
+	if (size <= win->size) {
+		return;
+	}
+	char* data = (char *)malloc(size);
+	assert(data);
+	if (win->data) {
+		copy_ring(data, size, win->data, win->size, ctx->seq_base,
+				  MIN(bytes_in_flight(ctx), win->size));
+		free(win->data);
+	}
+	our_dprintf("Send ring grown to %d bytes\n", size);
+	win->data = data;
+	win->size = size;
+}
+
+/* ***************************************************
+ * Function: grow_seg_ring
+ * ***************************************************
+ * 	Double the segment ring (or allocate it, the first
+ *  time), which is full.
+ */
+static void grow_seg_ring(context_t *ctx)
+{
+	struct send_buffer* win = &(ctx->sbuffer);
+	unsigned int num_segs = win->num_segs ? 2*win->num_segs : SEG_RING_INIT_SIZE;
+	struct segment* segs = (struct segment *)calloc(num_segs, sizeof(struct segment));
+	assert(segs);
+	unsigned int i;
+	for (i = win->head; i != win->tail; i++) {
+		segs[i & (num_segs - 1)] = win->segs[i & (win->num_segs - 1)];
+	}
+	free(win->segs);
+	win->segs = segs;
+	win->num_segs = num_segs;
+}
+
+/* ***************************************************
+ * Function: grow_recv_buffer
+ * ***************************************************
+ * 	The receive window has grown (see tune_rcv_space); grow
+ *  the receive ring to cover it.  If it has been allocated,
+ *  the out-of-order ranges move over to the new one.
+ */
+static void grow_recv_buffer(context_t *ctx)
+{
+	struct recv_buffer* win = &(ctx->rbuffer);
+	size_t size = ring_size(ctx->rcv_space, ctx->buf_max);
+	if (size <= win->size) {
+		return;
+	}
+	if (win->data) {
+		char* data = (char *)malloc(size);
+		assert(data);
+		unsigned int i;
+		for (i = 0; i < win->num_ooo; i++) {
+			copy_ring(data, size, win->data, win->size, win->ooo[i].start,
+					  win->ooo[i].end - win->ooo[i].start);
+		}
+		free(win->data);
+		win->data = data;
+	}
+	win->size = size;
+}
+
+/* ***************************************************
+ * Function: head_rto
+ * ***************************************************
+ * How long the head of the window gets before it times out.
+ * With a single segment outstanding the peer may be holding
+ * its ACK for that one (see delay_ack), so allow for that
+ * rather than flooring the RTO itself, which on short paths
+ * would make every real loss wait on the delayed ACK timer.
+ */
+static uint32_t head_rto(context_t *ctx)
+{
+	struct send_buffer* win = &(ctx->sbuffer);
+	if (win->tail - win->head == 1) {
+		return ctx->rto + DELACK_TIMEOUT;
+	}
+	return ctx->rto;
+}
+
+/* ***************************************************
+ * Function: arm_rexmit_timer
+ * ***************************************************
+ * 	(Re)start the retransmission timer from now.
+ */
+static void arm_rexmit_timer(context_t *ctx)
+{
+	timer_add(ctx->timers, &ctx->rexmit_timer, stcp_now() + head_rto(ctx));
+}
+
+/* ***************************************************
+ * Function: wait_until
+ * ***************************************************
+ * 	Wrapper for stcp_wait_for_event that times out at the given
+ *  time on the monotonic clock, or never if it is 0.
+ */
+static unsigned int wait_until(mysocket_t sd, unsigned int wait_flags, stcp_time_t deadline)
+{
+	if (deadline == 0) {
+		return stcp_wait_for_event(sd, wait_flags, NULL);
+	}
+	struct timespec finish_time = stcp_abstime(deadline);
+	return stcp_wait_for_event(sd, wait_flags, &finish_time);
+}
+
+/* ***************************************************
+ * Function: send_syn
+ * ***************************************************
+ * 	(Re)send our SYN, or in SYN_RCVD our SYN_ACK, and (re)start the
+ *  handshake timer.  It is built from the context each time, so a
+ *  retransmission needs nothing kept around.
+ */
+static void send_syn(mysocket_t sd, context_t *ctx)
+{
+	uint32_t pkt[TH_MAX_OFFSET];
+	struct tcphdr* hdr = (struct tcphdr *)pkt;
+	memset(pkt, 0, sizeof(pkt));
+	hdr->th_seq = ctx->initial_sequence_num;
+	hdr->th_flags = TH_SYN;
+	if (ctx->connection_state == CSTATE_SYN_RCVD) {
+		hdr->th_ack = ctx->last_ack_sent;
+		hdr->th_flags |= TH_ACK;
+	}
+	hdr->th_win = MIN(ctx->rcv_space, 0xffff);
+	size_t syn_len = add_syn_options(hdr, ctx);
+	our_dprintf("Sending SYN (flags %d) with seq: %d and ack: %d\n",
+				 hdr->th_flags, hdr->th_seq, hdr->th_ack);
+	network_send(sd, hdr, syn_len);
+	ctx->syn_tries+=1;
+	ctx->syn_tstart = stcp_now();
+	timer_add(ctx->timers, &ctx->rexmit_timer, ctx->syn_tstart + ctx->rto);
+}
+
+/* ***************************************************
+ * Function: handle_handshake
+ * ***************************************************
+ * 	A packet arrived before the connection is established.  The
+ *  passive node answers a SYN with a SYN_ACK and then waits for the
+ *  final ACK; the active node waits for the right SYN_ACK to its SYN
+ *  and sends the final ACK.  Anything else is dropped, and the
+ *  handshake timer resends whatever we sent last.  If the final ACK
+ *  got lost and the first data segment shows up instead, that
+ *  completes the handshake just as well and the data is kept.
+ *  A connection set up from a SYN cookie (stcp_syn_cookie) gets a
+ *  SYN rebuilt from the ACK that follows it, and answers neither.
+ */
+static void handle_handshake(mysocket_t sd, context_t *ctx)
+{
+	char *pkt;
+	size_t total_length = network_recv(sd, &pkt);
+	struct tcphdr* hdr = (struct tcphdr *)pkt;
+	if (ctx->connection_state == CSTATE_LISTEN && hdr->th_flags == TH_SYN) {
+		our_dprintf("PASSIVE - RCVD SYN with seq: %d\n", hdr->th_seq);
+		/* With a SYN cookie, our SYN_ACK has gone already */
+		uint32_t cookie_isn;
+		bool cookie = stcp_syn_cookie(sd, &cookie_isn);
+		if (cookie) {
+			ctx->initial_sequence_num = cookie_isn;
 		}
-		else if (event==TIMEOUT){
-			our_dprintf("Active - SYN TIMEOUT!, no SYN_ACK!\n");
-			gettimeofday(&tstart,NULL);
-			num_tries+=1;
-			our_dprintf("Active Resending SYN.  Seq:%d\n", out_packet->th_seq);
-			network_send(sd, out_packet, (TH_MIN_OFFSET*sizeof(uint32_t)));
+		accept_options(ctx, hdr);
+		ctx->recv_win = hdr->th_win; /* never scaled in a SYN */
+		ctx->last_ack_sent = hdr->th_seq + 1;
+		ctx->nxt_seq_num = ctx->initial_sequence_num + 1;
+		ctx->seq_base = ctx->nxt_seq_num; 
+		ctx->connection_state = CSTATE_SYN_RCVD;
+		if (!cookie) {
+			send_syn(sd, ctx);
 		}
-	}	
-	free(out_packet);
-	return success;
+	}
+	else if (ctx->connection_state == CSTATE_SYN_SENT &&
+			 (hdr->th_flags & (TH_SYN | TH_ACK)) && hdr->th_ack == ctx->nxt_seq_num) {
+		our_dprintf("Active - RVCD SYN_ACK Seq: %d, ACK: %d \n", hdr->th_seq, hdr->th_ack);
+		accept_options(ctx, hdr);
+		ctx->recv_win = hdr->th_win; /* never scaled in a SYN */
+		ctx->last_ack_sent = hdr->th_seq + 1;
+		ctx->seq_base = ctx->nxt_seq_num;
+		send_ack(sd, ctx);
+		established(sd, ctx);
+	}
+	else if (ctx->connection_state == CSTATE_SYN_RCVD &&
+			 hdr->th_flags == TH_ACK && hdr->th_ack == ctx->nxt_seq_num) {
+		our_dprintf("PASSIVE - RCVD Last Ack Packet has seq: %d and ack: %d \n",
+					 hdr->th_seq, hdr->th_ack);
+		established(sd, ctx);
+		handle_segment(sd, ctx, pkt, total_length);
+	}
+}
+
+/* ***************************************************
+ * Function: accept_options
+ * ***************************************************
+ * 	Options are on only if the other side's SYN (or SYN_ACK)
+ *  offered them too.
+ */
+static void accept_options(context_t *ctx, struct tcphdr* syn)
+{
+	struct tcp_options opts;
+	parse_options(syn, &opts);
+	ctx->wscale_ok = opts.wscale_ok;
+	ctx->snd_wscale = opts.wscale;
+	if (!ctx->wscale_ok) {
+		ctx->rcv_wscale = 0;
+	}
+	ctx->sack_ok = ctx->sack_ok && opts.sack_ok;
+}
+
+/* ***************************************************
+ * Function: established
+ * ***************************************************
+ * 	The handshake is over.  It gives us a first RTT sample unless
+ *  we had to resend (Karn), and the application can go ahead.
+ */
+static void established(mysocket_t sd, context_t *ctx)
+{
+	timer_cancel(ctx->timers, &ctx->rexmit_timer);
+	if (ctx->syn_tries == 1) {
+		rtt_sample(ctx, stcp_now() - ctx->syn_tstart);
+	}
+	ctx->connection_state = CSTATE_ESTABLISHED;
+	ctx->rcv_mark = stcp_now();
+	ctx->rcv_mark_seq = ctx->last_ack_sent;
+	ctx->rcv_mark_unread = 0;
+	errno = 0;
+	stcp_unblock_application(sd);
+}
+
+/* ***************************************************
+ * Function: handshake_timeout
+ * ***************************************************
+ * 	No answer to our SYN (or SYN_ACK).  Try sending it a total of
+ *  MAX_RT_TRIES times, doubling the RTO each time, before giving up.
+ */
+static void handshake_timeout(mysocket_t sd, context_t *ctx)
+{
+	if (ctx->syn_tries >= MAX_RT_TRIES) {
+		our_dprintf("Handshake TIMEOUT, giving up!\n");
+		ctx->connection_state = CSTATE_CLOSED;
+		ctx->done = true;
+		errno = ETIMEDOUT;
+		stcp_unblock_application(sd);
+		return;
+	}
+	our_dprintf("Handshake TIMEOUT, resending!\n");
+	ctx->rto = MIN(ctx->rto*2, MAX_RTO);
+	send_syn(sd, ctx);
 }
 
 /* ***************************************************
  * Function: network_recv
  * ***************************************************
  * Wrapper function for receiving network data.  It converts
- * data in the headers into host byte order.
+ * data in the headers into host byte order.  The packet is
+ * read in place, and stays ours until the next call, so
+ * in-order payload goes up to the application uncopied.
  */
-ssize_t network_recv(mysocket_t sd, void *dst)
+ssize_t network_recv(mysocket_t sd, char **pkt)
 {
 	ssize_t result;
-	/* Receive up to 44 bytes of TCP options */
-	while ((result = stcp_network_recv(sd, dst, 
-		   (TH_MAX_OFFSET*sizeof(uint32_t)) + STCP_MSS))<0);
-	struct tcphdr* hdr = (struct tcphdr *)dst;
+	while ((result = stcp_network_recv_packet(sd, (void **)pkt))<0);
+	struct tcphdr* hdr = (struct tcphdr *)*pkt;
 	hdr->th_ack = ntohl(hdr->th_ack);
 	hdr->th_seq = ntohl(hdr->th_seq);
 	hdr->th_win = ntohs(hdr->th_win);
@@ -395,93 +952,31 @@ ssize_t network_send(mysocket_t sd, const void *src, size_t src_len)
 }
 
 /* ***************************************************
- * Function: passive_init
+ * Function: network_send_data
  * ***************************************************
- * Passive node waits for a SYN packet to arrive, it then
- * sends an SYN_ACK using another helper function (below)
+ * Same as network_send but the payload is passed separately so it
+ * can be sent straight out of the send ring without first being
+ * copied behind a header.
  */
-static bool passive_init(mysocket_t sd, context_t *ctx)
-{
-	ctx->connection_state = CSTATE_LISTEN;
-	struct tcphdr* syn_packet = (struct tcphdr *)calloc(1,
-				(TH_MAX_OFFSET*sizeof(uint32_t))+STCP_MSS);
-   /* Listen for a connection request */
-	while (true){
-		stcp_wait_for_event(sd, NETWORK_DATA, NULL);
- 		network_recv(sd, syn_packet);
-		if (syn_packet->th_flags == TH_SYN){
-			break;	
-		}
+ssize_t network_send_data(mysocket_t sd, struct tcphdr* hdr, const void *data, size_t data_len)
+{
+	hdr->th_ack = htonl(hdr->th_ack);
+	hdr->th_seq = htonl(hdr->th_seq);
+	hdr->th_win = htons(hdr->th_win);
+	ssize_t result;
+	if (data_len > 0) {
+		while ((result = stcp_network_send(sd, hdr, TCP_DATA_START(hdr), 
+										   data, data_len, NULL))<0);
 	}
-	our_dprintf("PASSIVE - RCVD SYN with seq: %d\n", syn_packet->th_seq);
-	
-	/* Prepare SYN_ACK*/			
-	syn_packet->th_ack = syn_packet->th_seq + 1;
-	syn_packet->th_seq = ctx->initial_sequence_num;
-	syn_packet->th_off = TH_MIN_OFFSET;
-	syn_packet->th_flags = TH_SYN | TH_ACK;
-	syn_packet->th_win = RWIN;
-	/*Update connection state variables */	
-	ctx->last_ack_sent = syn_packet->th_ack;
-	ctx->nxt_seq_num = ctx->initial_sequence_num + 1;
-	ctx->connection_state = CSTATE_SYN_RCVD;
-	ctx->seq_base = ctx->nxt_seq_num; 
-	our_dprintf("PASSIVE - SEND SYN_ACK Packet with seq: %d and ack: %d \n",
-				 syn_packet->th_seq, syn_packet->th_ack);
-	bool success = send_syn_ack(sd, ctx, syn_packet);
-
-	free(syn_packet);
-	return success;
-}
-
-/* ***************************************************
- * Function: send_syn_ack
- * ***************************************************
- * Passive node calls this to send SYN_ACK and wait for
- * the final ACK packet. It tries a total of 6 times before
- * giving up.
- */
-static bool send_syn_ack(mysocket_t sd, context_t *ctx, struct tcphdr* syn_packet)
-{
-	struct tcphdr* ack_packet = (struct tcphdr *)calloc(1,(TH_MAX_OFFSET*sizeof(uint32_t))+STCP_MSS);
-	unsigned int event;
-	bool success = false;
-	int num_tries = 1;
-	struct timeval tstart;
-	gettimeofday(&tstart, NULL); /*Start the timer */
-	network_send(sd, syn_packet, (TH_MIN_OFFSET*sizeof(uint32_t)));
-	while((num_tries < MAX_RT_TRIES) && !success){
-		event = wait_for_event(sd, NETWORK_DATA, ctx, tstart);
-		if (event & NETWORK_DATA) {
-			network_recv(sd, ack_packet);
-			our_dprintf("Passive (ACK waiting): Ack: %d, Seq:%d, Next Seq:%d, Last Ack Sent: %d\n", 
-						 ack_packet->th_ack, ack_packet->th_seq, ctx->nxt_seq_num, ctx->last_ack_sent);
-			success =  ((ack_packet->th_flags == TH_ACK) &&
-						(ack_packet->th_ack == ctx->nxt_seq_num));
-		}
-		else if (event==TIMEOUT){
-			our_dprintf("Passive Final INIT ACK not Received TIMEOUT!\n");	
-			num_tries+=1;
-			gettimeofday(&tstart, NULL);
-			our_dprintf("PASSIVE - SEND SYN_ACK Packet with seq: %d and ack: %d \n",
-						 syn_packet->th_seq, syn_packet->th_ack);
-			network_send(sd, syn_packet, (TH_MIN_OFFSET*sizeof(uint32_t)));
-		}
+	else {
+		while ((result = stcp_network_send(sd, hdr, TCP_DATA_START(hdr), NULL))<0);
 	}
-	if (success){
-		our_dprintf("PASSIVE - RCVD Last Ack Packet has seq: %d and ack: %d \n",
-					 ack_packet->th_seq, ack_packet->th_ack);
-   		ctx->recv_win = MIN(syn_packet->th_win, CWIN);
-	}	
-	free(ack_packet);
-	return success;
+	hdr->th_ack = ntohl(hdr->th_ack);
+	hdr->th_seq = ntohl(hdr->th_seq);
+	hdr->th_win = ntohs(hdr->th_win);
+	return result;	
 }
 
-
-
-
-
-
 /* generate random initial sequence number for an STCP connection */
 static void generate_initial_seq_num(context_t *ctx)
 {
@@ -497,128 +992,194 @@ static void generate_initial_seq_num(context_t *ctx)
 
 
 /* ***************************************************
- * Function: control_loop
+ * Function: handle_rexmit_timeout
  * ***************************************************
- * control_loop() is the main STCP loop; it repeatedly waits for one of the
- * following to happen:
- *   - incoming data from the peer
- *   - new data from the application (via mywrite())
- *   - the socket to be closed (via myclose())
- *   - a timeout
+ * The segment at the beginning of the window has gone unacked for
+ * a whole RTO.  Only that segment is resent; the congestion window
+ * collapses and we enter recovery, in which each partial ACK points
+ * us at the next segment missing (see handle_ack and next_hole).
+ * Segments the receiver already has are never sent again since the
+ * cumulative ACK skips over them.  The RTO is doubled and the timer
+ * restarted (RFC 6298 5.5, 5.6).  The connection is given up on once
+ * the head has been sent MAX_RT_TRIES times, but not before
+ * MIN_GIVE_UP_TIME has gone by since it first timed out: on a short
+ * path the RTO can be a few ms, and a busy peer (one event loop
+ * thread running thousands of connections, say) takes longer than
+ * that to get round to acking.
  */
-static void control_loop(mysocket_t sd, context_t *ctx)
+static void handle_rexmit_timeout(mysocket_t sd, context_t *ctx)
+{	
+	struct send_buffer* win = &(ctx->sbuffer);
+	assert((win->head != win->tail) || !DEBUG);
+	our_dprintf("TIMEOUT waiting for seq:%d\n", ctx->seq_base);	
+	stcp_time_t now = stcp_now();
+	if (ctx->give_up_time == 0) {
+		ctx->give_up_time = now + MIN_GIVE_UP_TIME;
+	}
+	if (win->segs[win->head & (win->num_segs - 1)].num_transmits>=MAX_RT_TRIES &&
+		now >= ctx->give_up_time){
+		our_dprintf("MAX NUMBER OF TRIES REACHED KILLING CONNECTION !!!!\n\n");
+		ctx->done = true;
+		errno = ETIMEDOUT;
+		return;
+	}
+	ctx->timeouts+=1;
+	ctx->rto= MIN(ctx->rto*2, MAX_RTO);
+	ctx->cc_ops->on_timeout(&ctx->cc, bytes_in_flight(ctx));
+	ctx->recovery = RECOVERY_RTO;
+	ctx->recover = ctx->nxt_seq_num;
+	ctx->dupacks = 0;
+	ctx->rexmit_next = ctx->seq_base;
+	retransmit_segment(sd, ctx, &win->segs[win->head & (win->num_segs - 1)]);
+	arm_rexmit_timer(ctx);
+}
+
+/* ***************************************************
+ * Function: check_persist
+ * ***************************************************
+ * The peer has shut its window and nothing of ours is in flight, so
+ * no ACK is coming to tell us when it opens again.  Until it does,
+ * the persist timer sends window probes, backing off like the RTO.
+ */
+static void check_persist(mysocket_t sd, context_t *ctx)
 {
-    assert(ctx);
-	unsigned int event = 0;
-	bool fin_retry = false; /* TRUE = APP_CLOSE_REQUESTED but window was full */
-    while (!ctx->done)
-    {
-    	size_t bytes_in_transit = ctx->nxt_seq_num - ctx->seq_base;
-  		size_t win_space = ctx->recv_win - bytes_in_transit;
-    	event = control_wait(sd, ctx, fin_retry);
-		if (event & NETWORK_DATA) {
-		   handle_network_data(sd, ctx);
-		}
-		if ((event & APP_DATA) && !fin_retry) {
-			handle_app_data(sd, ctx); 
-		}
-		if (event == TIMEOUT){
-			handle_timeout(sd, ctx);
+	if (ctx->recv_win > 0 || bytes_in_flight(ctx) > 0 || ctx->done ||
+		(!ctx->fin_retry && stcp_app_pending(sd) == 0)) {
+		timer_cancel(ctx->timers, &ctx->persist_timer);
+		ctx->persist_backoff = 0;
+		return;
+	}
+	if (!timer_pending(&ctx->persist_timer)) {
+		ctx->persist_backoff = ctx->rto;
+		timer_add(ctx->timers, &ctx->persist_timer, stcp_now() + ctx->persist_backoff);
+	}
+}
 
-		}
-		if ((event & APP_CLOSE_REQUESTED) || fin_retry) {
-   			if (win_space>0){
-				send_fin(sd, ctx);
-				fin_retry = false;
-   			}
-   			else {
-   				our_dprintf("App requested FIN but window is full\n");
-   				fin_retry = true;	
-   			}
-		 }
-    }
+/* ***************************************************
+ * Function: send_window_probe
+ * ***************************************************
+ * A segment carrying no data and a sequence number the peer has
+ * already acked; the peer answers it with an ACK and with that its
+ * current window (see is_window_probe).
+ */
+static void send_window_probe(mysocket_t sd, context_t *ctx)
+{
+	struct tcphdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.th_seq = ctx->nxt_seq_num - 1;
+	hdr.th_ack = ctx->last_ack_sent;
+	hdr.th_off = TH_MIN_OFFSET;
+	hdr.th_flags = TH_ACK;
+	hdr.th_win = advertised_window(sd, ctx);
+	our_dprintf("Window probe with seq: %d\n", hdr.th_seq);
+	network_send(sd, &hdr, TCP_DATA_START(&hdr));
 }
 
+/* ***************************************************
+ * Function: is_window_probe
+ * ***************************************************
+ * Recognise the other side's send_window_probe: no data and the
+ * byte just below what we have acked.
+ */
+static bool is_window_probe(struct tcphdr* hdr, size_t data_length, context_t *ctx)
+{
+	return data_length == 0 && !(hdr->th_flags & (TH_FIN | TH_SYN)) &&
+		   hdr->th_seq + 1 == ctx->last_ack_sent;
+}
 
 /* ***************************************************
- * Function: control_wait
+ * Function: retransmit_segment
  * ***************************************************
- * This function determines the right event to wait for based on window size
- * and connection state.
- * If the window is full, then we don't wait for application data as we know
- * we can't send any.
- * If there are bytes outstanding (not-acked), then we need to wait using a timeout
- * value.
- * If we are TIME_WAIT state, then we set the RTO to the TIME_WAIT_VALUE and only accept
- * network data (i.e. FIN that need to be acknowledged).
+ * Resend one unacked segment.  rexmit_next remembers how far into
+ * the window this recovery has already resent.
  */
-unsigned int control_wait(mysocket_t sd, context_t *ctx, bool fin_retry)
+static void retransmit_segment(mysocket_t sd, context_t *ctx, struct segment* seg)
 {
-	unsigned int event = 0;
-	size_t bytes_in_transit = ctx->nxt_seq_num - ctx->seq_base;
-  	size_t win_space = ctx->recv_win - bytes_in_transit;
-  		
-	unsigned int wait_flags = NETWORK_DATA | APP_CLOSE_REQUESTED;
-	if (win_space >0 && !fin_retry) {
-		wait_flags |= APP_DATA;	
-	}
-	/* Is there something in flight? */
-	if (bytes_in_transit > 0) {
-		assert((ctx->sbuffer.num_entries>0) || !DEBUG);
-		our_dprintf("Waiting with RTO for Seq:%d \n", ctx->seq_base);
-		event = wait_with_rto(sd, wait_flags, ctx); 
-	}
-	else if (ctx->connection_state==CSTATE_TIME_WAIT) {
-		ctx->rto = TIME_WAIT_VALUE;
-		struct timeval current_time;
-		gettimeofday(&current_time, NULL);
-		our_dprintf("IN TIME WAIT!!!\n");
-		event = wait_for_event(sd, NETWORK_DATA, ctx,current_time);    			
-	}
-	else {
-		/* No unacked packets... take your sweet time*/
-		event = stcp_wait_for_event(sd, ANY_EVENT, NULL);
+	seg->num_transmits+=1; /* increase counter */
+	ctx->bytes_retransmitted += seg->len;
+	tcp_seq seg_end = seg->seq + seg->len + ((seg->flags & TH_FIN) ? 1 : 0);
+	ctx->rexmit_next = MAX(ctx->rexmit_next, seg_end);
+	send_segment(sd, ctx, seg);
+	our_dprintf("Retransmitting Seq:%d with Len:%d RTO:%u\n",
+		 seg->seq, seg->len, ctx->rto);
+}
+
+/* ***************************************************
+ * Function: find_segment
+ * ***************************************************
+ * Index in the segment ring of the first unacked segment starting
+ * at or after seq (tail if there is none).  Segments sit in the
+ * ring in sequence order, so this is a binary search.
+ */
+static unsigned int find_segment(context_t *ctx, tcp_seq seq)
+{
+	struct send_buffer* win = &(ctx->sbuffer);
+	unsigned int lo = win->head;
+	unsigned int hi = win->tail;
+	while (lo != hi) {
+		unsigned int mid = lo + (hi - lo)/2;
+		if (win->segs[mid & (win->num_segs - 1)].seq < seq) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
 	}
-	return event;	
+	return lo;
 }
 
 /* ***************************************************
- * Function: handle_timeout
+ * Function: next_hole
  * ***************************************************
- * This function is called whenever there is a timeout. Unless we
- * are in the TIME_WAIT state, I retransmit all the packets starting
- * from the beginning of the window.  
- * The RTO is also doubled when there is a retransmission as described
- * in K&R. 
+ * The next segment to resend in recovery: the first one not yet
+ * resent in this recovery that the peer hasn't SACKed, as long as
+ * something after it has been SACKed.  Without SACK information
+ * that can only be the segment at the front of the window.
  */
-static void handle_timeout(mysocket_t sd, context_t *ctx)
-{	
-	if (ctx->connection_state==CSTATE_TIME_WAIT){
-		ctx->connection_state = CSTATE_CLOSED;
-		ctx->done = true;
-		return;
+static struct segment* next_hole(context_t *ctx)
+{
+	struct send_buffer* win = &(ctx->sbuffer);
+	tcp_seq from = MAX(ctx->rexmit_next, ctx->seq_base);
+	tcp_seq limit = MAX(ctx->sack_high, ctx->seq_base + 1);
+	unsigned int i;
+	for (i = find_segment(ctx, from); i != win->tail; i++) {
+		struct segment* seg = &win->segs[i & (win->num_segs - 1)];
+		if (seg->seq >= limit) {
+			break;
+		}
+		if (!seg->sacked) {
+			return seg;
+		}
 	}
-	our_dprintf("TIMEOUT waiting for seq:%d\n", ctx->seq_base);	
-	assert(ctx->sbuffer.num_entries>0 || !DEBUG);
-	assert(ctx->sbuffer.start->next!=NULL || !DEBUG);
-	struct p_entry *curr = ctx->sbuffer.start->next;
-	ctx->rto= MIN(ctx->rto*2, MAX_RTO);
-	/* Retransmit all packets */
-	while (curr){
-			struct tcphdr *hdr = (struct tcphdr*)curr->packet;
-			if (curr->num_transmits>=MAX_RT_TRIES){
-				our_dprintf("MAX NUMBER OF TRIES REACHED KILLING CONNECTION !!!!\n\n");
-				ctx->done = true;
-				errno = ETIMEDOUT;
-				return;
+	return NULL;
+}
+
+/* ***************************************************
+ * Function: update_scoreboard
+ * ***************************************************
+ * Mark the segments covered by the SACK blocks of an incoming ACK.
+ * Blocks at or below the cumulative ACK, or past anything we sent,
+ * are ignored.
+ */
+static void update_scoreboard(context_t *ctx, struct tcp_options* opts)
+{
+	struct send_buffer* win = &(ctx->sbuffer);
+	unsigned int b;
+	for (b = 0; b < opts->num_sacks; b++) {
+		struct seq_range* block = &opts->sacks[b];
+		if (block->end <= ctx->seq_base || block->end > ctx->nxt_seq_num ||
+			block->start >= block->end) {
+			continue;
+		}
+		unsigned int i;
+		for (i = find_segment(ctx, block->start); i != win->tail; i++) {
+			struct segment* seg = &win->segs[i & (win->num_segs - 1)];
+			if (seg->seq + seg->len > block->end) {
+				break;
 			}
-			hdr->th_ack = ctx->last_ack_sent;
-			curr->num_transmits+=1; /* increase counter */
-			gettimeofday(&(curr->tstart),NULL);
-			network_send(sd, hdr, curr->packet_size);
-			curr = curr->next;
-			our_dprintf("Retransmitting Seq:%d with Len:%d New RTO:%f\n",
-				 hdr->th_seq, ctx->sbuffer.start->next->packet_size, ctx->rto);
+			seg->sacked = true;
+		}
+		ctx->sack_high = MAX(ctx->sack_high, block->end);
 	}
 }
 
@@ -628,19 +1189,15 @@ static void handle_timeout(mysocket_t sd, context_t *ctx)
  * ***************************************************
  * The application has requested to be closed and there
  * is at least 1 byte of room in the window. This function
- * prepares a fin packet, adds it to the send buffer, and
- * sends it.  It also updates the connection state.
+ * adds a FIN segment to the send buffer, and sends it.
+ * It also updates the connection state.
  */
 static void send_fin(mysocket_t sd, context_t *ctx)
 {
 	our_dprintf("App requested close there is space in window... SENDING FIN\n");
-  	struct tcphdr* fin_pkt = (struct tcphdr *)calloc(1,TH_MIN_OFFSET*sizeof(uint32_t));
-  	fin_pkt->th_seq = ctx->nxt_seq_num;
-  	ctx->fin_ack = fin_pkt->th_seq + 1;
+  	struct segment* seg = add_to_send_buffer(ctx, ctx->nxt_seq_num, 0, TH_FIN);
+  	ctx->fin_ack = seg->seq + 1;
   	ctx->nxt_seq_num += 1; /*FIN = 1 byte of data */
-  	fin_pkt->th_off = TH_MIN_OFFSET;
-  	fin_pkt->th_flags = TH_FIN;
-  	fin_pkt->th_win = RWIN;
   	/* Update State variables depending on previous state */
   	if (ctx->connection_state == CSTATE_ESTABLISHED ) {
   		ctx->connection_state = CSTATE_FIN_WAIT1;
@@ -649,283 +1206,365 @@ static void send_fin(mysocket_t sd, context_t *ctx)
   		assert(ctx->connection_state == CSTATE_CLOSE_WAIT || !DEBUG);
   		ctx->connection_state = CSTATE_LAST_ACK;
   	}
-  	add_to_send_buffer(ctx, (char *)fin_pkt, (TH_MIN_OFFSET*sizeof(uint32_t)));
-  	network_send(sd, fin_pkt, TH_MIN_OFFSET*sizeof(uint32_t));
-	free(fin_pkt);
+  	send_segment(sd, ctx, seg);
 }
 
 /* ***************************************************
  * Function: handle_app_data
  * ***************************************************
- * The application has new data to be sent out.  First make sure that
- * there is some space in the window.  Get maximum amount of data from 
- * the application, added it to the sender's buffer, and send it across
- * the network.
+ * The application has new data to be sent out.  As long as there is
+ * space in the window, read the data from the application straight into
+ * the send ring, record the segment and send it across the network, so
+ * one wakeup drains as much of the application's queue as the window
+ * takes.  The ring is grown first to hold all the window allows.  A
+ * segment stops at the end of the ring so that its payload is always
+ * contiguous.  A short tail is left queued while nagle_holds.
  */
 static void handle_app_data(mysocket_t sd, context_t *ctx)
 {
-   size_t bytes_in_transit = ctx->nxt_seq_num - ctx->seq_base;
-   size_t win_space = ctx->recv_win - bytes_in_transit;
-   if (win_space>0){
-       char *pkt = (char *)calloc(1,(TH_MIN_OFFSET*sizeof(uint32_t)) + STCP_MSS);
-       struct tcphdr* hdr = (struct tcphdr*)pkt;
-       hdr->th_off = TH_MIN_OFFSET;
-       hdr->th_seq = ctx->nxt_seq_num;
-       hdr->th_flags = 0;
-       hdr->th_win = RWIN;
-       /* Pick the minimum between space in the window and MSS */
-       size_t data_max = MIN(STCP_MSS, win_space);	           
-       size_t len = stcp_app_recv(sd, pkt + TCP_DATA_START(hdr), data_max); 	           
-       ctx->nxt_seq_num += len; /*add len to obtain nxt_seq_num to be used */
-       add_to_send_buffer(ctx,  pkt, (TH_MIN_OFFSET*sizeof(uint32_t)) + len);
- 	   our_dprintf("Sending packet with seq: %d of size: %d\n", 
- 	   				hdr->th_seq,(TH_MIN_OFFSET*sizeof(uint32_t)) + len);
-  	   network_send(sd, pkt, (TH_MIN_OFFSET*sizeof(uint32_t)) + len);
-       free(pkt);
-   }
-   else {
+   size_t win_space = send_window_space(ctx);
+   if (win_space==0){
    		our_dprintf(".");           	
-   }	
+   		return;
+   }
+   ctx->app_wakeups+=1;
+   grow_send_buffer(ctx, bytes_in_flight(ctx) + win_space);
+   size_t size = ctx->sbuffer.size;
+   do {
+       size_t offset = ctx->nxt_seq_num & (size - 1);
+       /* Pick the minimum between space in the window, MSS and the ring's end */
+       size_t data_max = MIN(MIN(STCP_MSS, win_space), size - offset);
+       size_t len = stcp_app_recv(sd, ctx->sbuffer.data + offset, data_max);
+       struct segment* seg = add_to_send_buffer(ctx, ctx->nxt_seq_num, len, 0);
+       ctx->nxt_seq_num += len; /*add len to obtain nxt_seq_num to be used */
+ 	   our_dprintf("Sending packet with seq: %d of size: %d\n", seg->seq, len);
+       send_segment(sd, ctx, seg);
+       ctx->data_segs_sent+=1;
+       if (len < MIN(STCP_MSS, size - offset)) {
+       		ctx->short_end = ctx->nxt_seq_num;
+       }
+   } while ((win_space = send_window_space(ctx)) > 0 &&
+   			stcp_app_pending(sd) > 0 && !nagle_holds(sd, ctx));
 }
 
+/* ***************************************************
+ * Function: nagle_holds
+ * ***************************************************
+ *  Nagle's algorithm (RFC 896) in Minshall's form: while a segment
+ *  shorter than a full one is unacked, don't send another, let more
+ *  of the app's writes pile up behind it instead.  Full segments in
+ *  flight don't hold anything up, so the short tail of a bulk write
+ *  isn't stuck behind a whole window (or a loss recovery).  A segment
+ *  cut short by the end of the ring counts as full.  MYSOCK_NODELAY
+ *  turns this off.
+ */
+static bool nagle_holds(mysocket_t sd, context_t *ctx)
+{
+	if (ctx->short_end <= ctx->seq_base || stcp_nodelay(sd)) {
+		return false;
+	}
+	size_t pending = stcp_app_pending(sd);
+	size_t size = ctx->sbuffer.size;
+	size_t full_seg = MIN(STCP_MSS, size - (ctx->nxt_seq_num & (size - 1)));
+	return pending > 0 && pending < full_seg;
+}
+
+
+/* ***************************************************
+ * Function: send_window_space
+ * ***************************************************
+ *  How many more bytes of new data we may send right now: whatever
+ *  is left of the smaller of the receiver's and the congestion
+ *  window, bounded by room in the send ring.
+ */
+static size_t send_window_space(context_t *ctx)
+{
+	size_t bytes_in_transit = ctx->nxt_seq_num - ctx->seq_base;
+	size_t win = MIN(ctx->recv_win, ctx->cc.cwnd);
+	/* The window can shrink under data already in flight */
+	if (bytes_in_transit >= win) {
+		return 0;
+	}
+	return MIN(win - bytes_in_transit, send_buffer_space(ctx));
+}
+
+/* ***************************************************
+ * Function: bytes_in_flight
+ * ***************************************************
+ *  Bytes sent and not yet acked.
+ */
+static size_t bytes_in_flight(context_t *ctx)
+{
+	return ctx->nxt_seq_num - ctx->seq_base;
+}
+
+/* ***************************************************
+ * Function: send_buffer_space
+ * ***************************************************
+ *  How many more bytes the send ring can take, once grown as far
+ *  as the budget allows.  A segment ring that can't grow any more
+ *  and is full counts as no space at all.
+ */
+static size_t send_buffer_space(context_t *ctx)
+{
+	struct send_buffer* win = &(ctx->sbuffer);
+	if (win->tail - win->head >= SEG_RING_MAX_SIZE) {
+		return 0;
+	}
+	return ctx->buf_max - (ctx->nxt_seq_num - ctx->seq_base);
+}
 
 /* ***************************************************
  * Function: add_to_send_buffer
  * ***************************************************
- *  A data/fin packet is being sent out. This function adds that packet
- *  to the sender's window (end of link list) in case it timeouts and 
- *  needs to be retransmitted. It records the time the packet was sent.
+ *  A data/fin segment is being sent out. The payload is already in
+ *  the send ring; this records the segment at the end of the segment
+ *  ring in case it timeouts and needs to be retransmitted, growing
+ *  that first if it's full.
  */
-static void add_to_send_buffer(context_t* ctx, char* pkt, size_t len)
-{
-	struct window* win = &(ctx->sbuffer);
-	assert((win->end->next==NULL) || !DEBUG);
-	struct p_entry* new_entry = (struct p_entry*)calloc(1,sizeof(struct p_entry));
-	new_entry->packet = (char *)calloc(1, len);
-	memcpy(new_entry->packet, pkt, len);
-	new_entry->packet_size = len;
-	new_entry->next = NULL;
-	new_entry->num_transmits = 1;
-	gettimeofday(&(new_entry->tstart), NULL);
-	win->end->next = new_entry; /* Attach to the end of the list */
-	win->end = win->end->next;  /* Update the end of the list */
-	win->num_entries+=1;		/* Add 1 to the number of entries */
-	assert(win->start->next || !DEBUG);
-	our_dprintf("Added Seq: %d to send buffer\n", ((struct tcphdr*)pkt)->th_seq);
+static struct segment* add_to_send_buffer(context_t* ctx, tcp_seq seq, size_t len, uint8_t flags)
+{
+	struct send_buffer* win = &(ctx->sbuffer);
+	assert((win->tail - win->head < SEG_RING_MAX_SIZE) || !DEBUG);
+	if (win->tail - win->head == win->num_segs) {
+		grow_seg_ring(ctx);
+	}
+	struct segment* seg = &win->segs[win->tail & (win->num_segs - 1)];
+	seg->seq = seq;
+	seg->len = len;
+	seg->flags = flags;
+	seg->num_transmits = 1;
+	seg->sacked = false;
+	win->tail+=1;
+	our_dprintf("Added Seq: %d to send buffer\n", seq);
+	return seg;
+} 
+
+/* ***************************************************
+ * Function: send_segment
+ * ***************************************************
+ *  (Re)transmit a segment from the send buffer.  The header is built
+ *  on the stack and the payload handed to the network layer straight
+ *  out of the send ring.  Every segment carries our current ACK, so
+ *  a delayed ACK rides along for free.  The retransmission timer is
+ *  started if it isn't running already (RFC 6298 5.1).
+ */
+static void send_segment(mysocket_t sd, context_t *ctx, struct segment* seg)
+{
+	struct tcphdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.th_seq = seg->seq;
+	hdr.th_ack = ctx->last_ack_sent;
+	hdr.th_off = TH_MIN_OFFSET;
+	hdr.th_flags = seg->flags | TH_ACK;
+	hdr.th_win = advertised_window(sd, ctx);
+	seg->tstart = stcp_now();
+	if (timer_pending(&ctx->delack_timer)) {
+		/* This carries the ACK we were holding back */
+		ctx->acks_piggybacked+=1;
+		timer_cancel(ctx->timers, &ctx->delack_timer);
+		ctx->bytes_unacked = 0;
+	}
+	if (!timer_pending(&ctx->rexmit_timer)) {
+		arm_rexmit_timer(ctx);
+	}
+	ctx->bytes_sent += seg->len;
+	/* (a FIN on its own may come before the ring is ever allocated) */
+	const char* data = seg->len ? ctx->sbuffer.data + (seg->seq & (ctx->sbuffer.size - 1)) : NULL;
+	network_send_data(sd, &hdr, data, seg->len);
 } 
 
 
 /* ***************************************************
  * Function: handle_network_data
  * ***************************************************
+ *  Take the next packet off the network queue.
+ */
+static void handle_network_data(mysocket_t sd, context_t *ctx)
+{
+	char *pkt;
+	size_t total_length = network_recv(sd, &pkt);
+	handle_segment(sd, ctx, pkt, total_length);
+}
+
+/* ***************************************************
+ * Function: handle_segment
+ * ***************************************************
  *  A packet has arrived.  If its an ACK packet, call a helper 
  * function that deals with acks.  If the packet has data or it's
- * a FIN packet, then add the packet to the receiver buffer only
+ * a FIN packet, then hand it to the receive buffer only
  * if it fits in the receiving window.  If it doesn't fit,
- * drop the packet.  If it fits, send an acknowledgement.
+ * drop the packet.  If it fits, acknowledge it: at once if it
+ * was out of order or a FIN, otherwise possibly later (delay_ack).
  */
-static void handle_network_data(mysocket_t sd, context_t *ctx)
+static void handle_segment(mysocket_t sd, context_t *ctx, char* pkt, size_t total_length)
 {
-	   char *pkt = (char *)calloc(1, (TH_MAX_OFFSET*sizeof(uint32_t)) + STCP_MSS);
-	   size_t total_length = network_recv(sd, pkt);
 	   struct tcphdr* hdr = (struct tcphdr *)pkt;
-	   ctx->recv_win = MIN(hdr->th_win, CWIN);
+	   /* th_win of a (duplicate) SYN_ACK is never scaled */
+	   ctx->recv_win = (hdr->th_flags & TH_SYN) ? hdr->th_win : 
+	   				   (uint32_t)hdr->th_win << ctx->snd_wscale;
+	   size_t data_length = total_length - TCP_DATA_START(hdr);
 	   if (hdr->th_flags & TH_ACK) {
-			handle_ack(hdr, sd, ctx);
+			handle_ack(hdr, data_length, sd, ctx);
 	   }
-	   size_t data_length = total_length - TCP_DATA_START(hdr);
-	   if (data_length>0 || (hdr->th_flags & TH_FIN)) {
+	   if (is_window_probe(hdr, data_length, ctx)) {
+	   		send_ack(sd, ctx);
+	   }
+	   else if (data_length>0 || (hdr->th_flags & TH_FIN)) {
 	   		our_dprintf("Received %d bytes of data with seq: %d, last ack sent: %d\n", 
 	   					data_length, hdr->th_seq, ctx->last_ack_sent);
-	   		/* Does the packet fit in the receiving window?*/
-	   		if ((hdr->th_seq + data_length)<=(ctx->last_ack_sent + RWIN)) {
-	   			add_to_recv_buffer(ctx, pkt, total_length);
-	   			if (hdr->th_seq == ctx->last_ack_sent){
-	   				/* The packet arrived in order. We can remove all in-order
-	   				 * packets from the receive buffer now */
-	   				our_dprintf("Packet In Order. Handling buffer\n");
-	   				handle_recv_buffer(sd, ctx);
+	   		/* Does the packet fit in the receive ring? (Anything we
+	   		 * advertised does, even if the window shrank since) */
+	   		if ((hdr->th_seq + data_length)<=(ctx->last_ack_sent + ctx->rbuffer.size)) {
+	   			if (hdr->th_flags & TH_FIN) {
+	   				ctx->rbuffer.fin_rcvd = true;
+	   				ctx->rbuffer.fin_seq = hdr->th_seq + data_length;
+	   			}
+	   			/* Out of order, duplicate or hole filling data is acked at once */
+	   			bool in_order = (hdr->th_seq == ctx->last_ack_sent) && 
+	   							(ctx->rbuffer.num_ooo == 0);
+	   			ctx->data_segs_rcvd += (data_length > 0);
+	   			add_to_recv_buffer(sd, ctx, hdr->th_seq, pkt + TCP_DATA_START(hdr), data_length);
+	   			our_dprintf("Handling buffer\n");
+	   			handle_recv_buffer(sd, ctx);
+	   			tune_rcv_space(sd, ctx);
+	   			if (in_order && !(hdr->th_flags & TH_FIN)) {
+	   				delay_ack(sd, ctx, data_length);
 	   			}
 	   			else {
-	   				if (hdr->th_seq > ctx->last_ack_sent) {
-	   					our_dprintf("This packet is out of order. Adding to recv buffer\n");
-	   				}
+	   				send_ack(sd, ctx);
 	   			}
-	   			send_ack(sd, ctx);
 	   		}
 	   		else {
 	   			our_dprintf("Packet outside receiver buffer. Dropping!!!\n");	
 	   	
 	   		}		
 	   }
-	   free(pkt);			
 }
 
 
 /* ***************************************************
  * Function: handle_recv_buffer
  * ***************************************************
- *  This function is called whenever we get the next packet
- *  we are expecting from the sender in-order.  It iterates
- *  through the receive buffer sending packets to the application
- * for consumption.  When a packet is consumed, it is freed and
- * removed from the buffer.  The loop stops as soon as we see
- * that the next packet is not in order or when we have emptied out
- * the buffer entirely (whichever happens first).  
+ *  This function is called after every segment we accept.  If the
+ *  segment filled the hole at last_ack_sent, the ranges that were
+ *  waiting behind it are now in order: pass them to the application
+ *  straight out of the ring and advance last_ack_sent past them.
+ *  Once we have caught up with a FIN, deliver it too.
  */
 static void handle_recv_buffer(mysocket_t sd, context_t *ctx)
 {
-	struct window* win = &(ctx->rbuffer);
-	struct p_entry* curr = win->start->next;
-	assert(curr || !DEBUG);
-	tcp_seq next_seq, curr_seq;
-	size_t data_len;
-	bool is_fin = false;
-	bool stop_loop = false;
-	/* Iterate through all entries in the receive buffer */
-	while (win->num_entries>0 && !stop_loop) {
-		data_len = curr->packet_size - TCP_DATA_START(curr->packet);
-		curr_seq = ((struct tcphdr *)curr->packet)->th_seq;
-		/* Special case, FIN packet in receive buffer */
-		is_fin = (((struct tcphdr *)curr->packet)->th_flags & TH_FIN);
-		if (is_fin){
-			assert(curr->next==NULL || !DEBUG);
-			ctx->last_ack_sent+=1;
-			if (data_len>0) {
-				/* FIN packet with data.  Send data to app */
-				stcp_app_send(sd, curr->packet + TCP_DATA_START(curr->packet), data_len);
+	struct recv_buffer* win = &(ctx->rbuffer);
+	unsigned int consumed = 0;
+	/* Ranges are sorted, so only the front ones can have become in order */
+	while (consumed < win->num_ooo && win->ooo[consumed].start <= ctx->last_ack_sent) {
+		tcp_seq end = win->ooo[consumed].end;
+		if (end > ctx->last_ack_sent) {
+			size_t len = end - ctx->last_ack_sent;
+			size_t offset = ctx->last_ack_sent & (win->size - 1);
+			size_t first = MIN(len, win->size - offset);
+			our_dprintf("Sending Seq: %d to %d to application \n", ctx->last_ack_sent, end);
+			stcp_app_send(sd, win->data + offset, first);
+			if (first < len) {
+				stcp_app_send(sd, win->data, len - first);
 			}
-			handle_fin(sd, ctx); /* Call helper function */
-			break;	
+			ctx->last_ack_sent = end;
 		}
-		our_dprintf("Sending packet with Seq: %d to application \n", curr_seq);
-		ctx->last_ack_sent = curr_seq + data_len;
-		stcp_app_send(sd, curr->packet + TCP_DATA_START(curr->packet), data_len);
-		/* Have we reached the end of the buffer?*/
-		if (curr->next){
-			/* No, exit only if next sequence is not in order */
-			next_seq = ((struct tcphdr *)curr->next->packet)->th_seq;	
-			if ((data_len + curr_seq)!=next_seq){
-				stop_loop = true;	
-			} 	
-		}
-		/* Update pointers and free memory */
-		win->start->next = curr->next;
-		if (win->end == curr){
-			win->end = win->start;	
-		}
-		free(curr->packet);
-		free(curr);
-		curr = win->start->next;
-		win->num_entries-=1;	
+		consumed++;
+	}
+	if (consumed > 0) {
+		memmove(win->ooo, win->ooo + consumed, (win->num_ooo - consumed)*sizeof(struct seq_range));
+		win->num_ooo -= consumed;
+	}
+	/* Special case, FIN in receive buffer */
+	if (win->fin_rcvd && win->fin_seq == ctx->last_ack_sent) {
+		win->fin_rcvd = false;
+		ctx->last_ack_sent+=1;
+		handle_fin(sd, ctx); /* Call helper function */
 	}
 }
 
 /* ***************************************************
  * Function: add_to_recv_buffer
  * ***************************************************
- *  This function simply adds a packet (if its a valid packet, defined
- *  by the next function) to the receiver buffer.  It searches the receiver
- *  buffer for the right place to put the file.  The receive buffer is always
- *  kept in anscending order of sequence numbers.   
+ *  This function takes the payload of a segment that fits in the
+ *  receive window.  Bytes we already passed to the application are
+ *  trimmed off the front.  If what's left starts at last_ack_sent it
+ *  goes straight up to the application; otherwise it is written into
+ *  the ring at its sequence offset and its range merged into the
+ *  sorted list of out-of-order ranges.  Duplicates and overlaps are
+ *  harmless since a byte always lands in the same place.  If there are
+ *  too many holes already, the segment is dropped (the sender will
+ *  retransmit it).
  */
-static void add_to_recv_buffer(context_t *ctx, char* pkt, size_t len)
+static void add_to_recv_buffer(mysocket_t sd, context_t *ctx, tcp_seq seq, const char* data, size_t len)
 {	
-	tcp_seq target_seq = ((struct tcphdr *)pkt)->th_seq;
-	size_t data_len = len - TCP_DATA_START(pkt);	
-	if (!is_valid_entry(ctx,target_seq, data_len)){
-		our_dprintf("Invalid incoming packet - dropping!\n");
-		return;	
-	}
-	struct window* win = &(ctx->rbuffer);
-	assert((win->end->next==NULL) || !DEBUG);
-	/* Create a new link list entry */
-	struct p_entry* new_entry = (struct p_entry*)calloc(1,sizeof(struct p_entry));
-	new_entry->packet = (char *)calloc(1, len);
-	memcpy(new_entry->packet, pkt, len);
-	new_entry->packet_size = len;
-	tcp_seq curr_seq;
-	struct p_entry* prev = win->start;
-	struct p_entry* curr = win->start->next;
-	bool inserted = false;
-	/* Search for the right place to add this sequence */
-	while(curr) {
-		curr_seq = ((struct tcphdr *)curr->packet)->th_seq;
-		if (target_seq < curr_seq) {
-			/* Place found */
-			inserted = true;
-			new_entry->next = curr;
-			prev->next = new_entry;
-			break;
+	struct recv_buffer* win = &(ctx->rbuffer);
+	if (seq < ctx->last_ack_sent) {
+		size_t skip = ctx->last_ack_sent - seq;
+		if (skip >= len) {
+			our_dprintf("Received Duplicate Packet with seq: %d\n", seq);
+			return;
 		}
-		prev = curr;
-		curr = curr->next;
+		seq += skip;
+		data += skip;
+		len -= skip;
 	}
-	/* Add to the end of the list if not added before */
-	if (!inserted){
-		new_entry->next = NULL;	
-		win->end->next = new_entry;
-		win->end = win->end->next;
+	if (len == 0) {
+		return;
+	}
+	if (seq == ctx->last_ack_sent) {
+		/* In order, the fast path */
+		our_dprintf("Packet In Order. Sending Seq: %d to application\n", seq);
+		stcp_app_send(sd, data, len);
+		ctx->last_ack_sent += len;
+		return;
 	}
-	win->num_entries+=1;
-	our_dprintf("Added Recv: %d to receive buffer\n", ((struct tcphdr*)pkt)->th_seq);
-}
 
-/* ***************************************************
- * Function: is_valid_entry
- * ***************************************************
- *  Determines if an incoming packet "fits" in the receive buffer. 
- *  The following conditions must be sastified.  
- * 	1.) The incoming sequence number better be greater than or equal to
- * 	    the last ack we sent out, otherwise we already have the data.
- *  2.) The incoming sequence number cannot be identical to any sequence
- * 		number in the receive buffer.  This just means we have a duplicate
- * 		packet so no need to store it.
- *  3.) If the packet fits between sequence X and sequence Y, its length
- * 		better not be large enough to overlap with Y, and the length of X
- * 		better not be large enough to overlap with the packet's sequence.
- * 		This means the packet is trying to overwrite data and I simply drop it.
- */
-static bool is_valid_entry(context_t* ctx, tcp_seq target_seq, size_t data_len)
-{
-	if (target_seq< ctx->last_ack_sent){
-		our_dprintf("Received Packet Outside receiver window with seq: %d\n", target_seq);
-		return false;	
-	}
-	struct p_entry* prev = ctx->rbuffer.start;
-	struct p_entry* curr = ctx->rbuffer.start->next;
-	while(curr) {
-		tcp_seq curr_seq = ((struct tcphdr *)curr->packet)->th_seq;
-		if (target_seq==curr_seq){
-			our_dprintf("Received Duplicate Packet with seq: %d\n", target_seq);
-			return false;
-		}
-		else if (target_seq < curr_seq) {
-			if (curr->next){
-				tcp_seq next_seq = ((struct tcphdr *)curr->next->packet)->th_seq;	
-				if ( (target_seq + data_len) > next_seq) {
-					our_dprintf("Packet overwriting 1!!! TARGET SEQ:%d DATA_LEN:%d NEXT_SEQ:%d CURR SEQ:%d\n",
-								 target_seq, data_len, curr_seq);
-					assert(!DEBUG);
-					return false;
-				}	
-			}
-			if (prev!=ctx->rbuffer.start) {
-				tcp_seq prev_seq = ((struct tcphdr *)prev->packet)->th_seq;
-				size_t prev_len = prev->packet_size - TCP_DATA_START(prev->packet);
-				if ((target_seq>prev_seq) && ((prev_seq + prev_len) > target_seq)){
-					our_dprintf("Packet overwriting 2!!! PREV SEQ:%d PREV_LEN:%d TARGET_SEQ:%d CURR SEQ:%d\n",
-								 prev_seq, prev_len, target_seq, curr_seq);
-					assert(!DEBUG);
-					return false;
-				}		
-				
-			}
-		}
-		prev = curr;
-		curr = curr->next;
+	/* Out of order: find where the range goes and how many it swallows */
+	tcp_seq end = seq + len;
+	unsigned int first = 0;
+	while (first < win->num_ooo && win->ooo[first].end < seq) {
+		first++;
+	}
+	unsigned int last = first;
+	while (last < win->num_ooo && win->ooo[last].start <= end) {
+		last++;
+	}
+	if (first == last && win->num_ooo == MAX_OOO_RANGES) {
+		our_dprintf("Too many holes in receive buffer. Dropping seq: %d\n", seq);
+		return;
+	}
+
+	if (!win->data) {
+		win->data = (char *)malloc(win->size);
+		assert(win->data);
+	}
+	size_t offset = seq & (win->size - 1);
+	size_t part = MIN(len, win->size - offset);
+	memcpy(win->data + offset, data, part);
+	if (part < len) {
+		memcpy(win->data, data + part, len - part);
 	}
-	return true;
+
+	if (first == last) {
+		/* New range, make room for it */
+		memmove(win->ooo + first + 1, win->ooo + first,
+				(win->num_ooo - first)*sizeof(struct seq_range));
+		win->ooo[first].start = seq;
+		win->ooo[first].end = end;
+		win->num_ooo += 1;
+	}
+	else {
+		/* Merge with ranges first..last-1 */
+		win->ooo[first].start = MIN(seq, win->ooo[first].start);
+		win->ooo[first].end = MAX(end, win->ooo[last-1].end);
+		memmove(win->ooo + first + 1, win->ooo + last,
+				(win->num_ooo - last)*sizeof(struct seq_range));
+		win->num_ooo -= (last - first - 1);
+	}
+	win->last_ooo_seq = seq;
+	our_dprintf("Added Recv: %d to receive buffer\n", seq);
 }
 
 /* ***************************************************
@@ -952,6 +1591,7 @@ static void handle_fin(mysocket_t sd, context_t *ctx)
     	assert(((ctx->seq_base + 1) == ctx->nxt_seq_num) || !DEBUG);
     	ctx->seq_base = ctx->nxt_seq_num;
     	remove_until_seq(ctx);
+    	timer_cancel(ctx->timers, &ctx->rexmit_timer);
     	ctx->connection_state = CSTATE_TIME_WAIT;
     }	
     else if (ctx->connection_state == CSTATE_FIN_WAIT2) {
@@ -963,6 +1603,9 @@ static void handle_fin(mysocket_t sd, context_t *ctx)
 		assert(bytes_in_transit==0 || !DEBUG);
 		ctx->connection_state = CSTATE_CLOSE_WAIT;
 	}
+	if (ctx->connection_state == CSTATE_TIME_WAIT) {
+		timer_add(ctx->timers, &ctx->time_wait_timer, stcp_now() + TIME_WAIT_VALUE);
+	}
 	stcp_fin_received(sd);
 }
 
@@ -971,13 +1614,21 @@ static void handle_fin(mysocket_t sd, context_t *ctx)
  * ***************************************************
  * We received an ACK.  Check the special case that we received
  * a duplicate SYN_ACK and if so, send an ACK back (this is the only 
- * ACK packet that requires an ACK to be sent back). Then check if the
- * ACK falls within the sender window and if so, estimate the new rto
- * (using helper function below), remove everything upto that sequence
- * number from the window. Finally, check to see if this is a FIN ACK
- * and update state variables.
+ * ACK packet that requires an ACK to be sent back). A pure ACK that
+ * doesn't move the window while data is outstanding is a duplicate
+ * ACK, see handle_dupack.  If the ACK falls within the sender window,
+ * remove everything upto that sequence number from the window and
+ * estimate the new rto from the newest segment it covered (using
+ * helper function below).  The retransmission timer is restarted,
+ * or stopped once nothing is left in flight (RFC 6298 5.2, 5.3).
+ * In recovery, an ACK that doesn't cover everything we had sent when
+ * recovery started (a partial ACK) means the segment now at the
+ * front of the window was lost too, so it is resent right away
+ * (NewReno, RFC 6582).  With SACK, the scoreboard is updated first
+ * and we resend the next hole in it instead.  Finally, check to see
+ * if this is a FIN ACK and update state variables.
  */
-static void handle_ack(struct tcphdr* hdr,  mysocket_t sd, context_t* ctx)
+static void handle_ack(struct tcphdr* hdr, size_t data_length, mysocket_t sd, context_t* ctx)
 {
 	our_dprintf("Ack:%d received - Prior Window Bottom:%d - Window Top: %d\n",
 				 hdr->th_ack, ctx->seq_base, ctx->nxt_seq_num);	
@@ -991,14 +1642,64 @@ static void handle_ack(struct tcphdr* hdr,  mysocket_t sd, context_t* ctx)
 			return;
 		}
 	}
+	if (ctx->sack_ok && TCP_OPTIONS_LEN(hdr) > 0) {
+		struct tcp_options opts;
+		parse_options(hdr, &opts);
+		update_scoreboard(ctx, &opts);
+	}
+	if (hdr->th_ack == ctx->seq_base && data_length == 0 && 
+		!(hdr->th_flags & TH_FIN) && bytes_in_flight(ctx) > 0 &&
+		!is_window_probe(hdr, data_length, ctx)) {
+		handle_dupack(sd, ctx);
+		return;
+	}
 	if (!((hdr->th_ack <= ctx->nxt_seq_num) && (hdr->th_ack > ctx->seq_base))) {
 		our_dprintf("Ack outside window. Throw Away!\n");
 		return;	
 	}
 	/* ACK INSIDE WINDOW - HANDLE IT */
-	estimate_rto(ctx, hdr->th_ack); /* check if we can get a new RTO*/
+	uint32_t acked_bytes = hdr->th_ack - ctx->seq_base;
 	ctx->seq_base = hdr->th_ack; /* new window bottom */
-	remove_until_seq(ctx); /* remove everything upto the new window bottom (cumulative acks)*/
+	ctx->dupacks = 0;
+	ctx->give_up_time = 0;
+	/* remove everything upto the new window bottom (cumulative acks)*/
+	struct segment* acked = remove_until_seq(ctx);
+	if (acked) {
+		estimate_rto(ctx, acked); /* check if we can get a new RTO*/
+	}
+	if (bytes_in_flight(ctx) > 0) {
+		arm_rexmit_timer(ctx);
+	}
+	else {
+		timer_cancel(ctx->timers, &ctx->rexmit_timer);
+	}
+	if (ctx->recovery != RECOVERY_NONE && hdr->th_ack < ctx->recover) {
+		/* Partial ACK */
+		if (ctx->recovery == RECOVERY_FAST) {
+			/* Deflate by what left the network, keep one segment's worth */
+			ctx->cc.cwnd -= MIN(acked_bytes, ctx->cc.cwnd - ctx->cc.mss);
+			if (acked_bytes >= ctx->cc.mss) {
+				ctx->cc.cwnd += ctx->cc.mss;
+			}
+		}
+		else {
+			ctx->cc_ops->on_ack(&ctx->cc, acked_bytes, ctx->srtt/1000.0);
+		}
+		struct segment* hole = next_hole(ctx);
+		if (hole) {
+			retransmit_segment(sd, ctx, hole);
+		}
+	}
+	else if (ctx->recovery == RECOVERY_FAST) {
+		/* Full ACK, deflate the window back to ssthresh */
+		ctx->cc.cwnd = MIN(ctx->cc.ssthresh, 
+						   MAX(bytes_in_flight(ctx), ctx->cc.mss) + ctx->cc.mss);
+		ctx->recovery = RECOVERY_NONE;
+	}
+	else {
+		ctx->recovery = RECOVERY_NONE;
+		ctx->cc_ops->on_ack(&ctx->cc, acked_bytes, ctx->srtt/1000.0);
+	}
 	
 	/* Check to see if we got ACK for FIN.  If so update state variables*/
 	if (hdr->th_ack == ctx->fin_ack) {
@@ -1013,52 +1714,93 @@ static void handle_ack(struct tcphdr* hdr,  mysocket_t sd, context_t* ctx)
 	}
 }
 
+/* ***************************************************
+ * Function: handle_dupack
+ * ***************************************************
+ * The receiver acked seq_base again, so something after it arrived
+ * but seq_base itself did not.  On the third in a row, resend that
+ * segment without waiting for the timer (fast retransmit), cut the
+ * congestion window and enter fast recovery.  Each further duplicate
+ * means another segment has left the network, so the window is
+ * inflated by one segment to let new data keep the ACKs coming; with
+ * SACK it also tells us which holes are left, and we resend the next
+ * one.  After a timeout, duplicates are ignored until everything sent
+ * before it has been acked, so one loss isn't reacted to twice.
+ * Resending the front of the window restarts the retransmission timer
+ * as a new ACK would: it was started for the last of those, before the
+ * duplicates, and left alone it would expire before the resent segment
+ * could be acked whenever the RTO is within a duplicate or so of the
+ * RTT, as it is on a steady path, sending the whole window again.
+ */
+static void handle_dupack(mysocket_t sd, context_t *ctx)
+{
+	ctx->dupacks+=1;
+	our_dprintf("Duplicate ACK %d for seq:%d\n", ctx->dupacks, ctx->seq_base);
+	if (ctx->recovery == RECOVERY_FAST) {
+		ctx->cc.cwnd += ctx->cc.mss;
+		struct segment* hole = next_hole(ctx);
+		if (hole) {
+			retransmit_segment(sd, ctx, hole);
+		}
+	}
+	else if (ctx->dupacks == DUPACK_THRESHOLD && ctx->recovery == RECOVERY_NONE) {
+		ctx->fast_retransmits+=1;
+		ctx->cc_ops->on_loss(&ctx->cc, bytes_in_flight(ctx));
+		ctx->cc.cwnd += DUPACK_THRESHOLD*ctx->cc.mss;
+		ctx->recovery = RECOVERY_FAST;
+		ctx->recover = ctx->nxt_seq_num;
+		ctx->rexmit_next = ctx->seq_base;
+		struct send_buffer* win = &(ctx->sbuffer);
+		retransmit_segment(sd, ctx, &win->segs[win->head & (win->num_segs - 1)]);
+		arm_rexmit_timer(ctx);
+	}
+}
+
 /* ***************************************************
  * Function: estimate_rto
  * ***************************************************
- * When we receive an ACK, we iterate through the send window in 
- * order to find the packet corresponding to such ACK.  When we find
- * the packet, we first make sure that this is not a retransmitted packet
- * and if so we update the estimated rtt and rtt deviation based on the
- * equations from K&R. Note that I use 3*estimate_rtt in my equation 
- * simply because a factor of 1 was too low and caused 5 retransmissions
- * way too quickly.   
+ * Called with the newest segment an ACK covered.  A segment we sent
+ * more than once gives no sample, since we can't tell which copy the
+ * ACK is for (Karn); the handshake follows the same rule.  Nor does
+ * anything acked during recovery: it may have sat behind a hole for
+ * several round trips.  New data got through though, so any backoff
+ * left over from a timeout goes.
  */
-static void estimate_rto(context_t* ctx, tcp_seq incoming_ack)
-{
-	struct p_entry* curr = ctx->sbuffer.start->next;
-	size_t data_len;
-	tcp_seq curr_seq; 
-	struct timeval curr_time;
-	assert(curr || !DEBUG);
-	while (curr) {
-		curr_seq = ((struct tcphdr*)curr->packet)->th_seq;
-		data_len = curr->packet_size - TCP_DATA_START(curr->packet);
-		if ((curr_seq + data_len) == incoming_ack && (curr->num_transmits==1)) {
-			gettimeofday(&curr_time,NULL);
-			double curr_time_total = (double)curr_time.tv_sec + 
-									 (curr_time.tv_usec/1000000.0);
-			double start_time_total = (double)curr->tstart.tv_sec + 
-									  (curr->tstart.tv_usec/1000000.0);
-			double sample_rtt = (curr_time_total - start_time_total)*1000;
-			if (ctx->estimated_rtt==0) {
-				/* Didn't have an estimated RTT before. Use something conservative */
-				ctx->estimated_rtt = 2*sample_rtt;
-			}
-			else {
-				ctx->estimated_rtt = ((1.0-ALPHA)*sample_rtt) + 
-									 (ALPHA*ctx->estimated_rtt);
-				ctx->devrtt = (1.0 - BETA)*ctx->devrtt + 
-						BETA*(fabs(sample_rtt - ctx->estimated_rtt));
-			}	
-			ctx->rto = 3.0*ctx->estimated_rtt + 4.0*ctx->devrtt;
-			our_dprintf("\nSample RTT:%f ms  Estimated RTT: %f ms DEVRTT:%f ms RTO:%f ms\n\n",
-						 sample_rtt, ctx->estimated_rtt, ctx->devrtt, ctx->rto);
-			break;	
+static void estimate_rto(context_t* ctx, struct segment* seg)
+{
+	if (seg->num_transmits!=1 || ctx->recovery != RECOVERY_NONE) {
+		if (ctx->srtt > 0) {
+			ctx->rto = MIN(ctx->srtt + MAX(TIMER_TICK_US, 4*ctx->rttvar), MAX_RTO);
 		}
-		curr = curr->next;
+		return;
 	}
-	
+	rtt_sample(ctx, stcp_now() - seg->tstart);
+}
+
+/* ***************************************************
+ * Function: rtt_sample
+ * ***************************************************
+ * Fold an RTT measurement (in microseconds) into srtt and rttvar
+ * and work out the RTO from them as in RFC 6298 section 2, with the
+ * timer wheel's tick as the clock granularity G.  The RFC's one
+ * second floor would dwarf the RTTs we see, so there is none; the
+ * MAX_RTO ceiling stays.
+ */
+static void rtt_sample(context_t* ctx, uint32_t rtt)
+{
+	rtt = MAX(rtt, 1);
+	if (ctx->srtt == 0) {
+		ctx->srtt = rtt;
+		ctx->rttvar = rtt/2;
+	}
+	else {
+		uint32_t err = (rtt > ctx->srtt) ? rtt - ctx->srtt : ctx->srtt - rtt;
+		ctx->rttvar = ctx->rttvar - (ctx->rttvar >> BETA_SHIFT) + (err >> BETA_SHIFT);
+		ctx->srtt = ctx->srtt - (ctx->srtt >> ALPHA_SHIFT) + (rtt >> ALPHA_SHIFT);
+	}
+	ctx->rto = MIN(ctx->srtt + MAX(TIMER_TICK_US, 4*ctx->rttvar), MAX_RTO);
+	our_dprintf("\nSample RTT:%u us  SRTT: %u us RTTVAR:%u us RTO:%u us\n\n",
+				 rtt, ctx->srtt, ctx->rttvar, ctx->rto);
 }
 
 
@@ -1066,28 +1808,25 @@ static void estimate_rto(context_t* ctx, tcp_seq incoming_ack)
  * Function: remove_until_seq
  * ***************************************************
  * When we receive an ACK, this is the function we call to
- * remove all entries up to the new/updated bottom of the 
- * send window.
+ * drop all segments below the new/updated bottom of the 
+ * send window.  Their bytes in the send ring are free as soon
+ * as seq_base moves, so this just advances the head of the
+ * segment ring.  Returns the last segment removed (still
+ * readable until the next send) or NULL.
  */
-static void remove_until_seq(context_t* ctx)
-{
-	struct window* win = &(ctx->sbuffer);
-	assert((win->start->next!=NULL) || !DEBUG);
-	assert((win->num_entries>0) || !DEBUG);
-	while (win->num_entries>0){
-		struct p_entry* victim = win->start->next;
-		tcp_seq sequence = ((struct tcphdr*)(victim->packet))->th_seq;
-		if (sequence>=ctx->seq_base) break;
-		our_dprintf("Removing Seq: %d from sender's buffer\n",
-					 ((struct tcphdr*)victim->packet)->th_seq);
-		if (victim==win->end) {
-			win->end = win->start;
-		}
-		win->start->next = win->start->next->next;
-		win->num_entries-=1;
-		free(victim->packet);
-		free(victim);
+static struct segment* remove_until_seq(context_t* ctx)
+{
+	struct send_buffer* win = &(ctx->sbuffer);
+	struct segment* last = NULL;
+	while (win->head != win->tail){
+		struct segment* seg = &win->segs[win->head & (win->num_segs - 1)];
+		tcp_seq seg_end = seg->seq + seg->len + ((seg->flags & TH_FIN) ? 1 : 0);
+		if (seg_end > ctx->seq_base) break;
+		our_dprintf("Removing Seq: %d from sender's buffer\n", seg->seq);
+		last = seg;
+		win->head+=1;
 	}
+	return last;
 }
 
 
@@ -1095,19 +1834,213 @@ static void remove_until_seq(context_t* ctx)
  * Function: send_ack
  * ***************************************************
  * Small helper function for preparing an ACK packet and sending
- * it to the network.   
+ * it to the network.  If SACK was agreed on and we are holding
+ * out-of-order data, the ACK carries SACK blocks for it.
  */
 static void send_ack(mysocket_t sd, context_t* ctx)
 {
-	struct tcphdr *ack_pkt = (struct tcphdr *)calloc(1, (TH_MIN_OFFSET*sizeof(uint32_t)));
+	uint32_t pkt[TH_MAX_OFFSET];
+	struct tcphdr *ack_pkt = (struct tcphdr *)pkt;
+	memset(pkt, 0, sizeof(pkt));
 	ack_pkt->th_flags = TH_ACK;
 	ack_pkt->th_ack = ctx->last_ack_sent;
 	ack_pkt->th_seq = ctx->nxt_seq_num;
 	our_dprintf("Sending ack: %d with seq: %d\n", ack_pkt->th_ack, ack_pkt->th_seq);	
-	ack_pkt->th_win = RWIN;
+	ack_pkt->th_win = advertised_window(sd, ctx);
 	ack_pkt->th_off = TH_MIN_OFFSET;
-	network_send(sd, ack_pkt, TH_MIN_OFFSET*sizeof(uint32_t));
-	free(ack_pkt);	
+	if (ctx->sack_ok && ctx->rbuffer.num_ooo > 0) {
+		add_sack_blocks(ack_pkt, ctx);
+	}
+	network_send(sd, ack_pkt, TCP_DATA_START(ack_pkt));
+	ctx->acks_sent+=1;
+	timer_cancel(ctx->timers, &ctx->delack_timer);
+	ctx->bytes_unacked = 0;
+}
+
+/* ***************************************************
+ * Function: delay_ack
+ * ***************************************************
+ * In-order data arrived.  Rather than ACK every segment, ACK every
+ * second full-sized segment's worth; anything less waits for our
+ * next data segment to carry the ACK or for DELACK_TIMEOUT to pass.
+ */
+static void delay_ack(mysocket_t sd, context_t* ctx, size_t len)
+{
+	ctx->bytes_unacked += len;
+	if (ctx->bytes_unacked >= 2*STCP_MSS) {
+		send_ack(sd, ctx);
+	}
+	else if (!timer_pending(&ctx->delack_timer)) {
+		timer_add(ctx->timers, &ctx->delack_timer, stcp_now() + DELACK_TIMEOUT);
+	}
+}
+
+/* ***************************************************
+ * Function: add_sack_blocks
+ * ***************************************************
+ * Append a SACK option listing the out-of-order ranges we hold.
+ * The range with the latest arrival goes first, then the others
+ * from the bottom of the window up, as many as fit (RFC 2018).
+ */
+static void add_sack_blocks(struct tcphdr* hdr, context_t* ctx)
+{
+	struct recv_buffer* win = &(ctx->rbuffer);
+	uint8_t* opt = (uint8_t *)hdr + sizeof(struct tcphdr);
+	unsigned int latest = win->num_ooo;
+	unsigned int num_blocks = 0;
+	unsigned int i;
+	for (i = 0; i < win->num_ooo; i++) {
+		if (win->ooo[i].start <= win->last_ooo_seq && win->last_ooo_seq < win->ooo[i].end) {
+			latest = i;
+			break;
+		}
+	}
+	opt[0] = TCPOPT_NOP;
+	opt[1] = TCPOPT_NOP;
+	opt[2] = TCPOPT_SACK;
+	for (i = 0; i <= win->num_ooo && num_blocks < MAX_SACK_BLOCKS; i++) {
+		/* Pass 0 is the latest range, the rest skip it */
+		unsigned int r = (i == 0) ? latest : i - 1;
+		if (r >= win->num_ooo || (i > 0 && r == latest)) {
+			continue;
+		}
+		uint32_t edge = htonl(win->ooo[r].start);
+		memcpy(opt + 4 + num_blocks*TCPOLEN_SACK_BLOCK, &edge, sizeof(edge));
+		edge = htonl(win->ooo[r].end);
+		memcpy(opt + 8 + num_blocks*TCPOLEN_SACK_BLOCK, &edge, sizeof(edge));
+		num_blocks+=1;
+	}
+	opt[3] = 2 + num_blocks*TCPOLEN_SACK_BLOCK;
+	hdr->th_off = TH_MIN_OFFSET + (4 + num_blocks*TCPOLEN_SACK_BLOCK)/sizeof(uint32_t);
+}
+
+/* ***************************************************
+ * Function: advertised_window
+ * ***************************************************
+ * The th_win to put in an outgoing segment: the receive window
+ * less what the application hasn't read yet, scaled down by the
+ * negotiated shift.  When that comes to nothing we ask to hear
+ * (APP_READ) once the application has read enough to open it by a
+ * segment, or half the window if that's smaller, and then send a
+ * window update (transport_event); waiting for that much rather
+ * than any read keeps the peer from sending silly small segments.
+ * Should the update be lost, the peer's persist timer finds out.
+ */
+static uint16_t advertised_window(mysocket_t sd, context_t *ctx)
+{
+	size_t unread = stcp_app_unread(sd);
+	size_t win = (unread < ctx->rcv_space) ? ctx->rcv_space - unread : 0;
+	win = MIN(win, (size_t)0xffff << ctx->rcv_wscale);
+	if ((win >> ctx->rcv_wscale) == 0) {
+		if (!ctx->rcv_win_shut) {
+			ctx->rcv_win_shut = true;
+			stcp_app_read_notify(sd, ctx->rcv_space - 
+								 MIN(STCP_MSS, ctx->rcv_space/2));
+		}
+	}
+	else {
+		ctx->rcv_win_shut = false;
+	}
+	return win >> ctx->rcv_wscale;
+}
+
+/* ***************************************************
+ * Function: tune_rcv_space
+ * ***************************************************
+ * Receive window auto-tuning.  Once per round trip, look at how
+ * much the application actually read (what we passed up less what
+ * is still queued for it).  If that is more than half the window,
+ * the window is what's holding the sender back, so double it to
+ * twice the amount read, up to the connection's budget.  The
+ * window never shrinks.  A receiver that sends no data has no RTT
+ * samples of its own, so srtt is the handshake's.
+ */
+static void tune_rcv_space(mysocket_t sd, context_t *ctx)
+{
+	stcp_time_t now = stcp_now();
+	if (now - ctx->rcv_mark < MAX(ctx->srtt, MIN_TUNE_INTERVAL)) {
+		return;
+	}
+	size_t unread = stcp_app_unread(sd);
+	size_t copied = (ctx->last_ack_sent - ctx->rcv_mark_seq) + 
+					ctx->rcv_mark_unread - unread;
+	if (2*copied > ctx->rcv_space && ctx->rcv_space < ctx->buf_max) {
+		ctx->rcv_space = MIN(2*copied, ctx->buf_max);
+		grow_recv_buffer(ctx);
+		our_dprintf("Receive window grown to %d bytes\n", ctx->rcv_space);
+	}
+	ctx->rcv_mark = now;
+	ctx->rcv_mark_seq = ctx->last_ack_sent;
+	ctx->rcv_mark_unread = unread;
+}
+
+/* ***************************************************
+ * Function: add_syn_options
+ * ***************************************************
+ * Append the options we offer (or, in a SYN_ACK, agreed to) to a
+ * SYN or SYN_ACK header and set th_off to match.  Returns the
+ * header length.
+ */
+static size_t add_syn_options(struct tcphdr* hdr, context_t *ctx)
+{
+	uint8_t* opt = (uint8_t *)hdr + sizeof(struct tcphdr);
+	size_t len = 0;
+	if (ctx->sack_ok) {
+		opt[len++] = TCPOPT_NOP;
+		opt[len++] = TCPOPT_NOP;
+		opt[len++] = TCPOPT_SACK_PERMITTED;
+		opt[len++] = TCPOLEN_SACK_PERMITTED;
+	}
+	if (ctx->wscale_ok) {
+		opt[len++] = TCPOPT_NOP;
+		opt[len++] = TCPOPT_WINDOW;
+		opt[len++] = TCPOLEN_WINDOW;
+		opt[len++] = ctx->rcv_wscale;
+	}
+	hdr->th_off = TH_MIN_OFFSET + len/sizeof(uint32_t);
+	return TCP_DATA_START(hdr);
+}
+
+/* ***************************************************
+ * Function: parse_options
+ * ***************************************************
+ * Pick out the options we understand from an incoming segment:
+ * window scale and SACK permitted in a SYN, SACK blocks in an ACK.
+ */
+static void parse_options(struct tcphdr* hdr, struct tcp_options* opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	uint8_t* opt = (uint8_t *)hdr + sizeof(struct tcphdr);
+	uint8_t* end = (uint8_t *)hdr + TCP_DATA_START(hdr);
+	while (opt < end && *opt != TCPOPT_EOL) {
+		if (*opt == TCPOPT_NOP) {
+			opt+=1;
+			continue;
+		}
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) {
+			break; /* malformed */
+		}
+		if (opt[0] == TCPOPT_WINDOW && opt[1] == TCPOLEN_WINDOW) {
+			opts->wscale_ok = true;
+			opts->wscale = MIN(opt[2], TCP_MAX_WINSHIFT);
+		}
+		else if (opt[0] == TCPOPT_SACK_PERMITTED && opt[1] == TCPOLEN_SACK_PERMITTED) {
+			opts->sack_ok = true;
+		}
+		else if (opt[0] == TCPOPT_SACK) {
+			unsigned int i;
+			uint32_t edge;
+			for (i = 0; i < (unsigned)(opt[1] - 2)/TCPOLEN_SACK_BLOCK && 
+						opts->num_sacks < MAX_SACK_BLOCKS; i++) {
+				memcpy(&edge, opt + 2 + i*TCPOLEN_SACK_BLOCK, sizeof(edge));
+				opts->sacks[opts->num_sacks].start = ntohl(edge);
+				memcpy(&edge, opt + 6 + i*TCPOLEN_SACK_BLOCK, sizeof(edge));
+				opts->sacks[opts->num_sacks].end = ntohl(edge);
+				opts->num_sacks+=1;
+			}
+		}
+		opt += opt[1];
+	}
 }
 
 /**********************************************************************/
@@ -117,4 +117,35 @@ typedef struct tcphdr
 
 extern void transport_init(mysocket_t sd, bool_t is_active);
 
+/* transport_init() runs a connection from start to finish in a thread
+ * of its own.  the event loop engine (see event_loop.h) runs many from
+ * one thread instead, through these; none of them block.  a connection
+ * is set up with transport_open(), its timers going into the given
+ * wheel.  from then on, whenever any of the events transport_wait_flags()
+ * asks for is ready it is passed to transport_event(), and any of its
+ * timers that timer_expire() hands back goes to transport_timer(), which
+ * returns the mysocket it belongs to.  once transport_done() is true,
+ * transport_close() frees it.
+ */
+struct timer_wheel;
+struct stcp_timer;
+
+extern void transport_open(mysocket_t sd, bool_t is_active,
+                           struct timer_wheel *timers);
+extern unsigned int transport_wait_flags(mysocket_t sd);
+extern void transport_event(mysocket_t sd, unsigned int events);
+extern mysocket_t transport_timer(struct stcp_timer *t);
+extern bool_t transport_done(mysocket_t sd);
+extern void transport_close(mysocket_t sd);
+
+/* SYN cookies:  a listening mysocket whose backlog is full answers a SYN
+ * with this SYN-ACK, using the given sequence number and keeping no state;
+ * reply must have room for a struct tcphdr.  syn and reply are as on the
+ * wire (in network byte order).  returns the reply's length.
+ * the connection is only set up once the peer's ACK of it arrives (see
+ * stcp_syn_cookie()).
+ */
+extern size_t transport_syn_cookie_reply(const void *syn, uint32_t isn,
+                                         void *reply);
+
 #endif  /* __TRANSPORT_H__ */